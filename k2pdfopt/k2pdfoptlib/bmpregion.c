@@ -39,27 +39,173 @@ static int word_longer_than(int gap_thresh,int *gw,int *copt,int ngaps,int displ
 */
 
 
-int bmpregion_row_black_count(BMPREGION *region,int r0)
+void k2darksum_init(K2DARKSUM *darksum)
 
     {
-    unsigned char *p;
-    int i,nc,c;
+    darksum->bmp8=NULL;
+    darksum->bgcolor=0;
+    darksum->calced=0;
+    darksum->width=darksum->height=0;
+    darksum->sum=NULL;
+    darksum->size_allocated=0;
+    }
 
-    p=bmp_rowptr_from_top(region->bmp8,r0)+region->c1;
-    nc=region->c2-region->c1+1;
-    for (c=i=0;i<nc;i++,p++)
-        if (p[0]<region->bgcolor)
-            c++;
+
+void k2darksum_free(K2DARKSUM *darksum)
+
+    {
+    static char *funcname="k2darksum_free";
+
+    willus_mem_free((double **)&darksum->sum,funcname);
+    k2darksum_init(darksum);
+    }
+
+
+/*
+** Make darksum count the dark pixels of bmp8 once they are asked for
+** (bmp8==NULL:  none).
+*/
+void k2darksum_set(K2DARKSUM *darksum,WILLUSBITMAP *bmp8,int bgcolor)
+
+    {
+    darksum->bmp8=bmp8;
+    darksum->bgcolor=bgcolor;
+    darksum->calced=0;
+    }
+
+
+/*
+** If there is not enough memory, darksum->calced is set to -1 and the
+** regions of bmp8 are scanned pixel by pixel as before.
+*/
+static void k2darksum_calc(K2DARKSUM *darksum)
+
+    {
+    static char *funcname="k2darksum_calc";
+    WILLUSBITMAP *bmp8;
+    double size;
+    int r,c,w;
+
+    bmp8=darksum->bmp8;
+    darksum->calced=-1;
+    if (bmp8->bpp!=8 || bmp8->width<=0 || bmp8->height<=0)
+        return;
+    w=bmp8->width+1;
+    size=(double)w*(bmp8->height+1)*sizeof(unsigned int);
+    if (size > 0x7fffffff)
+        return;
+    if ((long)size > darksum->size_allocated)
+        {
+        willus_mem_free((double **)&darksum->sum,funcname);
+        darksum->size_allocated=0;
+        if (!willus_mem_alloc((double **)&darksum->sum,(long)size,funcname))
+            return;
+        darksum->size_allocated=(long)size;
+        }
+    memset(darksum->sum,0,w*sizeof(unsigned int));
+    for (r=0;r<bmp8->height;r++)
+        {
+        unsigned char *p;
+        unsigned int *s0,*s1,run;
+
+        p=bmp_rowptr_from_top(bmp8,r);
+        s0=&darksum->sum[(size_t)r*w];
+        s1=&s0[w];
+        s1[0]=0;
+        for (run=0,c=0;c<bmp8->width;c++)
+            {
+            run += (p[c]<darksum->bgcolor);
+            s1[c+1]=s0[c+1]+run;
+            }
+        }
+    darksum->width=bmp8->width;
+    darksum->height=bmp8->height;
+    darksum->calced=1;
+    }
+
+
+/*
+** region->darksum if it counts the dark pixels of region->bmp8 for
+** region->bgcolor and they have been counted, otherwise NULL.  calc!=0
+** counts them first if they have not been yet.
+*/
+K2DARKSUM *bmpregion_darksum(BMPREGION *region,int calc)
+
+    {
+    K2DARKSUM *darksum;
+
+    darksum=region->darksum;
+    if (darksum==NULL || darksum->bmp8==NULL || darksum->bmp8!=region->bmp8
+            || darksum->bgcolor!=region->bgcolor)
+        return(NULL);
+    if (calc && darksum->calced==0)
+        k2darksum_calc(darksum);
+    if (darksum->calced!=1 || darksum->width!=region->bmp8->width
+            || darksum->height!=region->bmp8->height)
+        return(NULL);
+    return(darksum);
+    }
+
+
+/*
+** Dark pixels in rows r1..r2, columns c1..c2 (must be within the bitmap).
+*/
+static int k2darksum_count(K2DARKSUM *darksum,int r1,int c1,int r2,int c2)
+
+    {
+    unsigned int *s1,*s2;
+
+    s1=&darksum->sum[(size_t)r1*(darksum->width+1)];
+    s2=&darksum->sum[(size_t)(r2+1)*(darksum->width+1)];
+    return((int)((s2[c2+1]-s2[c1])-(s1[c2+1]-s1[c1])));
+    }
+
+
+/*
+** Number of dark pixels in rows r1..r2, columns c1..c2 of region->bmp8
+** (clipped to the bitmap).
+*/
+int bmpregion_dark_count(BMPREGION *region,int r1,int c1,int r2,int c2)
+
+    {
+    K2DARKSUM *darksum;
+    int c;
+
+    if (r1<0)
+        r1=0;
+    if (c1<0)
+        c1=0;
+    if (r2>region->bmp8->height-1)
+        r2=region->bmp8->height-1;
+    if (c2>region->bmp8->width-1)
+        c2=region->bmp8->width-1;
+    if (r2<r1 || c2<c1)
+        return(0);
+    darksum=bmpregion_darksum(region,1);
+    if (darksum!=NULL)
+        return(k2darksum_count(darksum,r1,c1,r2,c2));
+    for (c=0;r1<=r2;r1++)
+        bmpsimd_dark_counts(&c,NULL,bmp_rowptr_from_top(region->bmp8,r1)+c1,0,
+                            1,c2-c1+1,region->bgcolor);
     return(c);
     }
 
 
+int bmpregion_row_black_count(BMPREGION *region,int r0)
+
+    {
+    return(bmpregion_dark_count(region,r0,region->c1,r0,region->c2));
+    }
+
+
 int bmpregion_col_black_count(BMPREGION *region,int c0)
 
     {
     unsigned char *p;
     int i,nr,c,bw;
 
+    if (bmpregion_darksum(region,0)!=NULL)
+        return(bmpregion_dark_count(region,region->r1,c0,region->r2,c0));
     bw=bmp_bytewidth(region->bmp8);
     p=bmp_rowptr_from_top(region->bmp8,region->r1)+c0;
     nr=region->r2-region->r1+1;
@@ -70,6 +216,37 @@ int bmpregion_col_black_count(BMPREGION *region,int c0)
     }
 
 
+/*
+** count[c] = bmpregion_col_black_count(region,c), c=region->c1..region->c2,
+** in one pass over the rows.
+*/
+void bmpregion_col_black_counts(BMPREGION *region,int *count)
+
+    {
+    K2DARKSUM *darksum;
+    int nc;
+
+    nc=region->c2-region->c1+1;
+    if (nc<=0)
+        return;
+    darksum=bmpregion_darksum(region,0);
+    if (darksum!=NULL && region->c1>=0 && region->r1>=0
+          && region->c2<darksum->width && region->r2<darksum->height)
+        {
+        int i;
+
+        for (i=region->c1;i<=region->c2;i++)
+            count[i]=k2darksum_count(darksum,region->r1,i,region->r2,i);
+        return;
+        }
+    memset(&count[region->c1],0,nc*sizeof(int));
+    bmpsimd_dark_counts(NULL,&count[region->c1],
+                        bmp_rowptr_from_top(region->bmp8,region->r1)+region->c1,
+                        bmp_bytewidth(region->bmp8),region->r2-region->r1+1,nc,
+                        region->bgcolor);
+    }
+
+
 // #if (defined(WILLUSDEBUGX) || defined(WILLUSDEBUG))
 void bmpregion_write(BMPREGION *region,char *filename)
 
@@ -165,6 +342,16 @@ printf("@bmpregion_is_clear(rpc=%d, gt_in=%g), region->dpi=%d\n",rpc,gt_in,regio
     if (pt<0)
         pt=0;
     /*
+    ** Fastest:  from the page's dark pixel sums
+    */
+    if (bmpregion_darksum(region,1)!=NULL)
+        {
+        c=bmpregion_dark_count(region,region->r1,region->c1,region->r2,region->c2);
+        if (c>pt)
+            return(0);
+        return(pt<=0 ? 1 : 1+(int)10*c/pt);
+        }
+    /*
     ** Fast way to count dark pixels, but requires big array
     */
     if (col_pix_count!=NULL && rpc>0)
@@ -352,6 +539,7 @@ void bmpregion_init(BMPREGION *region)
     region->r1=region->r2=0;
     region->colcount=NULL;
     region->rowcount=NULL;
+    region->darksum=NULL;
     textrows_init(&region->textrows);
     textrow_init(&region->bbox);
     region->wrectmaps=NULL;
@@ -466,12 +654,13 @@ void bmpregion_copy(BMPREGION *dst,BMPREGION *src,int copy_text_rows)
 void bmpregion_calc_bbox(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,int calc_text_params)
 
     {
-    int i,j,n; /* ,r1,r2,dr1,dr2,dr,vtrim,vspace; */
+    int i,n; /* ,r1,r2,dr1,dr2,dr,vtrim,vspace; */
     int maxcount,mc2,h2;
     double f;
     int *colcount,*rowcount;
     static char *funcname="bmpregion_calc_bbox";
     TEXTROW *bbox;
+    K2DARKSUM *darksum;
 
 #if (WILLUSDEBUGX & 2)
 {
@@ -523,17 +712,18 @@ exit(10);
 
     memset(colcount,0,(bbox->c2+1)*sizeof(int));
     memset(rowcount,0,(bbox->r2+1)*sizeof(int));
-    for (j=bbox->r1;j<=bbox->r2;j++)
+    darksum=bmpregion_darksum(region,0);
+    if (darksum!=NULL && bbox->c1>=0 && bbox->r1>=0)
         {
-        unsigned char *p;
-        p=bmp_rowptr_from_top(region->bmp8,j)+bbox->c1;
-        for (i=0;i<n;i++,p++)
-            if (p[0]<region->bgcolor)
-                {
-                rowcount[j]++;
-                colcount[i+bbox->c1]++;
-                }
+        for (i=bbox->r1;i<=bbox->r2;i++)
+            rowcount[i]=k2darksum_count(darksum,i,bbox->c1,i,bbox->c2);
+        for (i=bbox->c1;i<=bbox->c2;i++)
+            colcount[i]=k2darksum_count(darksum,bbox->r1,i,bbox->r2,i);
         }
+    else
+        bmpsimd_dark_counts(&rowcount[bbox->r1],&colcount[bbox->c1],
+                            bmp_rowptr_from_top(region->bmp8,bbox->r1)+bbox->c1,
+                            bmp_bytewidth(region->bmp8),bbox->r2-bbox->r1+1,n,region->bgcolor);
 #if (WILLUSDEBUGX & 0x2)
 {
 if (region->rowcount!=NULL && region->r1>6690 && region->r1<6800)
@@ -1935,8 +2125,8 @@ printf("    Subdivided:  New len = %d pixels, multiplier=%g.\n",c2-c1+1,multipli
     if (k2settings->word_spacing>=0.)
         {
         double median_gap;
-        textwords_add_word_gaps(add_to_dbase ? textwords : NULL,lcheight,&median_gap,
-                                (double)gap_thresh/dr);
+        textwords_add_word_gaps(&k2settings->docstate,add_to_dbase ? textwords : NULL,
+                                lcheight,&median_gap,(double)gap_thresh/dr);
         textwords_remove_small_col_gaps(textwords,lcheight,median_gap/1.9,(double)gap_thresh/dr);
         }
 
@@ -2422,6 +2612,9 @@ void bmpregion_whiteout(BMPREGION *dstregion,BMPREGION *croppedregion)
         bmp_draw_filled_rect(dstregion->bmp8,croppedregion->c1,croppedregion->r1,
                                              croppedregion->c2,croppedregion->r2,
                                              255,255,255);
+    /* bmp8 has changed:  count its dark pixels again when needed */
+    if (dstregion->darksum!=NULL && dstregion->darksum->bmp8==dstregion->bmp8)
+        dstregion->darksum->calced=0;
     }
 
 
@@ -22,7 +22,13 @@
 
 #include "k2pdfopt.h"
 
-static int inflection_count(double *x,int n,int delta,int *wthresh);
+/* Most thresholds inflection_counts() handles in one pass */
+#define INFLECTION_MAXDELTAS 16
+
+static void bmp_inflections(WILLUSBITMAP *srcgrey,int ndivisions,int vertical,
+                            int *delta,int ndelta,int *wthresh,int *nisum);
+static int bmp_inflection_profiles(WILLUSBITMAP *srcgrey,int ndivisions,int vertical,double **g);
+static void inflection_counts(double *x,int n,int *delta,int ndelta,int *wthresh,int *count);
 static int vert_line_erase(WILLUSBITMAP *bmp,WILLUSBITMAP *cbmp,WILLUSBITMAP *tmp,
                     int row0,int col0,double tanth,double minheight_in,
                     /*double minwidth_in,*/ double maxwidth_in,int white_thresh,
@@ -46,9 +52,13 @@ static int k2pagebreakmarks_too_close_to_others(K2PAGEBREAKMARKS *k2pagebreakmar
                                                 int markrow,int dpi);
 
 
+/*
+** clip, if not NULL, limits what MuPDF draws of the page to the area inside
+** those margins (see masterinfo_source_clip()).  Other sources ignore it.
+*/
 int bmp_get_one_document_page(WILLUSBITMAP *src,K2PDFOPT_SETTINGS *k2settings,
                               int src_type,char *filename,
-                              int pageno,double dpi,int bpp,FILE *out)
+                              int pageno,double dpi,int bpp,double *clip,FILE *out)
 
     {
     int status;
@@ -69,7 +79,8 @@ if (status==0 && bpp!=24)
 bmp_convert_to_grayscale(src);
 return(status);
 #else
-            status=bmpmupdf_pdffile_to_bmp(src,filename,pageno,dpi*k2settings->document_scale_factor,bpp);
+            status=bmpmupdf_pdffile_to_bmp_ex(src,filename,pageno,dpi*k2settings->document_scale_factor,
+                                              bpp,clip);
             if (!status || k2settings->usegs<0 || src_type==SRC_TYPE_CBZ)
                 return(status);
 #endif
@@ -114,6 +125,42 @@ return(status);
     }
 
 
+/*
+** Have the source pages pagelist[0..n-1] rendered at dpi, bpp and clip on
+** nthreads background threads, so that bmp_get_one_document_page() finds
+** them ready.  Only done for files read with MuPDF.  Returns the number
+** of pages being rendered ahead.
+*/
+int bmp_document_pages_ahead(K2PDFOPT_SETTINGS *k2settings,int src_type,char *filename,
+                             int *pagelist,int n,double dpi,int bpp,double *clip,int nthreads)
+
+    {
+#if (defined(HAVE_MUPDF_LIB) && !(WILLUSDEBUGX & 0x80000000))
+    if (src_type==SRC_TYPE_CBZ || (src_type==SRC_TYPE_PDF && k2settings->usegs<=0))
+        return(bmpmupdf_render_ahead(filename,pagelist,n,dpi*k2settings->document_scale_factor,
+                                     bpp,clip,nthreads));
+#endif
+    return(0);
+    }
+
+
+/*
+** Returns 1 if bmp_document_pages_ahead() is rendering page pageno at dpi, bpp
+** and clip.
+*/
+int bmp_document_page_ahead(K2PDFOPT_SETTINGS *k2settings,int src_type,char *filename,
+                            int pageno,double dpi,int bpp,double *clip)
+
+    {
+#if (defined(HAVE_MUPDF_LIB) && !(WILLUSDEBUGX & 0x80000000))
+    if (src_type==SRC_TYPE_CBZ || (src_type==SRC_TYPE_PDF && k2settings->usegs<=0))
+        return(bmpmupdf_page_ahead(filename,pageno,dpi*k2settings->document_scale_factor,bpp,
+                                   clip));
+#endif
+    return(0);
+    }
+
+
 void k2bmp_erode(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,
                  K2PDFOPT_SETTINGS *k2settings)
     {
@@ -305,50 +352,24 @@ void bmp_clear_outside_crop_border(MASTERINFO *masterinfo,WILLUSBITMAP *src,
 double bmp_orientation(WILLUSBITMAP *bmp)
 
     {
-    int i,ic,wtcalc;
+    int i,nd,wth,wtv;
+    int delta[INFLECTION_MAXDELTAS],nh[INFLECTION_MAXDELTAS],nv[INFLECTION_MAXDELTAS];
     double hsum,vsum,rat;
 
-    wtcalc=-1;
-    for (vsum=0.,hsum=0.,ic=0,i=20;i<=85;i+=5,ic++)
+    /*
+    ** Each direction's profiles are found once and their inflections
+    ** counted for all thresholds in one pass.  (delta=20 used to be
+    ** evaluated only for a white threshold that was then not used.)
+    */
+    for (nd=0,i=25;i<=85;i+=5)
+        delta[nd++]=i;
+    wth=wtv=-1;
+    bmp_inflections(bmp,8,0,delta,nd,&wth,nh);
+    bmp_inflections(bmp,8,1,delta,nd,&wtv,nv);
+    for (vsum=0.,hsum=0.,i=0;i<nd;i++)
         {
-        double nv,nh;
-        int wth,wtv;
-
-#ifdef DEBUG
-k2printf("h %d:\n",i);
-#endif
-        if (ic==0)
-            wth=-1;
-        else
-            wth=wtcalc;
-wth=-1;
-        nh=bmp_inflections_horizontal(bmp,8,i,&wth);
-#ifdef DEBUG
-{
-FILE *f;
-f=fopen("inf.ep","a");
-fprintf(f,"/ag\n");
-fclose(f);
-}
-k2printf("v %d:\n",i);
-#endif
-        if (ic==0)
-            wtv=-1;
-        else
-            wtv=wtcalc;
-wtv=-1;
-        nv=bmp_inflections_vertical(bmp,8,i,&wtv);
-        if (ic==0)
-            {
-            if (wtv > wth)
-                wtcalc=wtv;
-            else
-                wtcalc=wth;
-            continue;
-            }
-// exit(10);
-        hsum += nh*i*i*i;
-        vsum += nv*i*i*i;
+        hsum += (double)nh[i]*delta[i]*delta[i]*delta[i];
+        vsum += (double)nv[i]*delta[i]*delta[i]*delta[i];
         }
     if (vsum==0. && hsum==0.)
         rat=1.0;
@@ -368,104 +389,152 @@ wtv=-1;
 double bmp_inflections_vertical(WILLUSBITMAP *srcgrey,int ndivisions,int delta,int *wthresh)
 
     {
-    int y0,y1,ny,i,nw,nisum,ni,wt,wtmax;
+    int nisum;
+
+    bmp_inflections(srcgrey,ndivisions,1,&delta,1,wthresh,&nisum);
+    return(nisum);
+    }
+
+
+double bmp_inflections_horizontal(WILLUSBITMAP *srcgrey,int ndivisions,int delta,int *wthresh)
+
+    {
+    int nisum;
+
+    bmp_inflections(srcgrey,ndivisions,0,&delta,1,wthresh,&nisum);
+    return(nisum);
+    }
+
+
+/*
+** nisum[k] = largest inflection count for delta[k], k=0..ndelta-1, among
+** ten strips of srcgrey, each 1/ndivisions of the width (vertical!=0,
+** profiles going down the page) or of the height (profiles going
+** across).  If (*wthresh)<0, the white threshold is found for each strip
+** and (*wthresh) gets the largest one among the strips with at least
+** three inflections for delta[0].
+*/
+static void bmp_inflections(WILLUSBITMAP *srcgrey,int ndivisions,int vertical,
+                            int *delta,int ndelta,int *wthresh,int *nisum)
+
+    {
+    int i,k,n,wt,wtmax;
+    int ni[INFLECTION_MAXDELTAS];
     double *g;
-    char *funcname="bmp_inflections_vertical";
+    static char *funcname="bmp_inflections";
 
-    nw=srcgrey->width/ndivisions;
-    y0=srcgrey->height/6;
-    y1=srcgrey->height-y0;
-    ny=y1-y0;
-    willus_dmem_alloc_warn(21,(void **)&g,ny*sizeof(double),funcname,10);
+    n=bmp_inflection_profiles(srcgrey,ndivisions,vertical,&g);
     wtmax=-1;
-    for (nisum=0,i=0;i<10;i++)
+    for (k=0;k<ndelta;k++)
+        nisum[k]=0;
+    for (i=0;i<10;i++)
         {
-        int x0,x1,nx,j;
-
-        x0=(srcgrey->width-nw)*(i+2)/13;
-        x1=x0+nw;
-        if (x1>srcgrey->width)
-            x1=srcgrey->width;
-        nx=x1-x0; 
-        for (j=y0;j<y1;j++)
-            {
-            int k,rsum;
-            unsigned char *p;
-
-            p=bmp_rowptr_from_top(srcgrey,j)+x0;
-            for (rsum=k=0;k<nx;k++,p++)
-                rsum+=p[0];
-            g[j-y0]=(double)rsum/nx;
-            }
         wt=(*wthresh);
-        ni=inflection_count(g,ny,delta,&wt);
-        if ((*wthresh)<0 && ni>=3 && wt>wtmax)
+        inflection_counts(&g[(size_t)i*n],n,delta,ndelta,&wt,ni);
+        if ((*wthresh)<0 && ni[0]>=3 && wt>wtmax)
             wtmax=wt;
-        if (ni>nisum)
-            nisum=ni;
+        for (k=0;k<ndelta;k++)
+            if (ni[k]>nisum[k])
+                nisum[k]=ni[k];
         }
     willus_dmem_free(21,&g,funcname);
     if ((*wthresh)<0)
         (*wthresh)=wtmax;
-    return(nisum);
     }
 
 
-double bmp_inflections_horizontal(WILLUSBITMAP *srcgrey,int ndivisions,int delta,int *wthresh)
+/*
+** Brightness profiles of the ten strips looked at by bmp_inflections():
+** (*g)[i*n..i*n+n-1] is strip i.  Returns n.
+*/
+static int bmp_inflection_profiles(WILLUSBITMAP *srcgrey,int ndivisions,int vertical,double **g)
 
     {
-    int x0,x1,nx,bw,i,nh,nisum,ni,wt,wtmax;
-    double *g;
-    char *funcname="bmp_inflections_vertical";
+    int i,j,k,n;
+    int *sum;
+    static char *funcname="bmp_inflection_profiles";
+
+    if (vertical)
+        {
+        int nw,y0,y1;
+
+        nw=srcgrey->width/ndivisions;
+        y0=srcgrey->height/6;
+        y1=srcgrey->height-y0;
+        n=y1-y0;
+        willus_dmem_alloc_warn(21,(void **)g,10*n*sizeof(double),funcname,10);
+        for (i=0;i<10;i++)
+            {
+            int x0,x1,nx;
+
+            x0=(srcgrey->width-nw)*(i+2)/13;
+            x1=x0+nw;
+            if (x1>srcgrey->width)
+                x1=srcgrey->width;
+            nx=x1-x0;
+            for (j=y0;j<y1;j++)
+                {
+                int rsum;
+                unsigned char *p;
+
+                p=bmp_rowptr_from_top(srcgrey,j)+x0;
+                for (rsum=k=0;k<nx;k++,p++)
+                    rsum+=p[0];
+                (*g)[i*n+j-y0]=(double)rsum/nx;
+                }
+            }
+        return(n);
+        }
+    {
+    int nh,x0,x1;
 
     nh=srcgrey->height/ndivisions;
     x0=srcgrey->width/6;
     x1=srcgrey->width-x0;
-    nx=x1-x0;
-    bw=bmp_bytewidth(srcgrey);
-    willus_dmem_alloc_warn(22,(void **)&g,nx*sizeof(double),funcname,10);
-    wtmax=-1;
-    for (nisum=0,i=0;i<10;i++)
+    n=x1-x0;
+    willus_dmem_alloc_warn(21,(void **)g,10*n*sizeof(double),funcname,10);
+    willus_dmem_alloc_warn(22,(void **)&sum,n*sizeof(int),funcname,10);
+    for (i=0;i<10;i++)
         {
-        int y0,y1,ny,j;
+        int y0,y1,ny;
 
         y0=(srcgrey->height-nh)*(i+2)/13;
         y1=y0+nh;
         if (y1>srcgrey->height)
             y1=srcgrey->height;
-        ny=y1-y0; 
-        for (j=x0;j<x1;j++)
+        ny=y1-y0;
+        /* Add up the columns a row at a time */
+        memset(sum,0,n*sizeof(int));
+        for (k=y0;k<y1;k++)
             {
-            int k,rsum;
             unsigned char *p;
 
-            p=bmp_rowptr_from_top(srcgrey,y0)+j;
-            for (rsum=k=0;k<ny;k++,p+=bw)
-                rsum+=p[0];
-            g[j-x0]=(double)rsum/ny;
+            p=bmp_rowptr_from_top(srcgrey,k)+x0;
+            for (j=0;j<n;j++)
+                sum[j]+=p[j];
             }
-        wt=(*wthresh);
-        ni=inflection_count(g,nx,delta,&wt);
-        if ((*wthresh)<0 && ni>=3 && wt>wtmax)
-            wtmax=wt;
-        if (ni>nisum)
-            nisum=ni;
+        for (j=0;j<n;j++)
+            (*g)[i*n+j]=(double)sum[j]/ny;
         }
-    willus_dmem_free(22,&g,funcname);
-    if ((*wthresh)<0)
-        (*wthresh)=wtmax;
-    return(nisum);
+    willus_dmem_free(22,(double **)&sum,funcname);
+    }
+    return(n);
     }
 
 
-static int inflection_count(double *x,int n,int delta,int *wthresh)
+/*
+** count[k] = inflection count of x[] for delta[k], k=0..ndelta-1
+** (ndelta <= INFLECTION_MAXDELTAS), all from one pass over x[].
+*/
+static void inflection_counts(double *x,int n,int *delta,int ndelta,int *wthresh,int *count)
 
     {
-    int i,i0,ni,ww,c,ct,wt,mode;
-    double meandi,meandisq,f1,f2,stdev;
+    int i,i0,k,ww,c,ct,wt;
+    int ipeak[INFLECTION_MAXDELTAS],ni[INFLECTION_MAXDELTAS],mode[INFLECTION_MAXDELTAS];
+    double meandi[INFLECTION_MAXDELTAS],meandisq[INFLECTION_MAXDELTAS];
     double *xs;
-    static int *hist;
-    static char *funcname="inflection_count";
+    int *hist;
+    static char *funcname="inflection_counts";
 
     /* Allocate memory for hist[] array rather than using static array */
     /* v2.13 fix */
@@ -512,58 +581,71 @@ k2printf("wt=%d\n",wt);
         for (xs[i]=0.,j=0;j<ww;j++,xs[i]+=x[i+j]);
         xs[i] /= ww;
         }
-    meandi=meandisq=0.;
-    if (xs[0]<=wt-delta)
-        mode=1;
-    else if (xs[0]>=wt)
-        mode=-1;
-    else
-        mode=0;
-    for (i0=0,ni=0,i=1;i<n-ww;i++)
+    for (k=0;k<ndelta;k++)
         {
-        if (mode==1 && xs[i]>=wt)
+        meandi[k]=meandisq[k]=0.;
+        if (xs[0]<=wt-delta[k])
+            mode[k]=1;
+        else if (xs[0]>=wt)
+            mode[k]=-1;
+        else
+            mode[k]=0;
+        ipeak[k]=ni[k]=0;
+        }
+    for (i=1;i<n-ww;i++)
+        for (k=0;k<ndelta;k++)
             {
-            if (i0>0)
+            if (mode[k]==1 && xs[i]>=wt)
                 {
-                meandi+=i-i0;
-                meandisq+=(i-i0)*(i-i0);
-                ni++;
+                if (ipeak[k]>0)
+                    {
+                    meandi[k]+=i-ipeak[k];
+                    meandisq[k]+=(i-ipeak[k])*(i-ipeak[k]);
+                    ni[k]++;
+                    }
+                ipeak[k]=i;
+                mode[k]=-1;
+                continue;
                 }
-            i0=i;
-            mode=-1;
-            continue;
+            if (xs[i]<=wt-delta[k])
+                mode[k]=1;
             }
-        if (xs[i]<=wt-delta)
-            mode=1;
-        }
-    stdev = 1.0; /* Avoid compiler warning */
-    if (ni>0)
-        {
-        meandi /= ni;
-        meandisq /= ni;
-        stdev = sqrt(fabs(meandi*meandi-meandisq));
-        }
-    f1=meandi/n;
-    if (f1>.15)
-        f1=.15;
-    if (ni>2)
+    for (k=0;k<ndelta;k++)
         {
-        if (stdev/meandi < .05)
-            f2=20.;
+        double f1,f2,stdev;
+
+        stdev = 1.0; /* Avoid compiler warning */
+        if (ni[k]>0)
+            {
+            meandi[k] /= ni[k];
+            meandisq[k] /= ni[k];
+            stdev = sqrt(fabs(meandi[k]*meandi[k]-meandisq[k]));
+            }
+        f1=meandi[k]/n;
+        if (f1>.15)
+            f1=.15;
+        if (ni[k]>2)
+            {
+            if (stdev/meandi[k] < .05)
+                f2=20.;
+            else
+                f2=meandi[k]/stdev;
+            }
         else
-            f2=meandi/stdev;
+            f2=1.;
+#ifdef DEBUG
+k2printf("    ni=%3d, f1=%8.4f, f2=%8.4f, f1*f2*ni=%8.4f\n",ni[k],f1,f2,f1*f2*ni[k]);
+#endif
+        count[k]=f1*f2*ni[k];
         }
-    else
-        f2=1.;
 #ifdef DEBUG
-k2printf("    ni=%3d, f1=%8.4f, f2=%8.4f, f1*f2*ni=%8.4f\n",ni,f1,f2,f1*f2*ni);
 {
 static int count=0;
 FILE *f;
 int i;
 f=fopen("inf.ep",count==0?"w":"a");
 count++;
-fprintf(f,"/sa l \"%d\" 1\n",ni);
+fprintf(f,"/sa l \"%d\" 1\n",ni[0]);
 for (i=0;i<n-ww;i++)
 fprintf(f,"%g\n",xs[i]);
 fprintf(f,"//nc\n");
@@ -571,7 +653,6 @@ fclose(f);
 }
 #endif /* DEBUG */
     willus_dmem_free(23,&xs,funcname);
-    return(f1*f2*ni);
     }
 
 /*
@@ -21,6 +21,9 @@
 
 #include "k2pdfopt.h"
 
+/* Max. source pages rendered ahead of the one being processed */
+#define K2FILE_MAX_PAGES_AHEAD 32
+
 static int k2files_overwrite=0;
 
 static void k2pdfopt_proc_file_or_folder(K2PDFOPT_SETTINGS *k2settings,char *arg,
@@ -57,7 +60,12 @@ static int  k2pdfopt_get_cover_image(WILLUSBITMAP *src,K2PDFOPT_SETTINGS *k2sett
                                      char *filename,int dpi,int *errcnt,int *pixwarn);
 static int  k2pdfopt_get_file_image(WILLUSBITMAP *src,K2PDFOPT_SETTINGS *k2settings,
                                     int src_type,char *filename,int pageno,
-                                    int dpi,int *errcnt,int *pixwarn);
+                                    int dpi,double *clip,int *errcnt,int *pixwarn);
+static int  k2file_render_ahead(K2PDFOPT_SETTINGS *k2settings,int src_type,char *filename,
+                                int index,int pagecount,int np,int dpi,double *clip);
+static int  k2file_read_ahead(K2PDFOPT_SETTINGS *k2settings,FILELIST *fl,int index,
+                              int pagecount,int np);
+static void k2file_pipestats_add(K2PIPESTATS *stats,int depth,double t0);
 static int  k2file_get_bitmap_file_list(FILELIST *fl,char *filename,int first_time_through);
 static int k2file_setup_output_file_names(K2PDFOPT_SETTINGS *k2settings,char *filename,
                                           K2PDFOPT_FILE_PROCESS *k2fileproc,
@@ -309,8 +317,8 @@ printf("    k2fileproc->rotation_deg=%d\n",(int)k2fileproc->rotation_deg);
             if (k2gui_active())
                 k2gui_cbox_error(filename,status);
 #endif
-            gs_conv_cleanup(psconv,filename,original_file);
             k2pdfopt_file_process_close(k2fileproc);
+            gs_conv_cleanup(psconv,filename,original_file);
             return;
             }
         }
@@ -328,8 +336,8 @@ printf("    k2fileproc->rotation_deg=%d\n",(int)k2fileproc->rotation_deg);
             if (k2gui_active())
                 k2gui_cbox_error(filename,status);
 #endif
-            gs_conv_cleanup(psconv,filename,original_file);
             k2pdfopt_file_process_close(k2fileproc);
+            gs_conv_cleanup(psconv,filename,original_file);
             return;
             }
         }
@@ -361,8 +369,9 @@ printf("    k2fileproc->rotation_deg=%d\n",(int)k2fileproc->rotation_deg);
             k2gui_cbox_set_files_completed(k2listproc->filecount,NULL);
         }
 #endif
-    gs_conv_cleanup(psconv,filename,original_file);
+    /* Close the source file before a converted copy of it is removed */
     k2pdfopt_file_process_close(k2fileproc);
+    gs_conv_cleanup(psconv,filename,original_file);
     }
 
 
@@ -442,10 +451,11 @@ static int k2pdfopt_proc_one(K2PDFOPT_SETTINGS *k2settings0,char *filename,
     WILLUSBITMAP preview_internal;
     int i,status,pw,pq,np,src_type,first_time_through,or_detect,fontsize_detect,preview;
     int pagecount,pagestep,pages_done,local_tocwrites;
-    int errcnt,pixwarn;
+    int errcnt,pixwarn,depth;
     FILELIST *fl,_fl;
     int dpi;
-    double rot_deg,size,bormean;
+    double rot_deg,size,bormean,t0;
+    double clip[8],*srcclip;
     char *srcfilename;
     extern int k2mark_page_count;
 /*
@@ -506,6 +516,7 @@ printf("first_time_through = %d\n",first_time_through);
         dpi=300;
     else
         dpi=k2settings->src_dpi;
+    srcclip=masterinfo_source_clip(k2settings,rot_deg,dpi,clip);
     src_type = get_source_type(filename);
     /*
     if (folder && first_time_through)
@@ -787,7 +798,10 @@ willus_mem_debug_update(bmpfile);
                 if (pageno-1>=fl->n)
                     continue;
                 wfile_fullname(bmpfile,fl->dir,fl->entry[pageno-1].name);
-                status=bmp_read(src,bmpfile,stdout);
+                t0=wsys_clock_secs();
+                depth=k2file_read_ahead(k2settings,fl,i,pagecount,np);
+                status=bmpahead_read(src,bmpfile,stdout);
+                k2file_pipestats_add(&masterinfo->pipestats,depth,t0);
                 if (status<0)
                     {
                     if (first_time_through)
@@ -801,12 +815,21 @@ willus_mem_debug_update(bmpfile);
                 if (i>0 && src_type!=SRC_TYPE_PDF && src_type!=SRC_TYPE_DJVU
                         && src_type!=SRC_TYPE_CBZ)
                     break;
+                t0=wsys_clock_secs();
+                depth=k2file_render_ahead(k2settings,src_type,srcfilename,i,pagecount,np,dpi,
+                                          srcclip);
                 status=k2pdfopt_get_file_image(src,k2settings,src_type,srcfilename,
-                                               pageno,dpi,&errcnt,&pixwarn);
+                                               pageno,dpi,srcclip,&errcnt,&pixwarn);
+                k2file_pipestats_add(&masterinfo->pipestats,depth,t0);
                 if (status<0)
                     break;
                 if (status==0)
                     continue;
+#ifdef HAVE_DJVU_LIB
+                /* Let djvulibre decode the next page while this one is processed */
+                if (src_type==SRC_TYPE_DJVU && nextpage>0)
+                    bmpdjvu_prefetch(srcfilename,nextpage);
+#endif
                 }
             } /* closing brace for "else" from checking for cover page */
         k2mark_page_count = i+1;
@@ -1067,6 +1090,9 @@ willus_mem_debug_update("End");
     if (k2settings->dst_break_pages<=0 && !k2settings_gap_override(k2settings))
     */
     masterinfo_flush(masterinfo,k2settings,1); /* 1 = final call--clear the bitmap */
+    masterinfo_encode_wait(masterinfo);
+    if (k2settings->verbose)
+        masterinfo_pipestats_echo(masterinfo);
     if (!k2settings_output_is_bitmap(k2settings))
         {
         char cdate[128],author[256],title[256];
@@ -1867,7 +1893,7 @@ void k2file_get_overlay_bitmap(WILLUSBITMAP *bmp,double *dpi,char *filename,char
 
         if (!pagelist_includes_page(pagelist,i,np))
             continue;
-        status=bmp_get_one_document_page(tmp,k2settings,src_type,srcfilename,i,100.,8,NULL);
+        status=bmp_get_one_document_page(tmp,k2settings,src_type,srcfilename,i,100.,8,NULL,NULL);
         c2++;
 #ifdef HAVE_K2GUI
         if (k2gui_active())
@@ -2095,6 +2121,14 @@ static void k2pdfopt_file_process_close(K2PDFOPT_FILE_PROCESS *k2fileproc)
 
     fontsize_histogram_free(&k2fileproc->fsh);
     willus_mem_free((double **)&k2fileproc->outname,funcname);
+    /* Done with this source file */
+    bmpahead_close();
+#ifdef HAVE_MUPDF_LIB
+    bmpmupdf_close();
+#endif
+#ifdef HAVE_DJVU_LIB
+    bmpdjvu_close();
+#endif
     }
 
 /*
@@ -2134,7 +2168,7 @@ static int k2pdfopt_get_cover_image(WILLUSBITMAP *src,K2PDFOPT_SETTINGS *k2setti
     /* If integer, interpret as page number of PDF source file */
     if ((src_type==SRC_TYPE_PDF || src_type==SRC_TYPE_DJVU || src_type==SRC_TYPE_CBZ) && pageno<=0)
         pageno=1;
-    status=k2pdfopt_get_file_image(src,k2settings,src_type,covfile,pageno,dpi,errcnt,pixwarn);
+    status=k2pdfopt_get_file_image(src,k2settings,src_type,covfile,pageno,dpi,NULL,errcnt,pixwarn);
     return(status==1 ? 1 : 0);
     }
     
@@ -2148,7 +2182,7 @@ static int k2pdfopt_get_cover_image(WILLUSBITMAP *src,K2PDFOPT_SETTINGS *k2setti
 */
 static int k2pdfopt_get_file_image(WILLUSBITMAP *src,K2PDFOPT_SETTINGS *k2settings,
                                    int src_type,char *filename,int pageno,
-                                   int dpi,int *errcnt,int *pixwarn)
+                                   int dpi,double *clip,int *errcnt,int *pixwarn)
 
     {
     static char *readerr=TTEXT_WARN "\a\n ** ERROR reading page %d from " TTEXT_BOLD2 "%s" TTEXT_WARN ".\n\n" TTEXT_NORMAL;
@@ -2159,57 +2193,66 @@ static int k2pdfopt_get_file_image(WILLUSBITMAP *src,K2PDFOPT_SETTINGS *k2settin
 /*
 printf("@k2pdfopt_get_file_image, fn=%s, src_type=%d, pageno=%d, dpi=%d\n",filename,src_type,pageno,dpi);
 */
-    /* Pre-read at low dpi to check bitmap size */
-
     source_is_bitmap = (src_type!=SRC_TYPE_PS && src_type!=SRC_TYPE_PDF && src_type!=SRC_TYPE_DJVU
                              && src_type!=SRC_TYPE_CBZ);
     if (source_is_bitmap && k2settings_need_color_initially(k2settings))
         bpp=24;
     else
         bpp=8;
-    wsys_set_decimal_period(1);
-    status=bmp_get_one_document_page(src,k2settings,src_type,filename,pageno,10.,bpp,stdout);
-    wsys_set_decimal_period(1);
-    if (status<0)
-        {
-        (*errcnt)=(*errcnt)+1;
-        if ((*errcnt)<=10)
+
+    /*
+    ** Pre-read at low dpi to check bitmap size--unless the page is already
+    ** being rendered at nominal dpi (k2file_render_ahead()).
+    */
+    if (source_is_bitmap
+          || !bmp_document_page_ahead(k2settings,src_type,filename,pageno,dpi,
+                                      k2settings_need_color_initially(k2settings) ? 24 : 8,clip))
+        {
+        wsys_set_decimal_period(1);
+        status=bmp_get_one_document_page(src,k2settings,src_type,filename,pageno,10.,bpp,
+                                         NULL,stdout);
+        wsys_set_decimal_period(1);
+        if (status<0)
             {
-            k2printf(readerr,pageno,filename);
-            if ((*errcnt)==10)
-                k2printf(readlimit,filename);
+            (*errcnt)=(*errcnt)+1;
+            if ((*errcnt)<=10)
+                {
+                k2printf(readerr,pageno,filename);
+                if ((*errcnt)==10)
+                    k2printf(readlimit,filename);
+                }
+            /* Error reading PS probably means we've run out of pages. */
+            if (src_type==SRC_TYPE_PS)
+                return(-1);
+            return(0);
             }
-        /* Error reading PS probably means we've run out of pages. */
-        if (src_type==SRC_TYPE_PS)
-            return(-1);
-        return(0);
-        }
-    /* If bitmap, no need to re-read */
-    if (source_is_bitmap)
-        return(1);
+        /* If bitmap, no need to re-read */
+        if (source_is_bitmap)
+            return(1);
 
-    /* Sanity check the bitmap size */
-    npix = (double)(dpi/10.)*(dpi/10.)*src->width*src->height;
-    if (npix > 2.5e8 && !(*pixwarn))
-        {
-        int ww,hh;
-        ww=(int)((double)(dpi/10.)*src->width+.5);
-        hh=(int)((double)(dpi/10.)*src->height+.5);
-        k2printf("\a\n" TTEXT_WARN "\n\a ** Source resolution is very high (%d x %d pixels)!\n"
-                "    You may want to reduce the -odpi or -idpi setting!\n"
-                "    k2pdfopt may crash when reading the source file..."
-                TTEXT_NORMAL "\n\n",ww,hh);
-        (*pixwarn)=1;
+        /* Sanity check the bitmap size */
+        npix = (double)(dpi/10.)*(dpi/10.)*src->width*src->height;
+        if (npix > 2.5e8 && !(*pixwarn))
+            {
+            int ww,hh;
+            ww=(int)((double)(dpi/10.)*src->width+.5);
+            hh=(int)((double)(dpi/10.)*src->height+.5);
+            k2printf("\a\n" TTEXT_WARN "\n\a ** Source resolution is very high (%d x %d pixels)!\n"
+                    "    You may want to reduce the -odpi or -idpi setting!\n"
+                    "    k2pdfopt may crash when reading the source file..."
+                    TTEXT_NORMAL "\n\n",ww,hh);
+            (*pixwarn)=1;
+            }
         }
 
     /* Read again at nominal source dpi */
     wsys_set_decimal_period(1);
     if (k2settings_need_color_initially(k2settings))
         status=bmp_get_one_document_page(src,k2settings,src_type,filename,pageno,
-                                         dpi,24,stdout);
+                                         dpi,24,clip,stdout);
     else
         status=bmp_get_one_document_page(src,k2settings,src_type,filename,pageno,
-                                         dpi,8,stdout);
+                                         dpi,8,clip,stdout);
     wsys_set_decimal_period(1);
     if (status<0)
         {
@@ -2229,6 +2272,80 @@ printf("@k2pdfopt_get_file_image, fn=%s, src_type=%d, pageno=%d, dpi=%d\n",filen
     }
 
 
+/*
+** Have the source pages from list index "index" on rendered on other
+** threads (-nt) while the main thread processes them one by one.
+** Returns the number of pages being rendered ahead.
+*/
+static int k2file_render_ahead(K2PDFOPT_SETTINGS *k2settings,int src_type,char *filename,
+                               int index,int pagecount,int np,int dpi,double *clip)
+
+    {
+    int pagelist[K2FILE_MAX_PAGES_AHEAD];
+    int i,n,nthreads;
+
+    if (k2settings->preview_page!=0 || pagecount<=0)
+        return(0);
+    nthreads=k2settings_num_threads(k2settings);
+    n = nthreads > K2FILE_MAX_PAGES_AHEAD ? K2FILE_MAX_PAGES_AHEAD : nthreads;
+    for (i=0;i<n && index+i<pagecount;i++)
+        {
+        pagelist[i]=double_pagelist_page_by_index(k2settings->pagelist,k2settings->pagexlist,
+                                                  index+i,np);
+        if (pagelist[i]<0)
+            break;
+        }
+    return(bmp_document_pages_ahead(k2settings,src_type,filename,pagelist,i,dpi,
+                             k2settings_need_color_initially(k2settings) ? 24 : 8,clip,nthreads));
+    }
+
+
+/*
+** Same as k2file_render_ahead(), for the files of a bitmap folder.
+** bmpahead_queue() keeps its own copy of the file names.
+*/
+static int k2file_read_ahead(K2PDFOPT_SETTINGS *k2settings,FILELIST *fl,int index,
+                             int pagecount,int np)
+
+    {
+    char names[K2FILE_MAX_PAGES_AHEAD][MAXFILENAMELEN];
+    char *filelist[K2FILE_MAX_PAGES_AHEAD];
+    int i,n,nthreads;
+
+    if (k2settings->preview_page!=0 || pagecount<=0)
+        return(0);
+    nthreads=k2settings_num_threads(k2settings);
+    n = nthreads > K2FILE_MAX_PAGES_AHEAD ? K2FILE_MAX_PAGES_AHEAD : nthreads;
+    for (i=0;i<n && index+i<pagecount;i++)
+        {
+        int pageno;
+
+        pageno=double_pagelist_page_by_index(k2settings->pagelist,k2settings->pagexlist,
+                                             index+i,np);
+        if (pageno<1 || pageno>fl->n)
+            break;
+        wfile_fullname(names[i],fl->dir,fl->entry[pageno-1].name);
+        filelist[i]=names[i];
+        }
+    return(bmpahead_queue(filelist,i,nthreads));
+    }
+
+
+/*
+** Count a source page that took since t0 to get, with depth pages being
+** rendered ahead of it.
+*/
+static void k2file_pipestats_add(K2PIPESTATS *stats,int depth,double t0)
+
+    {
+    stats->render_stall += wsys_clock_secs()-t0;
+    stats->pages++;
+    stats->render_depth += depth;
+    if (depth > stats->render_depth_max)
+        stats->render_depth_max = depth;
+    }
+
+
 static int k2file_get_bitmap_file_list(FILELIST *fl,char *filename,int first_time_through)
 
     {
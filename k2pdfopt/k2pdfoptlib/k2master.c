@@ -121,6 +121,10 @@ void masterinfo_init(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings)
     masterinfo->page_region_gap_in=-1.;
     masterinfo->k2pagebreakmarks.n=0;
     sprintf(masterinfo->pageinfo.producer,"K2pdfopt %s",k2pdfopt_version);
+    masterinfo->encoder=NULL;
+    k2darksum_init(&masterinfo->darksum);
+    memset(&masterinfo->pipestats,0,sizeof(K2PIPESTATS));
+    masterinfo->pipestats.start=wsys_clock_secs();
     }
 
 
@@ -164,11 +168,13 @@ void masterinfo_free(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings)
     {
     static char *funcname="masterinfo_free";
 
+    masterinfo_encode_wait(masterinfo);
 #ifdef HAVE_MUPDF_LIB
     if (k2settings->use_crop_boxes)
         wpdfboxes_free(&masterinfo->pageinfo.boxes);
 #endif
     wrapbmp_free(&masterinfo->wrapbmp);
+    k2darksum_free(&masterinfo->darksum);
     bmp_free(&masterinfo->bmp);
 #ifdef K2PDFOPT_KINDLEPDFVIEWER
     wrectmaps_free(&masterinfo->rectmaps);
@@ -213,27 +219,7 @@ int masterinfo_new_source_page_init(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2
 printf("@masterinfo_new_source_page(pageno=%d,nextpage=%d,maxpages=%d)\n",pageno,nextpage,masterinfo->srcpages);
 #endif
     white=k2settings->src_whitethresh;
-    if (pageno==masterinfo->nextpage && masterinfo->landscape_next!=-1)
-        masterinfo->landscape = masterinfo->landscape_next;
-    else
-        masterinfo->landscape = k2pdfopt_settings_landscape(k2settings,pageno,masterinfo->srcpages);
-#if (WILLUSDEBUGX & 1)
-printf("masterinfo->landscape=%d\n",masterinfo->landscape);
-#endif
-    if (nextpage>=0)
-        masterinfo->landscape_next = k2pdfopt_settings_landscape(k2settings,nextpage,masterinfo->srcpages);
-    else
-        masterinfo->landscape_next = -1;
-    masterinfo->nextpage=nextpage;
-    /* Record document scale factor so we know how PDF source dims were scaled */
-    masterinfo->document_scale_factor=k2settings->document_scale_factor;
-    masterinfo->pageinfo.srcpage = pageno;
-    /* v2.32 */
-    
-    /* v2.20:  rotation now used to find text in OCR layer, so always assign srcpage_rot_deg. */
-    masterinfo->pageinfo.srcpage_rot_deg=0.;
-    masterinfo->pageinfo.srcpage_fine_rot_deg = 0.;
-    region->rotdeg=0;
+    masterinfo_source_page_info_init(masterinfo,k2settings,region,pageno,nextpage);
     if (!OR_DETECT(rot_deg) && !OREP_DETECT(k2settings) && rot_deg!=0)
         {
         bmp_rotate_right_angle(src,rot_deg);
@@ -277,7 +263,7 @@ printf("masterinfo->landscape=%d\n",masterinfo->landscape);
         {
         double rot;
         rot=bmp_autostraighten(src,srcgrey,white,k2settings->src_autostraighten,0.1,
-                               k2settings->debug,out);
+                               k2settings_num_threads(k2settings),k2settings->debug,out);
 #ifdef HAVE_K2GUI
         if (k2gui_active() && fabs(rot)>1e-4)
             k2printf("\n(Page straightened--rotated cc by %.2f deg.)\n",rot);
@@ -354,6 +340,60 @@ printf("22\n");
     /* Convert source back to gray scale if not using color output */
     if (!k2settings_need_color_permanently(k2settings))
         bmp_convert_to_greyscale(src);
+    masterinfo_source_page_region_init(masterinfo,k2settings,src,srcgrey,marked,region,white,
+                                       pageno);
+    /* v2.34: moved k2pdfopt_settings_set_margins_and_devsize() to calling function */
+    /*
+    k2pdfopt_settings_set_margins_and_devsize(k2settings,region,masterinfo,0);
+    */
+    return(1);
+    }
+
+
+/*
+** First part of masterinfo_new_source_page_init():  page info that does
+** not depend on the source bitmap.
+*/
+void masterinfo_source_page_info_init(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings,
+                                      BMPREGION *region,int pageno,int nextpage)
+
+    {
+    if (pageno==masterinfo->nextpage && masterinfo->landscape_next!=-1)
+        masterinfo->landscape = masterinfo->landscape_next;
+    else
+        masterinfo->landscape = k2pdfopt_settings_landscape(k2settings,pageno,masterinfo->srcpages);
+#if (WILLUSDEBUGX & 1)
+printf("masterinfo->landscape=%d\n",masterinfo->landscape);
+#endif
+    if (nextpage>=0)
+        masterinfo->landscape_next = k2pdfopt_settings_landscape(k2settings,nextpage,masterinfo->srcpages);
+    else
+        masterinfo->landscape_next = -1;
+    masterinfo->nextpage=nextpage;
+    /* Record document scale factor so we know how PDF source dims were scaled */
+    masterinfo->document_scale_factor=k2settings->document_scale_factor;
+    masterinfo->pageinfo.srcpage = pageno;
+    /* v2.32 */
+    
+    /* v2.20:  rotation now used to find text in OCR layer, so always assign srcpage_rot_deg. */
+    masterinfo->pageinfo.srcpage_rot_deg=0.;
+    masterinfo->pageinfo.srcpage_fine_rot_deg = 0.;
+    region->rotdeg=0;
+    /* Sums of the previous page's bitmap */
+    k2darksum_set(&masterinfo->darksum,NULL,0);
+    }
+
+
+/*
+** Last part of masterinfo_new_source_page_init():  set up region to
+** cover the whole (already processed) src / srcgrey bitmaps.
+*/
+void masterinfo_source_page_region_init(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings,
+                                        WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,
+                                        WILLUSBITMAP *marked,BMPREGION *region,int white,
+                                        int pageno)
+
+    {
     region->dpi = k2settings->src_dpi;
     region->r1 = 0;
     region->r2 = srcgrey->height-1;
@@ -381,13 +421,11 @@ printf("22\n");
             region->marked=region->bmp;
         }
     masterinfo->bgcolor=white;
+    /* Regions copied from this one count their dark pixels from these sums */
+    k2darksum_set(&masterinfo->darksum,srcgrey,white);
+    region->darksum=&masterinfo->darksum;
     /* dst_fit_to_page == -2 if gridding */
     masterinfo->fit_to_page = k2settings->dst_fit_to_page;
-    /* v2.34: moved k2pdfopt_settings_set_margins_and_devsize() to calling function */
-    /*
-    k2pdfopt_settings_set_margins_and_devsize(k2settings,region,masterinfo,0);
-    */
-    return(1);
     }
 
 
@@ -2641,6 +2679,53 @@ margins_inches[3]);
     }
 
 
+/*
+** The source crop margins (-m) as clip margins for bmp_get_one_document_page()
+** at dpi, so that the area bmp_clear_outside_crop_border() will white out
+** anyway is not drawn in the first place.  clip[0..3] are pixels and
+** clip[4..7] fractions of the page width/height (see bmpmupdf_pdffile_to_bmp_ex()).
+**
+** Returns NULL (draw the whole page) if anything needs the source page
+** outside the crop margins:  orientation detection and rotation, straightening,
+** line erasure, erosion, autocrop, de-warping, trimmed or OCR-layer margins,
+** and the marked-source and preview pages.
+*/
+double *masterinfo_source_clip(K2PDFOPT_SETTINGS *k2settings,double rot_deg,double dpi,
+                               double *clip)
+
+    {
+    K2CROPBOX *cbox;
+    int i;
+
+    if (OR_DETECT(rot_deg) || OREP_DETECT(k2settings) || rot_deg!=0.
+          || k2settings->src_autostraighten > 0. || k2settings->erase_vertical_lines>0
+          || k2settings->erase_horizontal_lines>0 || k2settings->src_erosion!=0
+          || k2settings->autocrop || k2settings->show_marked_source
+          || k2settings->preview_page!=0)
+        return(NULL);
+#ifdef HAVE_LEPTONICA_LIB
+    if (k2settings->dewarp)
+        return(NULL);
+#endif
+    cbox=&k2settings->srccropmargins;
+    for (i=0;i<4;i++)
+        {
+        clip[i]=clip[i+4]=0.;
+        if (cbox->units[i]==UNITS_TRIMMED || cbox->units[i]==UNITS_OCRLAYER)
+            return(NULL);
+        if (cbox->units[i]==UNITS_SOURCE)
+            clip[i+4]=cbox->box[i];
+        else if (cbox->units[i]==UNITS_INCHES)
+            clip[i]=cbox->box[i]*dpi;
+        else if (cbox->units[i]==UNITS_CM)
+            clip[i]=cbox->box[i]*dpi/2.54;
+        else
+            clip[i]=cbox->box[i];
+        }
+    return(clip);
+    }
+
+
 /*
 **
 ** Master function to do unit conversion.  Does entire rectangle at once.
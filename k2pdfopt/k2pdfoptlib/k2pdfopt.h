@@ -231,6 +231,28 @@ typedef struct
     K2PAGEBREAKMARK k2pagebreakmark[MAXK2PAGEBREAKMARKS];
     } K2PAGEBREAKMARKS;
 
+/*
+** K2DOCSTATE carries layout history from one region to the next within a
+** source document.  These used to be function statics; keeping them with
+** the settings lets several documents be processed at once in different
+** threads.  Reset by k2pdfopt_settings_new_source_document_init().
+*/
+#define MAXWORDGAPS 1024
+typedef struct
+    {
+    /* Word gap history--see textwords_add_word_gaps() */
+    int    nwordgaps;
+    double wordgap[MAXWORDGAPS];
+    /* Last region added by bmpregion_vertically_break() */
+    int    last_ncols;
+    double last_region_width_inches;
+    int    last_source_page;
+    int    last_region_r2;
+    int    last_page_height;
+    /* Type (notes or main text) of last rows added by bmpregion_add_textrows() */
+    int    last_rows_type;
+    } K2DOCSTATE;
+
 /*
 ** K2PDFOPT_SETTINGS stores user settings that affect the document processing.
 */
@@ -439,6 +461,7 @@ typedef struct
     int src_erosion; /* Source erosion filter value */
     int detect_double_rows; /* Detect double or triple text rows "stuck together" */
     double textheight_min_pts; /* Minimum text row height allowed def = -1 (not used) */
+    K2DOCSTATE docstate; /* Not a user setting--per-document layout state */
     } K2PDFOPT_SETTINGS;
 
 
@@ -587,6 +610,22 @@ typedef struct
     int n,na;
     } WRECTMAPS;
     
+/*
+** Summed-area table of the dark pixels (< bgcolor) of an 8-bit bitmap:
+** sum[r*(width+1)+c] is the number of them in rows 0..r-1, columns 0..c-1.
+** Lets the layout analysis count the dark pixels of any rectangle of the
+** source page in O(1).  Calculated when first needed.  See bmpregion.c.
+*/
+typedef struct
+    {
+    WILLUSBITMAP *bmp8; /* Bitmap to count.  NULL if none. */
+    int bgcolor;
+    int calced;         /* 1 = sum[] is filled in, -1 = not enough memory */
+    int width,height;
+    unsigned int *sum;
+    long size_allocated;
+    } K2DARKSUM;
+
 /*
 ** BMPREGION is a rectangular region within a bitmap.  This is the main
 ** data structure used by k2pdfopt to break up the source page.
@@ -609,6 +648,7 @@ typedef struct
     int rotdeg;     /* Source rotation, degrees, counterclockwise */
     int *colcount;  /* Always check for NULL before using */
     int *rowcount;  /* Always check for NULL before using */
+    K2DARKSUM *darksum; /* Dark pixel sums of bmp8 (not owned), or NULL */
     WILLUSBITMAP *bmp;
     WILLUSBITMAP *bmp8;
     WILLUSBITMAP *marked;
@@ -666,6 +706,28 @@ typedef struct
     int na;
     } QUEUED_PAGE_INFO;
 
+/*
+** Where the source page loop spends its time.  The pages are rendered
+** ahead by other threads (render), laid out by the main thread (layout),
+** and the output pages are compressed by the encode threads and written
+** in order by the writer thread (encode).  A stall is time the main thread
+** spends waiting on a stage.
+*/
+typedef struct
+    {
+    double start;         /* wsys_clock_secs() at masterinfo_init() */
+    int    pages;         /* Source pages read */
+    double render_stall;  /* Waiting for source page bitmaps */
+    int    render_depth;  /* Sum over source pages of pages being rendered ahead */
+    int    render_depth_max;
+    int    encoded;       /* Output pages written by the writer thread */
+    double encode_stall;  /* Waiting for room in the encode queue, or for it to drain */
+    double encode_busy;   /* Encode and writer threads compressing and writing */
+    double encode_idle;   /* Writer thread waiting for output pages */
+    int    encode_depth;  /* Sum over output pages of encode queue length */
+    int    encode_depth_max;
+    } K2PIPESTATS;
+
 /*
 ** MASTERINFO contains performance parameters relevant to the device output.
 ** (E.g. the "master" bitmap which is a running scroll of content meant to
@@ -731,6 +793,9 @@ typedef struct
     double page_region_gap_in;  /* Gap between page regions.  If new page, gap between
                                 ** top of page and new region.
                                 */
+    void *encoder;          /* Output page encode threads--see k2publish.c */
+    K2PIPESTATS pipestats;  /* Source page loop timing */
+    K2DARKSUM darksum;      /* Of the source page's grey bitmap */
 #if 0
     int fontsize;    /* Font size of last row added (pixels).  < 0 = no last font */
     int linespacing; /* Line spacing of last row added (pixels) */
@@ -839,8 +904,14 @@ int  userinput_any_string(char *message,char *dstval,int maxlen,char *defname);
 int  get_ttyrows(void);
 
 /* bmpregion.c */
+void k2darksum_init(K2DARKSUM *darksum);
+void k2darksum_free(K2DARKSUM *darksum);
+void k2darksum_set(K2DARKSUM *darksum,WILLUSBITMAP *bmp8,int bgcolor);
+K2DARKSUM *bmpregion_darksum(BMPREGION *region,int calc);
+int  bmpregion_dark_count(BMPREGION *region,int r1,int c1,int r2,int c2);
 int  bmpregion_row_black_count(BMPREGION *region,int r0);
 int  bmpregion_col_black_count(BMPREGION *region,int c0);
+void bmpregion_col_black_counts(BMPREGION *region,int *count);
 void bmpregion_write(BMPREGION *region,char *filename);
 void bmpregion_row_histogram(BMPREGION *region);
 int  bmpregion_is_clear(BMPREGION *region,int *row_black_count,int *col_black_count,
@@ -942,8 +1013,8 @@ double fontsize_histogram_median(FONTSIZE_HISTOGRAM *fsh,int starting_index);
 void textwords_compute_col_gaps(TEXTWORDS *textwords,int c2);
 void textwords_remove_small_col_gaps(TEXTWORDS *textwords,int lcheight,double mingap,
                                      double word_spacing);
-void textwords_add_word_gaps(TEXTWORDS *textwords,int lcheight,double *median_gap,
-                             double word_spacing);
+void textwords_add_word_gaps(K2DOCSTATE *docstate,TEXTWORDS *textwords,int lcheight,
+                             double *median_gap,double word_spacing);
 #define textwords_init(x) textrows_init(x)
 #define textwords_free(x) textrows_free(x)
 #define textwords_clear(x) textrows_clear(x)
@@ -955,7 +1026,7 @@ void textwords_add_word_gaps(TEXTWORDS *textwords,int lcheight,double *median_ga
 
 
 /* k2proc.c */
-void k2proc_init_one_document(void);
+void k2proc_init_one_document(K2PDFOPT_SETTINGS *k2settings);
 void k2proc_get_fontsize_histogram(BMPREGION *region,MASTERINFO *masterinfo,
                                    K2PDFOPT_SETTINGS *k2settings,FONTSIZE_HISTOGRAM *fsh);
 void bmpregion_add_cover_image(BMPREGION *coverimage,K2PDFOPT_SETTINGS *k2settings,
@@ -972,6 +1043,7 @@ double line_spacing_from_font_size(double lcheight,double h5050,double capheight
 /* k2settings.c */
 void k2pdfopt_settings_init(K2PDFOPT_SETTINGS *k2settings);
 int  k2settings_output_is_bitmap(K2PDFOPT_SETTINGS *k2settings);
+int  k2settings_num_threads(K2PDFOPT_SETTINGS *k2settings);
 int k2settings_columns_left_to_right(K2PDFOPT_SETTINGS *k2settings);
 int k2settings_valid_grid_order(K2PDFOPT_SETTINGS *k2settings);
 K2NOTES *page_has_notes_margin(K2PDFOPT_SETTINGS *k2settings,MASTERINFO *masterinfo);
@@ -1040,6 +1112,12 @@ int  masterinfo_new_source_page_init(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k
                          WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,WILLUSBITMAP *marked,
                          BMPREGION *region,double rot_deg,double *bormean,
                          char *rotstr,int pageno,int nextpage,FILE *out);
+void masterinfo_source_page_info_init(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings,
+                                      BMPREGION *region,int pageno,int nextpage);
+void masterinfo_source_page_region_init(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings,
+                                        WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,
+                                        WILLUSBITMAP *marked,BMPREGION *region,int white,
+                                        int pageno);
 void masterinfo_add_pagebreakmark(MASTERINFO *masterinfo,int marktype);
 void masterinfo_add_bitmap(MASTERINFO *masterinfo,WILLUSBITMAP *src,
                     K2PDFOPT_SETTINGS *k2settings,int npageboxes,
@@ -1064,9 +1142,13 @@ void masterinfo_get_margins(K2PDFOPT_SETTINGS *k2setings,double *margins_inches,
                             K2CROPBOX *cbox,MASTERINFO *masterinfo,BMPREGION *region);
 void masterinfo_convert_to_source_pixels(MASTERINFO *masterinfo,LINE2D *userrect,int *units,
                                         POINT2D *pagedims_inches,double dpi,LINE2D *trimrect_in);
+double *masterinfo_source_clip(K2PDFOPT_SETTINGS *k2settings,double rot_deg,double dpi,
+                               double *clip);
 
 /* k2publish.c */
 void masterinfo_publish(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings,int flushall);
+void masterinfo_encode_wait(MASTERINFO *masterinfo);
+void masterinfo_pipestats_echo(MASTERINFO *masterinfo);
 
 /* k2ocr.c */
 void k2ocr_init(K2PDFOPT_SETTINGS *k2settings,char *initstr);
@@ -1101,7 +1183,12 @@ void pagelist_get_array(int **pagelist,char *asciilist);
 /* k2bmp.c */
 int    bmp_get_one_document_page(WILLUSBITMAP *src,K2PDFOPT_SETTINGS *k2pdfopt,
                               int src_type,char *filename,
-                              int pageno,double dpi,int bpp,FILE *out);
+                              int pageno,double dpi,int bpp,double *clip,FILE *out);
+int    bmp_document_pages_ahead(K2PDFOPT_SETTINGS *k2settings,int src_type,char *filename,
+                                int *pagelist,int n,double dpi,int bpp,double *clip,
+                                int nthreads);
+int    bmp_document_page_ahead(K2PDFOPT_SETTINGS *k2settings,int src_type,char *filename,
+                               int pageno,double dpi,int bpp,double *clip);
 double bmp_orientation(WILLUSBITMAP *bmp);
 void   bmp_clear_outside_crop_border(MASTERINFO *masterinfo,WILLUSBITMAP *src,
                                      WILLUSBITMAP *srcgrey,K2PDFOPT_SETTINGS *k2settings);
@@ -78,11 +78,13 @@ static void bmpregion_one_row_wrap_and_add(BMPREGION *region,K2PDFOPT_SETTINGS *
 /*
 ** Call once per document
 */
-void k2proc_init_one_document(void)
+void k2proc_init_one_document(K2PDFOPT_SETTINGS *k2settings)
 
     {
     /* Init vert break routine */
-    bmpregion_vertically_break(NULL,NULL,NULL,0.,0,0,NULL);
+    bmpregion_vertically_break(NULL,k2settings,NULL,0.,0,0,NULL);
+    /* Init text row type tracking */
+    k2settings->docstate.last_rows_type = -1;
     }
 
 
@@ -1900,8 +1902,10 @@ printf("After remove small rows:  %d rows left\n",textrows->n);
                                   funcname,10);
     if (1)
 #else
-    if (willus_mem_alloc((double **)&pixel_count_array,sizeof(int)*(region->c2+2)*(region->r2+2),
-                                  funcname))
+    /* Not needed if bmpregion_is_clear() can use the page's dark pixel sums */
+    if (bmpregion_darksum(region,1)==NULL
+          && willus_mem_alloc((double **)&pixel_count_array,
+                              sizeof(int)*(region->c2+2)*(region->r2+2),funcname))
 #endif
         {
         int bw,jmax;
@@ -1937,8 +1941,7 @@ printf("After remove small rows:  %d rows left\n",textrows->n);
     */
     for (i=0;i<region->c1;i++)
         black_pixel_count_by_column[i]=1;
-    for (i=region->c1;i<=region->c2;i++)
-        black_pixel_count_by_column[i]=bmpregion_col_black_count(region,i);
+    bmpregion_col_black_counts(region,black_pixel_count_by_column);
     for (i=region->c2+1;i<region->c2+2;i++)
         black_pixel_count_by_column[i]=1;
     /*
@@ -2241,12 +2244,8 @@ static void bmpregion_vertically_break(BMPREGION *region,K2PDFOPT_SETTINGS *k2se
                                        int source_page,int ncols,BMPREGION *notes)
 
     {
-    /* Keep track of last region dimensions */
-    static int    last_ncols=-1;
-    static double last_region_width_inches=-1.;
-    static int    last_source_page=-1;
-    static int    last_region_r2=-1;
-    static int    last_page_height=-1;
+    /* Keep track of last region dimensions (in k2settings->docstate) */
+    K2DOCSTATE *ds;
     int i,biggap,revert;
     int region_is_centered;
     int ni,notesgap,notes_are_centered;
@@ -2264,13 +2263,14 @@ static void bmpregion_vertically_break(BMPREGION *region,K2PDFOPT_SETTINGS *k2se
     static char *funcname="bmpregion_vertically_break";
 
     added_region.force_scale = force_scale;
+    ds=&k2settings->docstate;
     if (region==NULL)
         {
-        last_ncols = -1;
-        last_region_width_inches = -1.;
-        last_source_page=-1;
-        last_region_r2=-1;
-        last_page_height=-1;
+        ds->last_ncols = -1;
+        ds->last_region_width_inches = -1.;
+        ds->last_source_page=-1;
+        ds->last_region_r2=-1;
+        ds->last_page_height=-1;
         return;
         }
 /*
@@ -2429,7 +2429,7 @@ k2printf("    biggap=%d\n",biggap);
     region_width_inches = (double)(region->c2-region->c1+1)/region->dpi;
     region_height_inches = (double)(region->r2-region->r1+1)/region->dpi;
     /* If user wants a gap between pages--do that */
-    if (k2settings->dst_break_pages<-1 && source_page>0 && source_page != last_source_page)
+    if (k2settings->dst_break_pages<-1 && source_page>0 && source_page != ds->last_source_page)
         {
         masterinfo->mandatory_region_gap=2; /* 2 means set by -bp option */
         masterinfo->page_region_gap_in=(-1-k2settings->dst_break_pages)/1000.;
@@ -2442,24 +2442,24 @@ printf("page_region_gap set by dst_break to %g in.\n",masterinfo->page_region_ga
         double gap_in;
 
         /* First region on the source page? */
-        if (source_page != last_source_page)
+        if (source_page != ds->last_source_page)
             {
             double margins_inches[4];
 
             masterinfo_get_margins(k2settings,margins_inches,&k2settings->srccropmargins,
                                    masterinfo,region);
             gap_in = (double)region->r1/k2settings->src_dpi - margins_inches[1];
-            if (last_source_page>=0)
-                gap_in += (double)(last_page_height-last_region_r2)/k2settings->src_dpi
+            if (ds->last_source_page>=0)
+                gap_in += (double)(ds->last_page_height-ds->last_region_r2)/k2settings->src_dpi
                             - margins_inches[3];
 #if (WILLUSDEBUGX & 0x800000)
-printf("page_region_gap 1. set to %g in (sp=%d, lsp=%d).\n",gap_in,source_page,last_source_page);
+printf("page_region_gap 1. set to %g in (sp=%d, lsp=%d).\n",gap_in,source_page,ds->last_source_page);
 printf("          r->r1=%d, srcdpi=%d, margin=%g\n",region->r1,(int)k2settings->src_dpi,margins_inches[1]);
 #endif
             }
         else
             {
-            gap_in = (double)(region->r1 - last_region_r2 - 1)/k2settings->src_dpi;
+            gap_in = (double)(region->r1 - ds->last_region_r2 - 1)/k2settings->src_dpi;
             if (gap_in < 0.)
                 gap_in = 0.25;
 #if (WILLUSDEBUGX & 0x800000)
@@ -2469,8 +2469,8 @@ printf("page_region_gap 2. set to %g in.\n",gap_in);
         masterinfo->page_region_gap_in = gap_in;
 
         /* Got the gap--now determine whether it should be mandatory */
-        if (different_widths(last_region_width_inches,region_width_inches)
-               || ncols != last_ncols)
+        if (different_widths(ds->last_region_width_inches,region_width_inches)
+               || ncols != ds->last_ncols)
             masterinfo->mandatory_region_gap=1;
         else
             masterinfo->mandatory_region_gap=0;
@@ -2479,11 +2479,11 @@ printf("page_region_gap 2. set to %g in.\n",gap_in);
     /*
     ** Done determining region gap--store data about this region for next comparison
     */
-    last_ncols = ncols;
-    last_region_width_inches = region_width_inches;
-    last_source_page=source_page;
-    last_region_r2=region->r2;
-    last_page_height=region->bmp->height;
+    ds->last_ncols = ncols;
+    ds->last_region_width_inches = region_width_inches;
+    ds->last_source_page=source_page;
+    ds->last_region_r2=region->r2;
+    ds->last_page_height=region->bmp->height;
 
 
 /*
@@ -2677,11 +2677,12 @@ static void bmpregion_add_textrows(ADDED_REGION_INFO *added_region,
     BMPREGION *region,_region;
     TEXTROW *textrow;
     int n,j,c1,c2,nc,marking_flags;
-    static int lasttype=-1;
+    int *lasttype;
 
 #if (WILLUSDEBUGX & 0x40000)
 printf("ADDING %s ROWS %d - %d OUT OF %d ...\n",added_region->notes?"NOTES":"MAIN TEXT",added_region->firstrow+1,added_region->lastrow+1,added_region->region->textrows.n);
 #endif
+    lasttype=&k2settings->docstate.last_rows_type;
     n=added_region->region->textrows.n;
     textrow=added_region->region->textrows.textrow;
     region=&_region;
@@ -2717,7 +2718,7 @@ printf("ADDING %s ROWS %d - %d OUT OF %d ...\n",added_region->notes?"NOTES":"MAI
     /*
     ** Much simpler decision making about gap now (v2.00, 22 Aug 2013)
     */
-    if (lasttype>=0 && added_region->notes != lasttype)
+    if ((*lasttype)>=0 && added_region->notes != (*lasttype))
         {
         wrapbmp_flush(masterinfo,k2settings,0);
         masterinfo->mandatory_region_gap=1;
@@ -2742,7 +2743,7 @@ printf("page_region_gap set by add_text_rows II to %g in.\n",masterinfo->page_re
 #endif
             }
         }
-    lasttype = added_region->notes;
+    (*lasttype) = added_region->notes;
 /* printf("Adding %s region...\n",added_region->notes?"NOTES":"MAIN TEXT"); */
     {
     ADDED_REGION_INFO new_added_region;
@@ -3561,7 +3562,8 @@ static void bmpregion_one_row_wrap_and_add(BMPREGION *region,K2PDFOPT_SETTINGS *
     */
     {
     double median_gap;
-    textwords_add_word_gaps(NULL,newregion->bbox.lcheight,&median_gap,k2settings->word_spacing);
+    textwords_add_word_gaps(&k2settings->docstate,NULL,newregion->bbox.lcheight,&median_gap,
+                            k2settings->word_spacing);
     gappix = (int)(median_gap*newregion->bbox.lcheight+.5);
     }
 #if (WILLUSDEBUGX & 4)
@@ -18,10 +18,59 @@
 **
 */
 
+#include <pthread.h>
 #include "k2pdfopt.h"
 
+/*
+** Output pages waiting to be encoded or written.  The encode threads
+** compress the page images into memory, any page in any order, and the
+** writer thread appends them to the PDF file in order.  When the queue
+** is full, masterinfo_publish() waits.
+*/
+#define K2ENCODER_MAXPAGES 4
+
+#define K2ENCODER_QUEUED   0
+#define K2ENCODER_ENCODING 1
+#define K2ENCODER_ENCODED  2
+
+typedef struct
+    {
+    int state;            /* K2ENCODER_... */
+    WILLUSBITMAP bmp;     /* Freed once encoded */
+    double dpi;
+    int quality;
+    int size_reduction;
+    OCRWORDS ocrwords;
+    int use_ocrwords;
+    int flags;
+    PDFPAGEIMAGE image;
+    } K2ENCODER_PAGE;
+
+typedef struct
+    {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;  /* Signalled when a page is queued, encoded or written, or on quit */
+    pthread_t thread;     /* Writer */
+    pthread_t worker[K2ENCODER_MAXPAGES-1];  /* Encoders */
+    int nworkers;
+    PDFFILE *pdf;
+    K2ENCODER_PAGE page[K2ENCODER_MAXPAGES];
+    int first;            /* Page being written or next to be written */
+    int n;                /* Queued pages:  page[first], page[first+1], ... (circular) */
+    int quit;
+    int pages;
+    double busy;          /* Summed over the writer and encode threads */
+    double idle;          /* Writer only */
+    } K2ENCODER;
+
 static void k2publish_outline_check(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings,
                                     int srcpageno,int plus_one);
+static void k2publish_add_pdf_page(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings,
+                                   WILLUSBITMAP *bmp,double dpi,int size_reduction,
+                                   OCRWORDS *ocrwords,int flags);
+static void *k2publish_encoder(void *data);
+static void *k2publish_encode_worker(void *data);
+static void k2publish_encode_page(K2ENCODER_PAGE *page);
 
 
 /*
@@ -173,6 +222,7 @@ printf("use_toc=%d, outline=%p, spc=%d, srcpage=%d\n",k2settings->use_toc,master
 #ifdef HAVE_OCR_LIB
         if (k2settings->dst_ocr)
             {
+            masterinfo->wordcount += ocrwords->n;
             if (masterinfo->ocrfilename[0]!='\0')
                 ocrwords_to_textfile(ocrwords,masterinfo->ocrfilename,
                                      masterinfo->published_pages>1);
@@ -206,9 +256,8 @@ bmp_write(bmp,filename,stdout,100);
 wfile_written_info(filename,stdout);
 }
 #endif
-                pdffile_add_bitmap_with_ocrwords(&masterinfo->outfile,bmp,bmpdpi,
-                                             k2settings->jpeg_quality,size_reduction,
-                                             ocrwords,flags);
+                k2publish_add_pdf_page(masterinfo,k2settings,bmp,bmpdpi,size_reduction,
+                                       ocrwords,flags);
                 }
 /*
 {
@@ -218,7 +267,6 @@ sprintf(filename,"page%04d.png",count++);
 bmp_write(bmp,filename,stdout,100);
 }
 */
-            masterinfo->wordcount += ocrwords->n;
             ocrwords_free(ocrwords);
             }
         else if (!bitmap && !k2settings->use_crop_boxes)
@@ -227,8 +275,7 @@ bmp_write(bmp,filename,stdout,100);
 #if (WILLUSDEBUGX & 1)
 printf("Calling pdffile_add_bitmap... (%d x %d, %d dpi)\n",bmp->width,bmp->height,(int)bmpdpi);
 #endif
-            pdffile_add_bitmap(&masterinfo->outfile,bmp,bmpdpi,
-                               k2settings->jpeg_quality,size_reduction);
+            k2publish_add_pdf_page(masterinfo,k2settings,bmp,bmpdpi,size_reduction,NULL,1);
             }
         }
     /*
@@ -255,3 +302,264 @@ aprintf(ANSI_MAGENTA "\n    --> DEST PAGE %d\n\n" ANSI_NORMAL,masterinfo->publis
          masterinfo->outline_srcpage_completed = srcpageno;
          }
     }
+
+
+/*
+** Add an output page to the PDF file.  Unless marked source pages are
+** being written too (pdfwrite is not reentrant) or -nt allows only one
+** thread, the page is handed to the encode threads, which compress and
+** write it while the next source page is laid out.  Pages are written
+** in the order they are added.  bmp and ocrwords are left empty then.
+*/
+static void k2publish_add_pdf_page(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings,
+                                   WILLUSBITMAP *bmp,double dpi,int size_reduction,
+                                   OCRWORDS *ocrwords,int flags)
+
+    {
+    static char *funcname="k2publish_add_pdf_page";
+    K2ENCODER *encoder;
+    K2ENCODER_PAGE *page;
+    K2PIPESTATS *stats;
+    double t0;
+    int n;
+
+    if (k2settings->show_marked_source || k2settings_num_threads(k2settings)<2)
+        {
+        pdffile_add_bitmap_with_ocrwords(&masterinfo->outfile,bmp,dpi,k2settings->jpeg_quality,
+                                         size_reduction,ocrwords,flags);
+        return;
+        }
+    encoder=(K2ENCODER *)masterinfo->encoder;
+    if (encoder==NULL)
+        {
+        willus_mem_alloc_warn((void **)&encoder,sizeof(K2ENCODER),funcname,10);
+        pthread_mutex_init(&encoder->mutex,NULL);
+        pthread_cond_init(&encoder->cond,NULL);
+        encoder->pdf=&masterinfo->outfile;
+        encoder->first=encoder->n=0;
+        encoder->quit=0;
+        encoder->pages=0;
+        encoder->busy=encoder->idle=0.;
+        encoder->nworkers=0;
+        if (pthread_create(&encoder->thread,NULL,k2publish_encoder,encoder))
+            {
+            pthread_cond_destroy(&encoder->cond);
+            pthread_mutex_destroy(&encoder->mutex);
+            willus_mem_free((double **)&encoder,funcname);
+            pdffile_add_bitmap_with_ocrwords(&masterinfo->outfile,bmp,dpi,
+                                             k2settings->jpeg_quality,size_reduction,
+                                             ocrwords,flags);
+            return;
+            }
+        /* The writer encodes the pages no encode thread has started */
+        n=k2settings_num_threads(k2settings)-1;
+        if (n>K2ENCODER_MAXPAGES-1)
+            n=K2ENCODER_MAXPAGES-1;
+        for (;encoder->nworkers<n;encoder->nworkers++)
+            if (pthread_create(&encoder->worker[encoder->nworkers],NULL,
+                               k2publish_encode_worker,encoder))
+                break;
+        masterinfo->encoder=encoder;
+        }
+    stats=&masterinfo->pipestats;
+    pthread_mutex_lock(&encoder->mutex);
+    t0=wsys_clock_secs();
+    while (encoder->n>=K2ENCODER_MAXPAGES)
+        pthread_cond_wait(&encoder->cond,&encoder->mutex);
+    stats->encode_stall += wsys_clock_secs()-t0;
+    page=&encoder->page[(encoder->first+encoder->n)%K2ENCODER_MAXPAGES];
+    page->state=K2ENCODER_QUEUED;
+    page->bmp=(*bmp);
+    bmp_init(bmp);
+    page->dpi=dpi;
+    page->quality=k2settings->jpeg_quality;
+    page->size_reduction=size_reduction;
+    page->use_ocrwords=(ocrwords!=NULL);
+    if (ocrwords!=NULL)
+        {
+        page->ocrwords=(*ocrwords);
+        ocrwords_init(ocrwords);
+        }
+    else
+        ocrwords_init(&page->ocrwords);
+    page->flags=flags;
+    encoder->n++;
+    stats->encode_depth += encoder->n;
+    if (encoder->n > stats->encode_depth_max)
+        stats->encode_depth_max = encoder->n;
+    pthread_cond_broadcast(&encoder->cond);
+    pthread_mutex_unlock(&encoder->mutex);
+    }
+
+
+static void *k2publish_encoder(void *data)
+
+    {
+    K2ENCODER *encoder;
+
+    encoder=(K2ENCODER *)data;
+    pthread_mutex_lock(&encoder->mutex);
+    while (1)
+        {
+        K2ENCODER_PAGE *page;
+        double t0;
+
+        t0=wsys_clock_secs();
+        while (encoder->n==0 && !encoder->quit)
+            pthread_cond_wait(&encoder->cond,&encoder->mutex);
+        encoder->idle += wsys_clock_secs()-t0;
+        /* Quit only once the queue is empty */
+        if (encoder->n==0)
+            break;
+        page=&encoder->page[encoder->first];
+        if (page->state==K2ENCODER_QUEUED)
+            {
+            page->state=K2ENCODER_ENCODING;
+            pthread_mutex_unlock(&encoder->mutex);
+            t0=wsys_clock_secs();
+            k2publish_encode_page(page);
+            pthread_mutex_lock(&encoder->mutex);
+            encoder->busy += wsys_clock_secs()-t0;
+            page->state=K2ENCODER_ENCODED;
+            }
+        t0=wsys_clock_secs();
+        while (page->state!=K2ENCODER_ENCODED)
+            pthread_cond_wait(&encoder->cond,&encoder->mutex);
+        encoder->idle += wsys_clock_secs()-t0;
+        pthread_mutex_unlock(&encoder->mutex);
+        t0=wsys_clock_secs();
+        pdffile_add_encoded_bitmap(encoder->pdf,&page->image,page->dpi,
+                                   page->use_ocrwords ? &page->ocrwords : NULL,page->flags);
+        pdfpageimage_free(&page->image);
+        ocrwords_free(&page->ocrwords);
+        pthread_mutex_lock(&encoder->mutex);
+        encoder->busy += wsys_clock_secs()-t0;
+        encoder->pages++;
+        encoder->first = (encoder->first+1)%K2ENCODER_MAXPAGES;
+        encoder->n--;
+        pthread_cond_broadcast(&encoder->cond);
+        }
+    pthread_mutex_unlock(&encoder->mutex);
+    return(NULL);
+    }
+
+
+/*
+** Encode the earliest queued pages, leaving page[first] to the writer if
+** it gets there first.
+*/
+static void *k2publish_encode_worker(void *data)
+
+    {
+    K2ENCODER *encoder;
+
+    encoder=(K2ENCODER *)data;
+    pthread_mutex_lock(&encoder->mutex);
+    while (!encoder->quit)
+        {
+        K2ENCODER_PAGE *page;
+        double t0;
+        int i;
+
+        for (page=NULL,i=0;i<encoder->n;i++)
+            if (encoder->page[(encoder->first+i)%K2ENCODER_MAXPAGES].state==K2ENCODER_QUEUED)
+                {
+                page=&encoder->page[(encoder->first+i)%K2ENCODER_MAXPAGES];
+                break;
+                }
+        if (page==NULL)
+            {
+            pthread_cond_wait(&encoder->cond,&encoder->mutex);
+            continue;
+            }
+        page->state=K2ENCODER_ENCODING;
+        pthread_mutex_unlock(&encoder->mutex);
+        t0=wsys_clock_secs();
+        k2publish_encode_page(page);
+        pthread_mutex_lock(&encoder->mutex);
+        encoder->busy += wsys_clock_secs()-t0;
+        page->state=K2ENCODER_ENCODED;
+        pthread_cond_broadcast(&encoder->cond);
+        }
+    pthread_mutex_unlock(&encoder->mutex);
+    return(NULL);
+    }
+
+
+/*
+** Compress page->bmp into page->image and free it.  The page belongs to
+** the calling thread while it is K2ENCODER_ENCODING.
+*/
+static void k2publish_encode_page(K2ENCODER_PAGE *page)
+
+    {
+    pdfpageimage_init(&page->image);
+    pdffile_encode_bitmap(&page->image,&page->bmp,page->quality,page->size_reduction,
+                          page->use_ocrwords ? &page->ocrwords : NULL,page->flags);
+    bmp_free(&page->bmp);
+    }
+
+
+/*
+** Wait until the encode threads have written all queued output pages to
+** masterinfo->outfile, and end them.  Call before finishing or closing the
+** PDF file.
+*/
+void masterinfo_encode_wait(MASTERINFO *masterinfo)
+
+    {
+    static char *funcname="masterinfo_encode_wait";
+    K2ENCODER *encoder;
+    K2PIPESTATS *stats;
+    double t0;
+    int i;
+
+    encoder=(K2ENCODER *)masterinfo->encoder;
+    if (encoder==NULL)
+        return;
+    stats=&masterinfo->pipestats;
+    t0=wsys_clock_secs();
+    pthread_mutex_lock(&encoder->mutex);
+    encoder->quit=1;
+    pthread_cond_broadcast(&encoder->cond);
+    pthread_mutex_unlock(&encoder->mutex);
+    pthread_join(encoder->thread,NULL);
+    for (i=0;i<encoder->nworkers;i++)
+        pthread_join(encoder->worker[i],NULL);
+    stats->encode_stall += wsys_clock_secs()-t0;
+    stats->encoded += encoder->pages;
+    stats->encode_busy += encoder->busy;
+    stats->encode_idle += encoder->idle;
+    pthread_cond_destroy(&encoder->cond);
+    pthread_mutex_destroy(&encoder->mutex);
+    willus_mem_free((double **)&encoder,funcname);
+    masterinfo->encoder=NULL;
+    }
+
+
+/*
+** Report where the source page loop spent its time (-v).  Layout is
+** what is left of the main thread's time after the render and encode
+** stalls (it includes OCR).
+*/
+void masterinfo_pipestats_echo(MASTERINFO *masterinfo)
+
+    {
+    K2PIPESTATS *stats;
+    double total,layout;
+
+    stats=&masterinfo->pipestats;
+    if (stats->pages<=0)
+        return;
+    total=wsys_clock_secs()-stats->start;
+    layout=total-stats->render_stall-stats->encode_stall;
+    k2printf("    Stage times for %d source pages (%.2f s):\n",stats->pages,total);
+    k2printf("        render:  %.2f s stalled, %.1f pages ahead (max %d)\n",
+             stats->render_stall,(double)stats->render_depth/stats->pages,
+             stats->render_depth_max);
+    k2printf("        layout:  %.2f s\n",layout);
+    if (stats->encoded>0)
+        k2printf("        encode:  %.2f s stalled, %.2f s busy, %.2f s idle, queue %.1f (max %d)\n",
+                 stats->encode_stall,stats->encode_busy,stats->encode_idle,
+                 (double)stats->encode_depth/stats->encoded,stats->encode_depth_max);
+    }
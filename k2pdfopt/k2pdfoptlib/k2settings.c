@@ -248,6 +248,19 @@ int k2settings_output_is_bitmap(K2PDFOPT_SETTINGS *k2settings)
     }
 
 
+/*
+** Number of threads requested with -nt (negative = percent of cpus).
+** Can be zero.
+*/
+int k2settings_num_threads(K2PDFOPT_SETTINGS *k2settings)
+
+    {
+    if (k2settings->nthreads<0)
+        return(wsys_num_cpus()*abs(k2settings->nthreads)/100);
+    return(k2settings->nthreads);
+    }
+
+
 int k2settings_columns_left_to_right(K2PDFOPT_SETTINGS *k2settings)
 
     {
@@ -556,13 +569,13 @@ void k2pdfopt_settings_new_source_document_init(K2PDFOPT_SETTINGS *k2settings,ch
     /* Reset usegs for each document */
     k2settings->usegs=k2settings->user_usegs;
     /* Init document word spacing history */
-    textwords_add_word_gaps(NULL,0,NULL,0.);
+    textwords_add_word_gaps(&k2settings->docstate,NULL,0,NULL,0.);
 #ifdef HAVE_OCR_LIB
     /* Init document OCR word list */
     if (k2settings->dst_ocr)
         k2ocr_init(k2settings,initstr);
 #endif
-    k2proc_init_one_document();
+    k2proc_init_one_document(k2settings);
     }
 
 
@@ -640,6 +640,8 @@ static char *k2pdfopt_options=
 "                  find the optimum.  A negative value is interpreted as a\n"
 "                  percentage of available CPUs.  The default is -50, which\n"
 "                  tells k2pdfopt to use half of the available CPU threads.\n"
+"                  The same number of threads renders the upcoming pages\n"
+"                  of a PDF/CBZ source file ahead of time (MuPDF only).\n"
 "                  Some performances I measured:\n"
 "                  ----------------------------------------------------------\n"
 "                                                               OCR Speed\n"
@@ -76,17 +76,17 @@ void textwords_remove_small_col_gaps(TEXTWORDS *textwords,int lcheight,double mi
 ** Track gaps between words so that we can tell when one is out of family.
 ** lcheight = height of a lowercase letter.
 */
-void textwords_add_word_gaps(TEXTWORDS *textwords,int lcheight,double *median_gap,
-                             double word_spacing)
+void textwords_add_word_gaps(K2DOCSTATE *docstate,TEXTWORDS *textwords,int lcheight,
+                             double *median_gap,double word_spacing)
 
     {
-    static int nn=0;
-    static double gap[1024];
+    double *gap;
     static char *funcname="word_gaps_add";
 
+    gap=docstate->wordgap;
     if (textwords==NULL && median_gap==NULL)
         {
-        nn=0;
+        docstate->nwordgaps=0;
         return;
         }
     if (textwords!=NULL && textwords->n>1)
@@ -99,19 +99,19 @@ void textwords_add_word_gaps(TEXTWORDS *textwords,int lcheight,double *median_ga
             g = (double)textwords->textrow[i].gap / lcheight;
             if (g>=word_spacing)
                 {
-                gap[nn&0x3ff]= g;
-                nn++;
+                gap[docstate->nwordgaps&(MAXWORDGAPS-1)]= g;
+                docstate->nwordgaps++;
                 }
             }
         }
     if (median_gap!=NULL)
         {
-        if (nn>0)
+        if (docstate->nwordgaps>0)
             {
             int n;
             double *gap_sorted;  /* v2.02--this variable is no longer static */
 
-            n = (nn>1024) ? 1024 : nn;
+            n = (docstate->nwordgaps>MAXWORDGAPS) ? MAXWORDGAPS : docstate->nwordgaps;
             willus_dmem_alloc_warn(28,(void **)&gap_sorted,sizeof(double)*n,funcname,10);
             memcpy(gap_sorted,gap,n*sizeof(double));
             sortd(gap_sorted,n);
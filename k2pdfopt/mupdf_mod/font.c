@@ -14,6 +14,8 @@
 */
 
 #include <assert.h>
+/* willus mod--system font cache lock */
+#include <pthread.h>
 
 #include FT_FREETYPE_H
 #include FT_ADVANCES_H
@@ -403,17 +405,156 @@ void fz_install_load_system_font_funcs(fz_context *ctx,
 	ctx->font->load_fallback_font = f_back;
 }
 
+/*
+ * willus mod: process-wide cache of the fonts returned by the system font
+ * hooks, keyed by hook, font name and flags.  k2pdfopt creates a context
+ * for every page it renders, and each one would otherwise search the
+ * system for the same non-embedded fonts and read the same files again.
+ * The font file bytes are kept until exit and shared by the fonts of all
+ * contexts; fonts that were not found are remembered too.
+ */
+typedef void (system_font_hook)(void);
+typedef struct system_font_entry_s system_font_entry;
+struct system_font_entry_s
+{
+	system_font_hook *hook;
+	char *key;
+	int args[5];
+	int found;
+	unsigned char *data;
+	size_t len;
+	char *name;
+	int index;
+	int use_glyph_bbox;
+	fz_font_flags_t flags;
+	system_font_entry *next;
+};
+
+static pthread_mutex_t system_font_lock = PTHREAD_MUTEX_INITIALIZER;
+static system_font_entry *system_font_cache = NULL;
+
+/* Call with system_font_lock held.  Entries never change once added. */
+static system_font_entry *
+find_system_font(system_font_hook *hook, const char *key, const int *args)
+{
+	system_font_entry *entry;
+
+	for (entry = system_font_cache; entry; entry = entry->next)
+		if (entry->hook == hook && !strcmp(entry->key, key) && !memcmp(entry->args, args, sizeof entry->args))
+			return entry;
+	return NULL;
+}
+
+/* Returns 1 with *fontp set (NULL if the font was not found before) on a cache hit. */
+static int
+load_cached_system_font(fz_context *ctx, system_font_hook *hook, const char *key, const int *args, fz_font **fontp)
+{
+	system_font_entry *entry;
+	fz_font *font = NULL;
+
+	if (!key)
+		key = "";
+	pthread_mutex_lock(&system_font_lock);
+	entry = find_system_font(hook, key, args);
+	pthread_mutex_unlock(&system_font_lock);
+	if (!entry)
+		return 0;
+	if (entry->found)
+	{
+		fz_try(ctx)
+		{
+			font = fz_new_font_from_memory(ctx, entry->name, entry->data, (int)entry->len, entry->index, entry->use_glyph_bbox);
+			font->flags = entry->flags;
+		}
+		fz_catch(ctx)
+			font = NULL;
+	}
+	*fontp = font;
+	return 1;
+}
+
+static char *
+system_font_strdup(const char *s)
+{
+	size_t n = strlen(s) + 1;
+	char *d = malloc(n);
+	if (d)
+		memcpy(d, s, n);
+	return d;
+}
+
+static void
+cache_system_font(system_font_hook *hook, const char *key, const int *args, fz_font *font)
+{
+	system_font_entry *entry;
+
+	/* Only fonts loaded from a file into memory can be shared */
+	if (font && (!font->ft_face || !font->buffer))
+		return;
+	if (!key)
+		key = "";
+	entry = calloc(1, sizeof *entry);
+	if (!entry)
+		return;
+	entry->hook = hook;
+	entry->key = system_font_strdup(key);
+	memcpy(entry->args, args, sizeof entry->args);
+	if (font)
+	{
+		entry->found = 1;
+		entry->len = font->buffer->len;
+		entry->data = malloc(entry->len);
+		entry->name = system_font_strdup(font->name);
+		entry->index = (int)((FT_Face)font->ft_face)->face_index;
+		entry->use_glyph_bbox = font->bbox_table != NULL;
+		entry->flags = font->flags;
+		if (entry->data)
+			memcpy(entry->data, font->buffer->data, entry->len);
+	}
+	if (!entry->key || (font && (!entry->data || !entry->name)))
+	{
+		free(entry->key);
+		free(entry->data);
+		free(entry->name);
+		free(entry);
+		return;
+	}
+	pthread_mutex_lock(&system_font_lock);
+	if (find_system_font(hook, key, args))
+	{
+		/* Another thread got there first */
+		pthread_mutex_unlock(&system_font_lock);
+		free(entry->key);
+		free(entry->data);
+		free(entry->name);
+		free(entry);
+		return;
+	}
+	entry->next = system_font_cache;
+	system_font_cache = entry;
+	pthread_mutex_unlock(&system_font_lock);
+}
+
 /* fz_load_*_font returns NULL if no font could be loaded (also on error) */
 fz_font *fz_load_system_font(fz_context *ctx, const char *name, int bold, int italic, int needs_exact_metrics)
 {
 	fz_font *font = NULL;
+	int args[5] = { bold, italic, needs_exact_metrics, 0, 0 };
+	int cache = 1;
 
 	if (ctx->font->load_font)
 	{
+		if (load_cached_system_font(ctx, (system_font_hook *)ctx->font->load_font, name, args, &font))
+			return font;
 		fz_try(ctx)
 			font = ctx->font->load_font(ctx, name, bold, italic, needs_exact_metrics);
 		fz_catch(ctx)
+		{
 			font = NULL;
+			cache = fz_caught(ctx) != FZ_ERROR_MEMORY;
+		}
+		if (cache)
+			cache_system_font((system_font_hook *)ctx->font->load_font, name, args, font);
 	}
 
 	return font;
@@ -422,13 +563,22 @@ fz_font *fz_load_system_font(fz_context *ctx, const char *name, int bold, int it
 fz_font *fz_load_system_cjk_font(fz_context *ctx, const char *name, int ros, int serif)
 {
 	fz_font *font = NULL;
+	int args[5] = { ros, serif, 0, 0, 0 };
+	int cache = 1;
 
 	if (ctx->font->load_cjk_font)
 	{
+		if (load_cached_system_font(ctx, (system_font_hook *)ctx->font->load_cjk_font, name, args, &font))
+			return font;
 		fz_try(ctx)
 			font = ctx->font->load_cjk_font(ctx, name, ros, serif);
 		fz_catch(ctx)
+		{
 			font = NULL;
+			cache = fz_caught(ctx) != FZ_ERROR_MEMORY;
+		}
+		if (cache)
+			cache_system_font((system_font_hook *)ctx->font->load_cjk_font, name, args, font);
 	}
 
 	return font;
@@ -437,13 +587,22 @@ fz_font *fz_load_system_cjk_font(fz_context *ctx, const char *name, int ros, int
 fz_font *fz_load_system_fallback_font(fz_context *ctx, int script, int language, int serif, int bold, int italic)
 {
 	fz_font *font = NULL;
+	int args[5] = { script, language, serif, bold, italic };
+	int cache = 1;
 
 	if (ctx->font->load_fallback_font)
 	{
+		if (load_cached_system_font(ctx, (system_font_hook *)ctx->font->load_fallback_font, "", args, &font))
+			return font;
 		fz_try(ctx)
 			font = ctx->font->load_fallback_font(ctx, script, language, serif, bold, italic);
 		fz_catch(ctx)
+		{
 			font = NULL;
+			cache = fz_caught(ctx) != FZ_ERROR_MEMORY;
+		}
+		if (cache)
+			cache_system_font((system_font_hook *)ctx->font->load_fallback_font, "", args, font);
 	}
 
 	return font;
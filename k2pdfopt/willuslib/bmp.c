@@ -27,6 +27,8 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <limits.h>
+#include <pthread.h>
 
 
 #ifdef HAVE_PNG_LIB
@@ -99,9 +101,42 @@
         ptr+=3; \
         }
 
+/*
+** Columns of a grayscale bitmap sampled by bmp_autostraighten(), stored
+** one after another:  dark[nn*height+r] is 1 if row r of column c1+nn*dw
+** is darker than the white threshold.
+*/
+typedef struct
+    {
+    int width,height;
+    int c1,dw,nw;
+    unsigned char *dark;
+    } BMPSKEWCOLS;
+
+/*
+** Angles for bmp_row_by_row_stdev() to evaluate on several threads.
+*/
+typedef struct
+    {
+    BMPSKEWCOLS *cols;
+    double *theta;
+    double *sdev;
+    int n;
+    int next;   /* Next angle to evaluate */
+    pthread_mutex_t mutex;
+    } BMPSKEWJOB;
+
 static double willusbmp_dpi=150.;
 static int    willusbmp_pageno=-1;
 
+/*
+** Helper threads of all bmp_skew_stdevs() calls running at once.  Library
+** callers may straighten pages on several threads of their own, so this
+** is kept below the number of cpus no matter how many call at once.
+*/
+static pthread_mutex_t bmp_skew_mutex=PTHREAD_MUTEX_INITIALIZER;
+static int bmp_skew_helpers=0;
+
 
 static char *cnames[]={"red","green","blue","magenta","cyan","yellow",
                            "grey","black","white",""};
@@ -120,18 +155,17 @@ static int  bmp24_write(WILLUSBITMAP *bmap,char *filename,FILE *out);
 static void insert_int32lsbmsb(char *a,int x);
 static int  retrieve_int32lsbmsb(char *a);
 static void get_file_ext(char *fileext,char *filename);
-static void bmp_resample_1(double *tempbmp,WILLUSBITMAP *src,double x1,double y1,
-                           double x2,double y2,int newwidth,int newheight,
-                           double *temprow,int color);
-static void resample_1d(double *dst,double *src,double x1,double x2,int n);
-static double resample_single(double *y,double x1,double x2);
-static void bmp_resample_1_fixed_point(int *tempbmp,WILLUSBITMAP *src,int x1_fp,int y1_fp,
-                                       int x2_fp,int y2_fp,int newwidth,int newheight,
-                                       int *temprow,int color);
-static void resample_1d_fixed_point(int *dst,int *src,int x1_fp,int x2_fp,int n);
-static double resample_single_fixed_point(int *y,int x1_fp,int x2_fp);
+static int bmp_resample_ex(WILLUSBITMAP *dest,WILLUSBITMAP *src,double x1,double y1,
+                           double x2,double y2,int newwidth,int newheight,int native);
+static int resample_taps(int **taps,int *maxcount,double x1,double x2,int n,int srcsize);
 #ifdef HAVE_PNG_LIB
 static void bmp_read_png_from_memory(png_structp png_ptr,void *buf,int nbytes);
+static int bmp_read_png_file(WILLUSBITMAP *bmp,char *filename,double *dpi,FILE *out);
+static int bmp_read_png_dpi(WILLUSBITMAP *bmp,void *io,int size,double *dpi,FILE *out);
+#endif
+#ifdef HAVE_JPEG_LIB
+static int bmp_read_jpeg_file(WILLUSBITMAP *bmp,char *filename,double *dpi,FILE *out);
+static int bmp_read_jpeg_dpi(WILLUSBITMAP *bmp,void *infile,int size,double *dpi,FILE *out);
 #endif
 static void new_rgb(int *dpc,int *spc,int *dbgc,int *dfgc,int *sbgc,int *sfgc);
 static int jpeg_write_comments(FILE *out,char *buf);
@@ -145,8 +179,13 @@ static void bmp_color_xform8(WILLUSBITMAP *dest,WILLUSBITMAP *src,unsigned char
 static void bmp_one_component_erode(WILLUSBITMAP *src,WILLUSBITMAP *dst,int offsetplane,int bytesperpixel);
 static void bmp_apply_filter_gray(WILLUSBITMAP *dest,WILLUSBITMAP *src,
                                   double **filter,int ncols,int nrows);
-static double bmp_row_by_row_stdev(WILLUSBITMAP *bmp,int ccount,int whitethresh,
-                                   double theta_radians);
+static int bmp_skew_columns(BMPSKEWCOLS *cols,WILLUSBITMAP *bmp,int ccount,int whitethresh);
+static void bmp_skew_stdevs(BMPSKEWCOLS *cols,double *theta,double *sdev,int n,int nthreads);
+static int bmp_skew_reserve_helpers(int n);
+static void bmp_skew_release_helpers(int n);
+static void *bmp_skew_worker(void *data);
+static double bmp_row_by_row_stdev(BMPSKEWCOLS *cols,double theta_radians,int *edge,
+                                   unsigned short *count);
 static int pixval_dither(int pv,int n,int maxsrc,int maxdst,int x0,int y0);
 static int dither_rec(int bits,int x0,int y0);
 static int pcl_get_resolution(char *pclbuf,int n,int *w,int *h);
@@ -339,7 +378,7 @@ void bmp_fill(WILLUSBITMAP *bmp,int r,int g,int b)
 
     if (bmp->bpp==8 || (r==g && r==b))
         {
-        memset(bmp->data,r,bmp->size_allocated);
+        memset(bmp->data,r,abs(bmp->size_allocated));
         return;
         }
     if (bmp->type==WILLUSBITMAP_TYPE_WIN32 && bmp->bpp==24)
@@ -590,6 +629,13 @@ int bmp_png_info(char *filename,int *width,int *height,int *bpp,FILE *out)
 
 int bmp_read_png(WILLUSBITMAP *bmp,char *filename,FILE *out)
 
+    {
+    return(bmp_read_png_file(bmp,filename,&bmp_dpi,out));
+    }
+
+
+static int bmp_read_png_file(WILLUSBITMAP *bmp,char *filename,double *dpi,FILE *out)
+
     {
     FILE *f;
     int     status;
@@ -600,7 +646,7 @@ int bmp_read_png(WILLUSBITMAP *bmp,char *filename,FILE *out)
         nprintf(out,"Cannot open file %s for PNG input.\n",filename);
         return(-1);
         }
-    status=bmp_read_png_stream(bmp,(void *)f,0,out);
+    status=bmp_read_png_dpi(bmp,(void *)f,0,dpi,out);
     fclose(f);
     return(status);
     }
@@ -673,16 +719,27 @@ static int png_thread_index(png_structp png_ptr)
 
 int bmp_read_png_stream(WILLUSBITMAP *bmp,void *io,int size,FILE *out)
 
+    {
+    return(bmp_read_png_dpi(bmp,io,size,&bmp_dpi,out));
+    }
+
+
+/*
+** Stores the resolution recorded in the file to *dpi.  Reading from a FILE
+** (size==0), this is safe to call from several threads at once.
+*/
+static int bmp_read_png_dpi(WILLUSBITMAP *bmp,void *io,int size,double *dpi,FILE *out)
+
     {
     unsigned char header[8];
     png_structp png_ptr;
     png_infop info_ptr,end_info;
     int     color_type,gotpal,rowbytes;
-    static png_colorp pngpal;
+    png_colorp pngpal;
     unsigned char **rowptrs;
     double *dptr;
     int     i,num_palette;
-    static char *funcname="bmp_read_png_stream";
+    static char *funcname="bmp_read_png_dpi";
     FILE *f;
     static char *notpng="File doesn't appear to be PNG.\n";
 
@@ -751,7 +808,7 @@ int bmp_read_png_stream(WILLUSBITMAP *bmp,void *io,int size,FILE *out)
     png_uint_32 ww,hh;
     png_get_IHDR(png_ptr,info_ptr,&ww,&hh,&bmp->bpp,
                   &color_type,NULL,NULL,NULL);
-    bmp_dpi = (double)png_get_x_pixels_per_meter(png_ptr,info_ptr)*.0254;
+    (*dpi) = (double)png_get_x_pixels_per_meter(png_ptr,info_ptr)*.0254;
     bmp->width=(int)ww;
     bmp->height=(int)hh;
     }
@@ -1139,10 +1196,33 @@ int bmp_jpeg_info(char *filename,int *width,int *height,int *bpp)
 
 int bmp_read_jpeg(WILLUSBITMAP *bmp,char *filename,FILE *out)
 
+    {
+    return(bmp_read_jpeg_file(bmp,filename,&bmp_dpi,out));
+    }
+
+
+/*
+** The file is decoded straight from its memory mapping when it can be
+** mapped (libjpeg's memory source stops cleanly at the end of the data),
+** else through stdio.
+*/
+static int bmp_read_jpeg_file(WILLUSBITMAP *bmp,char *filename,double *dpi,FILE *out)
+
     {
     FILE *infile;
+    WFILEMAP map;
     int     status;
 
+    if (!wfile_map(&map,filename))
+        {
+        if (map.size>0 && map.size<=INT_MAX)
+            {
+            status=bmp_read_jpeg_dpi(bmp,map.data,(int)map.size,dpi,out);
+            wfile_unmap(&map);
+            return(status);
+            }
+        wfile_unmap(&map);
+        }
     infile=wfile_fopen_utf8(filename,"rb");
     if (infile==NULL)
         {
@@ -1150,7 +1230,7 @@ int bmp_read_jpeg(WILLUSBITMAP *bmp,char *filename,FILE *out)
             fprintf(out,"Cannot open JPEG file %s for input.\n",filename);
         return(-1);
         }
-    status=bmp_read_jpeg_stream(bmp,infile,0,out);
+    status=bmp_read_jpeg_dpi(bmp,infile,0,dpi,out);
     fclose(infile);
     return(status);
     }
@@ -1164,6 +1244,17 @@ int bmp_read_jpeg(WILLUSBITMAP *bmp,char *filename,FILE *out)
 */
 int bmp_read_jpeg_stream(WILLUSBITMAP *bmp,void *infile,int size,FILE *out)
 
+    {
+    return(bmp_read_jpeg_dpi(bmp,infile,size,&bmp_dpi,out));
+    }
+
+
+/*
+** The resolution recorded in the file goes to *dpi.
+** Safe to call from several threads at once.
+*/
+static int bmp_read_jpeg_dpi(WILLUSBITMAP *bmp,void *infile,int size,double *dpi,FILE *out)
+
     {
     struct jpeg_decompress_struct cinfo;
     struct my_error_mgr jerr;
@@ -1184,7 +1275,7 @@ int bmp_read_jpeg_stream(WILLUSBITMAP *bmp,void *infile,int size,FILE *out)
         jpeg_stdio_src(&cinfo,(FILE *)infile);
     cinfo.out_color_space = JCS_RGB;
     jpeg_read_header(&cinfo,TRUE);
-    bmp_dpi = cinfo.density_unit==2 ? cinfo.X_density*2.54 : cinfo.X_density;
+    (*dpi) = cinfo.density_unit==2 ? cinfo.X_density*2.54 : cinfo.X_density;
     jpeg_start_decompress(&cinfo);
     bmp->width=cinfo.output_width;
     bmp->height=cinfo.output_height;
@@ -1352,6 +1443,58 @@ void bmp_init(WILLUSBITMAP *bmap)
     }
 
 
+/*
+** Make bmap a view of the caller's buffer data[0..nbytes-1] instead of
+** allocating its own.  The width, height, bpp, and type of bmap should
+** be set to describe the buffer (rows must not be padded beyond
+** bmp_bytewidth()).  The buffer is not copied and is never freed by
+** willuslib:  bmp_free() just drops the view.  The bitmap may modify the
+** pixels in place, and if it ever needs more than nbytes (bmp_alloc(),
+** bmp_more_rows()), it makes its own copy first.
+**
+** A borrowed view is flagged by a negative size_allocated (= -nbytes).
+*/
+void bmp_borrow(WILLUSBITMAP *bmap,unsigned char *data,int nbytes)
+
+    {
+    bmp_free(bmap);
+    if (data==NULL || nbytes<=0)
+        return;
+    bmap->data=data;
+    bmap->size_allocated=-nbytes;
+    }
+
+
+int bmp_is_borrowed(WILLUSBITMAP *bmap)
+
+    {
+    return(bmap->data!=NULL && bmap->size_allocated<0);
+    }
+
+
+/*
+** If bmap is a borrowed view (see bmp_borrow()), give it its own copy
+** of the pixels, at least minsize bytes big.
+*/
+void bmp_own(WILLUSBITMAP *bmap,int minsize)
+
+    {
+    unsigned char *data;
+    int nbytes;
+    static char *funcname="bmp_own";
+
+    if (!bmp_is_borrowed(bmap))
+        return;
+    nbytes = -bmap->size_allocated;
+    if (minsize<nbytes)
+        minsize=nbytes;
+    willus_mem_alloc_warn((void **)&data,minsize,funcname,10);
+    memcpy(data,bmap->data,nbytes);
+    bmap->data=data;
+    bmap->size_allocated=minsize;
+    }
+
+
 /*
 ** The width, height, and bpp parameters of the WILLUSBITMAP structure
 ** should be set before calling this function.
@@ -1371,8 +1514,13 @@ int bmp_alloc(WILLUSBITMAP *bmap)
     /* and to allow the possibility of changing the "type" of the   */
     /* bitmap without reallocating memory.                          */
     size = bmp_bytewidth_win32(bmap)*bmap->height;
-    if (bmap->data!=NULL && bmap->size_allocated>=size)
+    if (bmap->data!=NULL && abs(bmap->size_allocated)>=size)
+        return(1);
+    if (bmp_is_borrowed(bmap))
+        {
+        bmp_own(bmap,size);
         return(1);
+        }
     if (bmap->data!=NULL)
         willus_mem_realloc_robust_warn((void **)&bmap->data,size,bmap->size_allocated,funcname,10);
     else
@@ -1736,6 +1884,11 @@ int bmp_bytewidth_win32(WILLUSBITMAP *bmp)
 void bmp_free(WILLUSBITMAP *bmap)
 
     {
+    if (bmp_is_borrowed(bmap))
+        {
+        bmap->data=NULL;
+        bmap->size_allocated=0;
+        }
     if (bmap->data!=NULL)
         {
         willus_mem_free((double **)&bmap->data,"bmp_free");
@@ -1800,6 +1953,30 @@ int bmp_read(WILLUSBITMAP *bmap,char *filename,FILE *out)
     }
 
 
+/*
+** Reads a PNG or JPEG file like bmp_read(), but without touching any static
+** state--the resolution recorded in the file goes to *dpi rather than to
+** bmp_last_read_dpi()--so that several threads can read files at once.
+** Returns -10 without reading for other file types.
+*/
+int bmp_read_dpi(WILLUSBITMAP *bmp,char *filename,double *dpi,FILE *out)
+
+    {
+    char    fileext[16];
+
+    get_file_ext(fileext,filename);
+#ifdef HAVE_PNG_LIB
+    if (!stricmp(fileext,"png"))
+        return(bmp_read_png_file(bmp,filename,dpi,out));
+#endif
+#ifdef HAVE_JPEG_LIB
+    if (!stricmp(fileext,"jpg") || !stricmp(fileext,"jpeg"))
+        return(bmp_read_jpeg_file(bmp,filename,dpi,out));
+#endif
+    return(-10);
+    }
+
+
 int bmp_info(char *filename,int *width,int *height,int *bpp,FILE *out)
 
     {
@@ -2685,6 +2862,9 @@ void bmp_draw_filled_rect(WILLUSBITMAP *bmp,int col1,int row1,int col2,int row2,
 ** The cropped rectangle (x1,y1) to (x2,y2) is placed into
 ** the destination bitmap, which need not be allocated yet.
 **
+** Each destination pixel is the area-weighted average of the source
+** pixels it covers.
+**
 ** The destination bitmap will be 8-bit grayscale if the source bitmap
 ** passes the bmp_is_grayscale() function.  Otherwise it will be 24-bit.
 **
@@ -2696,17 +2876,51 @@ int bmp_resample(WILLUSBITMAP *dest,WILLUSBITMAP *src,double x1,double y1,
                  double x2,double y2,int newwidth,int newheight)
 
     {
-    int gray,maxlen,colorplanes;
-    double t;
-    double *tempbmp;
-    double *temprow;
-    int color,hmax,row,col,dy;
+    return(bmp_resample_ex(dest,src,x1,y1,x2,y2,newwidth,newheight,0));
+    }
+
+
+/*
+** Same as bmp_resample(), except that the destination bitmap is always
+** WILLUSBITMAP_TYPE_NATIVE.  (Was a separate fixed-point implementation
+** of bmp_resample(); both are now all integer.)
+*/
+int bmp_resample_fixed_point(WILLUSBITMAP *dest,WILLUSBITMAP *src,double fx1,double fy1,
+                             double fx2,double fy2,int newwidth,int newheight)
+
+    {
+    return(bmp_resample_ex(dest,src,fx1,fy1,fx2,fy2,newwidth,newheight,1));
+    }
+
+
+/*
+** Resampling weights are in units of 1/RESAMPLE_ONE.
+*/
+#define RESAMPLE_BITS  14
+#define RESAMPLE_ONE   (1<<RESAMPLE_BITS)
+/*
+** Separable:  the source rows covered by each destination row are
+** averaged into one row (bmpsimd_weighted_rows(), 1/128 grey level units)
+** whose pixels--all color planes at once--are then averaged across.
+** native!=0 makes the destination WILLUSBITMAP_TYPE_NATIVE.
+*/
+static int bmp_resample_ex(WILLUSBITMAP *dest,WILLUSBITMAP *src,double x1,double y1,
+                           double x2,double y2,int newwidth,int newheight,int native)
+
+    {
     static char *funcname="bmp_resample";
+    WILLUSBITMAP _src24,*src24;
+    int *xtaps,*ytaps;
+    unsigned char **rowptr;
+    short *temprow;
+    double t;
+    int gray,colorplanes,swap,xmax,ymax,x0,row,col;
 
     if (newwidth==0 || newheight==0)
         return(-1);
     /* Quick check if we should use simple bmp_copy() call */
-    if (x1==0. && y1==0. && x2==newwidth && y2==newheight)
+    if (x1==0. && y1==0. && x2==newwidth && y2==newheight
+             && (!native || src->type==WILLUSBITMAP_TYPE_NATIVE))
         {
         bmp_copy(dest,src);
         return(0);
@@ -2740,288 +2954,43 @@ int bmp_resample(WILLUSBITMAP *dest,WILLUSBITMAP *src,double x1,double y1,
         y2=y1;
         y1=t;
         }
-    dy=y2-y1;
-    dy += 2;
     if (x2-x1==0. || y2-y1==0.)
         return(-2);
 
-    /* Allocate temp storage */
-    maxlen = x2-x1 > dy+newheight ? (int)(x2-x1) : dy+newheight;
-    maxlen += 16;
-    hmax = newheight > dy ? newheight : dy;
-    if (!willus_mem_alloc(&temprow,maxlen*sizeof(double),funcname))
+    /* Tap tables, temp storage */
+    x0=floor(x1);
+    if (!resample_taps(&xtaps,&xmax,x1-x0,x2-x0,newwidth,src->width-x0))
         return(-1);
-    if (!willus_mem_alloc(&tempbmp,hmax*newwidth*sizeof(double),funcname))
+    if (!resample_taps(&ytaps,&ymax,y1,y2,newheight,src->height))
         {
-        willus_mem_free(&temprow,funcname);
-        return(-1);
-        }
-    if ((gray=bmp_is_grayscale(src))!=0)
-        {
-        int i;
-        dest->bpp=8;
-        for (i=0;i<256;i++)
-            dest->red[i]=dest->blue[i]=dest->green[i]=i;
-        }
-    else
-        dest->bpp=24;
-    dest->width=newwidth;
-    dest->height=newheight;
-    /* dest->type=WILLUSBITMAP_TYPE_NATIVE; */
-    dest->type=src->type;
-    if (!bmp_alloc(dest))
-        {
-        willus_mem_free(&tempbmp,funcname);
-        willus_mem_free(&temprow,funcname);
+        willus_mem_free((double **)&xtaps,funcname);
         return(-1);
         }
+    gray=bmp_is_grayscale(src);
     colorplanes = gray ? 1 : 3;
-    for (color=0;color<colorplanes;color++)
-        {
-        bmp_resample_1(tempbmp,src,x1,y1,x2,y2,newwidth,newheight,
-                       temprow,gray ? -1 : color);
-        for (row=0;row<newheight;row++)
-            {
-            unsigned char *p;
-            double *s;
-            p=bmp_rowptr_from_top(dest,row)+color;
-            s=&tempbmp[row*newwidth];
-            if (colorplanes==1)
-                for (col=0;col<newwidth;p[0]=(int)(s[0]+.5),col++,s++,p++);
-            else
-                for (col=0;col<newwidth;p[0]=(int)(s[0]+.5),col++,s++,p+=colorplanes);
-            }
-        }
-    willus_mem_free(&tempbmp,funcname);
-    willus_mem_free(&temprow,funcname);
-    return(0);
-    }
-
-
-static void bmp_resample_1(double *tempbmp,WILLUSBITMAP *src,double x1,double y1,
-                           double x2,double y2,int newwidth,int newheight,
-                           double *temprow,int color)
-
-    {
-    int row,col,x0,dx,y0,dy;
-
-    x0=floor(x1);
-    dx=ceil(x2)-x0;
-    x1-=x0;
-    x2-=x0;
-    y0=floor(y1);
-    dy=ceil(y2)-y0;
-    y1-=y0;
-    y2-=y0;
-/*
-    if (src->type==WILLUSBITMAP_TYPE_WIN32 && color>=0)
-        color=2-color;
-*/
-    for (row=0;row<dy;row++)
-        {
-        unsigned char *p;
-        p=bmp_rowptr_from_top(src,row+y0);
-        if (src->bpp==8)
-            {
-            switch (color)
-                {
-                case -1:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=p[0];
-                    break;
-                case 0:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->red[p[0]];
-                    break;
-                case 1:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->green[p[0]];
-                    break;
-                case 2:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->blue[p[0]];
-                    break;
-                }
-            }
-        else
-            {
-            p+=color;
-            for (col=0,p+=3*x0;col<dx;temprow[col]=p[0],col++,p+=3);
-            }
-        resample_1d(&tempbmp[row*newwidth],temprow,x1,x2,newwidth);
-        }
-    for (col=0;col<newwidth;col++)
-        {
-        double *p,*s;
-        p=&tempbmp[col];
-        s=&temprow[dy];
-        for (row=0;row<dy;row++,p+=newwidth)
-            temprow[row]=p[0];
-        resample_1d(s,temprow,y1,y2,newheight);
-        p=&tempbmp[col];
-        for (row=0;row<newheight;row++,p+=newwidth,s++)
-            p[0]=s[0];
-        }
-    }
-
-
-/*
-** Resample src[] into dst[].
-** Examples:  resample_1d(dst,src,0.,5.,5) would simply copy the
-**            first five elements of src[] to dst[].
-**
-**            resample_1d(dst,src,0.,5.,10) would work as follows:
-**                dst[0] and dst[1] would get src[0].
-**                dst[2] and dst[3] would get src[1].
-**                and so on.
-**
-*/
-static void resample_1d(double *dst,double *src,double x1,double x2,int n)
-
-    {
-    int i;
-    double new,last;
-
-    last=x1;
-    for (i=0;i<n;i++)
+    if (!willus_mem_alloc((double **)&temprow,(xtaps[newwidth-1]+xmax)*colorplanes*sizeof(short)+64,funcname))
         {
-        new=x1+(x2-x1)*(i+1)/n;
-        dst[i] = resample_single(src,last,new);
-        last=new;
-        }
-    }
-
-
-static double resample_single(double *y,double x1,double x2)
-
-    {
-    int i,i1,i2;
-    double dx,dx1,dx2,sum;
-
-    i1=floor(x1);
-    i2=floor(x2);
-    if (i1==i2)
-        return(y[i1]);
-    dx=x2-x1;
-    if (dx>1.)
-        dx=1.;
-    dx1= 1.-(x1-i1);
-    dx2= x2-i2;
-    sum=0.;
-    if (dx1 > 1e-8*dx)
-        sum += dx1*y[i1];
-    if (dx2 > 1e-8*dx)
-        sum += dx2*y[i2];
-    for (i=i1+1;i<=i2-1;sum+=y[i],i++);
-    return(sum/(x2-x1));
-    }
-
-
-
-
-/*
-** Determine fixed-point accuracy of resample function
-*/
-#define FPBITS     10
-#define FPPIXBITS   8
-/*
-** Derived quantities
-*/
-#define FPMULT     (1<<FPBITS)
-#define FPMAX      ((1<<(31-FPBITS))-1)
-#define FPPIXMULT  (1<<FPPIXBITS)
-#define FPARMAX    (1<<(22-FPPIXBITS))
-#define FPDIMMAX   (1<<(30-FPBITS))
-/*
-** Resample (re-size) bitmap, but use fixed-point and all integer math.
-** Only slightly less accurate than floating point, but faster.
-*/
-int bmp_resample_fixed_point(WILLUSBITMAP *dest,WILLUSBITMAP *src,double fx1,double fy1,
-                             double fx2,double fy2,int newwidth,int newheight)
-
-    {
-    int gray,maxlen,colorplanes;
-    /* Assumes integers are 32-bit */
-    int *tempbmp;
-    int *temprow;
-    int x1_fp,y1_fp,x2_fp,y2_fp,swidth_fp,sheight_fp;
-    int color,hmax,row,col,dy,dx;
-    static char *funcname="bmp_resample";
-
-    if (newwidth==0 || newheight==0)
+        willus_mem_free((double **)&ytaps,funcname);
+        willus_mem_free((double **)&xtaps,funcname);
         return(-1);
-    /* Quick check if we should use simple bmp_copy() call */
-    if (fx1==0. && fy1==0. && fx2==newwidth && fy2==newheight)
-        {
-        bmp_copy(dest,src);
-        return(0);
         }
-    /*
-    ** Make sure we won't have fixed-precision overruns.
-    ** If so, just use the float routine
-    */
-    if (fabs(fx2-fx1)*fabs(fy2-fy1)/(newheight*newwidth) > FPARMAX
-          || fx1>FPDIMMAX || fx2>FPDIMMAX || fy1>FPDIMMAX || fy2>FPDIMMAX
-          || newwidth>FPDIMMAX || newheight>FPDIMMAX
-          || src->width>FPDIMMAX || src->height>FPDIMMAX)
-        return(bmp_resample(dest,src,fx1,fy1,fx2,fy2,newwidth,newheight));
-
-    /* Convert to fixed-point integers */
-    x1_fp=fx1*FPMULT+0.5;
-    y1_fp=fy1*FPMULT+0.5;
-    x2_fp=fx2*FPMULT+0.5;
-    y2_fp=fy2*FPMULT+0.5;
-    swidth_fp = src->width<<FPBITS;
-    sheight_fp = src->height<<FPBITS;
-    /* Clip and sort x1,y1 and x2,y2 */
-    if (x1_fp>swidth_fp)
-        x1_fp=swidth_fp;
-    else if (x1_fp<0)
-        x1_fp=0;
-    if (x2_fp>swidth_fp)
-        x2_fp=swidth_fp;
-    else if (x2_fp<0)
-        x2_fp=0;
-    if (y1_fp>sheight_fp)
-        y1_fp=sheight_fp;
-    else if (y1_fp<0)
-        y1_fp=0;
-    if (y2_fp>sheight_fp)
-        y2_fp=sheight_fp;
-    else if (y2_fp<0)
-        y2_fp=0;
-    if (x2_fp<x1_fp)
-        {
-        int t;
-        t=x2_fp;
-        x2_fp=x1_fp;
-        x1_fp=t;
-        }
-    if (y2_fp<y1_fp)
-        {
-        int t;
-        t=y2_fp;
-        y2_fp=y1_fp;
-        y1_fp=t;
-        }
-    dy=(y2_fp-y1_fp)>>FPBITS;
-    dy += 2;
-    if (x2_fp==x1_fp || y2_fp==y1_fp)
-        return(-2);
-
-    /* Allocate temp storage */
-    dx = (x2_fp-x1_fp)>>FPBITS;
-    maxlen = dx > dy+newheight ? dx : dy+newheight;
-    maxlen += 16;
-    hmax = newheight > dy ? newheight : dy;
-    if (!willus_mem_alloc((double **)&temprow,maxlen*sizeof(int),funcname))
-        return(-1);
-    if (!willus_mem_alloc((double **)&tempbmp,hmax*newwidth*sizeof(int),funcname))
+    if (!willus_mem_alloc((double **)&rowptr,ymax*sizeof(unsigned char *),funcname))
         {
         willus_mem_free((double **)&temprow,funcname);
+        willus_mem_free((double **)&ytaps,funcname);
+        willus_mem_free((double **)&xtaps,funcname);
         return(-1);
         }
-    if ((gray=bmp_is_grayscale(src))!=0)
+    /* Color-mapped 8-bit source:  work from a 24-bit copy */
+    src24=&_src24;
+    bmp_init(src24);
+    if (!gray && src->bpp==8)
+        {
+        bmp_copy(src24,src);
+        bmp_promote_to_24(src24);
+        src=src24;
+        }
+    if (gray)
         {
         int i;
         dest->bpp=8;
@@ -3032,136 +3001,155 @@ int bmp_resample_fixed_point(WILLUSBITMAP *dest,WILLUSBITMAP *src,double fx1,dou
         dest->bpp=24;
     dest->width=newwidth;
     dest->height=newheight;
-    dest->type=WILLUSBITMAP_TYPE_NATIVE;
+    dest->type=native ? WILLUSBITMAP_TYPE_NATIVE : src->type;
+    /* Win32 bitmaps store BGR */
+    swap = (!gray && src->type!=dest->type);
     if (!bmp_alloc(dest))
         {
-        willus_mem_free((double **)&tempbmp,funcname);
+        bmp_free(src24);
+        willus_mem_free((double **)&rowptr,funcname);
         willus_mem_free((double **)&temprow,funcname);
+        willus_mem_free((double **)&ytaps,funcname);
+        willus_mem_free((double **)&xtaps,funcname);
         return(-1);
         }
-    colorplanes = gray ? 1 : 3;
-    for (color=0;color<colorplanes;color++)
+    for (row=0;row<newheight;row++)
         {
-        bmp_resample_1_fixed_point(tempbmp,src,x1_fp,y1_fp,x2_fp,y2_fp,newwidth,newheight,
-                                   temprow,gray ? -1 : color);
-        for (row=0;row<newheight;row++)
+        unsigned char *p;
+        int *w;
+        int k,nr,n;
+
+        nr=ytaps[newheight+row];
+        for (k=0;k<nr;k++)
+            rowptr[k]=bmp_rowptr_from_top(src,ytaps[row]+k)+x0*colorplanes;
+        n=(xtaps[newwidth-1]+xtaps[2*newwidth-1])*colorplanes;
+        bmpsimd_weighted_rows(temprow,rowptr,&ytaps[ytaps[2*newheight+row]],nr,n);
+        p=bmp_rowptr_from_top(dest,row);
+        for (col=0;col<newwidth;col++,p+=colorplanes)
             {
-            unsigned char *p;
-            int *s;
-            p=bmp_rowptr_from_top(dest,row)+color;
-            s=&tempbmp[row*newwidth];
+            short *s;
+            int nc;
+
+            s=&temprow[xtaps[col]*colorplanes];
+            w=&xtaps[xtaps[2*newwidth+col]];
+            nc=xtaps[newwidth+col];
+            /* Output is in 1/128 units times RESAMPLE_ONE */
             if (colorplanes==1)
-                for (col=0;col<newwidth;p[0]=(s[0]+(FPPIXMULT/2-1))>>FPPIXBITS,col++,s++,p++);
+                {
+                int sum;
+                for (sum=1<<(RESAMPLE_BITS+6),k=0;k<nc;k++)
+                    sum += w[k]*s[k];
+                p[0]=sum>>(RESAMPLE_BITS+7);
+                }
             else
-                for (col=0;col<newwidth;p[0]=(s[0]+(FPPIXMULT/2-1))>>FPPIXBITS,col++,s++,p+=colorplanes);
+                {
+                int r,g,b,t;
+                for (r=g=b=1<<(RESAMPLE_BITS+6),k=0;k<nc;k++,s+=3)
+                    {
+                    r += w[k]*s[0];
+                    g += w[k]*s[1];
+                    b += w[k]*s[2];
+                    }
+                if (swap)
+                    {
+                    t=r;
+                    r=b;
+                    b=t;
+                    }
+                p[0]=r>>(RESAMPLE_BITS+7);
+                p[1]=g>>(RESAMPLE_BITS+7);
+                p[2]=b>>(RESAMPLE_BITS+7);
+                }
             }
         }
-    willus_mem_free((double **)&tempbmp,funcname);
+    bmp_free(src24);
+    willus_mem_free((double **)&rowptr,funcname);
     willus_mem_free((double **)&temprow,funcname);
+    willus_mem_free((double **)&ytaps,funcname);
+    willus_mem_free((double **)&xtaps,funcname);
     return(0);
     }
 
 
-static void bmp_resample_1_fixed_point(int *tempbmp,WILLUSBITMAP *src,int x1_fp,int y1_fp,
-                                       int x2_fp,int y2_fp,int newwidth,int newheight,
-                                       int *temprow,int color)
+/*
+** Tap table for resampling source pixels 0..srcsize-1, from coordinate x1
+** to x2, to n pixels:  destination pixel i averages the count[i]=(*taps)[n+i]
+** source pixels starting at (*taps)[i], with the weights starting at
+** (*taps)[(*taps)[2*n+i]] (adding up to RESAMPLE_ONE).  Destination pixel i
+** covers x1+(x2-x1)*i/n to x1+(x2-x1)*(i+1)/n.  Source pixels it covers by
+** less than 1e-8 of its width are left out.
+**
+** Sets *maxcount to the largest count.  Returns 0 if out of memory.
+*/
+static int resample_taps(int **taps,int *maxcount,double x1,double x2,int n,int srcsize)
 
     {
-    int row,col,x0,dx,y0,dy;
+    static char *funcname="resample_taps";
+    double last;
+    int i,nw,maxtaps;
 
-    x0=x1_fp>>FPBITS;
-    dx=((x2_fp+(FPMULT-1))>>FPBITS)-x0;
-    x1_fp-=(x0<<FPBITS);
-    x2_fp-=(x0<<FPBITS);
-    y0=y1_fp>>FPBITS;
-    dy=((y2_fp+(FPMULT-1))>>FPBITS)-y0;
-    y1_fp-=(y0<<FPBITS);
-    y2_fp-=(y0<<FPBITS);
-    if (src->type==WILLUSBITMAP_TYPE_WIN32 && color>=0)
-        color=2-color;
-    for (row=0;row<dy;row++)
+    maxtaps=4*n+(int)(x2-x1)+2;
+    if (!willus_mem_alloc((double **)taps,maxtaps*sizeof(int),funcname))
+        return(0);
+    last=x1;
+    nw=3*n;
+    (*maxcount)=1;
+    for (i=0;i<n;i++)
         {
-        unsigned char *p;
-        p=bmp_rowptr_from_top(src,row+y0);
-        if (src->bpp==8)
+        int *w;
+        double new,dx,dx1,dx2;
+        int i1,i2,j,k,sum,jmax;
+
+        new=x1+(x2-x1)*(i+1)/n;
+        i1=floor(last);
+        i2=floor(new);
+        w=&(*taps)[nw];
+        if (i1==i2)
             {
-            switch (color)
-                {
-                case -1:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=(((unsigned int)p[0])<<FPPIXBITS);
-                    break;
-                case 0:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->red[p[0]]<<FPPIXBITS;
-                    break;
-                case 1:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->green[p[0]]<<FPPIXBITS;
-                    break;
-                case 2:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->blue[p[0]]<<FPPIXBITS;
-                    break;
-                }
+            w[0]=RESAMPLE_ONE;
+            k=1;
             }
         else
             {
-            p+=color;
-            for (col=0,p+=3*x0;col<dx;temprow[col]=(((unsigned int)p[0])<<FPPIXBITS),col++,p+=3);
+            dx=new-last;
+            dx1=1.-(last-i1);
+            dx2=new-i2;
+            k=0;
+            if (dx1 > 1e-8*(dx>1. ? 1. : dx))
+                w[k++]=(int)(RESAMPLE_ONE*dx1/dx+.5);
+            else
+                i1++;
+            for (j=0;j<i2-i1-(k>0);j++)
+                w[k++]=(int)(RESAMPLE_ONE/dx+.5);
+            if (dx2 > 1e-8*(dx>1. ? 1. : dx))
+                w[k++]=(int)(RESAMPLE_ONE*dx2/dx+.5);
             }
-        resample_1d_fixed_point(&tempbmp[row*newwidth],temprow,x1_fp,x2_fp,newwidth);
-        }
-    for (col=0;col<newwidth;col++)
-        {
-        int *p,*s;
-        p=&tempbmp[col];
-        s=&temprow[dy];
-        for (row=0;row<dy;row++,p+=newwidth)
-            temprow[row]=p[0];
-        resample_1d_fixed_point(s,temprow,y1_fp,y2_fp,newheight);
-        p=&tempbmp[col];
-        for (row=0;row<newheight;row++,p+=newwidth,s++)
-            p[0]=s[0];
-        }
-    }
-
-
-/*
-** Fixed point version of resample_1d().
-*/
-static void resample_1d_fixed_point(int *dst,int *src,int x1_fp,int x2_fp,int n)
-
-    {
-    int i,new_fp,last_fp;
-
-    last_fp=x1_fp;
-    for (i=0;i<n;i++)
-        {
-        /* Needs to go to double to prevent integer overflow */
-        new_fp=(int)(x1_fp+(double)(x2_fp-x1_fp)*(i+1)/n+.5);
-        dst[i] = resample_single_fixed_point(src,last_fp,new_fp);
-        last_fp=new_fp;
+        /* Make the weights add up exactly */
+        for (sum=jmax=j=0;j<k;j++)
+            {
+            sum+=w[j];
+            if (w[j]>w[jmax])
+                jmax=j;
+            }
+        w[jmax] += RESAMPLE_ONE-sum;
+        /* Stay inside the source */
+        if (i1>srcsize-1)
+            i1=srcsize-1;
+        if (i1+k>srcsize)
+            {
+            for (j=srcsize-i1;j<k;j++)
+                w[srcsize-i1-1] += w[j];
+            k=srcsize-i1;
+            }
+        (*taps)[i]=i1;
+        (*taps)[n+i]=k;
+        (*taps)[2*n+i]=nw;
+        nw+=k;
+        if (k>(*maxcount))
+            (*maxcount)=k;
+        last=new;
         }
-    }
-
-
-static double resample_single_fixed_point(int *y,int x1_fp,int x2_fp)
-
-    {
-    int i,i1,i2;
-    int dx_fp,dx1_fp,dx2_fp,sum;
-
-    i1=x1_fp>>FPBITS;
-    i2=x2_fp>>FPBITS;
-    if (i1==i2)
-        return(y[i1]);
-    dx_fp = x2_fp-x1_fp;
-    dx1_fp = FPMULT-(x1_fp-(i1<<FPBITS));
-    dx2_fp = x2_fp-(i2<<FPBITS);
-    sum= ((dx1_fp*y[i1]+(FPMULT/2))>>FPBITS) + ((dx2_fp*y[i2]+(FPMULT/2))>>FPBITS);
-    for (i=i1+1;i<=i2-1;sum+=y[i],i++);
-    return((sum<=FPMAX) ? ((sum<<FPBITS)+(FPMULT/2))/dx_fp : ((double)sum*FPMULT+(FPMULT/2))/dx_fp);
+    return(1);
     }
 
 
@@ -3329,7 +3317,7 @@ void bmp_contrast_adjust(WILLUSBITMAP *dest,WILLUSBITMAP *src,double contrast)
 
     {
     int i;
-    static unsigned char newval[256];
+    unsigned char newval[256];
 
     for (i=0;i<256;i++)
         {
@@ -3372,7 +3360,7 @@ void bmp_gamma_correct(WILLUSBITMAP *dest,WILLUSBITMAP *src,double gamma)
     {
     double gc;
     int i;
-    static unsigned char newval[256];
+    unsigned char newval[256];
 
     if (gamma<0.001)
         gamma=0.001;
@@ -4435,6 +4423,8 @@ void bmp_more_rows(WILLUSBITMAP *bmp,double ratio,int pixval)
         new_height = bmp->height + 128;
     bw=bmp_bytewidth(bmp);
     new_bytes=bw*new_height;
+    if (bmp_is_borrowed(bmp))
+        bmp_own(bmp,new_bytes);
     if (new_bytes > bmp->size_allocated)
         {
         willus_mem_realloc_robust_warn((void **)&bmp->data,
@@ -4448,25 +4438,155 @@ void bmp_more_rows(WILLUSBITMAP *bmp,double ratio,int pixval)
 
 
 /*
-** Bitmap is assumed to be grayscale
+** Bitmap is assumed to be grayscale.  Samples about ccount columns.
+** Returns 0 if out of memory.
 */
-static double bmp_row_by_row_stdev(WILLUSBITMAP *bmp,int ccount,int whitethresh,
-                                   double theta_radians)
+static int bmp_skew_columns(BMPSKEWCOLS *cols,WILLUSBITMAP *bmp,int ccount,int whitethresh)
 
     {
-    static char *funcname="bmp_row_by_row_stdev";
-    int dc1,dc2,c1,c2;
-    int r,n,nn,nw,dw,countthresh;
+    static char *funcname="bmp_skew_columns";
+    int c,c2,r,nn;
+
+    cols->width=bmp->width;
+    cols->height=bmp->height;
+    cols->c1=bmp->width/15.;
+    c2=bmp->width-cols->c1;
+    cols->dw=(int)((c2-cols->c1)/ccount+.5);
+    if (cols->dw<1)
+        cols->dw=1;
+    for (cols->nw=0,c=cols->c1;c<c2;c+=cols->dw,cols->nw++);
+    if (!willus_mem_alloc((double **)&cols->dark,(long)cols->nw*cols->height+1,funcname))
+        return(0);
+    for (r=0;r<cols->height;r++)
+        {
+        unsigned char *p,*d;
+
+        p=bmp_rowptr_from_top(bmp,r)+cols->c1;
+        d=&cols->dark[r];
+        for (nn=0;nn<cols->nw;nn++,p+=cols->dw,d+=cols->height)
+            (*d)=((*p)<whitethresh);
+        }
+    return(1);
+    }
+
+
+/*
+** sdev[i] = bmp_row_by_row_stdev(cols,theta[i],...), i=0..n-1, on up to
+** nthreads threads (including this one), fewer if other calls already
+** use the other cpus.
+*/
+static void bmp_skew_stdevs(BMPSKEWCOLS *cols,double *theta,double *sdev,int n,int nthreads)
+
+    {
+    static char *funcname="bmp_skew_stdevs";
+    BMPSKEWJOB job;
+    pthread_t *thread;
+    int i,nhelpers,nworkers;
+
+    job.cols=cols;
+    job.theta=theta;
+    job.sdev=sdev;
+    job.n=n;
+    job.next=0;
+    pthread_mutex_init(&job.mutex,NULL);
+    if (nthreads>n)
+        nthreads=n;
+    nhelpers=bmp_skew_reserve_helpers(nthreads-1);
+    nworkers=0;
+    thread=NULL;
+    if (nhelpers>0 && willus_mem_alloc((double **)&thread,nhelpers*sizeof(pthread_t),funcname))
+        for (;nworkers<nhelpers;nworkers++)
+            if (pthread_create(&thread[nworkers],NULL,bmp_skew_worker,&job))
+                break;
+    bmp_skew_worker(&job);
+    for (i=0;i<nworkers;i++)
+        pthread_join(thread[i],NULL);
+    willus_mem_free((double **)&thread,funcname);
+    bmp_skew_release_helpers(nhelpers);
+    pthread_mutex_destroy(&job.mutex);
+    }
+
+
+/*
+** Returns how many of the n helper threads asked for may be started.
+*/
+static int bmp_skew_reserve_helpers(int n)
+
+    {
+    int nfree;
+
+    if (n<1)
+        return(0);
+    pthread_mutex_lock(&bmp_skew_mutex);
+    nfree=wsys_num_cpus()-1-bmp_skew_helpers;
+    if (n>nfree)
+        n = nfree>0 ? nfree : 0;
+    bmp_skew_helpers+=n;
+    pthread_mutex_unlock(&bmp_skew_mutex);
+    return(n);
+    }
+
+
+static void bmp_skew_release_helpers(int n)
+
+    {
+    if (n<1)
+        return;
+    pthread_mutex_lock(&bmp_skew_mutex);
+    bmp_skew_helpers-=n;
+    pthread_mutex_unlock(&bmp_skew_mutex);
+    }
+
+
+static void *bmp_skew_worker(void *data)
+
+    {
+    static char *funcname="bmp_skew_worker";
+    BMPSKEWJOB *job;
+    int *edge;
+
+    job=(BMPSKEWJOB *)data;
+    willus_mem_alloc_warn((void **)&edge,(sizeof(int)+sizeof(short))*(job->cols->height+1),
+                          funcname,10);
+    while (1)
+        {
+        int i;
+
+        pthread_mutex_lock(&job->mutex);
+        i=job->next++;
+        pthread_mutex_unlock(&job->mutex);
+        if (i>=job->n)
+            break;
+        job->sdev[i]=bmp_row_by_row_stdev(job->cols,job->theta[i],edge,
+                                   (unsigned short *)&edge[job->cols->height+1]);
+        }
+    willus_mem_free((double **)&edge,funcname);
+    return(NULL);
+    }
+
+
+/*
+** Standard deviation, over the rows of the page sheared by theta, of the
+** percentage of the sampled columns that are dark in each row.  edge[]
+** and count[] are scratch space for cols->height+1 values each.
+**
+** Row r of the sheared page reads column nn at row r+row(nn), where
+** row(nn) only ever increases or only ever decreases, so the columns
+** that are inside the page for a given row are contiguous.  Each column
+** is added into count[] over the rows where it is inside the page, and
+** the number of such columns for each row (cin) is tallied from where
+** each one starts and stops.
+*/
+static double bmp_row_by_row_stdev(BMPSKEWCOLS *cols,double theta_radians,int *edge,
+                                   unsigned short *count)
+
+    {
+    int dc1,dc2,r1,r2;
+    int r,nn,cin,countthresh;
     double tanth,csum,csumsq,stdev;
-    int *row,*rowoff;
 
-    c1=bmp->width/15.;
-    c2=bmp->width-c1;
-    dw=(int)((c2-c1)/ccount+.5);
-    if (dw<1)
-        dw=1;
     tanth=-tan(theta_radians);
-    dc1=(int)(tanth*bmp->width);
+    dc1=(int)(tanth*cols->width);
     if (dc1<0)
         {
         dc1=1-dc1;
@@ -4477,75 +4597,74 @@ static double bmp_row_by_row_stdev(WILLUSBITMAP *bmp,int ccount,int whitethresh,
         dc2=-dc1-1;
         dc1=0;
         }
-    dc1 += bmp->height/15.;
-    dc2 -= bmp->height/15.;
+    dc1 += cols->height/15.;
+    dc2 -= cols->height/15.;
+    /* Rows r1..r2-1 */
+    r1=dc1+1;
+    r2=cols->height+dc2-1;
+    if (r1<0)
+        r1=0;
+    if (r2>cols->height)
+        r2=cols->height;
     csum=csumsq=0.;
-    n=0;
-    {
-    int c;
-    for (nw=0,c=c1;c<c2;c+=dw,nw++);
-    countthresh=nw*2/3;
-    willus_mem_alloc_warn((void **)&row,sizeof(int)*nw*2,funcname,10);
-    rowoff=&row[nw];
-    for (nn=0,c=c1;c<c2;c+=dw,nn++)
+    if (r2<=r1)
+        return(0.);
+    countthresh=cols->nw*2/3;
+    memset(edge,0,sizeof(int)*(cols->height+1));
+    memset(count,0,sizeof(short)*(cols->height+1));
+    for (nn=0;nn<cols->nw;nn++)
         {
-        row[nn]=tanth*c;
-        rowoff[nn]=(int)(bmp_rowptr_from_top(bmp,row[nn]) - bmp_rowptr_from_top(bmp,0));
+        int off,ra,rb;
+
+        off=tanth*(cols->c1+nn*cols->dw);
+        ra = -off > r1 ? -off : r1;
+        rb = cols->height-off < r2 ? cols->height-off : r2;
+        if (ra>=rb)
+            continue;
+        edge[ra]++;
+        edge[rb]--;
+        bmpsimd_add_bytes(&count[ra],&cols->dark[(size_t)nn*cols->height+off+ra],rb-ra);
         }
-    }
-    for (r=dc1+1;r<bmp->height+dc2-1;r++)
+    {
+    int n;
+    for (n=0,cin=0,r=r1;r<r2;r++)
         {
-        int c,cin,count;
         double dcount;
-        unsigned char *p;
 
-        p=bmp_rowptr_from_top(bmp,r);
-        for (cin=nn=count=0,c=c1;c<c2;c+=dw,nn++)
-            {
-            int r0;
-
-            r0=r+row[nn];
-            if (r0<0 || r0>=bmp->height)
-                {
-                if (cin>0)
-                    break;
-                continue;
-                }
-            cin++;
-            if (p[c+rowoff[nn]]<whitethresh)
-                count++;
-            }
+        cin+=edge[r];
         if (cin < countthresh)
             continue;
-        dcount=100.*count/cin;
+        dcount=100.*count[r]/cin;
         csum+=dcount;
         csumsq+=dcount*dcount;
         n++;
         }
-    willus_mem_free((double **)&row,funcname);
     if (n<=0)
         stdev=0.;
     else
         stdev=sqrt(fabs((csum/n)*(csum/n)-csumsq/n));
+    }
     return(stdev);
     }
 
 
 double bmp_autostraighten(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,int white,double maxdegrees,
-                          double mindegrees,int debug,FILE *out)
+                          double mindegrees,int nthreads,int debug,FILE *out)
 
     {
     int i,na,n,imax,maxpt;
     double stepsize,sdmin,sdmax,rotdeg;
-    double *sdev;
+    double *sdev,*theta;
+    BMPSKEWCOLS _cols,*cols;
     FILE *f;
     static int rpc=0;
     static char *funcname="bmp_autostraighten";
 
-    rpc++;
     f=NULL;
+    /* page counter only numbers the debug output, so leave it alone otherwise */
     if (debug)
         {
+        rpc++;
         f=wfile_fopen_utf8("straighten_metrics.ep",rpc==1?"w":"a");
         nprintf(f,"/sa l \"src page %d\" 2\n",rpc);
         }
@@ -4557,13 +4676,23 @@ double bmp_autostraighten(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,int white,doub
     sdmin=999.;
     sdmax=-999.;
     imax=0;
-    willus_mem_alloc_warn((void **)&sdev,n*sizeof(double),funcname,10);
+    cols=&_cols;
+    if (!bmp_skew_columns(cols,srcgrey,400,white))
+        {
+        if (debug)
+            fclose(f);
+        return(0.);
+        }
+    willus_mem_alloc_warn((void **)&sdev,n*2*sizeof(double),funcname,10);
+    theta=&sdev[n];
+    for (i=0;i<n;i++)
+        theta[i] = (i-na)*stepsize*PI/180.;
+    bmp_skew_stdevs(cols,theta,sdev,n,nthreads);
     for (i=0;i<n;i++)
         {
-        double theta,sdev0;
+        double sdev0;
 
-        theta = (i-na)*stepsize*PI/180.;
-        sdev0=bmp_row_by_row_stdev(srcgrey,400,white,theta);
+        sdev0=sdev[i];
         if (sdmin > sdev0)
             sdmin = sdev0;
         if (sdmax < sdev0)
@@ -4571,11 +4700,11 @@ double bmp_autostraighten(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,int white,doub
             imax = i;
             sdmax = sdev0;
             }
-        sdev[i]=sdev0;
         }
     if (sdmax<=0.)
         {
         willus_mem_free((double **)&sdev,funcname);
+        willus_mem_free((double **)&cols->dark,funcname);
         if (debug)
             fclose(f);
         return(0.);
@@ -4599,6 +4728,7 @@ double bmp_autostraighten(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,int white,doub
                      || fabs(fabs(rotdeg)-fabs(maxdegrees)) < 0.25)
         {
         willus_mem_free((double **)&sdev,funcname);
+        willus_mem_free((double **)&cols->dark,funcname);
         if (debug)
             {
             nprintf(f,"//nc\n");
@@ -4625,18 +4755,23 @@ double bmp_autostraighten(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,int white,doub
         {
         double sdmax2;
         double thbest;
+        double thfine[8],sdfine[8];
         int ifine,nfine;
         sdmax2=1.0;
         thbest=(imax-na)*stepsize*PI/180.;
         nfine=5;
-        for (ifine=-nfine+1;ifine<nfine;ifine++)
+        for (i=0,ifine=-nfine+1;ifine<nfine;ifine++)
+            if (ifine!=0)
+                thfine[i++] = (imax+(double)ifine/nfine-na)*stepsize*PI/180.;
+        bmp_skew_stdevs(cols,thfine,sdfine,i,nthreads);
+        for (i=0,ifine=-nfine+1;ifine<nfine;ifine++)
             {
             double theta,sdev0;
 
             if (ifine==0)
                 continue;
-            theta = (imax+(double)ifine/nfine-na)*stepsize*PI/180.;
-            sdev0=bmp_row_by_row_stdev(srcgrey,400,white,theta)/sdmax;
+            theta = thfine[i];
+            sdev0=sdfine[i++]/sdmax;
             if (debug)
                 nprintf(f,"%.3f %g\n",theta*180./PI,sdev0);
             if (sdev0>sdmax2)
@@ -4732,6 +4867,7 @@ double bmp_autostraighten(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,int white,doub
         bmp_rotate_fast(src,rotdeg,0);
         }
     willus_mem_free((double **)&sdev,funcname);
+    willus_mem_free((double **)&cols->dark,funcname);
     return(rotdeg);
     }
 
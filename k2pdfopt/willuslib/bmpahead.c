@@ -0,0 +1,440 @@
+/*
+** bmpahead.c   Read bitmap files ahead of time on background threads.
+**
+** Part of willus.com general purpose C code library.
+**
+** Copyright (C) 2020  http://willus.com
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU Affero General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+*/
+#include "willus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define BMPAHEAD_EMPTY     0
+#define BMPAHEAD_QUEUED    1
+#define BMPAHEAD_RUNNING   2
+#define BMPAHEAD_DONE      3
+
+typedef struct
+    {
+    BMPAHEAD_POOL *pool;
+    void *data;     /* funcs.worker_start() return value */
+    pthread_t thread;
+    } BMPAHEAD_WORKER;
+
+struct bmpahead_pool_s
+    {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;  /* Signalled when an item is queued or done, or on quit */
+    int quit;
+    BMPAHEAD_FUNCS funcs;
+    void *user;     /* Passed to each of funcs */
+    int nworkers;   /* Started */
+    int nitems;
+    BMPAHEAD_ITEM *item;
+    BMPAHEAD_WORKER *worker;
+    };
+
+/*
+** Files of a bitmap folder being read ahead of time, see bmpahead_queue().
+*/
+typedef struct
+    {
+    BMPAHEAD_POOL *pool;
+    int nthreads;
+    int nfiles;
+    } BMPAHEAD_FILES;
+
+static BMPAHEAD_ITEM *bmpahead_pool_find(BMPAHEAD_POOL *pool,char *filename,int pageno);
+static void bmpahead_pool_drop(BMPAHEAD_POOL *pool,BMPAHEAD_ITEM *item);
+static void *bmpahead_pool_worker(void *data);
+static int bmpahead_read_file(BMPAHEAD_ITEM *item,void *worker,void *user);
+
+static BMPAHEAD_FILES bmpahead_files;
+static BMPAHEAD_FUNCS bmpahead_file_funcs={NULL,bmpahead_read_file,NULL,NULL,NULL};
+
+
+/*
+** Start nthreads threads that read the items queued with
+** bmpahead_pool_queue() through funcs->read(), keeping at most nitems
+** of them.  funcs is copied.  Returns NULL if no thread could be started.
+*/
+BMPAHEAD_POOL *bmpahead_pool_start(BMPAHEAD_FUNCS *funcs,void *user,int nthreads,int nitems)
+
+    {
+    static char *funcname="bmpahead_pool_start";
+    BMPAHEAD_POOL *pool;
+    int i;
+
+    willus_mem_alloc_warn((void **)&pool,sizeof(BMPAHEAD_POOL),funcname,10);
+    willus_mem_alloc_warn((void **)&pool->item,sizeof(BMPAHEAD_ITEM)*nitems,funcname,10);
+    willus_mem_alloc_warn((void **)&pool->worker,sizeof(BMPAHEAD_WORKER)*nthreads,funcname,10);
+    pthread_mutex_init(&pool->mutex,NULL);
+    pthread_cond_init(&pool->cond,NULL);
+    pool->quit=0;
+    pool->funcs=(*funcs);
+    pool->user=user;
+    pool->nitems=nitems;
+    for (i=0;i<nitems;i++)
+        {
+        pool->item[i].filename[0]='\0';
+        pool->item[i].pageno=0;
+        pool->item[i].index=i;
+        pool->item[i].state=BMPAHEAD_EMPTY;
+        bmp_init(&pool->item[i].bmp);
+        }
+    /* Per thread set-up on this thread, e.g. cloning a context only used here */
+    for (pool->nworkers=0;pool->nworkers<nthreads;pool->nworkers++)
+        {
+        BMPAHEAD_WORKER *worker;
+
+        worker=&pool->worker[pool->nworkers];
+        worker->pool=pool;
+        worker->data=NULL;
+        if (pool->funcs.worker_start!=NULL
+              && (worker->data=pool->funcs.worker_start(user))==NULL)
+            break;
+        if (pthread_create(&worker->thread,NULL,bmpahead_pool_worker,worker))
+            {
+            if (pool->funcs.worker_end!=NULL)
+                pool->funcs.worker_end(worker->data,user);
+            break;
+            }
+        }
+    if (pool->nworkers==0)
+        {
+        bmpahead_pool_stop(pool);
+        return(NULL);
+        }
+    return(pool);
+    }
+
+
+/*
+** Stop the threads of pool and free what they read.
+*/
+void bmpahead_pool_stop(BMPAHEAD_POOL *pool)
+
+    {
+    static char *funcname="bmpahead_pool_stop";
+    int i;
+
+    if (pool==NULL)
+        return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit=1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i=0;i<pool->nworkers;i++)
+        pthread_join(pool->worker[i].thread,NULL);
+    for (i=0;i<pool->nitems;i++)
+        bmp_free(&pool->item[i].bmp);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    willus_mem_free((double **)&pool->worker,funcname);
+    willus_mem_free((double **)&pool->item,funcname);
+    willus_mem_free((double **)&pool,funcname);
+    }
+
+
+/*
+** Have pool read items 0..n-1, in that order:  file filelist[i] and/or
+** page pagelist[i] (either list may be NULL).  The items keep their own
+** copy of the file names.  Call again with the updated list as items are
+** used:  items no longer in the list are dropped.  Entries with an empty
+** file name or a page number below 1 are skipped.
+**
+** Returns the number of items being read or ready.
+*/
+int bmpahead_pool_queue(BMPAHEAD_POOL *pool,char **filelist,int *pagelist,int n)
+
+    {
+    int i,j,count;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (i=0;i<pool->nitems;i++)
+        {
+        BMPAHEAD_ITEM *item;
+
+        item=&pool->item[i];
+        if (item->state==BMPAHEAD_EMPTY)
+            continue;
+        for (j=0;j<n;j++)
+            if ((filelist==NULL || !strcmp(filelist[j],item->filename))
+                  && (pagelist==NULL || pagelist[j]==item->pageno))
+                break;
+        if (j<n)
+            {
+            item->order=j;
+            item->cancelled=0;
+            }
+        else if (item->state==BMPAHEAD_RUNNING)
+            item->cancelled=1;
+        else
+            bmpahead_pool_drop(pool,item);
+        }
+    for (j=0;j<n;j++)
+        {
+        char *filename;
+        int pageno;
+
+        filename = filelist==NULL ? "" : filelist[j];
+        pageno = pagelist==NULL ? 0 : pagelist[j];
+        if ((filelist!=NULL && filename[0]=='\0') || (pagelist!=NULL && pageno<1)
+                || bmpahead_pool_find(pool,filename,pageno)!=NULL)
+            continue;
+        for (i=0;i<pool->nitems && pool->item[i].state!=BMPAHEAD_EMPTY;i++);
+        if (i>=pool->nitems)
+            break;
+        xstrncpy(pool->item[i].filename,filename,MAXFILENAMELEN-1);
+        pool->item[i].pageno=pageno;
+        pool->item[i].state=BMPAHEAD_QUEUED;
+        pool->item[i].order=j;
+        pool->item[i].cancelled=0;
+        }
+    for (i=count=0;i<pool->nitems;i++)
+        if (pool->item[i].state!=BMPAHEAD_EMPTY && !pool->item[i].cancelled)
+            count++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return(count);
+    }
+
+
+/*
+** Returns 1 if pool is reading (or has read) filename / pageno, 0 otherwise.
+** filename==NULL is the same as "".
+*/
+int bmpahead_pool_has(BMPAHEAD_POOL *pool,char *filename,int pageno)
+
+    {
+    int status;
+
+    pthread_mutex_lock(&pool->mutex);
+    status=(bmpahead_pool_find(pool,filename==NULL ? "" : filename,pageno)!=NULL);
+    pthread_mutex_unlock(&pool->mutex);
+    return(status);
+    }
+
+
+/*
+** Hand the item read ahead of time over to bmp, waiting for it if it is
+** being read.  Returns 0 if bmp was filled (and *dpi set if dpi!=NULL),
+** 1 if the caller should read it itself (not queued, not started yet, or
+** it failed--reading again reports the error the usual way).
+*/
+int bmpahead_pool_take(BMPAHEAD_POOL *pool,WILLUSBITMAP *bmp,char *filename,int pageno,
+                       double *dpi)
+
+    {
+    BMPAHEAD_ITEM *item;
+    int status;
+
+    if (bmp->type!=WILLUSBITMAP_TYPE_NATIVE)
+        return(1);
+    pthread_mutex_lock(&pool->mutex);
+    item=bmpahead_pool_find(pool,filename==NULL ? "" : filename,pageno);
+    if (item==NULL)
+        {
+        pthread_mutex_unlock(&pool->mutex);
+        return(1);
+        }
+    if (item->state==BMPAHEAD_QUEUED)
+        {
+        item->state=BMPAHEAD_EMPTY;
+        pthread_mutex_unlock(&pool->mutex);
+        return(1);
+        }
+    item->cancelled=0;
+    while (item->state==BMPAHEAD_RUNNING)
+        pthread_cond_wait(&pool->cond,&pool->mutex);
+    status=item->status;
+    if (status==0)
+        {
+        /* Move the pixels and, for 8-bit, the palette */
+        bmp_free(bmp);
+        bmp->data=item->bmp.data;
+        bmp->size_allocated=item->bmp.size_allocated;
+        bmp->width=item->bmp.width;
+        bmp->height=item->bmp.height;
+        bmp->bpp=item->bmp.bpp;
+        if (bmp->bpp==8)
+            {
+            memcpy(bmp->red,item->bmp.red,sizeof(bmp->red));
+            memcpy(bmp->green,item->bmp.green,sizeof(bmp->green));
+            memcpy(bmp->blue,item->bmp.blue,sizeof(bmp->blue));
+            }
+        bmp_init(&item->bmp);
+        if (dpi!=NULL)
+            (*dpi)=item->dpi;
+        if (pool->funcs.take!=NULL)
+            pool->funcs.take(item,pool->user);
+        }
+    bmpahead_pool_drop(pool,item);
+    pthread_mutex_unlock(&pool->mutex);
+    return(status==0 ? 0 : 1);
+    }
+
+
+/*
+** Call with pool->mutex locked.
+*/
+static BMPAHEAD_ITEM *bmpahead_pool_find(BMPAHEAD_POOL *pool,char *filename,int pageno)
+
+    {
+    int i;
+
+    for (i=0;i<pool->nitems;i++)
+        if (pool->item[i].state!=BMPAHEAD_EMPTY && pool->item[i].pageno==pageno
+                                                && !strcmp(pool->item[i].filename,filename))
+            return(&pool->item[i]);
+    return(NULL);
+    }
+
+
+/*
+** Free what was read for item and mark it empty.  Call with pool->mutex
+** locked, not while the item is running.
+*/
+static void bmpahead_pool_drop(BMPAHEAD_POOL *pool,BMPAHEAD_ITEM *item)
+
+    {
+    bmp_free(&item->bmp);
+    if (pool->funcs.drop!=NULL)
+        pool->funcs.drop(item,pool->user);
+    item->state=BMPAHEAD_EMPTY;
+    }
+
+
+static void *bmpahead_pool_worker(void *data)
+
+    {
+    BMPAHEAD_WORKER *worker;
+    BMPAHEAD_POOL *pool;
+
+    worker=(BMPAHEAD_WORKER *)data;
+    pool=worker->pool;
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->quit)
+        {
+        BMPAHEAD_ITEM *item;
+        int i,status;
+
+        /* Earliest queued item in the list first */
+        for (item=NULL,i=0;i<pool->nitems;i++)
+            if (pool->item[i].state==BMPAHEAD_QUEUED
+                  && (item==NULL || pool->item[i].order<item->order))
+                item=&pool->item[i];
+        if (item==NULL)
+            {
+            pthread_cond_wait(&pool->cond,&pool->mutex);
+            continue;
+            }
+        item->state=BMPAHEAD_RUNNING;
+        pthread_mutex_unlock(&pool->mutex);
+        /* item->bmp, ->dpi are only touched by this thread while running */
+        status=pool->funcs.read(item,worker->data,pool->user);
+        pthread_mutex_lock(&pool->mutex);
+        item->status=status;
+        item->state=BMPAHEAD_DONE;
+        if (item->cancelled)
+            bmpahead_pool_drop(pool,item);
+        pthread_cond_broadcast(&pool->cond);
+        }
+    pthread_mutex_unlock(&pool->mutex);
+    if (pool->funcs.worker_end!=NULL)
+        pool->funcs.worker_end(worker->data,pool->user);
+    return(NULL);
+    }
+
+
+/*
+** Read files filelist[0..n-1] with bmp_read_dpi(), in that order, on nthreads background threads so that bmpahead_read() finds them
+** ready.  Call again with the updated list as files are used:  files no
+** longer in the list are dropped.  nthreads<1 or n<1 stops the threads.
+**
+** Returns the number of files being read or ready.
+*/
+int bmpahead_queue(char **filelist,int n,int nthreads)
+
+    {
+    BMPAHEAD_FILES *files;
+
+    if (nthreads<1 || n<1)
+        {
+        bmpahead_close();
+        return(0);
+        }
+    files=&bmpahead_files;
+    if (files->pool!=NULL && (files->nthreads!=nthreads || files->nfiles<n))
+        bmpahead_close();
+    if (files->pool==NULL)
+        {
+        /* Only read by the threads of the new pool */
+        files->nthreads=nthreads;
+        files->nfiles=n;
+        files->pool=bmpahead_pool_start(&bmpahead_file_funcs,files,nthreads,n);
+        if (files->pool==NULL)
+            return(0);
+        }
+    return(bmpahead_pool_queue(files->pool,filelist,NULL,n));
+    }
+
+
+/*
+** Read filename into bmp like bmp_read(), except that PNG and JPEG files
+** are read with bmp_read_dpi()--and taken from the bmpahead_queue()
+** threads if they have them.
+*/
+int bmpahead_read(WILLUSBITMAP *bmp,char *filename,FILE *out)
+
+    {
+    double dpi;
+    int status;
+
+    if (bmpahead_files.pool!=NULL
+                  && !bmpahead_pool_take(bmpahead_files.pool,bmp,filename,0,&dpi))
+        status=0;
+    else
+        {
+        status=bmp_read_dpi(bmp,filename,&dpi,out);
+        if (status==-10)
+            return(bmp_read(bmp,filename,out));
+        }
+    if (status==0)
+        bmp_set_dpi(dpi);
+    return(status);
+    }
+
+
+/*
+** Stop the bmpahead_queue() threads and free what they read.
+*/
+void bmpahead_close(void)
+
+    {
+    bmpahead_pool_stop(bmpahead_files.pool);
+    bmpahead_files.pool=NULL;
+    }
+
+
+static int bmpahead_read_file(BMPAHEAD_ITEM *item,void *worker,void *user)
+
+    {
+    return(bmp_read_dpi(&item->bmp,item->filename,&item->dpi,NULL));
+    }
@@ -25,6 +25,9 @@
 #ifdef HAVE_DJVU_LIB
 #include <djvu.h>
 
+static int bmpdjvu_open(char *infile);
+static ddjvu_page_t *bmpdjvu_page_get(int pageno);
+static void bmpdjvu_pages_release(void);
 static void handle(int wait,ddjvu_context_t *ctx);
 static void djvu_add_page_info(char *buf,ddjvu_document_t *doc,int page,int npages);
 static int wpdfoutline_fill_from_miniexp(WPDFOUTLINE *outline,miniexp_t bmarks);
@@ -43,6 +46,132 @@ extern char *miniexp_to_name(miniexp_t p);
 extern char *miniexp_to_str(miniexp_t p);
 extern int miniexp_stringp(miniexp_t p);
 
+/*
+** The djvu file opened last stays open, so that a bundled file's
+** directory and shared dictionaries (Djbz) are only read once, until a
+** different file--or the same file with a new date--is asked for, or
+** until bmpdjvu_close().  Two page handles are kept with it:  the page
+** rendered last (pages are often read twice, first at low dpi) and the
+** one passed to bmpdjvu_prefetch(), which ddjvu decodes in its own
+** thread while the caller works on the current page.
+*/
+static ddjvu_context_t *bmpdjvu_ctx=NULL;
+static ddjvu_document_t *bmpdjvu_doc=NULL;
+static char bmpdjvu_docname[MAXFILENAMELEN];
+static struct tm bmpdjvu_docdate;
+static ddjvu_page_t *bmpdjvu_page[2]={NULL,NULL}; /* [0]=current, [1]=prefetched */
+static int bmpdjvu_pageno[2];
+
+
+/*
+** Returns 0 with bmpdjvu_ctx and bmpdjvu_doc set to infile.
+** Returns -1 if the djvu context cannot be created, -2 if the
+** document cannot be opened.
+*/
+static int bmpdjvu_open(char *infile)
+
+    {
+    struct tm date;
+
+    if (wfile_date(infile,&date)!=1)
+        memset(&date,0,sizeof(struct tm));
+    if (bmpdjvu_doc!=NULL && !strcmp(bmpdjvu_docname,infile)
+                          && !wfile_datecomp(&bmpdjvu_docdate,&date))
+        return(0);
+    bmpdjvu_close();
+    bmpdjvu_ctx=ddjvu_context_create("bmpdjvu");
+    if (bmpdjvu_ctx==NULL)
+        return(-1);
+    bmpdjvu_doc=ddjvu_document_create_by_filename_utf8(bmpdjvu_ctx,infile,1);
+    if (bmpdjvu_doc==NULL)
+        {
+        bmpdjvu_close();
+        return(-2);
+        }
+    /* Wait for the directory so that the page count is known */
+    while (!ddjvu_document_decoding_done(bmpdjvu_doc))
+        handle(1,bmpdjvu_ctx);
+    xstrncpy(bmpdjvu_docname,infile,MAXFILENAMELEN-1);
+    bmpdjvu_docdate=date;
+    return(0);
+    }
+
+
+/*
+** Close the djvu file kept open by bmpdjvu_djvufile_to_bmp(), if any.
+*/
+void bmpdjvu_close(void)
+
+    {
+    bmpdjvu_pages_release();
+    if (bmpdjvu_doc!=NULL)
+        ddjvu_document_release(bmpdjvu_doc);
+    if (bmpdjvu_ctx!=NULL)
+        ddjvu_context_release(bmpdjvu_ctx);
+    bmpdjvu_doc=NULL;
+    bmpdjvu_ctx=NULL;
+    bmpdjvu_docname[0]='\0';
+    }
+
+
+/*
+** Start decoding page pageno (starts at 1) of infile in the background
+** so that a following bmpdjvu_djvufile_to_bmp() call for it does not
+** have to wait as long.  Does nothing unless infile is the file that
+** is already open.
+*/
+void bmpdjvu_prefetch(char *infile,int pageno)
+
+    {
+    if (bmpdjvu_doc==NULL || strcmp(bmpdjvu_docname,infile)
+           || pageno<1 || pageno>ddjvu_document_get_pagenum(bmpdjvu_doc))
+        return;
+    if ((bmpdjvu_page[0]!=NULL && bmpdjvu_pageno[0]==pageno)
+          || (bmpdjvu_page[1]!=NULL && bmpdjvu_pageno[1]==pageno))
+        return;
+    if (bmpdjvu_page[1]!=NULL)
+        ddjvu_page_release(bmpdjvu_page[1]);
+    bmpdjvu_page[1]=ddjvu_page_create_by_pageno(bmpdjvu_doc,pageno-1);
+    bmpdjvu_pageno[1]=pageno;
+    }
+
+
+/*
+** Returns the handle of page pageno (starts at 1) of the open document,
+** which becomes the current page, or NULL.
+*/
+static ddjvu_page_t *bmpdjvu_page_get(int pageno)
+
+    {
+    if (bmpdjvu_page[0]!=NULL && bmpdjvu_pageno[0]==pageno)
+        return(bmpdjvu_page[0]);
+    if (bmpdjvu_page[0]!=NULL)
+        ddjvu_page_release(bmpdjvu_page[0]);
+    if (bmpdjvu_page[1]!=NULL && bmpdjvu_pageno[1]==pageno)
+        {
+        bmpdjvu_page[0]=bmpdjvu_page[1];
+        bmpdjvu_page[1]=NULL;
+        }
+    else
+        bmpdjvu_page[0]=ddjvu_page_create_by_pageno(bmpdjvu_doc,pageno-1);
+    bmpdjvu_pageno[0]=pageno;
+    return(bmpdjvu_page[0]);
+    }
+
+
+static void bmpdjvu_pages_release(void)
+
+    {
+    int i;
+
+    for (i=0;i<2;i++)
+        {
+        if (bmpdjvu_page[i]!=NULL)
+            ddjvu_page_release(bmpdjvu_page[i]);
+        bmpdjvu_page[i]=NULL;
+        }
+    }
+
 
 /*
 ** Returns 0 for success, negative number for error code.
@@ -64,33 +193,29 @@ int bmpdjvu_djvufile_to_bmp(WILLUSBITMAP *bmp,char *infile,int pageno,
     ddjvu_format_t *fmt;
     int i,iw,ih,idpi,status;
 
-    ctx=ddjvu_context_create("bmpdjvu_djvufile_to_bmp");
-    if (ctx==NULL)
+    status=bmpdjvu_open(infile);
+    if (status==-1)
         {
         nprintf(out,"Cannot create djvu context.\n");
         return(-1);
         }
-    doc=ddjvu_document_create_by_filename_utf8(ctx,infile,1);
-    if (doc==NULL)
+    if (status<0)
         {
-        ddjvu_context_release(ctx);
         nprintf(out,"Cannot create djvu document context from djvu file %s.\n",
                 infile);
         return(-2);
         }
+    ctx=bmpdjvu_ctx;
+    doc=bmpdjvu_doc;
     i=ddjvu_document_get_pagenum(doc);
-    if (pageno<0 || pageno>i)
+    if (pageno<1 || pageno>i)
         {
-        ddjvu_document_release(doc);
-        ddjvu_context_release(ctx);
         nprintf(out,"Page number %d is out of range for djvu file %s.\n",pageno,infile);
         return(-3);
         }
-    page=ddjvu_page_create_by_pageno(doc,pageno-1);
+    page=bmpdjvu_page_get(pageno);
     if (page==NULL)
         {
-        ddjvu_document_release(doc);
-        ddjvu_context_release(ctx);
         nprintf(out,"Cannot parse page %d of djvu file %s.\n",pageno,infile);
         return(-4);
         }
@@ -98,9 +223,7 @@ int bmpdjvu_djvufile_to_bmp(WILLUSBITMAP *bmp,char *infile,int pageno,
         handle(1,ctx);
     if (ddjvu_page_decoding_error(page))
         {
-        ddjvu_page_release(page);
-        ddjvu_document_release(doc);
-        ddjvu_context_release(ctx);
+        bmpdjvu_pages_release();
         nprintf(out,"Error decoding page %d of djvu file %s.\n",pageno,infile);
         return(-5);
         }
@@ -130,9 +253,6 @@ int bmpdjvu_djvufile_to_bmp(WILLUSBITMAP *bmp,char *infile,int pageno,
     fmt=ddjvu_format_create(style,0,0);
     if (fmt==NULL)
         {
-        ddjvu_page_release(page);
-        ddjvu_document_release(doc);
-        ddjvu_context_release(ctx);
         nprintf(out,"Error setting DJVU format for djvu file %s (page %d).\n",infile,pageno);
         return(-6);
         }
@@ -142,9 +262,6 @@ int bmpdjvu_djvufile_to_bmp(WILLUSBITMAP *bmp,char *infile,int pageno,
     if (!status) 
         bmp_fill(bmp,255,255,255);
     ddjvu_format_release(fmt);
-    ddjvu_page_release(page);
-    ddjvu_document_release(doc);
-    ddjvu_context_release(ctx);
     /*
     if (!status)
         {
@@ -162,23 +279,12 @@ int bmpdjvu_djvufile_to_bmp(WILLUSBITMAP *bmp,char *infile,int pageno,
 int bmpdjvu_numpages(char *infile)
 
     {
-    ddjvu_context_t *ctx;
-    ddjvu_document_t *doc;
-    int i;
+    int status;
 
-    ctx=ddjvu_context_create("bmpdjvu_numpages");
-    if (ctx==NULL)
-        return(-1);
-    doc=ddjvu_document_create_by_filename_utf8(ctx,infile,1);
-    if (doc==NULL)
-        {
-        ddjvu_context_release(ctx);
-        return(-2);
-        }
-    i=ddjvu_document_get_pagenum(doc);
-    ddjvu_document_release(doc);
-    ddjvu_context_release(ctx);
-    return(i);
+    status=bmpdjvu_open(infile);
+    if (status<0)
+        return(status);
+    return(ddjvu_document_get_pagenum(bmpdjvu_doc));
     }
 
 
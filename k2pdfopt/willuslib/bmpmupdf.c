@@ -24,96 +24,546 @@
 #include "willus.h"
 
 #ifdef HAVE_MUPDF_LIB
+#include <pthread.h>
 #include <mupdf/pdf.h>
 void pdf_install_load_system_font_funcs(fz_context *ctx);
+void wtextchars_add_fz_chars(WTEXTCHARS *wtc,fz_context *ctx,fz_stext_page *page,
+                             int boundingbox);
 
+/*
+** Text of a page, taken from the same display list that it is rendered from
+*/
+typedef struct
+    {
+    int pageno;     /* 0 = none */
+    WTEXTCHARS wtc; /* All characters */
+    WTEXTCHARS box; /* Bounding box of all of them as one character */
+    } BMPMUPDF_TEXT;
+
+/*
+** Render ahead threads (a BMPAHEAD_POOL) for the open document, all at
+** the same dpi, bpp and clip.
+*/
+typedef struct
+    {
+    BMPAHEAD_POOL *pool;
+    char filename[MAXFILENAMELEN];
+    double dpi;
+    int bpp;
+    double clip[8]; /* bmpmupdf_render_page() clip margins */
+    int text;       /* Extract the text of each page too */
+    int nthreads;   /* Requested */
+    int npages;
+    BMPMUPDF_TEXT *pagetext;  /* Text of each pool item, by BMPAHEAD_ITEM index */
+    } BMPMUPDF_AHEAD;
+
+typedef struct
+    {
+    fz_context *ctx;  /* Clone of bmpmupdf_ctx */
+    fz_document *doc; /* Own copy of the document */
+    int opened;
+    } BMPMUPDF_AHEAD_WORKER;
+
+static fz_document *bmpmupdf_open_document(fz_context *ctx,char *filename);
 static void mupdf_cbz_add_page_info(char *buf,fz_context *ctx,fz_document *doc,
                                     int pageno,int npages);
-static int bmpmupdf_pixmap_to_bmp(WILLUSBITMAP *bmp,fz_context *ctx,fz_pixmap *pixmap);
+static int bmpmupdf_page_list(fz_context *ctx,fz_document *doc,int pageno,
+                              fz_display_list **list,fz_rect *bounds);
+static int bmpmupdf_render_page(WILLUSBITMAP *bmp,fz_context *ctx,fz_document *doc,
+                                int pageno,double dpi,int bpp,double *clip,
+                                BMPMUPDF_TEXT *text);
+static void bmpmupdf_text_init(BMPMUPDF_TEXT *text);
+static void bmpmupdf_text_free(BMPMUPDF_TEXT *text);
+static void bmpmupdf_text_extract(BMPMUPDF_TEXT *text,fz_context *ctx,fz_display_list *list,
+                                  fz_rect bounds,int pageno);
+static void wtextchars_append(WTEXTCHARS *dst,WTEXTCHARS *src);
+static fz_irect bmpmupdf_clip_bbox(fz_irect bbox,double *clip);
+static void bmpmupdf_clip_copy(double *dst,double *clip);
+static void bmpmupdf_pixmap_to_bmp(WILLUSBITMAP *bmp,fz_context *ctx,fz_pixmap *pixmap);
+static fz_locks_context *bmpmupdf_locks(void);
+static void bmpmupdf_lock(void *user,int lock);
+static void bmpmupdf_unlock(void *user,int lock);
+static BMPMUPDF_AHEAD *bmpmupdf_ahead_start(char *filename,double dpi,int bpp,double *clip,
+                                            int nthreads,int npages);
+static void bmpmupdf_ahead_stop(void);
+static int bmpmupdf_ahead_take(WILLUSBITMAP *bmp,char *filename,int pageno,double dpi,
+                               int bpp,double *clip);
+static void *bmpmupdf_ahead_worker_start(void *user);
+static int bmpmupdf_ahead_render(BMPAHEAD_ITEM *item,void *worker,void *user);
+static void bmpmupdf_ahead_worker_end(void *worker,void *user);
+static void bmpmupdf_ahead_drop(BMPAHEAD_ITEM *item,void *user);
+static void bmpmupdf_ahead_take_text(BMPAHEAD_ITEM *item,void *user);
 
-int bmpmupdf_pdffile_to_bmp(WILLUSBITMAP *bmp,char *filename,int pageno,double dpi,
-                            int bpp)
+/*
+** The document opened last is kept open, together with its context (and
+** so its resource store and glyph cache), until a different file--or the
+** same file with a new date--is asked for, or until bmpmupdf_close().
+** Converting a long PDF otherwise re-parses the xref and page tree and
+** reloads the fonts for every page.
+*/
+static fz_context *bmpmupdf_ctx=NULL;
+static fz_document *bmpmupdf_doc=NULL;
+static char bmpmupdf_docname[MAXFILENAMELEN];
+static struct tm bmpmupdf_docdate;
+
+/*
+** The open document's file, mapped into memory.  mupdf reads it through
+** a memory stream instead of seeking and reading a FILE, and the render
+** ahead threads open their copies of the document from the same bytes.
+*/
+static WFILEMAP bmpmupdf_map;
+
+/*
+** Text of the page rendered last.  Once bmpmupdf_page_text() has been
+** called for the open document, each page's text is extracted as it is
+** rendered (bmpmupdf_text_wanted), so that asking for it afterwards does
+** not interpret the page contents a second time.
+*/
+static BMPMUPDF_TEXT bmpmupdf_text;
+static int bmpmupdf_text_wanted=0;
+
+/*
+** Pages rendered ahead of time from the open document, see
+** bmpmupdf_render_ahead().
+*/
+static BMPMUPDF_AHEAD *bmpmupdf_ahead=NULL;
+
+
+/*
+** Returns 0 with bmpmupdf_ctx and bmpmupdf_doc set to filename.
+** Returns -1 if the document cannot be opened, -20 if the mupdf
+** context cannot be set up.
+*/
+static int bmpmupdf_open(char *filename)
 
     {
     fz_context *ctx;
-    fz_colorspace *colorspace;
     fz_document *doc;
-    fz_page *page;
-    fz_display_list *list;
-    fz_device *dev;
-    fz_pixmap *pix;
-    double dpp;
-    fz_rect bounds,bounds2;
-    fz_matrix ctm,identity;
-    fz_irect bbox;
-//    fz_glyph_cache *glyphcache;
-//    fz_error error;
-    int np,status;
+    struct tm date;
 
-    dev=NULL;
-    list=NULL;
-    page=NULL;
-    doc=NULL;
-    status=0;
-    if (pageno<1)
-        return(-99);
-    ctx = fz_new_context(NULL,NULL,FZ_STORE_DEFAULT);
+    if (wfile_date(filename,&date)!=1)
+        memset(&date,0,sizeof(struct tm));
+    if (bmpmupdf_doc!=NULL && !strcmp(bmpmupdf_docname,filename)
+                          && !wfile_datecomp(&bmpmupdf_docdate,&date))
+        return(0);
+    bmpmupdf_close();
+    /* With locks, so that bmpmupdf_render_ahead() can clone it */
+    ctx = fz_new_context(NULL,bmpmupdf_locks(),FZ_STORE_DEFAULT);
     if (!ctx)
         return(-1);
     fz_try(ctx)
-    {
-    fz_register_document_handlers(ctx);
-    fz_set_aa_level(ctx,8);
-    /* Sumatra version of MuPDF v1.4 -- use locally installed fonts */
-    pdf_install_load_system_font_funcs(ctx);
-//    fz_accelerate();
-//    glyphcache=fz_new_glyph_cache();
-    colorspace=(bpp==8 ? fz_device_gray(ctx) : fz_device_rgb(ctx));
-    fz_try(ctx) { doc=fz_open_document(ctx,filename); }
-    fz_catch(ctx) 
-        { 
+        {
+        fz_register_document_handlers(ctx);
+        fz_set_aa_level(ctx,8);
+        /* Sumatra version of MuPDF v1.4 -- use locally installed fonts */
+        pdf_install_load_system_font_funcs(ctx);
+        }
+    fz_catch(ctx) /* Error registering */
+        {
         fz_drop_context(ctx);
+        return(-20);
+        }
+    if (wfile_map(&bmpmupdf_map,filename))
+        bmpmupdf_map.data=NULL;
+    doc=bmpmupdf_open_document(ctx,filename);
+    if (doc==NULL)
+        {
+        fz_drop_context(ctx);
+        wfile_unmap(&bmpmupdf_map);
         return(-1);
         }
     /*
     if (fz_needs_password(doc) && !fz_authenticate_password(doc,password))
         return(-2);
     */
-//    error=pdf_load_page_tree(xref);
-//    if (error)
-//        {
-//        pdf_free_xref(xref);
-//        return(-2);
-//        }
-
-    np=fz_count_pages(ctx,doc);
-    if (pageno>np)
-        return(-99);
-    fz_try(ctx) { page = fz_load_page(ctx,doc,pageno-1); }
-    fz_catch(ctx) 
+    bmpmupdf_ctx=ctx;
+    bmpmupdf_doc=doc;
+    xstrncpy(bmpmupdf_docname,filename,MAXFILENAMELEN-1);
+    bmpmupdf_docdate=date;
+    return(0);
+    }
+
+
+/*
+** Open filename from bmpmupdf_map if it is mapped, else from the file.
+** The file name is still passed so that mupdf picks the handler by it.
+** Returns NULL on failure.
+*/
+static fz_document *bmpmupdf_open_document(fz_context *ctx,char *filename)
+
+    {
+    fz_document *doc;
+    fz_stream *stm;
+
+    doc=NULL;
+    if (bmpmupdf_map.data==NULL)
         {
-        fz_drop_document(ctx,doc);
-        fz_drop_context(ctx);
-        return(-3);
+        fz_try(ctx) { doc=fz_open_document(ctx,filename); }
+        fz_catch(ctx) { doc=NULL; }
+        return(doc);
+        }
+    stm=NULL;
+    fz_var(stm);
+    fz_try(ctx)
+        {
+        stm=fz_open_memory(ctx,bmpmupdf_map.data,bmpmupdf_map.size);
+        doc=fz_open_document_with_stream(ctx,filename,stm);
+        }
+    fz_always(ctx)
+        {
+        fz_drop_stream(ctx,stm);
         }
-    bounds=fz_bound_page(ctx,page);
-    fz_try(ctx) { list=fz_new_display_list(ctx,bounds);
-                  dev=fz_new_list_device(ctx,list);
-                  fz_run_page(ctx,page,dev,fz_identity,NULL);
-                }
     fz_catch(ctx)
         {
-        fz_close_device(ctx,dev);
-        fz_drop_device(ctx,dev);
-        fz_drop_display_list(ctx,list);
-        fz_drop_page(ctx,page);
-        fz_drop_document(ctx,doc);
-        fz_drop_context(ctx);
-        return(-4);
+        doc=NULL;
         }
-    fz_close_device(ctx,dev);
-    fz_drop_device(ctx,dev);
+    return(doc);
+    }
+
+
+/*
+** Close the document kept open by bmpmupdf_pdffile_to_bmp() and
+** bmpmupdf_pdffile_width_and_height(), if any.
+*/
+void bmpmupdf_close(void)
+
+    {
+    bmpmupdf_ahead_stop();
+    if (bmpmupdf_ctx==NULL)
+        return;
+    if (bmpmupdf_doc!=NULL)
+        fz_drop_document(bmpmupdf_ctx,bmpmupdf_doc);
+    fz_flush_warnings(bmpmupdf_ctx);
+    fz_drop_context(bmpmupdf_ctx);
+    /* Only now, with no document left reading from it */
+    wfile_unmap(&bmpmupdf_map);
+    bmpmupdf_doc=NULL;
+    bmpmupdf_ctx=NULL;
+    bmpmupdf_docname[0]='\0';
+    bmpmupdf_text_free(&bmpmupdf_text);
+    bmpmupdf_text_wanted=0;
+    }
+
+
+/*
+** Render pages pagelist[0..n-1] of filename at dpi, bpp and clip, in that
+** order, on nthreads background threads so that bmpmupdf_pdffile_to_bmp_ex()
+** finds them ready.  Call again with the updated list as pages are used:
+** pages no longer in the list are dropped.  Each thread works on its own
+** clone of the mupdf context (sharing the resource store and glyph cache)
+** with its own copy of the document, and renders a page exactly as
+** bmpmupdf_pdffile_to_bmp_ex() would.  nthreads<1 or n<1 stops the threads.
+**
+** Returns the number of pages being rendered or ready.
+*/
+int bmpmupdf_render_ahead(char *filename,int *pagelist,int n,double dpi,int bpp,
+                          double *clip,int nthreads)
+
+    {
+    BMPMUPDF_AHEAD *ahead;
+    double clip0[8];
+
+    if (nthreads<1 || n<1)
+        {
+        bmpmupdf_ahead_stop();
+        return(0);
+        }
+    /* Closes any other document and stops its threads */
+    if (bmpmupdf_open(filename)<0)
+        return(0);
+    ahead=bmpmupdf_ahead;
+    bmpmupdf_clip_copy(clip0,clip);
+    if (ahead!=NULL && (strcmp(ahead->filename,filename) || ahead->dpi!=dpi
+                          || ahead->bpp!=bpp || memcmp(ahead->clip,clip0,sizeof(clip0))
+                          || ahead->text!=bmpmupdf_text_wanted
+                          || ahead->nthreads!=nthreads || ahead->npages<n))
+        {
+        bmpmupdf_ahead_stop();
+        ahead=NULL;
+        }
+    if (ahead==NULL)
+        ahead=bmpmupdf_ahead_start(filename,dpi,bpp,clip0,nthreads,n);
+    if (ahead==NULL)
+        return(0);
+    return(bmpahead_pool_queue(ahead->pool,NULL,pagelist,n));
+    }
+
+
+/*
+** Returns 1 if page pageno of filename is being rendered (or is ready)
+** at dpi, bpp and clip by bmpmupdf_render_ahead(), 0 otherwise.
+*/
+int bmpmupdf_page_ahead(char *filename,int pageno,double dpi,int bpp,double *clip)
+
+    {
+    BMPMUPDF_AHEAD *ahead;
+    double clip0[8];
+
+    ahead=bmpmupdf_ahead;
+    bmpmupdf_clip_copy(clip0,clip);
+    if (ahead==NULL || strcmp(ahead->filename,filename) || ahead->dpi!=dpi || ahead->bpp!=bpp
+                    || memcmp(ahead->clip,clip0,sizeof(clip0)))
+        return(0);
+    return(bmpahead_pool_has(ahead->pool,NULL,pageno));
+    }
+
+
+static BMPMUPDF_AHEAD *bmpmupdf_ahead_start(char *filename,double dpi,int bpp,double *clip,
+                                            int nthreads,int npages)
+
+    {
+    static char *funcname="bmpmupdf_ahead_start";
+    static BMPAHEAD_FUNCS funcs={bmpmupdf_ahead_worker_start,bmpmupdf_ahead_render,
+                                 bmpmupdf_ahead_worker_end,bmpmupdf_ahead_drop,
+                                 bmpmupdf_ahead_take_text};
+    BMPMUPDF_AHEAD *ahead;
+    int i;
+
+    willus_mem_alloc_warn((void **)&ahead,sizeof(BMPMUPDF_AHEAD),funcname,10);
+    willus_mem_alloc_warn((void **)&ahead->pagetext,sizeof(BMPMUPDF_TEXT)*npages,funcname,10);
+    xstrncpy(ahead->filename,filename,MAXFILENAMELEN-1);
+    ahead->dpi=dpi;
+    ahead->bpp=bpp;
+    memcpy(ahead->clip,clip,sizeof(ahead->clip));
+    ahead->text=bmpmupdf_text_wanted;
+    ahead->nthreads=nthreads;
+    ahead->npages=npages;
+    for (i=0;i<npages;i++)
+        bmpmupdf_text_init(&ahead->pagetext[i]);
+    bmpmupdf_ahead=ahead;
+    ahead->pool=bmpahead_pool_start(&funcs,ahead,nthreads,npages);
+    if (ahead->pool==NULL)
+        {
+        bmpmupdf_ahead_stop();
+        return(NULL);
+        }
+    return(ahead);
+    }
+
+
+static void bmpmupdf_ahead_stop(void)
+
+    {
+    static char *funcname="bmpmupdf_ahead_stop";
+    BMPMUPDF_AHEAD *ahead;
+    int i;
+
+    ahead=bmpmupdf_ahead;
+    if (ahead==NULL)
+        return;
+    bmpahead_pool_stop(ahead->pool);
+    for (i=0;i<ahead->npages;i++)
+        bmpmupdf_text_free(&ahead->pagetext[i]);
+    willus_mem_free((double **)&ahead->pagetext,funcname);
+    willus_mem_free((double **)&ahead,funcname);
+    bmpmupdf_ahead=NULL;
+    }
+
+
+/*
+** Hand the page rendered ahead of time over to bmp, waiting for it if
+** it is being rendered.  Returns 0 if bmp was filled, 1 if the caller
+** should render the page itself (see bmpahead_pool_take()).
+*/
+static int bmpmupdf_ahead_take(WILLUSBITMAP *bmp,char *filename,int pageno,double dpi,
+                               int bpp,double *clip)
+
+    {
+    BMPMUPDF_AHEAD *ahead;
+    double clip0[8];
+
+    ahead=bmpmupdf_ahead;
+    bmpmupdf_clip_copy(clip0,clip);
+    if (ahead==NULL || strcmp(ahead->filename,filename) || ahead->dpi!=dpi
+                    || ahead->bpp!=bpp || memcmp(ahead->clip,clip0,sizeof(clip0)))
+        return(1);
+    return(bmpahead_pool_take(ahead->pool,bmp,NULL,pageno,NULL));
+    }
+
+
+/*
+** Runs on the bmpmupdf_ahead_start() thread:  bmpmupdf_ctx is only used there.
+*/
+static void *bmpmupdf_ahead_worker_start(void *user)
+
+    {
+    static char *funcname="bmpmupdf_ahead_worker_start";
+    BMPMUPDF_AHEAD_WORKER *worker;
+
+    willus_mem_alloc_warn((void **)&worker,sizeof(BMPMUPDF_AHEAD_WORKER),funcname,10);
+    worker->ctx=fz_clone_context(bmpmupdf_ctx);
+    worker->doc=NULL;
+    worker->opened=0;
+    if (worker->ctx==NULL)
+        willus_mem_free((double **)&worker,funcname);
+    return(worker);
+    }
+
+
+static int bmpmupdf_ahead_render(BMPAHEAD_ITEM *item,void *worker,void *user)
+
+    {
+    BMPMUPDF_AHEAD_WORKER *w;
+    BMPMUPDF_AHEAD *ahead;
+
+    w=(BMPMUPDF_AHEAD_WORKER *)worker;
+    ahead=(BMPMUPDF_AHEAD *)user;
+    /* bmpmupdf_map does not change while the threads are running */
+    if (!w->opened)
+        {
+        w->doc=bmpmupdf_open_document(w->ctx,ahead->filename);
+        w->opened=1;
+        }
+    if (w->doc==NULL)
+        return(-1);
+    return(bmpmupdf_render_page(&item->bmp,w->ctx,w->doc,item->pageno,ahead->dpi,ahead->bpp,
+                                ahead->clip,ahead->text ? &ahead->pagetext[item->index] : NULL));
+    }
+
+
+static void bmpmupdf_ahead_worker_end(void *worker,void *user)
+
+    {
+    static char *funcname="bmpmupdf_ahead_worker_end";
+    BMPMUPDF_AHEAD_WORKER *w;
+
+    w=(BMPMUPDF_AHEAD_WORKER *)worker;
+    if (w->doc!=NULL)
+        fz_drop_document(w->ctx,w->doc);
+    fz_flush_warnings(w->ctx);
+    fz_drop_context(w->ctx);
+    willus_mem_free((double **)&w,funcname);
+    }
+
+
+static void bmpmupdf_ahead_drop(BMPAHEAD_ITEM *item,void *user)
+
+    {
+    ((BMPMUPDF_AHEAD *)user)->pagetext[item->index].pageno=0;
+    }
+
+
+/*
+** The text of the page taken becomes the text of the page rendered last.
+*/
+static void bmpmupdf_ahead_take_text(BMPAHEAD_ITEM *item,void *user)
+
+    {
+    BMPMUPDF_TEXT *pagetext;
+
+    pagetext=&((BMPMUPDF_AHEAD *)user)->pagetext[item->index];
+    if (pagetext->pageno>0)
+        {
+        BMPMUPDF_TEXT text;
+
+        text=bmpmupdf_text;
+        bmpmupdf_text=(*pagetext);
+        (*pagetext)=text;
+        }
+    }
+
+
+static fz_locks_context *bmpmupdf_locks(void)
+
+    {
+    static pthread_mutex_t mutex[FZ_LOCK_MAX];
+    static fz_locks_context locks;
+    static int inited=0;
+    int i;
+
+    if (!inited)
+        {
+        for (i=0;i<FZ_LOCK_MAX;i++)
+            pthread_mutex_init(&mutex[i],NULL);
+        locks.user=mutex;
+        locks.lock=bmpmupdf_lock;
+        locks.unlock=bmpmupdf_unlock;
+        inited=1;
+        }
+    return(&locks);
+    }
+
+
+static void bmpmupdf_lock(void *user,int lock)
+
+    {
+    pthread_mutex_lock(&((pthread_mutex_t *)user)[lock]);
+    }
+
+
+static void bmpmupdf_unlock(void *user,int lock)
+
+    {
+    pthread_mutex_unlock(&((pthread_mutex_t *)user)[lock]);
+    }
+
+
+int bmpmupdf_pdffile_to_bmp(WILLUSBITMAP *bmp,char *filename,int pageno,double dpi,
+                            int bpp)
+
+    {
+    return(bmpmupdf_pdffile_to_bmp_ex(bmp,filename,pageno,dpi,bpp,NULL));
+    }
+
+
+/*
+** Only the part of the page inside clip[] is drawn--the rest of bmp is
+** left white.  clip[0..3] are the left, top, right and bottom margins in
+** pixels and clip[4..7] add to those a fraction of the bitmap width (left
+** and right) or height (top and bottom).  The drawn area is a pixel
+** larger on each side than the margins ask for so that rounding never
+** clips into the kept area.  clip==NULL draws the whole page.
+*/
+int bmpmupdf_pdffile_to_bmp_ex(WILLUSBITMAP *bmp,char *filename,int pageno,double dpi,
+                               int bpp,double *clip)
+
+    {
+    int status;
+
+    if (pageno<1)
+        return(-99);
+    if (!bmpmupdf_ahead_take(bmp,filename,pageno,dpi,bpp,clip))
+        return(0);
+    status=bmpmupdf_open(filename);
+    if (status<0)
+        return(status);
+    status=bmpmupdf_render_page(bmp,bmpmupdf_ctx,bmpmupdf_doc,pageno,dpi,bpp,clip,
+                                bmpmupdf_text_wanted ? &bmpmupdf_text : NULL);
+    if (status==-2)
+        bmpmupdf_close();
+    return(status);
+    }
+
+
+/*
+** Render page pageno (starts at 1) of doc.  Called both for the open
+** document and by the bmpmupdf_render_ahead() threads, each on its own
+** context and document.
+**
+** The pixmap has no alpha channel and, if bmp is a native bitmap, uses
+** the bitmap pixels as its samples, so that mupdf draws straight into bmp.
+** If text!=NULL, the page text is extracted from the same display list.
+*/
+static int bmpmupdf_render_page(WILLUSBITMAP *bmp,fz_context *ctx,fz_document *doc,
+                                int pageno,double dpi,int bpp,double *clip,
+                                BMPMUPDF_TEXT *text)
+
+    {
+    fz_colorspace *colorspace;
+    fz_display_list *list;
+    fz_device *dev;
+    fz_pixmap *pix;
+    double dpp;
+    fz_rect bounds,bounds2;
+    fz_matrix ctm,identity;
+    fz_irect bbox,clipbox;
+    int i,status,direct;
+
     dev=NULL;
+    colorspace=(bpp==8 ? fz_device_gray(ctx) : fz_device_rgb(ctx));
+    status=bmpmupdf_page_list(ctx,doc,pageno,&list,&bounds);
+    if (status<0)
+        return(status);
     dpp=dpi/72.;
     pix=NULL;
     fz_var(pix);
@@ -123,25 +573,29 @@ int bmpmupdf_pdffile_to_bmp(WILLUSBITMAP *bmp,char *filename,int pageno,double d
 //    ctm=fz_concat(ctm,fz_rotate(rotation));
     bounds2=fz_transform_rect(bounds,ctm);
     bbox=fz_round_rect(bounds2);
-//    ctm=fz_translate(0,-page->mediabox.y1);
-//    ctm=fz_concat(ctm,fz_scale(dpp,-dpp));
-//    ctm=fz_concat(ctm,fz_rotate(page->rotate));
-//    ctm=fz_concat(ctm,fz_rotate(0));
-//    bbox=fz_round_rect(fz_transform_rect(ctm,page->mediabox));
-//    pix=fz_new_pixmap_with_rect(colorspace,bbox);
+    clipbox=bmpmupdf_clip_bbox(bbox,clip);
+    bmp->width=bbox.x1-bbox.x0;
+    bmp->height=bbox.y1-bbox.y0;
+    bmp->bpp=bpp;
+    bmp_alloc(bmp);
+    if (bpp==8)
+        for (i=0;i<256;i++)
+            bmp->red[i]=bmp->green[i]=bmp->blue[i]=i;
+    direct=(bmp->type==WILLUSBITMAP_TYPE_NATIVE);
     fz_try(ctx)
         {
-        pix=fz_new_pixmap_with_bbox(ctx,colorspace,bbox,NULL,1);
-        fz_clear_pixmap_with_value(ctx,pix,255);
-        dev=fz_new_draw_device(ctx,identity,pix);
-        if (list)
-            fz_run_display_list(ctx,list,dev,ctm,bounds2,NULL);
+        if (direct)
+            pix=fz_new_pixmap_with_bbox_and_data(ctx,colorspace,bbox,NULL,0,bmp->data);
         else
-            fz_run_page(ctx,page,dev,ctm,NULL);
+            pix=fz_new_pixmap_with_bbox(ctx,colorspace,bbox,NULL,0);
+        fz_clear_pixmap_with_value(ctx,pix,255);
+        dev=fz_new_draw_device_with_bbox(ctx,identity,pix,&clipbox);
+        fz_run_display_list(ctx,list,dev,ctm,fz_rect_from_irect(clipbox),NULL);
         fz_close_device(ctx,dev);
         fz_drop_device(ctx,dev);
         dev=NULL;
-        status=bmpmupdf_pixmap_to_bmp(bmp,ctx,pix);
+        if (!direct)
+            bmpmupdf_pixmap_to_bmp(bmp,ctx,pix);
         fz_drop_pixmap(ctx,pix);
         }
     fz_catch(ctx)
@@ -150,31 +604,208 @@ int bmpmupdf_pdffile_to_bmp(WILLUSBITMAP *bmp,char *filename,int pageno,double d
         fz_drop_device(ctx,dev);
         fz_drop_pixmap(ctx,pix);
         fz_drop_display_list(ctx,list);
-        fz_drop_page(ctx,page);
-        fz_drop_document(ctx,doc);
-        fz_drop_context(ctx);
         return(-5);
         }
-    if (list)
-        fz_drop_display_list(ctx,list);
-    fz_drop_page(ctx,page);
-//    pdf_free_xref(xref);
-    fz_drop_document(ctx,doc);
+    if (text!=NULL)
+        bmpmupdf_text_extract(text,ctx,list,bounds,pageno);
+    fz_drop_display_list(ctx,list);
     fz_flush_warnings(ctx);
-    } /* fz_catch before registering handlers */
-    fz_catch(ctx) /* Error registering */
+    return(0);
+    }
+
+
+/*
+** Interpret page pageno (starts at 1) of doc into a display list, which
+** the caller drops.  Returns 0 or bmpmupdf_pdffile_to_bmp() error status.
+*/
+static int bmpmupdf_page_list(fz_context *ctx,fz_document *doc,int pageno,
+                              fz_display_list **list,fz_rect *bounds)
+
     {
-    status = -10;
+    fz_page *page;
+    fz_device *dev;
+    int np;
+
+    dev=NULL;
+    (*list)=NULL;
+    np=0;
+    fz_try(ctx) { np=fz_count_pages(ctx,doc); }
+    fz_catch(ctx)
+        {
+        return(-2);
+        }
+    if (pageno>np)
+        return(-99);
+    fz_try(ctx) { page = fz_load_page(ctx,doc,pageno-1); }
+    fz_catch(ctx) 
+        {
+        return(-3);
+        }
+    (*bounds)=fz_bound_page(ctx,page);
+    fz_try(ctx) { (*list)=fz_new_display_list(ctx,(*bounds));
+                  dev=fz_new_list_device(ctx,(*list));
+                  fz_run_page(ctx,page,dev,fz_identity,NULL);
+                }
+    fz_catch(ctx)
+        {
+        fz_close_device(ctx,dev);
+        fz_drop_device(ctx,dev);
+        fz_drop_display_list(ctx,(*list));
+        fz_drop_page(ctx,page);
+        return(-4);
+        }
+    fz_close_device(ctx,dev);
+    fz_drop_device(ctx,dev);
+    fz_drop_page(ctx,page);
+    return(0);
     }
-    fz_drop_context(ctx);
-//    fz_free_glyph_cache(glyphcache);
-//    fz_flush_warnings();
+
+
+/*
+** Add the text of page pageno of filename to wtc, as wtextchars_fill_from_page_ex()
+** does.  The text comes from the page rendered last if that is pageno;
+** otherwise the page is interpreted here, and from now on the text of each
+** page is extracted as the page is rendered.
+**
+** Only for the document that is open already (or when none is), so that
+** the renders of that document are not disturbed.  Returns 0 if wtc was
+** filled, < 0 if the caller has to extract the text itself.
+*/
+int bmpmupdf_page_text(WTEXTCHARS *wtc,char *filename,int pageno,int boundingbox)
+
+    {
+    int status;
+
+    if (pageno<1)
+        return(-99);
+    if (bmpmupdf_doc!=NULL && strcmp(bmpmupdf_docname,filename))
+        return(-1);
+    status=bmpmupdf_open(filename);
     if (status<0)
-        return(status-10);
+        return(status);
+    if (bmpmupdf_text.pageno!=pageno)
+        {
+        fz_display_list *list;
+        fz_rect bounds;
+
+        status=bmpmupdf_page_list(bmpmupdf_ctx,bmpmupdf_doc,pageno,&list,&bounds);
+        if (status<0)
+            return(status);
+        bmpmupdf_text_extract(&bmpmupdf_text,bmpmupdf_ctx,list,bounds,pageno);
+        fz_drop_display_list(bmpmupdf_ctx,list);
+        fz_flush_warnings(bmpmupdf_ctx);
+        if (bmpmupdf_text.pageno!=pageno)
+            return(-5);
+        }
+    bmpmupdf_text_wanted=1;
+    wtextchars_append(wtc,boundingbox ? &bmpmupdf_text.box : &bmpmupdf_text.wtc);
     return(0);
     }
 
 
+static void bmpmupdf_text_init(BMPMUPDF_TEXT *text)
+
+    {
+    text->pageno=0;
+    wtextchars_init(&text->wtc);
+    wtextchars_init(&text->box);
+    }
+
+
+static void bmpmupdf_text_free(BMPMUPDF_TEXT *text)
+
+    {
+    text->pageno=0;
+    wtextchars_free(&text->box);
+    wtextchars_free(&text->wtc);
+    }
+
+
+static void bmpmupdf_text_extract(BMPMUPDF_TEXT *text,fz_context *ctx,fz_display_list *list,
+                                  fz_rect bounds,int pageno)
+
+    {
+    fz_stext_page *stext;
+
+    text->pageno=0;
+    wtextchars_clear(&text->wtc);
+    wtextchars_clear(&text->box);
+    /* Mupdf v1.14:  bounds.y1 > bounds.y0 */
+    text->wtc.width=text->box.width=fabs(bounds.x1-bounds.x0);
+    text->wtc.height=text->box.height=fabs(bounds.y1-bounds.y0);
+    stext=NULL;
+    fz_var(stext);
+    fz_try(ctx)
+        {
+        /* Do not preserve ligatures or white space */
+        stext=fz_new_stext_page_from_display_list(ctx,list,NULL);
+        wtextchars_add_fz_chars(&text->wtc,ctx,stext,0);
+        wtextchars_add_fz_chars(&text->box,ctx,stext,1);
+        text->pageno=pageno;
+        }
+    fz_always(ctx)
+        {
+        fz_drop_stext_page(ctx,stext);
+        }
+    fz_catch(ctx)
+        {
+        text->pageno=0;
+        }
+    }
+
+
+static void wtextchars_append(WTEXTCHARS *dst,WTEXTCHARS *src)
+
+    {
+    int i;
+
+    dst->width=src->width;
+    dst->height=src->height;
+    for (i=0;i<src->n;i++)
+        wtextchars_add_wtextchar(dst,&src->wtextchar[i]);
+    }
+
+
+/*
+** The device area of bbox that bmpmupdf_render_page() draws for the clip
+** margins (see bmpmupdf_pdffile_to_bmp_ex()).
+*/
+static fz_irect bmpmupdf_clip_bbox(fz_irect bbox,double *clip)
+
+    {
+    fz_irect clipbox;
+    double m[4];
+    int i;
+
+    if (clip==NULL)
+        return(bbox);
+    for (i=0;i<4;i++)
+        {
+        m[i]=floor(clip[i]+clip[i+4]*((i&1) ? bbox.y1-bbox.y0 : bbox.x1-bbox.x0))-1.;
+        if (m[i]<0.)
+            m[i]=0.;
+        }
+    clipbox.x0=bbox.x0+(int)m[0];
+    clipbox.y0=bbox.y0+(int)m[1];
+    clipbox.x1=bbox.x1-(int)m[2];
+    clipbox.y1=bbox.y1-(int)m[3];
+    return(fz_intersect_irect(clipbox,bbox));
+    }
+
+
+/*
+** Clip margins as kept by bmpmupdf_render_ahead():  no clip is all zeros.
+*/
+static void bmpmupdf_clip_copy(double *dst,double *clip)
+
+    {
+    if (clip==NULL)
+        memset(dst,0,8*sizeof(double));
+    else
+        memcpy(dst,clip,8*sizeof(double));
+    }
+
+
 void wmupdf_cbzinfo_get(char *filename,int *pagelist,char **buf0)
 
     {
@@ -265,126 +896,55 @@ int bmpmupdf_pdffile_width_and_height(char *filename,int pageno,double *width_in
     fz_context *ctx;
     fz_document *doc;
     fz_page *page;
-    fz_display_list *list;
-    fz_device *dev;
     fz_rect bounds;
-    int np;
+    int np,status;
 
-    dev=NULL;
-    list=NULL;
     page=NULL;
-    doc=NULL;
     if (pageno<1)
         return(-99);
-    ctx = fz_new_context(NULL,NULL,FZ_STORE_DEFAULT);
-    if (!ctx)
-        return(-1);
-    fz_try(ctx)
-    {
-    fz_register_document_handlers(ctx);
-    fz_set_aa_level(ctx,8);
-    /* Sumatra version of MuPDF v1.4 -- use locally installed fonts */
-    pdf_install_load_system_font_funcs(ctx);
-    fz_try(ctx) { doc=fz_open_document(ctx,filename); }
-    fz_catch(ctx) 
-        { 
-        fz_drop_context(ctx);
-        return(-1);
+    status=bmpmupdf_open(filename);
+    if (status<0)
+        return(status);
+    ctx=bmpmupdf_ctx;
+    doc=bmpmupdf_doc;
+    np=0;
+    fz_try(ctx) { np=fz_count_pages(ctx,doc); }
+    fz_catch(ctx)
+        {
+        bmpmupdf_close();
+        return(-2);
         }
-    np=fz_count_pages(ctx,doc);
     if (pageno>np)
         return(-99);
     fz_try(ctx) { page = fz_load_page(ctx,doc,pageno-1); }
     fz_catch(ctx) 
         {
-        fz_drop_document(ctx,doc);
-        fz_drop_context(ctx);
         return(-3);
         }
     bounds=fz_bound_page(ctx,page);
-    fz_try(ctx) { list=fz_new_display_list(ctx,bounds);
-                  dev=fz_new_list_device(ctx,list);
-                  fz_run_page(ctx,page,dev,fz_identity,NULL);
-                }
-    fz_catch(ctx)
-        {
-        fz_close_device(ctx,dev);
-        fz_drop_device(ctx,dev);
-        fz_drop_display_list(ctx,list);
-        fz_drop_page(ctx,page);
-        fz_drop_document(ctx,doc);
-        fz_drop_context(ctx);
-        return(-4);
-        }
-    fz_close_device(ctx,dev);
-    fz_drop_device(ctx,dev);
-    dev=NULL;
     if (width_in!=NULL)
         (*width_in)=fabs(bounds.x1-bounds.x0)/72.;
     if (height_in!=NULL)
         (*height_in)=fabs(bounds.y1-bounds.y0)/72.;
-    fz_drop_display_list(ctx,list);
     fz_drop_page(ctx,page);
-    fz_drop_document(ctx,doc);
-    } 
-    fz_catch(ctx) /* Error registering */
-    {
-    fz_drop_context(ctx);
-    return(-20);
-    }
-    fz_drop_context(ctx);
     return(0);
     }
 
 
-static int bmpmupdf_pixmap_to_bmp(WILLUSBITMAP *bmp,fz_context *ctx,fz_pixmap *pixmap)
+/*
+** Copy an alpha-free grey or RGB pixmap into bmp, which has been allocated
+** to its size (for bitmaps that mupdf cannot draw into directly).
+*/
+static void bmpmupdf_pixmap_to_bmp(WILLUSBITMAP *bmp,fz_context *ctx,fz_pixmap *pixmap)
 
     {
-	unsigned char *p;
-	int ncomp,i,row,col;
+    unsigned char *p;
+    int row,stride,bw;
 
-    bmp->width=fz_pixmap_width(ctx,pixmap);
-    bmp->height=fz_pixmap_height(ctx,pixmap);
-    ncomp=fz_pixmap_components(ctx,pixmap);
-    /* Has to be 8-bit or RGB */
-	if (ncomp != 2 && ncomp != 4)
-		return(-1);
-    bmp->bpp=(ncomp==2) ? 8 : 24;
-    bmp_alloc(bmp);
-    if (ncomp==2)
-        {
-        for (i=0;i<256;i++)
-            bmp->red[i]=bmp->green[i]=bmp->blue[i]=i;
-        }
-	p = fz_pixmap_samples(ctx,pixmap);
-    if (ncomp==1)
-        for (row=0;row<bmp->height;row++)
-            {
-            unsigned char *dest;
-            dest=bmp_rowptr_from_top(bmp,row);
-            memcpy(dest,p,bmp->width);
-            p+=bmp->width;
-            }
-    else if (ncomp==2)
-        {
-        for (row=0;row<bmp->height;row++)
-            {
-            unsigned char *dest;
-            dest=bmp_rowptr_from_top(bmp,row);
-            for (col=0;col<bmp->width;col++,dest++,p+=2)
-                dest[0]=p[0];
-            }
-        }
-    else
-        {
-        for (row=0;row<bmp->height;row++)
-            {
-            unsigned char *dest;
-            dest=bmp_rowptr_from_top(bmp,row);
-            for (col=0;col<bmp->width;col++,dest+=ncomp-1,p+=ncomp)
-                memcpy(dest,p,ncomp-1);
-            }
-        }
-	return(0);
+    p=fz_pixmap_samples(ctx,pixmap);
+    stride=fz_pixmap_stride(ctx,pixmap);
+    bw=bmp->width*(bmp->bpp>>3);
+    for (row=0;row<bmp->height;row++,p+=stride)
+        memcpy(bmp_rowptr_from_top(bmp,row),p,bw);
     }
 #endif /* HAVE_MUPDF_LIB */
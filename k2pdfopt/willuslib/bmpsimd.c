@@ -0,0 +1,695 @@
+/*
+** bmpsimd.c    Vectorized pixel format conversions for bitmap ingestion,
+**              dark pixel counts and resampling, with the instruction set
+**              chosen at run time.
+**
+** Part of willus.com general purpose C code library.
+**
+** Copyright (C) 2020  http://willus.com
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU Affero General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+*/
+#include "willus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+#define BMPSIMD_X86
+#include <immintrin.h>
+#endif
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define BMPSIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+** bmpsimd_dark_counts() works on blocks of up to this many columns and
+** 255 rows, so that each column's count fits in a byte.
+*/
+#define BMPSIMD_DARK_COLS 256
+
+static void ga_to_grey_c(unsigned char *dst,unsigned char *src,int n);
+static void rgba_to_rgb_c(unsigned char *dst,unsigned char *src,int n);
+static int dark_row_c(unsigned char *acc,unsigned char *p,int n,int maxval);
+static void weighted_rows_c(short *dst,unsigned char **src,int *weight,int nrows,int i,int n);
+static void add_bytes_c(unsigned short *sum,unsigned char *p,int n);
+#ifdef BMPSIMD_X86
+static int ga_to_grey_sse2(unsigned char *dst,unsigned char *src,int n);
+static int ga_to_grey_avx2(unsigned char *dst,unsigned char *src,int n);
+static int rgba_to_rgb_ssse3(unsigned char *dst,unsigned char *src,int n);
+static int dark_row_sse2(unsigned char *acc,unsigned char *p,int n,int maxval,int *count);
+static int dark_row_avx2(unsigned char *acc,unsigned char *p,int n,int maxval,int *count);
+static int weighted_rows_sse2(short *dst,unsigned char **src,int *weight,int nrows,int n);
+static int weighted_rows_avx2(short *dst,unsigned char **src,int *weight,int nrows,int n);
+static int add_bytes_sse2(unsigned short *sum,unsigned char *p,int n);
+static int add_bytes_avx2(unsigned short *sum,unsigned char *p,int n);
+#endif
+#ifdef BMPSIMD_NEON
+static int ga_to_grey_neon(unsigned char *dst,unsigned char *src,int n);
+static int rgba_to_rgb_neon(unsigned char *dst,unsigned char *src,int n);
+static int dark_row_neon(unsigned char *acc,unsigned char *p,int n,int maxval,int *count);
+static int weighted_rows_neon(short *dst,unsigned char **src,int *weight,int nrows,int n);
+static int add_bytes_neon(unsigned short *sum,unsigned char *p,int n);
+#endif
+
+
+/*
+** Vector kernels for this CPU, chosen once by bmpsimd_select() before
+** their first use.  Each does a leading part of the job and returns how
+** many items it did; the C code does the rest.  Kernels the CPU cannot
+** run are left pointing to ones that do nothing.
+*/
+typedef int (*BMPSIMD_CONVERT)(unsigned char *dst,unsigned char *src,int n);
+typedef int (*BMPSIMD_DARKROW)(unsigned char *acc,unsigned char *p,int n,int maxval,int *count);
+typedef int (*BMPSIMD_WEIGHTED)(short *dst,unsigned char **src,int *weight,int nrows,int n);
+typedef int (*BMPSIMD_ADD)(unsigned short *sum,unsigned char *p,int n);
+
+static int convert_none(unsigned char *dst,unsigned char *src,int n);
+static int dark_row_none(unsigned char *acc,unsigned char *p,int n,int maxval,int *count);
+static int weighted_rows_none(short *dst,unsigned char **src,int *weight,int nrows,int n);
+static int add_bytes_none(unsigned short *sum,unsigned char *p,int n);
+static void bmpsimd_select(void);
+
+static pthread_once_t bmpsimd_once=PTHREAD_ONCE_INIT;
+static BMPSIMD_CONVERT  ga_to_grey_simd=convert_none;
+static BMPSIMD_CONVERT  rgba_to_rgb_simd=convert_none;
+static BMPSIMD_DARKROW  dark_row_simd=dark_row_none;
+static BMPSIMD_WEIGHTED weighted_rows_simd=weighted_rows_none;
+static BMPSIMD_ADD      add_bytes_simd=add_bytes_none;
+
+
+/*
+** dst[i] = src[2*i], i=0..n-1 (grey + alpha pixels to grey).
+*/
+void bmpsimd_ga_to_grey(unsigned char *dst,unsigned char *src,int n)
+
+    {
+    int i;
+
+    pthread_once(&bmpsimd_once,bmpsimd_select);
+    i=(*ga_to_grey_simd)(dst,src,n);
+    ga_to_grey_c(&dst[i],&src[2*i],n-i);
+    }
+
+
+/*
+** dst[3*i+k] = src[4*i+k], k=0..2, i=0..n-1 (RGBA pixels to RGB).
+*/
+void bmpsimd_rgba_to_rgb(unsigned char *dst,unsigned char *src,int n)
+
+    {
+    int i;
+
+    pthread_once(&bmpsimd_once,bmpsimd_select);
+    i=(*rgba_to_rgb_simd)(dst,src,n);
+    rgba_to_rgb_c(&dst[3*i],&src[4*i],n-i);
+    }
+
+
+/*
+** Count the pixels darker than thresh (p[] < thresh) in the nr x nc block
+** of 8-bit pixels at p, whose rows are bw bytes apart:  rowcount[j] and
+** colcount[i] are incremented by the counts of row j and column i.  Either
+** may be NULL.
+*/
+void bmpsimd_dark_counts(int *rowcount,int *colcount,unsigned char *p,int bw,
+                         int nr,int nc,int thresh)
+
+    {
+    unsigned char acc[BMPSIMD_DARK_COLS];
+    int c0,r0,maxval;
+
+    if (thresh<=0)
+        return;
+    /* p[] < thresh is p[] <= maxval */
+    maxval = thresh>256 ? 255 : thresh-1;
+    pthread_once(&bmpsimd_once,bmpsimd_select);
+    for (c0=0;c0<nc;c0+=BMPSIMD_DARK_COLS)
+        {
+        int n;
+
+        n = nc-c0 < BMPSIMD_DARK_COLS ? nc-c0 : BMPSIMD_DARK_COLS;
+        for (r0=0;r0<nr;r0+=255)
+            {
+            int i,j,m;
+
+            m = nr-r0 < 255 ? nr-r0 : 255;
+            memset(acc,0,n);
+            for (j=0;j<m;j++)
+                {
+                unsigned char *row;
+                int count;
+
+                row=&p[(size_t)(r0+j)*bw+c0];
+                count=0;
+                i=(*dark_row_simd)(acc,row,n,maxval,&count);
+                count += dark_row_c(&acc[i],&row[i],n-i,maxval);
+                if (rowcount!=NULL)
+                    rowcount[r0+j] += count;
+                }
+            if (colcount!=NULL)
+                for (i=0;i<n;i++)
+                    colcount[c0+i] += acc[i];
+            }
+        }
+    }
+
+
+/*
+** dst[i] = sum over k of weight[k]*src[k][i], i=0..n-1, k=0..nrows-1, with
+** the weights in units of 1/16384 and the result in units of 1/128:
+** the weights must add up to at most 16384.  (Vertical pass of
+** bmp_resample().)
+*/
+void bmpsimd_weighted_rows(short *dst,unsigned char **src,int *weight,int nrows,int n)
+
+    {
+    int i;
+
+    pthread_once(&bmpsimd_once,bmpsimd_select);
+    i=(*weighted_rows_simd)(dst,src,weight,nrows,n);
+    weighted_rows_c(dst,src,weight,nrows,i,n);
+    }
+
+
+/*
+** sum[i] += p[i], i=0..n-1.  (Column tallies of bmp_autostraighten().)
+*/
+void bmpsimd_add_bytes(unsigned short *sum,unsigned char *p,int n)
+
+    {
+    int i;
+
+    pthread_once(&bmpsimd_once,bmpsimd_select);
+    i=(*add_bytes_simd)(sum,p,n);
+    add_bytes_c(&sum[i],&p[i],n-i);
+    }
+
+
+/*
+** Query the CPU and point the kernels at the best versions it runs.
+** Only called through pthread_once(), so the pointers are written once
+** and every thread sees them before it uses them.
+*/
+static void bmpsimd_select(void)
+
+    {
+    int cpu;
+
+    cpu=wsys_cpu_features();
+#ifdef BMPSIMD_X86
+    if (cpu & WSYS_CPU_AVX2)
+        {
+        ga_to_grey_simd=ga_to_grey_avx2;
+        dark_row_simd=dark_row_avx2;
+        weighted_rows_simd=weighted_rows_avx2;
+        add_bytes_simd=add_bytes_avx2;
+        }
+    else if (cpu & WSYS_CPU_SSE2)
+        {
+        ga_to_grey_simd=ga_to_grey_sse2;
+        dark_row_simd=dark_row_sse2;
+        weighted_rows_simd=weighted_rows_sse2;
+        add_bytes_simd=add_bytes_sse2;
+        }
+    if (cpu & WSYS_CPU_SSSE3)
+        rgba_to_rgb_simd=rgba_to_rgb_ssse3;
+#endif
+#ifdef BMPSIMD_NEON
+    if (cpu & WSYS_CPU_NEON)
+        {
+        ga_to_grey_simd=ga_to_grey_neon;
+        rgba_to_rgb_simd=rgba_to_rgb_neon;
+        dark_row_simd=dark_row_neon;
+        weighted_rows_simd=weighted_rows_neon;
+        add_bytes_simd=add_bytes_neon;
+        }
+#endif
+    }
+
+
+static int convert_none(unsigned char *dst,unsigned char *src,int n)
+
+    {
+    return(0);
+    }
+
+
+static int dark_row_none(unsigned char *acc,unsigned char *p,int n,int maxval,int *count)
+
+    {
+    return(0);
+    }
+
+
+static int weighted_rows_none(short *dst,unsigned char **src,int *weight,int nrows,int n)
+
+    {
+    return(0);
+    }
+
+
+static int add_bytes_none(unsigned short *sum,unsigned char *p,int n)
+
+    {
+    return(0);
+    }
+
+
+static void ga_to_grey_c(unsigned char *dst,unsigned char *src,int n)
+
+    {
+    int i;
+
+    for (i=0;i<n;i++)
+        dst[i]=src[2*i];
+    }
+
+
+static void rgba_to_rgb_c(unsigned char *dst,unsigned char *src,int n)
+
+    {
+    int i;
+
+    for (i=0;i<n;i++,dst+=3,src+=4)
+        {
+        dst[0]=src[0];
+        dst[1]=src[1];
+        dst[2]=src[2];
+        }
+    }
+
+
+/*
+** acc[i] += (p[i] <= maxval), i=0..n-1.  Returns the number of such p[i].
+*/
+static int dark_row_c(unsigned char *acc,unsigned char *p,int n,int maxval)
+
+    {
+    int i,c;
+
+    for (c=i=0;i<n;i++)
+        if (p[i]<=maxval)
+            {
+            acc[i]++;
+            c++;
+            }
+    return(c);
+    }
+
+
+static void weighted_rows_c(short *dst,unsigned char **src,int *weight,int nrows,int i,int n)
+
+    {
+    for (;i<n;i++)
+        {
+        int k,sum;
+
+        for (sum=64,k=0;k<nrows;k++)
+            sum += weight[k]*src[k][i];
+        dst[i]=sum>>7;
+        }
+    }
+
+
+static void add_bytes_c(unsigned short *sum,unsigned char *p,int n)
+
+    {
+    int i;
+
+    for (i=0;i<n;i++)
+        sum[i]+=p[i];
+    }
+
+
+/*
+** The vector kernels below convert (or count) as many leading pixels as
+** suits them and return that count.  The caller finishes the rest in C.
+*/
+#ifdef BMPSIMD_X86
+__attribute__((target("sse2")))
+static int ga_to_grey_sse2(unsigned char *dst,unsigned char *src,int n)
+
+    {
+    __m128i mask;
+    int i;
+
+    mask=_mm_set1_epi16(0xff);
+    for (i=0;i+16<=n;i+=16)
+        {
+        __m128i a,b;
+
+        a=_mm_and_si128(_mm_loadu_si128((__m128i *)&src[2*i]),mask);
+        b=_mm_and_si128(_mm_loadu_si128((__m128i *)&src[2*i+16]),mask);
+        _mm_storeu_si128((__m128i *)&dst[i],_mm_packus_epi16(a,b));
+        }
+    return(i);
+    }
+
+
+__attribute__((target("avx2")))
+static int ga_to_grey_avx2(unsigned char *dst,unsigned char *src,int n)
+
+    {
+    __m256i mask;
+    int i;
+
+    mask=_mm256_set1_epi16(0xff);
+    for (i=0;i+32<=n;i+=32)
+        {
+        __m256i a,b;
+
+        a=_mm256_and_si256(_mm256_loadu_si256((__m256i *)&src[2*i]),mask);
+        b=_mm256_and_si256(_mm256_loadu_si256((__m256i *)&src[2*i+32]),mask);
+        /* packus works per 128-bit lane:  put the quarters back in order */
+        _mm256_storeu_si256((__m256i *)&dst[i],
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(a,b),0xd8));
+        }
+    return(i);
+    }
+
+
+/*
+** Each 16-byte store writes 4 bytes past the 12 it converts, so stop
+** while there are still at least 2 pixels (6 bytes) left after them.
+*/
+__attribute__((target("ssse3")))
+static int rgba_to_rgb_ssse3(unsigned char *dst,unsigned char *src,int n)
+
+    {
+    __m128i shuf;
+    int i;
+
+    shuf=_mm_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+    for (i=0;i+6<=n;i+=4)
+        _mm_storeu_si128((__m128i *)&dst[3*i],
+                         _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)&src[4*i]),shuf));
+    return(i);
+    }
+
+
+/*
+** Dark pixels are those where min(p,maxval)==p.  The compare gives 0xff
+** for them, so subtracting it counts one.  A lane of the row total sees
+** at most BMPSIMD_DARK_COLS/16 pixels, so it cannot overflow either.
+*/
+__attribute__((target("sse2")))
+static int dark_row_sse2(unsigned char *acc,unsigned char *p,int n,int maxval,int *count)
+
+    {
+    __m128i max,total;
+    int i;
+
+    max=_mm_set1_epi8((char)maxval);
+    total=_mm_setzero_si128();
+    for (i=0;i+16<=n;i+=16)
+        {
+        __m128i a,dark;
+
+        a=_mm_loadu_si128((__m128i *)&p[i]);
+        dark=_mm_cmpeq_epi8(_mm_min_epu8(a,max),a);
+        _mm_storeu_si128((__m128i *)&acc[i],
+                         _mm_sub_epi8(_mm_loadu_si128((__m128i *)&acc[i]),dark));
+        total=_mm_sub_epi8(total,dark);
+        }
+    total=_mm_sad_epu8(total,_mm_setzero_si128());
+    (*count) = _mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_srli_si128(total,8));
+    return(i);
+    }
+
+
+__attribute__((target("avx2")))
+static int dark_row_avx2(unsigned char *acc,unsigned char *p,int n,int maxval,int *count)
+
+    {
+    __m256i max,total;
+    __m128i sum;
+    int i;
+
+    max=_mm256_set1_epi8((char)maxval);
+    total=_mm256_setzero_si256();
+    for (i=0;i+32<=n;i+=32)
+        {
+        __m256i a,dark;
+
+        a=_mm256_loadu_si256((__m256i *)&p[i]);
+        dark=_mm256_cmpeq_epi8(_mm256_min_epu8(a,max),a);
+        _mm256_storeu_si256((__m256i *)&acc[i],
+                            _mm256_sub_epi8(_mm256_loadu_si256((__m256i *)&acc[i]),dark));
+        total=_mm256_sub_epi8(total,dark);
+        }
+    total=_mm256_sad_epu8(total,_mm256_setzero_si256());
+    sum=_mm_add_epi64(_mm256_castsi256_si128(total),_mm256_extracti128_si256(total,1));
+    (*count) = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum,8));
+    return(i);
+    }
+
+
+/*
+** Two rows at a time:  interleaving their bytes and widening them to 16
+** bits gives the pixel pairs that _mm_madd_epi16() multiplies by the
+** weight pair and adds.  The sums stay below 2^22, and below 2^15 once
+** scaled to 1/128 units, so the signed packs do not saturate.
+*/
+__attribute__((target("sse2")))
+static int weighted_rows_sse2(short *dst,unsigned char **src,int *weight,int nrows,int n)
+
+    {
+    __m128i zero,round;
+    int i,k;
+
+    zero=_mm_setzero_si128();
+    round=_mm_set1_epi32(64);
+    for (i=0;i+16<=n;i+=16)
+        {
+        __m128i acc0,acc1,acc2,acc3;
+
+        acc0=acc1=acc2=acc3=round;
+        for (k=0;k<nrows;k+=2)
+            {
+            __m128i a,b,w,lo,hi;
+
+            a=_mm_loadu_si128((__m128i *)&src[k][i]);
+            if (k+1<nrows)
+                {
+                b=_mm_loadu_si128((__m128i *)&src[k+1][i]);
+                w=_mm_set1_epi32((weight[k+1]<<16)|weight[k]);
+                }
+            else
+                {
+                b=zero;
+                w=_mm_set1_epi32(weight[k]);
+                }
+            lo=_mm_unpacklo_epi8(a,b);
+            hi=_mm_unpackhi_epi8(a,b);
+            acc0=_mm_add_epi32(acc0,_mm_madd_epi16(_mm_unpacklo_epi8(lo,zero),w));
+            acc1=_mm_add_epi32(acc1,_mm_madd_epi16(_mm_unpackhi_epi8(lo,zero),w));
+            acc2=_mm_add_epi32(acc2,_mm_madd_epi16(_mm_unpacklo_epi8(hi,zero),w));
+            acc3=_mm_add_epi32(acc3,_mm_madd_epi16(_mm_unpackhi_epi8(hi,zero),w));
+            }
+        _mm_storeu_si128((__m128i *)&dst[i],
+                         _mm_packs_epi32(_mm_srai_epi32(acc0,7),_mm_srai_epi32(acc1,7)));
+        _mm_storeu_si128((__m128i *)&dst[i+8],
+                         _mm_packs_epi32(_mm_srai_epi32(acc2,7),_mm_srai_epi32(acc3,7)));
+        }
+    return(i);
+    }
+
+
+/*
+** As weighted_rows_sse2(), but the unpacks and packs work within 128-bit
+** lanes, so the two halves are put back in order before storing.
+*/
+__attribute__((target("avx2")))
+static int weighted_rows_avx2(short *dst,unsigned char **src,int *weight,int nrows,int n)
+
+    {
+    __m256i zero,round;
+    int i,k;
+
+    zero=_mm256_setzero_si256();
+    round=_mm256_set1_epi32(64);
+    for (i=0;i+32<=n;i+=32)
+        {
+        __m256i acc0,acc1,acc2,acc3,x,y;
+
+        acc0=acc1=acc2=acc3=round;
+        for (k=0;k<nrows;k+=2)
+            {
+            __m256i a,b,w,lo,hi;
+
+            a=_mm256_loadu_si256((__m256i *)&src[k][i]);
+            if (k+1<nrows)
+                {
+                b=_mm256_loadu_si256((__m256i *)&src[k+1][i]);
+                w=_mm256_set1_epi32((weight[k+1]<<16)|weight[k]);
+                }
+            else
+                {
+                b=zero;
+                w=_mm256_set1_epi32(weight[k]);
+                }
+            lo=_mm256_unpacklo_epi8(a,b);
+            hi=_mm256_unpackhi_epi8(a,b);
+            acc0=_mm256_add_epi32(acc0,_mm256_madd_epi16(_mm256_unpacklo_epi8(lo,zero),w));
+            acc1=_mm256_add_epi32(acc1,_mm256_madd_epi16(_mm256_unpackhi_epi8(lo,zero),w));
+            acc2=_mm256_add_epi32(acc2,_mm256_madd_epi16(_mm256_unpacklo_epi8(hi,zero),w));
+            acc3=_mm256_add_epi32(acc3,_mm256_madd_epi16(_mm256_unpackhi_epi8(hi,zero),w));
+            }
+        /* x = pixels 0-7 | 16-23, y = 8-15 | 24-31 */
+        x=_mm256_packs_epi32(_mm256_srai_epi32(acc0,7),_mm256_srai_epi32(acc1,7));
+        y=_mm256_packs_epi32(_mm256_srai_epi32(acc2,7),_mm256_srai_epi32(acc3,7));
+        _mm256_storeu_si256((__m256i *)&dst[i],_mm256_permute2x128_si256(x,y,0x20));
+        _mm256_storeu_si256((__m256i *)&dst[i+16],_mm256_permute2x128_si256(x,y,0x31));
+        }
+    return(i);
+    }
+
+
+__attribute__((target("sse2")))
+static int add_bytes_sse2(unsigned short *sum,unsigned char *p,int n)
+
+    {
+    __m128i zero;
+    int i;
+
+    zero=_mm_setzero_si128();
+    for (i=0;i+16<=n;i+=16)
+        {
+        __m128i a;
+
+        a=_mm_loadu_si128((__m128i *)&p[i]);
+        _mm_storeu_si128((__m128i *)&sum[i],_mm_add_epi16(_mm_loadu_si128((__m128i *)&sum[i]),
+                                                          _mm_unpacklo_epi8(a,zero)));
+        _mm_storeu_si128((__m128i *)&sum[i+8],_mm_add_epi16(_mm_loadu_si128((__m128i *)&sum[i+8]),
+                                                            _mm_unpackhi_epi8(a,zero)));
+        }
+    return(i);
+    }
+
+
+__attribute__((target("avx2")))
+static int add_bytes_avx2(unsigned short *sum,unsigned char *p,int n)
+
+    {
+    int i;
+
+    for (i=0;i+16<=n;i+=16)
+        _mm256_storeu_si256((__m256i *)&sum[i],
+                  _mm256_add_epi16(_mm256_loadu_si256((__m256i *)&sum[i]),
+                                   _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *)&p[i]))));
+    return(i);
+    }
+#endif /* BMPSIMD_X86 */
+
+
+#ifdef BMPSIMD_NEON
+static int ga_to_grey_neon(unsigned char *dst,unsigned char *src,int n)
+
+    {
+    int i;
+
+    for (i=0;i+16<=n;i+=16)
+        vst1q_u8(&dst[i],vld2q_u8(&src[2*i]).val[0]);
+    return(i);
+    }
+
+
+static int rgba_to_rgb_neon(unsigned char *dst,unsigned char *src,int n)
+
+    {
+    int i;
+
+    for (i=0;i+16<=n;i+=16)
+        {
+        uint8x16x4_t rgba;
+        uint8x16x3_t rgb;
+
+        rgba=vld4q_u8(&src[4*i]);
+        rgb.val[0]=rgba.val[0];
+        rgb.val[1]=rgba.val[1];
+        rgb.val[2]=rgba.val[2];
+        vst3q_u8(&dst[3*i],rgb);
+        }
+    return(i);
+    }
+
+
+static int dark_row_neon(unsigned char *acc,unsigned char *p,int n,int maxval,int *count)
+
+    {
+    uint8x16_t max,total;
+    uint64x2_t sum;
+    int i;
+
+    max=vdupq_n_u8((uint8_t)maxval);
+    total=vdupq_n_u8(0);
+    for (i=0;i+16<=n;i+=16)
+        {
+        uint8x16_t dark;
+
+        dark=vcleq_u8(vld1q_u8(&p[i]),max);
+        vst1q_u8(&acc[i],vsubq_u8(vld1q_u8(&acc[i]),dark));
+        total=vsubq_u8(total,dark);
+        }
+    sum=vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(total)));
+    (*count) = (int)(vgetq_lane_u64(sum,0)+vgetq_lane_u64(sum,1));
+    return(i);
+    }
+
+
+static int weighted_rows_neon(short *dst,unsigned char **src,int *weight,int nrows,int n)
+
+    {
+    int i,k;
+
+    for (i=0;i+8<=n;i+=8)
+        {
+        uint32x4_t acc_lo,acc_hi;
+
+        acc_lo=acc_hi=vdupq_n_u32(0);
+        for (k=0;k<nrows;k++)
+            {
+            uint16x8_t a;
+
+            a=vmovl_u8(vld1_u8(&src[k][i]));
+            acc_lo=vmlal_n_u16(acc_lo,vget_low_u16(a),(uint16_t)weight[k]);
+            acc_hi=vmlal_n_u16(acc_hi,vget_high_u16(a),(uint16_t)weight[k]);
+            }
+        vst1q_s16(&dst[i],vreinterpretq_s16_u16(vcombine_u16(vrshrn_n_u32(acc_lo,7),
+                                                              vrshrn_n_u32(acc_hi,7))));
+        }
+    return(i);
+    }
+
+
+static int add_bytes_neon(unsigned short *sum,unsigned char *p,int n)
+
+    {
+    int i;
+
+    for (i=0;i+16<=n;i+=16)
+        {
+        uint8x16_t a;
+
+        a=vld1q_u8(&p[i]);
+        vst1q_u16(&sum[i],vaddw_u8(vld1q_u16(&sum[i]),vget_low_u8(a)));
+        vst1q_u16(&sum[i+8],vaddw_u8(vld1q_u16(&sum[i+8]),vget_high_u8(a)));
+        }
+    return(i);
+    }
+#endif /* BMPSIMD_NEON */
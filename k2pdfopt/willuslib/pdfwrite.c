@@ -298,7 +298,13 @@ static int pdffile_page_reference(PDFFILE *pdf,int pageno);
 static void pdf_utf8_out(FILE *out,char *s);
 static void pdffile_unicode_map(PDFFILE *pdf,WILLUSCHARMAPLIST *cmaplist,int nf);
 static void thumbnail_create(WILLUSBITMAP *thumb,WILLUSBITMAP *bmp);
-static void pdffile_bmp_stream(PDFFILE *pdf,WILLUSBITMAP *bmp,int quality,int halfsize,int thumb);
+static void pdfimagestream_init(PDFIMAGESTREAM *s);
+static void pdfimagestream_free(PDFIMAGESTREAM *s);
+static void pdfimagestream_encode(PDFIMAGESTREAM *s,WILLUSBITMAP *src,int quality,int halfsize,
+                                  int thumb);
+static FILE *pdfimagestream_fopen(PDFIMAGESTREAM *s);
+static void pdfimagestream_fclose(PDFIMAGESTREAM *s,FILE *f);
+static void pdffile_image_stream(PDFFILE *pdf,PDFIMAGESTREAM *s,int thumb);
 static void bmp_flate_decode(WILLUSBITMAP *bmp,FILE *f,compress_handle handle,int halfsize);
 static void pdffile_new_object(PDFFILE *pdf,int flags);
 static void pdffile_add_object(PDFFILE *pdf,PDFOBJECT *object);
@@ -591,6 +597,70 @@ void pdffile_add_bitmap_with_ocrwords(PDFFILE *pdf,WILLUSBITMAP *bmp,double dpi,
                                       int quality,int halfsize,OCRWORDS *ocrwords,
                                       int ocr_render_flags)
 
+    {
+    PDFPAGEIMAGE _img,*img;
+
+    img=&_img;
+    pdfpageimage_init(img);
+    pdffile_encode_bitmap(img,bmp,quality,halfsize,ocrwords,ocr_render_flags);
+    pdffile_add_encoded_bitmap(pdf,img,dpi,ocrwords,ocr_render_flags);
+    pdfpageimage_free(img);
+    }
+
+
+void pdfpageimage_init(PDFPAGEIMAGE *img)
+
+    {
+    img->width=img->height=0;
+    img->showbitmap=0;
+    pdfimagestream_init(&img->image);
+    pdfimagestream_init(&img->thumb);
+    }
+
+
+void pdfpageimage_free(PDFPAGEIMAGE *img)
+
+    {
+    pdfimagestream_free(&img->thumb);
+    pdfimagestream_free(&img->image);
+    }
+
+
+/*
+** The part of pdffile_add_bitmap_with_ocrwords() that does not touch the
+** PDF file:  apply ocr_render_flags to bmp, then compress its image and
+** thumbnail streams into img.  Different pages can be encoded on several
+** threads at once while another thread writes earlier pages with
+** pdffile_add_encoded_bitmap().
+*/
+void pdffile_encode_bitmap(PDFPAGEIMAGE *img,WILLUSBITMAP *bmp,int quality,int halfsize,
+                           OCRWORDS *ocrwords,int ocr_render_flags)
+
+    {
+    /* Fix: 24 Nov 2016 */
+    img->showbitmap = (ocr_render_flags&5);
+    /* If only showing boxes, clear the bitmap */
+    if (img->showbitmap && !(ocr_render_flags&1))
+        bmp_fill(bmp,255,255,255);
+    if (ocr_render_flags&4)
+        ocrwords_box(ocrwords,bmp);
+    img->width=bmp->width;
+    img->height=bmp->height;
+    if (img->showbitmap)
+        {
+        pdfimagestream_encode(&img->image,bmp,quality,halfsize,0);
+        pdfimagestream_encode(&img->thumb,bmp,quality,halfsize,1);
+        }
+    }
+
+
+/*
+** Write the page encoded by pdffile_encode_bitmap() to the PDF file.  Gives
+** the same bytes as pdffile_add_bitmap_with_ocrwords() would have.
+*/
+void pdffile_add_encoded_bitmap(PDFFILE *pdf,PDFPAGEIMAGE *img,double dpi,
+                                OCRWORDS *ocrwords,int ocr_render_flags)
+
     {
     double pw,ph;
     int ptr1,ptr2,ptrlen,showbitmap,nf;
@@ -614,14 +684,9 @@ ocrwords->word[i].h);
 */
     lastfont=-1;
     lastfontsize=-1;
-    /* Fix: 24 Nov 2016 */
-    showbitmap = (ocr_render_flags&5);
-    /* If only showing boxes, clear the bitmap */
-    if (showbitmap && !(ocr_render_flags&1))
-        bmp_fill(bmp,255,255,255);
-
-    pw=bmp->width*72./dpi;
-    ph=bmp->height*72./dpi;
+    showbitmap=img->showbitmap;
+    pw=img->width*72./dpi;
+    ph=img->height*72./dpi;
 
     /* New page object */
     pdffile_new_object(pdf,3);
@@ -710,8 +775,6 @@ ocrwords->word[i].h);
         /* 2-1-14: Fix memory leak */
         willuscharmaplist_free(cmaplist);
         }
-    if (ocr_render_flags&4)
-        ocrwords_box(ocrwords,bmp);
     fflush(pdf->f);
     fseek(pdf->f,0L,1);
     ptr2=ftell(pdf->f);
@@ -721,9 +784,9 @@ ocrwords->word[i].h);
     if (showbitmap)
         {
         /* Stream the bitmap */
-        pdffile_bmp_stream(pdf,bmp,quality,halfsize,0);
+        pdffile_image_stream(pdf,&img->image,0);
         /* Stream the thumbnail */
-        pdffile_bmp_stream(pdf,bmp,quality,halfsize,1);
+        pdffile_image_stream(pdf,&img->thumb,1);
         }
     }
 
@@ -821,11 +884,47 @@ static void thumbnail_create(WILLUSBITMAP *thumb,WILLUSBITMAP *bmp)
     }
 
 
-static void pdffile_bmp_stream(PDFFILE *pdf,WILLUSBITMAP *src,int quality,int halfsize,int thumb)
+static void pdfimagestream_init(PDFIMAGESTREAM *s)
+
+    {
+    s->data=NULL;
+    s->size=0;
+    s->memstream=0;
+    s->width=s->height=0;
+    s->bpp=8;
+    s->bpc=8;
+    s->dct=0;
+    }
+
+
+static void pdfimagestream_free(PDFIMAGESTREAM *s)
+
+    {
+    static char *funcname="pdfimagestream_free";
+
+    if (s->memstream)
+        {
+        free(s->data);
+        s->data=NULL;
+        }
+    else
+        willus_mem_free((double **)&s->data,funcname);
+    s->size=0;
+    s->memstream=0;
+    }
+
+
+/*
+** Compress the bitmap (thumb==0) or its thumbnail (thumb==1) into s.  The
+** stream is written through a FILE exactly as it used to be written to the
+** PDF file, so the bytes are the same.
+*/
+static void pdfimagestream_encode(PDFIMAGESTREAM *s,WILLUSBITMAP *src,int quality,int halfsize,
+                                  int thumb)
 
     {
-    int ptrlen,ptr1,ptr2,bpc;
     WILLUSBITMAP *bmp,_bmp;
+    FILE *f;
 
     if (thumb)
         {
@@ -835,24 +934,99 @@ static void pdffile_bmp_stream(PDFFILE *pdf,WILLUSBITMAP *src,int quality,int ha
         }
     else
         bmp=src;
+    s->width=bmp->width;
+    s->height=bmp->height;
+    s->bpp=bmp->bpp;
     if (quality<0 && halfsize>0 && halfsize<4)
-        bpc=8>>halfsize;
+        s->bpc=8>>halfsize;
     else
-        bpc=8;
+        s->bpc=8;
+    s->dct=0;
+    f=pdfimagestream_fopen(s);
+    if (f!=NULL)
+        {
+#ifdef HAVE_JPEG_LIB
+        if (quality>0)
+            {
+            s->dct=1;
+            bmp_write_jpeg_stream(bmp,f,quality,NULL);
+            }
+        else
+#endif
+            {
+            compress_handle h;
+            h=compress_start(f,7); /* compression level = 7 */
+            bmp_flate_decode(bmp,f,h,halfsize);
+            compress_done(f,&h);
+            }
+        pdfimagestream_fclose(s,f);
+        }
+    if (thumb)
+        bmp_free(bmp);
+    }
+
+
+/*
+** A FILE that writes into memory (s->data, s->size) if the C library
+** supports it, else a temporary file that pdfimagestream_fclose() reads
+** back in.
+*/
+static FILE *pdfimagestream_fopen(PDFIMAGESTREAM *s)
+
+    {
+    pdfimagestream_free(s);
+#ifdef UNIXPURE
+    {
+    FILE *f;
+
+    f=open_memstream((char **)&s->data,&s->size);
+    if (f!=NULL)
+        {
+        s->memstream=1;
+        return(f);
+        }
+    }
+#endif
+    return(tmpfile());
+    }
+
+
+static void pdfimagestream_fclose(PDFIMAGESTREAM *s,FILE *f)
+
+    {
+    static char *funcname="pdfimagestream_fclose";
+    long n;
+
+    if (s->memstream)
+        {
+        fclose(f);
+        return;
+        }
+    fflush(f);
+    fseek(f,0L,2);
+    n=ftell(f);
+    rewind(f);
+    willus_mem_alloc_warn((void **)&s->data,n>0 ? n : 1,funcname,10);
+    s->size = n>0 ? fread(s->data,1,n,f) : 0;
+    fclose(f);
+    }
+
+
+static void pdffile_image_stream(PDFFILE *pdf,PDFIMAGESTREAM *s,int thumb)
+
+    {
+    int ptrlen,ptr1,ptr2;
+
     /* The bitmap */
     pdffile_new_object(pdf,0);
     fprintf(pdf->f,"<<\n");
     if (!thumb)
         fprintf(pdf->f,"/Type /XObject\n"
                        "/Subtype /Image\n");
-#ifdef HAVE_JPEG_LIB
-    if (quality>0)
+    if (s->dct)
         fprintf(pdf->f,"/Filter %s/DCTDecode%s\n",thumb?"[ ":"",thumb?" ]":"");
-#endif
-#if (defined(HAVE_JPEG_LIB) && defined(HAVE_Z_LIB))
-    else
-#endif
 #ifdef HAVE_Z_LIB
+    else
         fprintf(pdf->f,"/Filter %s/FlateDecode%s\n",thumb?"[ ":"",thumb?" ]":"");
 #endif
     fprintf(pdf->f,"/Width %d\n"
@@ -860,9 +1034,9 @@ static void pdffile_bmp_stream(PDFFILE *pdf,WILLUSBITMAP *src,int quality,int ha
                    "/ColorSpace /Device%s\n"
                    "/BitsPerComponent %d\n"
                    "/Length ",
-                   bmp->width,bmp->height,
-                   bmp->bpp==8?"Gray":"RGB",
-                   bpc);
+                   s->width,s->height,
+                   s->bpp==8?"Gray":"RGB",
+                   s->bpc);
     fflush(pdf->f);
     fseek(pdf->f,0L,1);
     ptrlen=(int)ftell(pdf->f);
@@ -872,28 +1046,14 @@ static void pdffile_bmp_stream(PDFFILE *pdf,WILLUSBITMAP *src,int quality,int ha
     fflush(pdf->f);
     fseek(pdf->f,0L,1);
     ptr1=(int)ftell(pdf->f);
-#ifdef HAVE_JPEG_LIB
-    if (quality>0)
-        {
-        bmp_write_jpeg_stream(bmp,pdf->f,quality,NULL);
-        fprintf(pdf->f,"\n");
-        }
-    else
-#endif
-        {
-        compress_handle h;
-        h=compress_start(pdf->f,7); /* compression level = 7 */
-        bmp_flate_decode(bmp,pdf->f,h,halfsize);
-        compress_done(pdf->f,&h);
-        fprintf(pdf->f,"\n");
-        }
+    if (s->size>0)
+        fwrite(s->data,1,s->size,pdf->f);
+    fprintf(pdf->f,"\n");
     fflush(pdf->f);
     fseek(pdf->f,0L,1);
     ptr2=(int)ftell(pdf->f)-1;
     fprintf(pdf->f,"endstream\nendobj\n");
     insert_length(pdf->f,ptrlen,ptr2-ptr1);
-    if (thumb)
-        bmp_free(bmp);
     }
 
 
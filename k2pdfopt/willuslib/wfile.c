@@ -48,6 +48,10 @@
 #include <unistd.h>
 #include <errno.h>
 #endif
+#ifdef UNIXPURE
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 /* Get rmdir() prototype for MINGW--not sure why I have to do this. */
 #ifdef MINGW
 int rmdir(const char *);
@@ -3534,3 +3538,97 @@ int wfile_read_ascii_to_buf(char **buf,char *filename)
     (*buf)[sizebytes]='\0';
     return(0);
     }
+
+
+/*
+** Get the contents of filename into memory once, so that they can be read
+** repeatedly (and by several threads) without file seeks:  mapped read-only
+** if possible (regular files under UNIX), otherwise read into an allocated
+** buffer (pipes, other systems).
+** Returns 0 if map->data holds the map->size bytes of the file.
+*/
+int wfile_map(WFILEMAP *map,char *filename)
+
+    {
+    static char *funcname="wfile_map";
+    FILE *f;
+    int na,n;
+
+    map->data=NULL;
+    map->size=0;
+    map->mapped=0;
+#ifdef UNIXPURE
+    {
+    struct stat st;
+    int fd;
+
+    fd=open(filename,O_RDONLY);
+    if (fd<0)
+        return(-1);
+    if (!fstat(fd,&st) && S_ISREG(st.st_mode) && st.st_size>0)
+        {
+        void *p;
+
+        p=mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_SHARED,fd,0);
+        if (p!=MAP_FAILED)
+            {
+            close(fd);
+            map->data=(unsigned char *)p;
+            map->size=(size_t)st.st_size;
+            map->mapped=1;
+            return(0);
+            }
+        }
+    close(fd);
+    }
+#endif
+    f=wfile_fopen_utf8(filename,"rb");
+    if (f==NULL)
+        return(-1);
+    for (na=n=0;1;)
+        {
+        if (n>=na)
+            {
+            int newsize;
+
+            newsize = na < 65536 ? 65536 : na*2;
+            if (newsize<na)
+                {
+                willus_mem_free((double **)&map->data,funcname);
+                fclose(f);
+                return(-2);
+                }
+            willus_mem_realloc_robust_warn((void **)&map->data,newsize,na,funcname,10);
+            na=newsize;
+            }
+        if (feof(f))
+            break;
+        n+=fread(&map->data[n],1,na-n,f);
+        if (ferror(f))
+            {
+            willus_mem_free((double **)&map->data,funcname);
+            fclose(f);
+            return(-3);
+            }
+        }
+    fclose(f);
+    map->size=n;
+    return(0);
+    }
+
+
+void wfile_unmap(WFILEMAP *map)
+
+    {
+    static char *funcname="wfile_unmap";
+
+#ifdef UNIXPURE
+    if (map->mapped)
+        munmap((void *)map->data,map->size);
+    else
+#endif
+    willus_mem_free((double **)&map->data,funcname);
+    map->data=NULL;
+    map->size=0;
+    map->mapped=0;
+    }
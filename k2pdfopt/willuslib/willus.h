@@ -472,6 +472,9 @@ void bmp8_to_bw(WILLUSBITMAP *bmap,int thresh);
 int  bmp8_greylevel_convert(int r,int g,int b);
 #define bmp8_graylevel_convert(r,g,b) bmp8_greylevel_convert(r,g,b)
 void bmp_init(WILLUSBITMAP *bmap);
+void bmp_borrow(WILLUSBITMAP *bmap,unsigned char *data,int nbytes);
+int  bmp_is_borrowed(WILLUSBITMAP *bmap);
+void bmp_own(WILLUSBITMAP *bmap,int minsize);
 int  bmp_alloc(WILLUSBITMAP *bmap);
 int  bmp_bytewidth(WILLUSBITMAP *bmp);
 unsigned char *bmp_rowptr_from_top(WILLUSBITMAP *bmp,int row);
@@ -488,6 +491,7 @@ void bmp_flip_vertical(WILLUSBITMAP *bmp);
 int  bmp_bytewidth_win32(WILLUSBITMAP *bmp);
 void bmp_free(WILLUSBITMAP *bmap);
 int  bmp_read(WILLUSBITMAP *bmap,char *filename,FILE *out);
+int  bmp_read_dpi(WILLUSBITMAP *bmp,char *filename,double *dpi,FILE *out);
 void bmp24_reduce_size(WILLUSBITMAP *bmp,int mx,int my);
 void bmp24_mixbmps(WILLUSBITMAP *dest,WILLUSBITMAP *src1,WILLUSBITMAP *src2,int level);
 void bmp24_flip_rgb(WILLUSBITMAP *bmp);
@@ -511,16 +515,11 @@ void bmp_integer_resample_ex(WILLUSBITMAP *dest,WILLUSBITMAP *src,int nx,int ny)
 void bmp_draw_filled_rect(WILLUSBITMAP *bmp,int col1,int row1,int col2,int row2,
                           int r,int g,int b);
 /*
-** As of Sept. 2013, the floating-point bmp_resample() is only faster than
-** the fixed-point version on 64-bit compiles.  For 32-bit Intel (and ARM),
-** the fixed-point version is considerably faster.
-** (__x86_64 is automatically pre-defined for 64-bit gcc compiles on Intel CPUs.)
+** bmp_resample() and bmp_resample_fixed_point() are now the same integer
+** (and vectorized) implementation, so the choice no longer depends on the
+** platform.  Kept for the existing callers.
 */
-#ifdef __x86_64
-#define bmp_resample_optimum_performance bmp_resample
-#else
 #define bmp_resample_optimum_performance bmp_resample_fixed_point
-#endif
 int  bmp_resample(WILLUSBITMAP *dest,WILLUSBITMAP *src,double x1,double y1,
                   double x2,double y2,int newwidth,int newheight);
 int  bmp_resample_fixed_point(WILLUSBITMAP *dest,WILLUSBITMAP *src,double fx1,double fy1,
@@ -552,13 +551,66 @@ int bmp_jasper_read(WILLUSBITMAP *bmp,char *filename,FILE *out);
 #endif
 void bmp_more_rows(WILLUSBITMAP *bmp,double ratio,int pixval);
 double bmp_autostraighten(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,int white,double maxdegrees,
-                        double mindegrees,int debug,FILE *out);
+                        double mindegrees,int nthreads,int debug,FILE *out);
 void bmp_apply_whitethresh(WILLUSBITMAP *bmp,int whitethresh);
 void bmp_dither_to_bpc(WILLUSBITMAP *bmp,int newbpc);
 void bmp_extract(WILLUSBITMAP *dst,WILLUSBITMAP *src,int x0,int y0_from_top,int width,int height);
 int  bmp_read_pcl(WILLUSBITMAP *bmp,char *pclbuf,int n);
 void bmp_autocrop(WILLUSBITMAP *bmp,int pad);
 
+/* bmpahead.c */
+/*
+** An item read by a BMPAHEAD_POOL thread:  a file and/or page number
+** (with its own copy of the file name) and what funcs->read() made of it.
+*/
+typedef struct
+    {
+    char filename[MAXFILENAMELEN];  /* "" if the pool reads pages */
+    int pageno;     /* 0 if the pool reads files */
+    int index;      /* Position in the pool, for data the caller keeps per item */
+    int state;      /* Used by bmpahead.c */
+    int order;      /* Position in the last bmpahead_pool_queue() list */
+    int cancelled;  /* Running, but no longer in the list:  drop it once read */
+    int status;     /* funcs->read() return value, 0 = bmp was read */
+    double dpi;     /* Resolution of bmp, if funcs->read() sets it */
+    WILLUSBITMAP bmp;
+    } BMPAHEAD_ITEM;
+/*
+** How a BMPAHEAD_POOL reads its items.  Only read is required.
+** worker_start() runs on the bmpahead_pool_start() thread once per worker
+** thread and returns what read() and worker_end() get as worker (NULL =
+** don't start the thread).  worker_end() runs on the worker thread as it
+** quits.  drop() is called whenever the pool empties an item it read,
+** take() when bmpahead_pool_take() hands item->bmp over, both with the
+** pool locked.
+*/
+typedef struct
+    {
+    void *(*worker_start)(void *user);
+    int   (*read)(BMPAHEAD_ITEM *item,void *worker,void *user);
+    void  (*worker_end)(void *worker,void *user);
+    void  (*drop)(BMPAHEAD_ITEM *item,void *user);
+    void  (*take)(BMPAHEAD_ITEM *item,void *user);
+    } BMPAHEAD_FUNCS;
+typedef struct bmpahead_pool_s BMPAHEAD_POOL;
+BMPAHEAD_POOL *bmpahead_pool_start(BMPAHEAD_FUNCS *funcs,void *user,int nthreads,int nitems);
+void bmpahead_pool_stop(BMPAHEAD_POOL *pool);
+int  bmpahead_pool_queue(BMPAHEAD_POOL *pool,char **filelist,int *pagelist,int n);
+int  bmpahead_pool_has(BMPAHEAD_POOL *pool,char *filename,int pageno);
+int  bmpahead_pool_take(BMPAHEAD_POOL *pool,WILLUSBITMAP *bmp,char *filename,int pageno,
+                        double *dpi);
+int  bmpahead_queue(char **filelist,int n,int nthreads);
+int  bmpahead_read(WILLUSBITMAP *bmp,char *filename,FILE *out);
+void bmpahead_close(void);
+
+/* bmpsimd.c */
+void bmpsimd_ga_to_grey(unsigned char *dst,unsigned char *src,int n);
+void bmpsimd_rgba_to_rgb(unsigned char *dst,unsigned char *src,int n);
+void bmpsimd_dark_counts(int *rowcount,int *colcount,unsigned char *p,int bw,
+                         int nr,int nc,int thresh);
+void bmpsimd_weighted_rows(short *dst,unsigned char **src,int *weight,int nrows,int n);
+void bmpsimd_add_bytes(unsigned short *sum,unsigned char *p,int n);
+
 /* fontrender.c */
 void fontrender_set_or(int status);
 void fontrender_set_typeface(char *name);
@@ -724,6 +776,12 @@ typedef void wmetafile;
 #endif
 
 /* wfile.c */
+typedef struct
+    {
+    unsigned char *data;
+    size_t size;
+    int mapped;  /* 1 = mmap(), 0 = read into an allocated buffer */
+    } WFILEMAP;
 #define DIR_STRUCT_SIZE 4096
 #define WFILE_ARCHIVE   0x0001
 #define WFILE_DIR       0x0002
@@ -889,6 +947,8 @@ FILE *wfile_fopen_utf8(char *filename,char *mode);
 int wfile_remove_utf8(char *filename);
 int wfile_rename_utf8(char *filename1,char *filename2);
 int wfile_read_ascii_to_buf(char **buf,char *filename);
+int wfile_map(WFILEMAP *map,char *filename);
+void wfile_unmap(WFILEMAP *map);
 
 /* wzfile.c */
 typedef struct
@@ -1135,7 +1195,13 @@ int    wsys_win32_api(void);
 int    wsys_wpid_status(int wpid);
 void   wsys_sleep(int secs);
 void   wsys_sleep_ms(int ms);
+double wsys_clock_secs(void);
 int    wsys_num_cpus(void);
+#define WSYS_CPU_SSE2    0x01
+#define WSYS_CPU_SSSE3   0x02
+#define WSYS_CPU_AVX2    0x04
+#define WSYS_CPU_NEON    0x08
+int    wsys_cpu_features(void);
 char  *wsys_full_exe_name(char *s);
 void   wsys_append_nul_redirect(char *s);
 int    wsys_which(char *exactname,char *exename);
@@ -1595,6 +1661,31 @@ typedef struct
     char filename[512];
     } PDFFILE;
 
+/*
+** Image stream of an output page, compressed ahead of writing it to the
+** PDF file (see pdffile_encode_bitmap()).
+*/
+typedef struct
+    {
+    unsigned char *data;
+    size_t size;
+    int memstream;  /* data is from open_memstream() */
+    int width;
+    int height;
+    int bpp;        /* 8 or 24 */
+    int bpc;        /* Bits per component */
+    int dct;        /* 1 = DCTDecode (JPEG), 0 = FlateDecode */
+    } PDFIMAGESTREAM;
+
+typedef struct
+    {
+    int width;      /* Page bitmap */
+    int height;
+    int showbitmap;
+    PDFIMAGESTREAM image;
+    PDFIMAGESTREAM thumb;
+    } PDFPAGEIMAGE;
+
 FILE *pdffile_init(PDFFILE *pdf,char *filename,int pages_at_end);
 void pdffile_close(PDFFILE *pdf);
 int  pdffile_page_count(PDFFILE *pdf);
@@ -1603,6 +1694,12 @@ void pdffile_add_bitmap(PDFFILE *pdf,WILLUSBITMAP *bmp,double dpi,int quality,in
 void pdffile_add_bitmap_with_ocrwords(PDFFILE *pdf,WILLUSBITMAP *bmp,double dpi,
                                       int quality,int halfsize,OCRWORDS *ocrwords,
                                       int ocr_render_flags);
+void pdfpageimage_init(PDFPAGEIMAGE *img);
+void pdfpageimage_free(PDFPAGEIMAGE *img);
+void pdffile_encode_bitmap(PDFPAGEIMAGE *img,WILLUSBITMAP *bmp,int quality,int halfsize,
+                           OCRWORDS *ocrwords,int ocr_render_flags);
+void pdffile_add_encoded_bitmap(PDFFILE *pdf,PDFPAGEIMAGE *img,double dpi,
+                                OCRWORDS *ocrwords,int ocr_render_flags);
 void pdffile_finish(PDFFILE *pdf,char *title,char *author,char *producer,char *cdate);
 int  pdf_numpages(char *filename);
 void ocrwords_box(OCRWORDS *ocrwords,WILLUSBITMAP *bmp);
@@ -1725,8 +1822,15 @@ void wtextchars_to_easyplot(WTEXTCHARS *wtcs,char *filename);
 /* Mupdf / bitmap functions */
 #ifdef HAVE_MUPDF_LIB
 int bmpmupdf_pdffile_to_bmp(WILLUSBITMAP *bmp,char *filename,int pageno,double dpi,int bpp);
+int bmpmupdf_pdffile_to_bmp_ex(WILLUSBITMAP *bmp,char *filename,int pageno,double dpi,
+                               int bpp,double *clip);
 void wmupdf_cbzinfo_get(char *filename,int *pagelist,char **buf0);
 int bmpmupdf_pdffile_width_and_height(char *filename,int pageno,double *width_in,double *height_in);
+void bmpmupdf_close(void);
+int bmpmupdf_render_ahead(char *filename,int *pagelist,int n,double dpi,int bpp,
+                          double *clip,int nthreads);
+int bmpmupdf_page_ahead(char *filename,int pageno,double dpi,int bpp,double *clip);
+int bmpmupdf_page_text(WTEXTCHARS *wtc,char *filename,int pageno,int boundingbox);
 #endif /* HAVE_MUPDF_LIB */
 
 /* wmupdf.c */
@@ -1758,6 +1862,8 @@ int bmpdjvu_djvufile_to_bmp(WILLUSBITMAP *bmp,char *infile,int pageno,
                             int dpi,int bpp,FILE *out);
 void bmpdjvu_info_get(char *filename,int *pagelist,char **buf0);
 int bmpdjvu_numpages(char *infile);
+void bmpdjvu_prefetch(char *infile,int pageno);
+void bmpdjvu_close(void);
 WPDFOUTLINE *wpdfoutline_read_from_djvu_file(char *filename);
 int wtextchars_fill_from_djvu_page(WTEXTCHARS *wtcs,char *filename,int pageno,int boundingbox);
 #endif /* HAVE_DJVU_LIB */
@@ -63,7 +63,7 @@ static void matrix_rotate(double m[][3],double deg);
 static void matrix_xymul(double m[][3],double *x,double *y);
 
 /* Character positions */
-static void wtextchars_add_fz_chars(WTEXTCHARS *wtc,fz_context *ctx,fz_stext_page *page,
+void wtextchars_add_fz_chars(WTEXTCHARS *wtc,fz_context *ctx,fz_stext_page *page,
                                     int boundingbox);
 /*
 ** Outline functions
@@ -1384,6 +1384,9 @@ int wtextchars_fill_from_page(WTEXTCHARS *wtc,char *filename,int pageno,char *pa
 ** if boundingbox==1, only one character is returned, and its upper-left and lower-right
 ** corner are the bounding box of all text on the page.
 **
+** The page of the document being rendered by bmpmupdf_pdffile_to_bmp() is
+** taken from there (bmpmupdf_page_text()).
+**
 */
 int wtextchars_fill_from_page_ex(WTEXTCHARS *wtc,char *filename,int pageno,char *password,
                                  int boundingbox)
@@ -1397,6 +1400,8 @@ int wtextchars_fill_from_page_ex(WTEXTCHARS *wtc,char *filename,int pageno,char
     fz_device *dev=NULL;
     fz_rect bounds;
 
+    if (!bmpmupdf_page_text(wtc,filename,pageno,boundingbox))
+        return(0);
     fz_var(doc);
     ctx=fz_new_context(NULL,NULL,FZ_STORE_DEFAULT);
     if (ctx==NULL)
@@ -1500,7 +1505,7 @@ int wtextchars_fill_from_page_ex(WTEXTCHARS *wtc,char *filename,int pageno,char
     }
 
 
-static void wtextchars_add_fz_chars(WTEXTCHARS *wtc,fz_context *ctx,fz_stext_page *page,
+void wtextchars_add_fz_chars(WTEXTCHARS *wtc,fz_context *ctx,fz_stext_page *page,
                                     int boundingbox)
 
     {
@@ -323,6 +323,24 @@ void wsys_sleep_ms(int ms)
     }
 
 
+/*
+** Seconds from an arbitrary start on a wall clock that is not adjusted,
+** for timing intervals.
+*/
+double wsys_clock_secs(void)
+
+    {
+#ifdef HAVE_WIN32_API
+    return((double)GetTickCount()/1000.);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return(ts.tv_sec+ts.tv_nsec/1e9);
+#endif
+    }
+
+
 int wsys_num_cpus(void)
 
     {
@@ -336,6 +354,33 @@ int wsys_num_cpus(void)
     }
 
 
+/*
+** Returns the WSYS_CPU_... instruction set extensions that this
+** process can use (only those the SIMD code in willuslib cares about).
+*/
+int wsys_cpu_features(void)
+
+    {
+    int features;
+
+    features=0;
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        features |= WSYS_CPU_SSE2;
+    if (__builtin_cpu_supports("ssse3"))
+        features |= WSYS_CPU_SSSE3;
+    if (__builtin_cpu_supports("avx2"))
+        features |= WSYS_CPU_AVX2;
+#endif
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__))
+    /* Compiled for NEON--every CPU that can run this code has it */
+    features |= WSYS_CPU_NEON;
+#endif
+    return(features);
+    }
+
+
 char *wsys_full_exe_name(char *s)
 
     {
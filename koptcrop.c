@@ -30,43 +30,33 @@
 #include "koptcrop.h"
 
 void k2pdfopt_crop_bmp(KOPTContext *kctx) {
-	static char *funcname="k2pdfopt_crop_bmp";
-	K2PDFOPT_SETTINGS _k2settings, *k2settings;
-	MASTERINFO _masterinfo, *masterinfo;
-	WILLUSBITMAP _srcgrey, *srcgrey;
+	KOPTSession *session;
+
+	session = k2pdfopt_session_create();
+	k2pdfopt_session_crop_bmp(session, kctx);
+	k2pdfopt_session_destroy(session);
+}
+
+void k2pdfopt_session_crop_bmp(KOPTSession *session, KOPTContext *kctx) {
+	K2PDFOPT_SETTINGS *k2settings;
+	MASTERINFO *masterinfo;
+	WILLUSBITMAP *srcgrey;
 	WILLUSBITMAP *src;
-	BMPREGION _region, *region;
-	int *colcount,*rowcount;
-	int i,j;
+	BMPREGION *region;
 	float margin;
-    char initstr[256];
 
 	src = &kctx->src;
-	srcgrey = &_srcgrey;
-	bmp_init(srcgrey);
-
-	k2settings = &_k2settings;
-	masterinfo = &_masterinfo;
-	/* Initialize settings */
-	k2pdfopt_settings_init_from_koptcontext(k2settings, kctx);
-	k2pdfopt_settings_quick_sanity_check(k2settings);
-	/* Init for new source doc */
-	k2pdfopt_settings_new_source_document_init(k2settings,initstr);
-	/* Init master output structure */
-	masterinfo_init(masterinfo, k2settings);
-	bmp_init(&masterinfo->bmp);
-	masterinfo->bmp.width = 0;
-	masterinfo->bmp.height = 0;
-	//wrapbmp_free(&masterinfo->wrapbmp);
-	//wrapbmp_init(&masterinfo->wrapbmp, k2settings->dst_color);
+	/* Init settings, master output structure and region for new page */
+	k2pdfopt_session_begin_page(session, kctx, KOPT_SESSION_CROP);
+	k2settings = &session->k2settings;
+	masterinfo = &session->masterinfo;
+	srcgrey = &session->srcgrey;
+	region = &session->region;
 	/* Init new source bitmap */
-	region = &_region;
-	bmpregion_init(region);
-	masterinfo_new_source_page_init(masterinfo, k2settings, src, srcgrey, NULL,
-			region, k2settings->src_rot, NULL, NULL, 1, -1, NULL);
+	k2pdfopt_session_new_source_page(session, kctx);
 	//printf("source page (%d,%d) - (%d,%d)\n",region->c1,region->r1,region->c2,region->r2);
 	//printf("source page bgcolor %d\n", region->bgcolor);
-	bmpregion_trim_margins(region,k2settings,0xf);
+	k2pdfopt_session_trim_margins(session);
 	margin = kctx->margin*k2settings->dst_dpi;
 	/*
 	 * Suppose when page is zoomed to k level at fit to content width zoom mode,
@@ -85,7 +75,5 @@ void k2pdfopt_crop_bmp(KOPTContext *kctx) {
 	kctx->bbox.y1 = (float)region->r2 + margin;
 
 	bmp_free(src);
-	bmp_free(srcgrey);
-	bmpregion_free(region);
-	masterinfo_free(masterinfo,k2settings);
+	k2pdfopt_session_end_page(session);
 }
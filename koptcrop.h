@@ -23,8 +23,10 @@
 
 #include "k2pdfopt.h"
 #include "context.h"
+#include "koptsession.h"
 
 void k2pdfopt_crop_bmp(KOPTContext *kctx);
+void k2pdfopt_session_crop_bmp(KOPTSession *session, KOPTContext *kctx);
 
 #endif
 
@@ -24,8 +24,10 @@
 
 #include "k2pdfopt.h"
 #include "context.h"
+#include "koptsession.h"
 
 void k2pdfopt_optimize_bmp(KOPTContext *kctx);
+void k2pdfopt_session_optimize_bmp(KOPTSession *session, KOPTContext *kctx);
 
 #endif
 
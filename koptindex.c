@@ -0,0 +1,387 @@
+/*
+ ** koptindex.c  spatial index over the rect maps of a reflowed page.
+ **
+ ** Copyright (C) 2012  http://willus.com
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU Affero General Public License as
+ ** published by the Free Software Foundation, either version 3 of the
+ ** License, or (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU Affero General Public License for more details.
+ **
+ ** You should have received a copy of the GNU Affero General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ */
+
+/*
+ ** A reflowed page maps thousands of word rects between kctx->dst and the
+ ** source page.  Instead of scanning all of them on every tap or drag the
+ ** reader asks this index, which keeps a uniform grid per coordinate space
+ ** with cells about the size of an average rect, so a point query looks
+ ** at a handful of rects.  All rects are numbered in reading order once at
+ ** build time, so query results come out in reading order by sorting
+ ** those numbers.
+ */
+
+#include <math.h>
+#include "koptindex.h"
+
+typedef struct {
+    float y0, y1, x0;
+    int item;
+} KOPTOrderItem;
+
+static int rectindex_compare_rows(const void *a, const void *b) {
+    const KOPTOrderItem *i1 = a, *i2 = b;
+
+    if (i1->y0 != i2->y0)
+        return i1->y0 < i2->y0 ? -1 : 1;
+    if (i1->x0 != i2->x0)
+        return i1->x0 < i2->x0 ? -1 : 1;
+    return i1->item - i2->item;
+}
+
+static int rectindex_compare_cols(const void *a, const void *b) {
+    const KOPTOrderItem *i1 = a, *i2 = b;
+
+    if (i1->x0 != i2->x0)
+        return i1->x0 < i2->x0 ? -1 : 1;
+    return i1->item - i2->item;
+}
+
+static int rectindex_compare_ints(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ ** Reading order is taken from the reflowed page, where it is simply top
+ ** to bottom, left to right: sort by top edge, cut into lines wherever a
+ ** rect's middle is below the bottom of some rect on the current line
+ ** (so that one tall rect does not swallow the lines next to it), then
+ ** sort each line by left edge.
+ */
+static void rectindex_reading_order(KOPTRectIndex *index, BBox *reflowed) {
+    static char *funcname = "rectindex_reading_order";
+    KOPTOrderItem *items;
+    int i, start, nlines;
+    float ly1;
+
+    willus_mem_alloc_warn((void **)&items, index->n * sizeof(KOPTOrderItem), funcname, 10);
+    for (i = 0; i < index->n; i++) {
+        items[i].y0 = reflowed[i].y0;
+        items[i].y1 = reflowed[i].y1;
+        items[i].x0 = reflowed[i].x0;
+        items[i].item = i;
+    }
+    qsort(items, index->n, sizeof(KOPTOrderItem), rectindex_compare_rows);
+    nlines = 0;
+    for (start = 0; start < index->n; start = i) {
+        ly1 = items[start].y1;
+        for (i = start + 1; i < index->n; i++) {
+            if ((items[i].y0 + items[i].y1) / 2 > ly1)
+                break;
+            if (items[i].y1 < ly1)
+                ly1 = items[i].y1;
+        }
+        qsort(&items[start], i - start, sizeof(KOPTOrderItem), rectindex_compare_cols);
+        for (; start < i; start++) {
+            index->order[start] = items[start].item;
+            index->line[KOPT_SPACE_REFLOWED][start] = nlines;
+        }
+        nlines++;
+    }
+    willus_mem_free((double **)&items, funcname);
+}
+
+/*
+ ** Lines of the source page, following the reading order: a rect starts
+ ** a new line when it is not level with the current one or steps back to
+ ** the left (e.g. at the top of the next column).
+ */
+static void rectindex_native_lines(KOPTRectIndex *index) {
+    BBox *r, *prev;
+    float ly0, ly1, yc;
+    int i, nlines;
+
+    nlines = 0;
+    ly0 = ly1 = 0;
+    prev = NULL;
+    for (i = 0; i < index->n; i++) {
+        r = &index->rect[KOPT_SPACE_NATIVE][i];
+        yc = (r->y0 + r->y1) / 2;
+        if (prev != NULL && (yc < ly0 || yc > ly1 || r->x0 < prev->x0)) {
+            nlines++;
+            prev = NULL;
+        }
+        if (prev == NULL) {
+            ly0 = r->y0;
+            ly1 = r->y1;
+        } else {
+            if (r->y0 < ly0)
+                ly0 = r->y0;
+            if (r->y1 > ly1)
+                ly1 = r->y1;
+        }
+        index->line[KOPT_SPACE_NATIVE][i] = nlines;
+        prev = r;
+    }
+}
+
+static int rectindex_grid_col(KOPTRectGrid *grid, float x) {
+    int c;
+
+    c = (int)floor((x - grid->extent.x0) / grid->cellw);
+    return c < 0 ? 0 : (c >= grid->ncols ? grid->ncols - 1 : c);
+}
+
+static int rectindex_grid_row(KOPTRectGrid *grid, float y) {
+    int r;
+
+    r = (int)floor((y - grid->extent.y0) / grid->cellh);
+    return r < 0 ? 0 : (r >= grid->nrows ? grid->nrows - 1 : r);
+}
+
+static void rectindex_grid_build(KOPTRectGrid *grid, BBox *rect, int n) {
+    static char *funcname = "rectindex_grid_build";
+    double sumw, sumh, scale;
+    int i, k, c, r, c1, c2, r1, r2, ncells;
+
+    memset(grid, 0, sizeof(KOPTRectGrid));
+    if (n <= 0)
+        return;
+    grid->extent = rect[0];
+    sumw = sumh = 0;
+    for (i = 0; i < n; i++) {
+        if (rect[i].x0 < grid->extent.x0)
+            grid->extent.x0 = rect[i].x0;
+        if (rect[i].y0 < grid->extent.y0)
+            grid->extent.y0 = rect[i].y0;
+        if (rect[i].x1 > grid->extent.x1)
+            grid->extent.x1 = rect[i].x1;
+        if (rect[i].y1 > grid->extent.y1)
+            grid->extent.y1 = rect[i].y1;
+        sumw += rect[i].x1 - rect[i].x0;
+        sumh += rect[i].y1 - rect[i].y0;
+    }
+    /* Cells about the size of an average rect, at most ~4 cells per rect */
+    grid->cellw = sumw / n > 1. ? sumw / n : 1.;
+    grid->cellh = sumh / n > 1. ? sumh / n : 1.;
+    ncells = (int)((grid->extent.x1 - grid->extent.x0) / grid->cellw + 1)
+           * (int)((grid->extent.y1 - grid->extent.y0) / grid->cellh + 1);
+    if (ncells > 4 * n + 64) {
+        scale = sqrt((double)ncells / (4 * n + 64));
+        grid->cellw *= scale;
+        grid->cellh *= scale;
+    }
+    grid->ncols = (int)((grid->extent.x1 - grid->extent.x0) / grid->cellw) + 1;
+    grid->nrows = (int)((grid->extent.y1 - grid->extent.y0) / grid->cellh) + 1;
+    ncells = grid->ncols * grid->nrows;
+
+    /* Count the rects per cell, then fill the cells in rank order */
+    willus_mem_alloc_warn((void **)&grid->cellstart, (ncells + 1) * sizeof(int), funcname, 10);
+    memset(grid->cellstart, 0, (ncells + 1) * sizeof(int));
+    for (i = 0; i < n; i++) {
+        c1 = rectindex_grid_col(grid, rect[i].x0);
+        c2 = rectindex_grid_col(grid, rect[i].x1);
+        r1 = rectindex_grid_row(grid, rect[i].y0);
+        r2 = rectindex_grid_row(grid, rect[i].y1);
+        for (r = r1; r <= r2; r++)
+            for (c = c1; c <= c2; c++)
+                grid->cellstart[r * grid->ncols + c + 1]++;
+    }
+    for (k = 0; k < ncells; k++)
+        grid->cellstart[k + 1] += grid->cellstart[k];
+    willus_mem_alloc_warn((void **)&grid->cellitems,
+            (grid->cellstart[ncells] > 0 ? grid->cellstart[ncells] : 1) * sizeof(int),
+            funcname, 10);
+    for (i = 0; i < n; i++) {
+        c1 = rectindex_grid_col(grid, rect[i].x0);
+        c2 = rectindex_grid_col(grid, rect[i].x1);
+        r1 = rectindex_grid_row(grid, rect[i].y0);
+        r2 = rectindex_grid_row(grid, rect[i].y1);
+        for (r = r1; r <= r2; r++)
+            for (c = c1; c <= c2; c++)
+                grid->cellitems[grid->cellstart[r * grid->ncols + c]++] = i;
+    }
+    /* the fill pass moved every start to the next cell's start */
+    for (k = ncells; k > 0; k--)
+        grid->cellstart[k] = grid->cellstart[k - 1];
+    grid->cellstart[0] = 0;
+}
+
+static void rectindex_grid_free(KOPTRectGrid *grid) {
+    static char *funcname = "rectindex_grid_free";
+
+    willus_mem_free((double **)&grid->cellitems, funcname);
+    willus_mem_free((double **)&grid->cellstart, funcname);
+}
+
+/*
+ ** Index n rects given in both coordinate spaces.  Rect i is rect map
+ ** first+i of the context the index is attached to.
+ */
+KOPTRectIndex* k2pdfopt_rectindex_create(BBox *reflowed, BBox *native, int n, int first) {
+    static char *funcname = "k2pdfopt_rectindex_create";
+    KOPTRectIndex *index;
+    int i, space;
+
+    willus_mem_alloc_warn((void **)&index, sizeof(KOPTRectIndex), funcname, 10);
+    index->n = n;
+    willus_mem_alloc_warn((void **)&index->order, (n + 1) * sizeof(int), funcname, 10);
+    for (space = 0; space < 2; space++) {
+        willus_mem_alloc_warn((void **)&index->line[space], (n + 1) * sizeof(int), funcname, 10);
+        willus_mem_alloc_warn((void **)&index->rect[space], (n + 1) * sizeof(BBox), funcname, 10);
+    }
+    rectindex_reading_order(index, reflowed);
+    for (i = 0; i < n; i++) {
+        index->rect[KOPT_SPACE_REFLOWED][i] = reflowed[index->order[i]];
+        index->rect[KOPT_SPACE_NATIVE][i] = native[index->order[i]];
+        index->order[i] += first;
+    }
+    rectindex_native_lines(index);
+    for (space = 0; space < 2; space++)
+        rectindex_grid_build(&index->grid[space], index->rect[space], n);
+    return index;
+}
+
+void k2pdfopt_rectindex_destroy(KOPTRectIndex *index) {
+    static char *funcname = "k2pdfopt_rectindex_destroy";
+    int space;
+
+    if (index == NULL)
+        return;
+    for (space = 0; space < 2; space++) {
+        rectindex_grid_free(&index->grid[space]);
+        willus_mem_free((double **)&index->rect[space], funcname);
+        willus_mem_free((double **)&index->line[space], funcname);
+    }
+    willus_mem_free((double **)&index->order, funcname);
+    willus_mem_free((double **)&index, funcname);
+}
+
+/*
+ ** The rect maps the index was built for now start at rect map first
+ ** (e.g. after they were appended to other ones).
+ */
+void k2pdfopt_rectindex_shift(KOPTRectIndex *index, int first) {
+    int i;
+
+    for (i = 0; i < index->n; i++)
+        index->order[i] += first;
+}
+
+/*
+ ** Have the following reflows of kctx keep their rect index for
+ ** k2pdfopt_rectindex_point() and _query().  Like a tile height, this
+ ** gives kctx library state, so k2pdfopt_context_release() must be called
+ ** once the context is done with.  keep = 0 frees the index.
+ */
+void k2pdfopt_rectindex_keep(KOPTContext *kctx, int keep) {
+    KOPTContextState *state;
+
+    state = k2pdfopt_context_state(kctx, keep);
+    if (state == NULL)
+        return;
+    state->keep_rectindex = keep ? 1 : 0;
+    if (!keep) {
+        k2pdfopt_rectindex_destroy(state->rectindex);
+        state->rectindex = NULL;
+    }
+}
+
+int k2pdfopt_rectindex_kept(KOPTContext *kctx) {
+    KOPTContextState *state;
+
+    state = k2pdfopt_context_state(kctx, 0);
+    return state != NULL && state->keep_rectindex;
+}
+
+/*
+ ** Rect map of kctx at (x,y) in the given space (edges included, like
+ ** wrectmap_inside()), the first one in reading order if rects overlap.
+ ** Returns -1 if there is none or the index was not kept.
+ */
+int k2pdfopt_rectindex_point(KOPTContext *kctx, int space, float x, float y) {
+    KOPTContextState *state;
+    KOPTRectIndex *index;
+    KOPTRectGrid *grid;
+    BBox *r;
+    int k, i, rank, best;
+
+    state = k2pdfopt_context_state(kctx, 0);
+    index = state != NULL ? state->rectindex : NULL;
+    if (index == NULL || index->n <= 0 || (space != KOPT_SPACE_REFLOWED && space != KOPT_SPACE_NATIVE))
+        return -1;
+    grid = &index->grid[space];
+    if (x < grid->extent.x0 || x > grid->extent.x1 || y < grid->extent.y0 || y > grid->extent.y1)
+        return -1;
+    k = rectindex_grid_row(grid, y) * grid->ncols + rectindex_grid_col(grid, x);
+    best = -1;
+    for (i = grid->cellstart[k]; i < grid->cellstart[k + 1]; i++) {
+        rank = grid->cellitems[i];
+        r = &index->rect[space][rank];
+        if ((best < 0 || rank < best) && r->x0 <= x && r->x1 >= x && r->y0 <= y && r->y1 >= y)
+            best = rank;
+    }
+    return best < 0 ? -1 : index->order[best];
+}
+
+/*
+ ** Rect maps of kctx that touch area in the given space, in reading
+ ** order.  The first max of them are stored in rectmaps; returns how many
+ ** there are in total.
+ */
+int k2pdfopt_rectindex_query(KOPTContext *kctx, int space, BBox *area, int *rectmaps, int max) {
+    static char *funcname = "k2pdfopt_rectindex_query";
+    KOPTContextState *state;
+    KOPTRectIndex *index;
+    KOPTRectGrid *grid;
+    BBox *r;
+    int *ranks;
+    int c, c1, c2, row, r1, r2, i, k, rank, n, na;
+
+    state = k2pdfopt_context_state(kctx, 0);
+    index = state != NULL ? state->rectindex : NULL;
+    if (index == NULL || index->n <= 0 || (space != KOPT_SPACE_REFLOWED && space != KOPT_SPACE_NATIVE))
+        return 0;
+    grid = &index->grid[space];
+    if (area->x1 < grid->extent.x0 || area->x0 > grid->extent.x1
+            || area->y1 < grid->extent.y0 || area->y0 > grid->extent.y1)
+        return 0;
+    c1 = rectindex_grid_col(grid, area->x0);
+    c2 = rectindex_grid_col(grid, area->x1);
+    r1 = rectindex_grid_row(grid, area->y0);
+    r2 = rectindex_grid_row(grid, area->y1);
+    na = 0;
+    for (row = r1; row <= r2; row++)
+        na += grid->cellstart[row * grid->ncols + c2 + 1] - grid->cellstart[row * grid->ncols + c1];
+    if (na == 0)
+        return 0;
+    willus_mem_alloc_warn((void **)&ranks, na * sizeof(int), funcname, 10);
+    n = 0;
+    for (row = r1; row <= r2; row++)
+        for (c = c1; c <= c2; c++) {
+            k = row * grid->ncols + c;
+            for (i = grid->cellstart[k]; i < grid->cellstart[k + 1]; i++) {
+                rank = grid->cellitems[i];
+                r = &index->rect[space][rank];
+                if (r->x0 > area->x1 || r->x1 < area->x0 || r->y0 > area->y1 || r->y1 < area->y0)
+                    continue;
+                /* a rect spanning several cells is only reported by the first one inside area */
+                if (rectindex_grid_col(grid, r->x0 > area->x0 ? r->x0 : area->x0) != c
+                        || rectindex_grid_row(grid, r->y0 > area->y0 ? r->y0 : area->y0) != row)
+                    continue;
+                ranks[n++] = rank;
+            }
+        }
+    qsort(ranks, n, sizeof(int), rectindex_compare_ints);
+    for (i = 0; i < n && i < max; i++)
+        rectmaps[i] = index->order[ranks[i]];
+    willus_mem_free((double **)&ranks, funcname);
+    return n;
+}
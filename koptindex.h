@@ -0,0 +1,66 @@
+/*
+ ** koptindex.h  spatial index over the rect maps of a reflowed page.
+ **
+ ** Copyright (C) 2012  http://willus.com
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU Affero General Public License as
+ ** published by the Free Software Foundation, either version 3 of the
+ ** License, or (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU Affero General Public License for more details.
+ **
+ ** You should have received a copy of the GNU Affero General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ */
+
+#ifndef _KOPTINDEX_H
+#define _KOPTINDEX_H
+
+#include "context.h"
+#include "koptstate.h"
+
+#define KOPT_SPACE_REFLOWED 0       // coordinates in kctx->dst
+#define KOPT_SPACE_NATIVE   1       // coordinates in the (unzoomed) source page
+
+/*
+ ** Uniform grid over the rects of one coordinate space.  The items of
+ ** cell (col,row) are cellitems[cellstart[k] .. cellstart[k+1]-1] with
+ ** k = row*ncols + col; items are reading order ranks.
+ */
+typedef struct {
+    BBox extent;
+    float cellw, cellh;
+    int ncols, nrows;
+    int *cellstart;
+    int *cellitems;
+} KOPTRectGrid;
+
+/*
+ ** Built once per reflowed page, and kept in the state of its context
+ ** (see koptstate.h) if the reader asked for it with
+ ** k2pdfopt_rectindex_keep().  Rects are stored by reading order
+ ** rank: rank r is rect map order[r] of kctx->rectmaps, and lies on
+ ** line[space][r] of its page.
+ */
+typedef struct KOPTRectIndex {
+    int n;
+    int *order;
+    int *line[2];
+    BBox *rect[2];
+    KOPTRectGrid grid[2];
+} KOPTRectIndex;
+
+KOPTRectIndex* k2pdfopt_rectindex_create(BBox *reflowed, BBox *native, int n, int first);
+void k2pdfopt_rectindex_destroy(KOPTRectIndex *index);
+void k2pdfopt_rectindex_shift(KOPTRectIndex *index, int first);
+void k2pdfopt_rectindex_keep(KOPTContext *kctx, int keep);
+int k2pdfopt_rectindex_kept(KOPTContext *kctx);
+int k2pdfopt_rectindex_point(KOPTContext *kctx, int space, float x, float y);
+int k2pdfopt_rectindex_query(KOPTContext *kctx, int space, BBox *area, int *rectmaps, int max);
+
+#endif
@@ -31,6 +31,7 @@
 #include <tesseract/capi.h>
 #endif
 #include <assert.h>
+#include <pthread.h>
 #include "setting.h"
 #include "koptocr.h"
 #include "tcapi.h"
@@ -40,19 +41,337 @@ l_int32 k2pdfopt_pixGetWordBoxesInTextlines(PIX *pixs, l_int32 maxsize,
 		l_int32 reduction, l_int32 minwidth, l_int32 minheight,
 		l_int32 maxwidth, l_int32 maxheight, BOXA **pboxad, NUMA **pnai);
 
-void* tess_api = NULL;
+/*
+ ** Warm tesseract engines, keyed by data dir, language and engine mode.
+ ** A thread checks an engine out for its exclusive use and back in when
+ ** done, so different threads OCR at the same time.  Idle engines stay
+ ** loaded for the next user until the memory budget or the slots run out,
+ ** then the least recently used idle ones go first.
+ */
+typedef struct {
+	int used;               // slot taken; api is NULL while it is starting
+	int busy;               // checked out
+	unsigned long stamp;    // last checkin, for LRU eviction
+	double cost;            // estimated memory, in bytes
+	void *api;
+	char datadir[MAXFILENAMELEN];
+	char lang[64];
+	char loaded[64];        // languages tesseract actually loaded
+	int oem;                // tesseract engine mode, see tess_capi_init()
+} KOPTOCREngine;
 
-void k2pdfopt_tocr_init(char *datadir, char *lang) {
-	if (tess_api != NULL && strncmp(lang, k2pdfopt_tocr_get_language(tess_api), 32)) {
-		k2pdfopt_tocr_end(tess_api);
-	}
-	if (tess_api == NULL) {
-		int status;
-		tess_api = ocrtess_init(datadir, NULL, 0, lang, NULL, NULL, 0, &status);
-		if (tess_api == NULL) {
-			printf("fail to start tesseract OCR engine\n");
+static KOPTOCREngine tess_engines[KOPT_TOCR_MAX_ENGINES];
+static unsigned long tess_stamp = 0;
+static double tess_budget = KOPT_TOCR_BUDGET_MB * 1024. * 1024.;
+/* engine the word box and language calls refer to, set by k2pdfopt_tocr_init() */
+static char tess_datadir[MAXFILENAMELEN] = "";
+static char tess_lang[64] = "";
+/* languages loaded by the engine of tess_datadir and tess_lang */
+static char tess_loaded_lang[64] = "";
+static pthread_mutex_t tess_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tess_checkin = PTHREAD_COND_INITIALIZER;
+/* tesseract sets the process locale while it loads its data */
+static pthread_mutex_t tess_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+	WILLUSBITMAP *src;
+	int *rects;
+	int nrects;
+	char *words;
+	int max_length;
+	int ocr_type;
+	int allow_spaces;
+	int std_proc;
+	int next;               // next rect to OCR
+	pthread_mutex_t mutex;
+} KOPTOCRBatch;
+
+typedef struct {
+	KOPTOCRBatch *batch;
+	void *api;
+} KOPTOCRWorker;
+
+/*
+ ** Same as ocrtess_init(), with the engine mode.  The languages the
+ ** engine loaded go to loaded (64 chars).
+ */
+static void *tocr_engine_start(char *datadir, char *lang, int oem, char *loaded) {
+	char tesspath[MAXFILENAMELEN];
+	char langdef[16];
+	int status;
+	void *api;
+
+	ocrtess_datapath(tesspath, datadir, MAXFILENAMELEN - 1);
+	if (lang == NULL || lang[0] == '\0')
+		ocrtess_lang_default(tesspath, NULL, 0, langdef, 16, NULL, 0, 0);
+	else {
+		strncpy(langdef, lang, 15);
+		langdef[15] = '\0';
+	}
+	pthread_mutex_lock(&tess_init_mutex);
+	api = tess_capi_init(tesspath, langdef, oem, NULL, NULL, 0, &status);
+	pthread_mutex_unlock(&tess_init_mutex);
+	if (api == NULL) {
+		printf("fail to start tesseract OCR engine\n");
+		loaded[0] = '\0';
+		return api;
+	}
+#ifndef NO_TESSERACT
+	strncpy(loaded, TessBaseAPIGetInitLanguagesAsString(api), 63);
+#else
+	strncpy(loaded, langdef, 63);
+#endif
+	loaded[63] = '\0';
+	return api;
+}
+
+/* A loaded engine takes about as much memory as its .traineddata files */
+static double tocr_engine_cost(char *datadir, char *lang) {
+	char tesspath[MAXFILENAMELEN], filename[MAXFILENAMELEN];
+	char one[64];
+	double size, cost;
+	int i, n;
+
+	ocrtess_datapath(tesspath, datadir, MAXFILENAMELEN - 1);
+	cost = 0.;
+	/* languages are given as e.g. "eng+deu" */
+	while (lang[0] != '\0') {
+		for (n = 0; lang[n] != '\0' && lang[n] != '+'; n++);
+		i = n < 63 ? n : 63;
+		strncpy(one, lang, i);
+		one[i] = '\0';
+		lang += lang[n] == '+' ? n + 1 : n;
+		if (one[0] == '\0')
+			continue;
+		wfile_fullname(filename, tesspath, one);
+		strcat(filename, ".traineddata");
+		size = wfile_size(filename);
+		cost += size > 0. ? size : KOPT_TOCR_DEFAULT_COST_MB * 1024. * 1024.;
+	}
+	return cost > 0. ? cost : KOPT_TOCR_DEFAULT_COST_MB * 1024. * 1024.;
+}
+
+static int tocr_engine_matches(KOPTOCREngine *engine, char *datadir, char *lang, int oem) {
+	return engine->used && engine->oem == oem
+		&& !strcmp(engine->datadir, datadir) && !strcmp(engine->lang, lang);
+}
+
+/* must hold tess_mutex; least recently used idle engine, if any */
+static KOPTOCREngine *tocr_engine_lru_idle() {
+	KOPTOCREngine *engine;
+	int i;
+
+	engine = NULL;
+	for (i = 0; i < KOPT_TOCR_MAX_ENGINES; i++)
+		if (tess_engines[i].used && !tess_engines[i].busy && tess_engines[i].api != NULL
+				&& (engine == NULL || tess_engines[i].stamp < engine->stamp))
+			engine = &tess_engines[i];
+	return engine;
+}
+
+/*
+ ** must hold tess_mutex; take idle engines out of the pool, LRU first,
+ ** while the pool is over budget.  Their apis go to evicted, to be ended
+ ** once the lock is released.  Returns how many.
+ */
+static int tocr_evict_locked(void **evicted) {
+	KOPTOCREngine *engine;
+	double total;
+	int i, n;
+
+	n = 0;
+	while (1) {
+		total = 0.;
+		for (i = 0; i < KOPT_TOCR_MAX_ENGINES; i++)
+			if (tess_engines[i].used)
+				total += tess_engines[i].cost;
+		if (total <= tess_budget || (engine = tocr_engine_lru_idle()) == NULL)
+			break;
+		evicted[n++] = engine->api;
+		engine->used = 0;
+		engine->api = NULL;
+	}
+	return n;
+}
+
+static void tocr_end_engines(void **apis, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		ocrtess_end(apis[i]);
+}
+
+/*
+ ** Check out an engine for (datadir, lang, oem), starting one if there is
+ ** no idle one.  If all slots are busy, waits for a checkin when wait is
+ ** set, otherwise returns NULL (as it does if the engine fails to start).
+ */
+static KOPTOCREngine *tocr_checkout(char *datadir, char *lang, int oem, int wait) {
+	KOPTOCREngine *engine;
+	void *evicted[KOPT_TOCR_MAX_ENGINES];
+	char loaded[64];
+	void *api;
+	double cost, total;
+	int i, n, have;
+
+	if (datadir == NULL)
+		datadir = "";
+	if (lang == NULL)
+		lang = "";
+	cost = -1.;
+	n = 0;
+	pthread_mutex_lock(&tess_mutex);
+	while (1) {
+		for (i = 0; i < KOPT_TOCR_MAX_ENGINES; i++)
+			if (tocr_engine_matches(&tess_engines[i], datadir, lang, oem)
+					&& !tess_engines[i].busy && tess_engines[i].api != NULL) {
+				engine = &tess_engines[i];
+				engine->busy = 1;
+				pthread_mutex_unlock(&tess_mutex);
+				return engine;
+			}
+		/*
+		 * No idle engine:  only now is the cost of another one needed.
+		 * Take it from an engine of the same key, or size up the data
+		 * files without holding the lock, then look again.
+		 */
+		if (cost < 0.) {
+			for (i = 0; i < KOPT_TOCR_MAX_ENGINES; i++)
+				if (tocr_engine_matches(&tess_engines[i], datadir, lang, oem))
+					cost = tess_engines[i].cost;
+			if (cost < 0.) {
+				pthread_mutex_unlock(&tess_mutex);
+				cost = tocr_engine_cost(datadir, lang);
+				pthread_mutex_lock(&tess_mutex);
+				continue;
+			}
+		}
+		/*
+		 * Another engine for a key that already has one only if it fits
+		 * in a free slot and the budget; otherwise wait for that one.
+		 */
+		have = 0;
+		total = cost;
+		engine = NULL;
+		for (i = 0; i < KOPT_TOCR_MAX_ENGINES; i++) {
+			if (!tess_engines[i].used) {
+				if (engine == NULL)
+					engine = &tess_engines[i];
+				continue;
+			}
+			total += tess_engines[i].cost;
+			if (tocr_engine_matches(&tess_engines[i], datadir, lang, oem))
+				have = 1;
+		}
+		if (engine != NULL && (!have || total <= tess_budget))
+			break;
+		if (!wait) {
+			pthread_mutex_unlock(&tess_mutex);
+			return NULL;
+		}
+		/* no engine of this key at all: make room for one */
+		if (engine == NULL && !have && (engine = tocr_engine_lru_idle()) != NULL) {
+			evicted[n++] = engine->api;
+			engine->used = 0;
+			engine->api = NULL;
+			break;
 		}
+		pthread_cond_wait(&tess_checkin, &tess_mutex);
 	}
+	/* reserve the slot and start the engine without holding the lock */
+	engine->used = 1;
+	engine->busy = 1;
+	engine->api = NULL;
+	engine->cost = cost;
+	engine->oem = oem;
+	strncpy(engine->datadir, datadir, MAXFILENAMELEN - 1);
+	engine->datadir[MAXFILENAMELEN - 1] = '\0';
+	strncpy(engine->lang, lang, 63);
+	engine->lang[63] = '\0';
+	pthread_mutex_unlock(&tess_mutex);
+	tocr_end_engines(evicted, n);
+
+	api = tocr_engine_start(datadir, lang, oem, loaded);
+
+	pthread_mutex_lock(&tess_mutex);
+	engine->api = api;
+	engine->cost = cost;
+	strcpy(engine->loaded, loaded);
+	if (api == NULL) {
+		engine->used = engine->busy = 0;
+		pthread_cond_broadcast(&tess_checkin);
+		engine = NULL;
+	}
+	n = tocr_evict_locked(evicted);
+	pthread_mutex_unlock(&tess_mutex);
+	tocr_end_engines(evicted, n);
+	return engine;
+}
+
+static void tocr_checkin(KOPTOCREngine *engine) {
+	void *evicted[KOPT_TOCR_MAX_ENGINES];
+	int n;
+
+	if (engine == NULL)
+		return;
+	pthread_mutex_lock(&tess_mutex);
+	engine->busy = 0;
+	engine->stamp = ++tess_stamp;
+	n = tocr_evict_locked(evicted);
+	pthread_cond_broadcast(&tess_checkin);
+	pthread_mutex_unlock(&tess_mutex);
+	tocr_end_engines(evicted, n);
+}
+
+/*
+ ** Checks out an engine of the current language (last given to
+ ** k2pdfopt_tocr_init() or k2pdfopt_tocr_single_word()).
+ */
+static KOPTOCREngine *tocr_checkout_current() {
+	KOPTOCREngine *engine;
+	char datadir[MAXFILENAMELEN], lang[64];
+
+	pthread_mutex_lock(&tess_mutex);
+	strcpy(datadir, tess_datadir);
+	strcpy(lang, tess_lang);
+	pthread_mutex_unlock(&tess_mutex);
+	engine = tocr_checkout(datadir, lang, 0, 1);
+	pthread_mutex_lock(&tess_mutex);
+	if (engine != NULL && !strcmp(datadir, tess_datadir) && !strcmp(lang, tess_lang))
+		strcpy(tess_loaded_lang, engine->loaded);
+	pthread_mutex_unlock(&tess_mutex);
+	return engine;
+}
+
+static void tocr_set_current(char *datadir, char *lang) {
+	pthread_mutex_lock(&tess_mutex);
+	strncpy(tess_datadir, datadir != NULL ? datadir : "", MAXFILENAMELEN - 1);
+	strncpy(tess_lang, lang != NULL ? lang : "", 63);
+	pthread_mutex_unlock(&tess_mutex);
+}
+
+/*
+ ** Make lang the current language and have an engine for it ready.
+ ** Engines of other languages are kept (see k2pdfopt_tocr_set_budget()).
+ */
+void k2pdfopt_tocr_init(char *datadir, char *lang) {
+	tocr_set_current(datadir, lang);
+	tocr_checkin(tocr_checkout_current());
+}
+
+/*
+ ** Memory all loaded engines may take together, in megabytes.  Idle
+ ** engines are ended, least recently used first, to stay within it.
+ */
+void k2pdfopt_tocr_set_budget(int megabytes) {
+	void *evicted[KOPT_TOCR_MAX_ENGINES];
+	int n;
+
+	pthread_mutex_lock(&tess_mutex);
+	tess_budget = megabytes * 1024. * 1024.;
+	n = tocr_evict_locked(evicted);
+	pthread_mutex_unlock(&tess_mutex);
+	tocr_end_engines(evicted, n);
 }
 
 void k2pdfopt_tocr_single_word(WILLUSBITMAP *src,
@@ -60,41 +379,166 @@ void k2pdfopt_tocr_single_word(WILLUSBITMAP *src,
 		char *word, int max_length,
 		char *datadir, char *lang, int ocr_type,
 		int allow_spaces, int std_proc) {
-	k2pdfopt_tocr_init(datadir, lang);
-	if (tess_api != NULL) {
-		ocrtess_from_bmp8(tess_api,
+	KOPTOCREngine *engine;
+
+	/* the word box calls use this language too, as after k2pdfopt_tocr_init() */
+	tocr_set_current(datadir, lang);
+	engine = tocr_checkout_current();
+	if (engine != NULL) {
+		ocrtess_from_bmp8(engine->api,
 				word, max_length, src,
 				x, y, x + w, y + h, 100, //XXX 100dpi
 				ocr_type, allow_spaces, std_proc, stderr);
 	}
+	tocr_checkin(engine);
+}
+
+static void *tocr_words_worker(void *arg) {
+	KOPTOCRWorker *worker = (KOPTOCRWorker *)arg;
+	KOPTOCRBatch *batch = worker->batch;
+	int i, *r;
+
+	while (1) {
+		pthread_mutex_lock(&batch->mutex);
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->mutex);
+		if (i >= batch->nrects)
+			break;
+		r = &batch->rects[4 * i];
+		ocrtess_from_bmp8(worker->api,
+				&batch->words[i * batch->max_length], batch->max_length, batch->src,
+				r[0], r[1], r[0] + r[2], r[1] + r[3], 100, //XXX 100dpi
+				batch->ocr_type, batch->allow_spaces, batch->std_proc, stderr);
+	}
+	return NULL;
 }
 
+/*
+ ** OCR nrects words of src at once.  rects holds x, y, w, h of each word;
+ ** the text of word i goes to words + i*max_length.  The words are shared
+ ** out over up to nthreads engines of the pool (nthreads <= 0: one per
+ ** cpu); only the first one is waited for if the pool is busy.
+ */
+void k2pdfopt_tocr_words(WILLUSBITMAP *src, int *rects, int nrects,
+		char *words, int max_length,
+		char *datadir, char *lang, int ocr_type,
+		int allow_spaces, int std_proc, int nthreads) {
+	KOPTOCRBatch batch;
+	KOPTOCREngine *engines[KOPT_TOCR_MAX_ENGINES];
+	KOPTOCRWorker workers[KOPT_TOCR_MAX_ENGINES];
+	pthread_t threads[KOPT_TOCR_MAX_ENGINES];
+	int i, nengines, nstarted;
+
+	for (i = 0; i < nrects; i++)
+		words[i * max_length] = '\0';
+	if (nrects <= 0)
+		return;
+	if (nthreads <= 0)
+		nthreads = wsys_num_cpus();
+	if (nthreads > nrects)
+		nthreads = nrects;
+	if (nthreads > KOPT_TOCR_MAX_ENGINES)
+		nthreads = KOPT_TOCR_MAX_ENGINES;
+	batch.src = src;
+	batch.rects = rects;
+	batch.nrects = nrects;
+	batch.words = words;
+	batch.max_length = max_length;
+	batch.ocr_type = ocr_type;
+	batch.allow_spaces = allow_spaces;
+	batch.std_proc = std_proc;
+	batch.next = 0;
+	pthread_mutex_init(&batch.mutex, NULL);
+
+	for (nengines = 0; nengines < nthreads; nengines++) {
+		engines[nengines] = tocr_checkout(datadir, lang, 0, nengines == 0);
+		if (engines[nengines] == NULL)
+			break;
+	}
+	nstarted = 0;
+	for (i = 1; i < nengines; i++) {
+		workers[i].batch = &batch;
+		workers[i].api = engines[i]->api;
+		if (pthread_create(&threads[i], NULL, tocr_words_worker, &workers[i]) != 0)
+			break;
+		nstarted = i;
+	}
+	if (nengines > 0) {
+		/* the calling thread works too */
+		workers[0].batch = &batch;
+		workers[0].api = engines[0]->api;
+		tocr_words_worker(&workers[0]);
+	}
+	for (i = 1; i <= nstarted; i++)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < nengines; i++)
+		tocr_checkin(engines[i]);
+	pthread_mutex_destroy(&batch.mutex);
+}
+
+/*
+ ** Copy the languages tesseract loaded for the current language ("" if
+ ** none yet) into buf, truncated to len-1 characters.  Safe to call from
+ ** any thread.  Returns the length of the full string.
+ */
+int k2pdfopt_tocr_copy_language(char *buf, int len) {
+	int n;
+
+	pthread_mutex_lock(&tess_mutex);
+	n = strlen(tess_loaded_lang);
+	if (buf != NULL && len > 0) {
+		strncpy(buf, tess_loaded_lang, len - 1);
+		buf[len - 1] = '\0';
+	}
+	pthread_mutex_unlock(&tess_mutex);
+	return n;
+}
+
+/*
+ ** Same as k2pdfopt_tocr_copy_language(), for readers that call it from
+ ** one thread only:  the string is kept in a static buffer that the next
+ ** call overwrites.
+ */
 const char* k2pdfopt_tocr_get_language() {
-	return TessBaseAPIGetInitLanguagesAsString(tess_api);
+	static char lang[64];
+
+	k2pdfopt_tocr_copy_language(lang, sizeof(lang));
+	return lang;
 }
 
+/* End every engine, waiting for the ones checked out to come back */
 void k2pdfopt_tocr_end() {
-	if (tess_api != NULL) {
-		ocrtess_end(tess_api);
-		tess_api = NULL;
-	}
+	void *ended[KOPT_TOCR_MAX_ENGINES];
+	int i, n, busy;
+
+	n = 0;
+	pthread_mutex_lock(&tess_mutex);
+	do {
+		busy = 0;
+		for (i = 0; i < KOPT_TOCR_MAX_ENGINES; i++) {
+			if (!tess_engines[i].used)
+				continue;
+			if (tess_engines[i].busy) {
+				busy = 1;
+				continue;
+			}
+			ended[n++] = tess_engines[i].api;
+			tess_engines[i].used = 0;
+			tess_engines[i].api = NULL;
+		}
+		if (busy)
+			pthread_cond_wait(&tess_checkin, &tess_mutex);
+	} while (busy);
+	pthread_mutex_unlock(&tess_mutex);
+	tocr_end_engines(ended, n);
 }
 
 void k2pdfopt_get_word_boxes(KOPTContext *kctx, WILLUSBITMAP *src,
 		int x, int y, int w, int h, int box_type) {
-	static K2PDFOPT_SETTINGS _k2settings, *k2settings;
 	PIX *pixs, *pixt, *pixb;
 	int words;
 	BOXA **pboxa;
 	NUMA **pnai;
-	char initstr[256];
-
-	k2settings = &_k2settings;
-	/* Initialize settings */
-	k2pdfopt_settings_init_from_koptcontext(k2settings, kctx);
-	k2pdfopt_settings_quick_sanity_check(k2settings);
-	/* Init for new source doc */
-	k2pdfopt_settings_new_source_document_init(k2settings, initstr);
 
 	if (box_type == 0) {
 		pboxa = &kctx->rboxa;
@@ -155,6 +599,7 @@ PIX* bitmap2pix(WILLUSBITMAP *src, int x, int y, int w, int h) {
 
 int k2pdfopt_get_word_boxes_from_tesseract(PIX *pixs, int is_cjk,
 		BOXA **pboxad, NUMA **pnai) {
+	KOPTOCREngine *engine;
 	BOXA *boxa, *boxad;
 	BOXAA *baa;
 	NUMA *nai;
@@ -168,11 +613,14 @@ int k2pdfopt_get_word_boxes_from_tesseract(PIX *pixs, int is_cjk,
 	if (!pixs)
 		return ERROR_INT("pixs not defined", procName, 1);
 
-	if (tess_capi_get_word_boxes(tess_api, pixs, &boxa, is_cjk, stderr) != 0) {
+	engine = tocr_checkout_current();
+	if (engine == NULL || tess_capi_get_word_boxes(engine->api, pixs, &boxa, is_cjk, stderr) != 0) {
+		tocr_checkin(engine);
 		*pboxad = NULL;
 		*pnai = NULL;
 		return ERROR_INT("Tesseract failed to get word boxes", procName, 1);
 	}
+	tocr_checkin(engine);
 	/* 2D sort the bounding boxes of these words. */
 	baa = boxaSort2d(boxa, NULL, 3, -5, 5);
 
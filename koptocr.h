@@ -26,18 +26,31 @@
 #include "leptonica.h"
 #include "tesseract.h"
 
+#define KOPT_TOCR_MAX_ENGINES       8       // engine slots, over all languages
+#define KOPT_TOCR_BUDGET_MB         256     // default memory budget for the engines
+#define KOPT_TOCR_DEFAULT_COST_MB   30      // if the size of the data is not known
+
 void k2pdfopt_tocr_init(char *datadir, char *lang);
 
 void k2pdfopt_tocr_end();
 
+void k2pdfopt_tocr_set_budget(int megabytes);
+
 const char* k2pdfopt_tocr_get_language();
 
+int k2pdfopt_tocr_copy_language(char *buf, int len);
+
 void k2pdfopt_tocr_single_word(WILLUSBITMAP *src,
 		int x, int y, int w, int h,
 		char *word, int max_length,
 		char *datadir, char *lang, int ocr_type,
 		int allow_spaces, int std_proc);
 
+void k2pdfopt_tocr_words(WILLUSBITMAP *src, int *rects, int nrects,
+		char *words, int max_length,
+		char *datadir, char *lang, int ocr_type,
+		int allow_spaces, int std_proc, int nthreads);
+
 void k2pdfopt_get_reflowed_word_boxes(KOPTContext *kctx, WILLUSBITMAP *src,
 		int x, int y, int w, int h);
 
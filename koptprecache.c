@@ -0,0 +1,386 @@
+/*
+ ** koptprecache.c  background page reflow for koreader.
+ **
+ ** Copyright (C) 2012  http://willus.com
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU Affero General Public License as
+ ** published by the Free Software Foundation, either version 3 of the
+ ** License, or (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU Affero General Public License for more details.
+ **
+ ** You should have received a copy of the GNU Affero General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ */
+
+/*
+ ** Typical use from the reader: after showing page N, render the source
+ ** bitmaps of pages N+1..N+k into contexts with precache set and submit
+ ** them.  When the user turns the page, fetch it; on a hit the reflowed
+ ** page is moved into the context without any processing.  Jumping to
+ ** another page should cancel the jobs outside the new window.  Changing
+ ** a reflow parameter (zoom, margins, ...) drops every job submitted with
+ ** the old parameters on the next submit.
+ */
+
+#include "koptprecache.h"
+#include "koptreflow.h"
+#include "koptindex.h"
+
+static void precache_key_from_koptcontext(KOPTPrecacheKey *key, KOPTContext *kctx, int pageno) {
+    /* zero the padding too so that keys can be compared with memcmp() */
+    memset(key, 0, sizeof(KOPTPrecacheKey));
+    key->pageno = pageno;
+    key->page_height = kctx->page_height;
+    key->tile_height = k2pdfopt_reflow_get_tile_height(kctx);
+    key->keep_rectindex = k2pdfopt_rectindex_kept(kctx);
+    key->zoom = kctx->zoom;
+    key->bbox = kctx->bbox;
+    k2pdfopt_settings_key_from_koptcontext(&key->settings, kctx);
+}
+
+/* same reflow parameters, regardless of the page */
+static int precache_same_params(KOPTPrecacheKey *k1, KOPTPrecacheKey *k2) {
+    KOPTPrecacheKey key;
+
+    key = (*k2);
+    key.pageno = k1->pageno;
+    return !memcmp(k1, &key, sizeof(KOPTPrecacheKey));
+}
+
+static void precache_free_koptcontext(KOPTContext *kctx) {
+    bmp_free(&kctx->src);
+    bmp_free(&kctx->dst);
+    wrectmaps_free(&kctx->rectmaps);
+    boxaDestroy(&kctx->rboxa);
+    numaDestroy(&kctx->rnai);
+    boxaDestroy(&kctx->nboxa);
+    numaDestroy(&kctx->nnai);
+    k2pdfopt_context_release(kctx);
+}
+
+static void precache_unlink_entry(KOPTPrecache *precache, KOPTPrecacheEntry *entry) {
+    KOPTPrecacheEntry **p;
+
+    for (p = &precache->entries; (*p) != NULL; p = &(*p)->next)
+        if ((*p) == entry) {
+            (*p) = entry->next;
+            break;
+        }
+}
+
+static void precache_free_entry(KOPTPrecache *precache, KOPTPrecacheEntry *entry) {
+    precache_unlink_entry(precache, entry);
+    precache_free_koptcontext(&entry->kctx);
+    willus_mem_free((double **)&entry, "precache_free_entry");
+}
+
+/* drop entry now, or as soon as its worker is done with it */
+static void precache_drop_entry(KOPTPrecache *precache, KOPTPrecacheEntry *entry) {
+    if (entry->state == KOPT_PRECACHE_RUNNING)
+        entry->cancelled = 1;
+    else
+        precache_free_entry(precache, entry);
+}
+
+static KOPTPrecacheEntry *precache_find(KOPTPrecache *precache, KOPTPrecacheKey *key) {
+    KOPTPrecacheEntry *entry;
+
+    for (entry = precache->entries; entry != NULL; entry = entry->next)
+        if (!entry->cancelled && !memcmp(&entry->key, key, sizeof(KOPTPrecacheKey)))
+            return entry;
+    return NULL;
+}
+
+/*
+ ** Make room for one more page.  Finished pages go first (least recently
+ ** used one first), then the jobs that were queued the longest time ago.
+ ** Returns 0 if every slot is taken by a running job.
+ */
+static int precache_make_room(KOPTPrecache *precache) {
+    KOPTPrecacheEntry *entry, *done, *queued;
+    int n;
+
+    while (1) {
+        n = 0;
+        done = queued = NULL;
+        for (entry = precache->entries; entry != NULL; entry = entry->next) {
+            if (entry->cancelled)
+                continue;
+            n++;
+            if (entry->state == KOPT_PRECACHE_DONE
+                    && (done == NULL || entry->stamp < done->stamp))
+                done = entry;
+            if (entry->state == KOPT_PRECACHE_QUEUED
+                    && (queued == NULL || entry->stamp < queued->stamp))
+                queued = entry;
+        }
+        if (n < precache->maxpages)
+            return 1;
+        if (done != NULL)
+            precache_free_entry(precache, done);
+        else if (queued != NULL)
+            precache_free_entry(precache, queued);
+        else
+            return 0;
+    }
+}
+
+static void *precache_worker(void *arg) {
+    KOPTPrecache *precache;
+    KOPTPrecacheEntry *entry, *job;
+    KOPTSession *session;
+
+    precache = (KOPTPrecache *)arg;
+    session = k2pdfopt_session_create();
+    pthread_mutex_lock(&precache->mutex);
+    while (1) {
+        /* oldest queued job first */
+        job = NULL;
+        for (entry = precache->entries; entry != NULL; entry = entry->next)
+            if (entry->state == KOPT_PRECACHE_QUEUED
+                    && (job == NULL || entry->stamp < job->stamp))
+                job = entry;
+        if (job == NULL) {
+            if (precache->quit)
+                break;
+            pthread_cond_wait(&precache->queued, &precache->mutex);
+            continue;
+        }
+        job->state = KOPT_PRECACHE_RUNNING;
+        pthread_mutex_unlock(&precache->mutex);
+        k2pdfopt_session_reflow_bmp(session, &job->kctx);
+        pthread_mutex_lock(&precache->mutex);
+        job->state = KOPT_PRECACHE_DONE;
+        job->stamp = ++precache->stamp;
+        if (job->cancelled)
+            precache_free_entry(precache, job);
+        pthread_cond_broadcast(&precache->done);
+    }
+    pthread_mutex_unlock(&precache->mutex);
+    k2pdfopt_session_destroy(session);
+    return NULL;
+}
+
+KOPTPrecache* k2pdfopt_precache_create(int nthreads, int maxpages) {
+    static char *funcname="k2pdfopt_precache_create";
+    KOPTPrecache *precache;
+    int i;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (maxpages < 1)
+        maxpages = 1;
+    willus_mem_alloc_warn((void **)&precache, sizeof(KOPTPrecache), funcname, 10);
+    willus_mem_alloc_warn((void **)&precache->threads, sizeof(pthread_t)*nthreads, funcname, 10);
+    pthread_mutex_init(&precache->mutex, NULL);
+    pthread_cond_init(&precache->queued, NULL);
+    pthread_cond_init(&precache->done, NULL);
+    precache->quit = 0;
+    precache->maxpages = maxpages;
+    precache->stamp = 0;
+    precache->entries = NULL;
+    for (i = 0; i < nthreads; i++)
+        if (pthread_create(&precache->threads[i], NULL, precache_worker, precache) != 0)
+            break;
+    precache->nthreads = i;
+    if (precache->nthreads == 0) {
+        k2pdfopt_precache_destroy(precache);
+        return NULL;
+    }
+    return precache;
+}
+
+void k2pdfopt_precache_destroy(KOPTPrecache *precache) {
+    KOPTPrecacheEntry *entry, *next;
+    int i;
+
+    if (precache == NULL)
+        return;
+    pthread_mutex_lock(&precache->mutex);
+    precache->quit = 1;
+    /* running jobs are freed by their workers */
+    for (entry = precache->entries; entry != NULL; entry = next) {
+        next = entry->next;
+        precache_drop_entry(precache, entry);
+    }
+    pthread_cond_broadcast(&precache->queued);
+    pthread_mutex_unlock(&precache->mutex);
+    for (i = 0; i < precache->nthreads; i++)
+        pthread_join(precache->threads[i], NULL);
+    pthread_cond_destroy(&precache->done);
+    pthread_cond_destroy(&precache->queued);
+    pthread_mutex_destroy(&precache->mutex);
+    willus_mem_free((double **)&precache->threads, "k2pdfopt_precache_destroy");
+    willus_mem_free((double **)&precache, "k2pdfopt_precache_destroy");
+}
+
+/*
+ ** Queue a background reflow of page pageno.  Only contexts the reader
+ ** marked with kctx->precache are taken; others are left alone and -1 is
+ ** returned.  The source bitmap of kctx is taken over by the job
+ ** (kctx->src is left empty), just like k2pdfopt_reflow_bmp() frees it.
+ ** Returns 0 if the job was queued or the page is already cached, -1 if
+ ** it could not be queued.
+ */
+int k2pdfopt_precache_submit(KOPTPrecache *precache, KOPTContext *kctx, int pageno) {
+    static char *funcname="k2pdfopt_precache_submit";
+    KOPTPrecacheEntry *entry, *next;
+    KOPTContextState *state;
+    KOPTPrecacheKey key;
+    int status;
+
+    if (precache == NULL || !kctx->precache || kctx->src.data == NULL)
+        return -1;
+    precache_key_from_koptcontext(&key, kctx, pageno);
+    pthread_mutex_lock(&precache->mutex);
+    /* reflow parameters changed: nothing submitted before is of any use */
+    for (entry = precache->entries; entry != NULL; entry = next) {
+        next = entry->next;
+        if (!entry->cancelled && !precache_same_params(&entry->key, &key))
+            precache_drop_entry(precache, entry);
+    }
+    if (precache_find(precache, &key) != NULL)
+        status = 0;
+    else if (!precache_make_room(precache))
+        status = -1;
+    else
+        status = 1;
+    if (status <= 0) {
+        pthread_mutex_unlock(&precache->mutex);
+        bmp_free(&kctx->src);
+        return status;
+    }
+    willus_mem_alloc_warn((void **)&entry, sizeof(KOPTPrecacheEntry), funcname, 10);
+    entry->state = KOPT_PRECACHE_QUEUED;
+    entry->cancelled = 0;
+    entry->stamp = ++precache->stamp;
+    entry->key = key;
+    /* private copy of the parameters; the result buffers start out empty */
+    entry->kctx = (*kctx);
+    entry->kctx.rboxa = NULL;
+    entry->kctx.rnai = NULL;
+    entry->kctx.nboxa = NULL;
+    entry->kctx.nnai = NULL;
+    entry->kctx.language = NULL;
+    wrectmaps_init(&entry->kctx.rectmaps);
+    pageregions_init(&entry->kctx.pageregions);
+    bmp_init(&entry->kctx.dst);
+    k2pdfopt_reflow_set_tile_height(&entry->kctx, key.tile_height);
+    k2pdfopt_rectindex_keep(&entry->kctx, key.keep_rectindex);
+    state = k2pdfopt_context_state(kctx, 0);
+    if (state != NULL && state->pagecache != NULL)
+        k2pdfopt_pagecache_set_page(&entry->kctx, state->pagecache, state->pageno);
+    /* the job outlives the caller's pixmap */
+    bmp_own(&entry->kctx.src, 0);
+    bmp_init(&kctx->src);
+    entry->next = precache->entries;
+    precache->entries = entry;
+    pthread_cond_signal(&precache->queued);
+    pthread_mutex_unlock(&precache->mutex);
+    return 0;
+}
+
+/*
+ ** Move the reflowed page pageno into kctx if it was precached with the
+ ** reflow parameters of kctx.  A page that is still being reflowed is
+ ** waited for if wait is set; a page still in the queue is then reflowed
+ ** right away on the calling thread.  Returns 1 on a hit (kctx then looks
+ ** exactly as after k2pdfopt_reflow_bmp()), 0 otherwise.
+ */
+int k2pdfopt_precache_fetch(KOPTPrecache *precache, KOPTContext *kctx, int pageno, int wait) {
+    KOPTPrecacheEntry *entry;
+    KOPTContextState *state;
+    KOPTPrecacheKey key;
+    int i, first;
+
+    if (precache == NULL)
+        return 0;
+    precache_key_from_koptcontext(&key, kctx, pageno);
+    pthread_mutex_lock(&precache->mutex);
+    while ((entry = precache_find(precache, &key)) != NULL && entry->state != KOPT_PRECACHE_DONE) {
+        if (!wait)
+            break;
+        if (entry->state == KOPT_PRECACHE_QUEUED) {
+            /* reflow it here, like a worker would */
+            entry->state = KOPT_PRECACHE_RUNNING;
+            pthread_mutex_unlock(&precache->mutex);
+            k2pdfopt_reflow_bmp(&entry->kctx);
+            pthread_mutex_lock(&precache->mutex);
+            entry->state = KOPT_PRECACHE_DONE;
+            entry->stamp = ++precache->stamp;
+            if (entry->cancelled) {
+                /* cancelled while it was reflowed */
+                precache_free_entry(precache, entry);
+                entry = NULL;
+            }
+            pthread_cond_broadcast(&precache->done);
+            break;
+        }
+        pthread_cond_wait(&precache->done, &precache->mutex);
+    }
+    if (entry == NULL || entry->state != KOPT_PRECACHE_DONE) {
+        pthread_mutex_unlock(&precache->mutex);
+        return 0;
+    }
+    precache_unlink_entry(precache, entry);
+    pthread_mutex_unlock(&precache->mutex);
+
+    /* hand the results over to kctx, as k2pdfopt_reflow_bmp() leaves them */
+    bmp_free(&kctx->dst);
+    kctx->dst = entry->kctx.dst;
+    bmp_init(&entry->kctx.dst);
+    /* the rect maps of the page are appended, so the index moves along */
+    first = kctx->rectmaps.n;
+    for (i = 0; i < entry->kctx.rectmaps.n; i++)
+        wrectmaps_add_wrectmap(&kctx->rectmaps, &entry->kctx.rectmaps.wrectmap[i]);
+    state = k2pdfopt_context_state(&entry->kctx, 0);
+    if (state != NULL && state->rectindex != NULL)
+        k2pdfopt_rectindex_shift(state->rectindex, first);
+    boxaDestroy(&kctx->rboxa);
+    numaDestroy(&kctx->rnai);
+    boxaDestroy(&kctx->nboxa);
+    numaDestroy(&kctx->nnai);
+    kctx->rboxa = entry->kctx.rboxa;
+    kctx->rnai = entry->kctx.rnai;
+    kctx->nboxa = entry->kctx.nboxa;
+    kctx->nnai = entry->kctx.nnai;
+    entry->kctx.rboxa = NULL;
+    entry->kctx.rnai = NULL;
+    entry->kctx.nboxa = NULL;
+    entry->kctx.nnai = NULL;
+    k2pdfopt_context_state_move(kctx, &entry->kctx);
+    kctx->page_width = entry->kctx.page_width;
+    kctx->page_height = entry->kctx.page_height;
+    kctx->precache = 0;
+    bmp_free(&kctx->src);
+    precache_free_koptcontext(&entry->kctx);
+    willus_mem_free((double **)&entry, "k2pdfopt_precache_fetch");
+    return 1;
+}
+
+/*
+ ** Drop every queued, running or finished page outside first_page..last_page
+ ** (e.g. after a jump to another part of the document).  Pass first_page >
+ ** last_page to drop everything.  Running jobs are not interrupted but
+ ** their results are discarded.
+ */
+void k2pdfopt_precache_cancel(KOPTPrecache *precache, int first_page, int last_page) {
+    KOPTPrecacheEntry *entry, *next;
+
+    if (precache == NULL)
+        return;
+    pthread_mutex_lock(&precache->mutex);
+    for (entry = precache->entries; entry != NULL; entry = next) {
+        next = entry->next;
+        if (!entry->cancelled
+                && (entry->key.pageno < first_page || entry->key.pageno > last_page))
+            precache_drop_entry(precache, entry);
+    }
+    pthread_mutex_unlock(&precache->mutex);
+}
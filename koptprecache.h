@@ -0,0 +1,81 @@
+/*
+ ** koptprecache.h  background page reflow for koreader.
+ **
+ ** Copyright (C) 2012  http://willus.com
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU Affero General Public License as
+ ** published by the Free Software Foundation, either version 3 of the
+ ** License, or (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU Affero General Public License for more details.
+ **
+ ** You should have received a copy of the GNU Affero General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ */
+
+#ifndef _KOPTPRECACHE_H
+#define _KOPTPRECACHE_H
+
+#include <pthread.h>
+#include "k2pdfopt.h"
+#include "context.h"
+#include "setting.h"
+#include "koptsession.h"
+
+#define KOPT_PRECACHE_QUEUED    0
+#define KOPT_PRECACHE_RUNNING   1
+#define KOPT_PRECACHE_DONE      2
+
+/*
+ ** Everything a reflowed page depends on besides the source bitmap.
+ ** A cached page is only handed out for a context with an equal key.
+ */
+typedef struct {
+    int pageno;
+    int page_height;
+    int tile_height;
+    int keep_rectindex;
+    double zoom;
+    BBox bbox;
+    KOPTSettingsKey settings;
+} KOPTPrecacheKey;
+
+typedef struct KOPTPrecacheEntry {
+    int state;                      // KOPT_PRECACHE_QUEUED, _RUNNING or _DONE
+    int cancelled;                  // result is dropped once the worker is done
+    unsigned long stamp;            // submit order while queued, last use once done
+    KOPTPrecacheKey key;
+    KOPTContext kctx;               // private context: src in, dst and boxes out
+    struct KOPTPrecacheEntry *next;
+} KOPTPrecacheEntry;
+
+/*
+ ** A pool of worker threads, each with its own KOPTSession, that reflow
+ ** submitted pages in the background and keep at most maxpages results.
+ ** Only contexts with KOPTContext.precache set are submitted; a fetch
+ ** clears the flag, as a reflow does.
+ */
+typedef struct KOPTPrecache {
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;          // signalled when a job is submitted
+    pthread_cond_t done;            // signalled when a job finishes
+    int quit;
+    int nthreads;
+    int maxpages;
+    unsigned long stamp;
+    KOPTPrecacheEntry *entries;
+    pthread_t *threads;
+} KOPTPrecache;
+
+KOPTPrecache* k2pdfopt_precache_create(int nthreads, int maxpages);
+void k2pdfopt_precache_destroy(KOPTPrecache *precache);
+int k2pdfopt_precache_submit(KOPTPrecache *precache, KOPTContext *kctx, int pageno);
+int k2pdfopt_precache_fetch(KOPTPrecache *precache, KOPTContext *kctx, int pageno, int wait);
+void k2pdfopt_precache_cancel(KOPTPrecache *precache, int first_page, int last_page);
+
+#endif
@@ -29,102 +29,189 @@
 
 #include "setting.h"
 #include "koptreflow.h"
+#include "koptindex.h"
 #include "leptonica.h"
 
+static void set_grey_palette(WILLUSBITMAP *bmp) {
+    int i;
+
+    for (i = 0; i < 256; i++)
+        bmp->red[i] = bmp->blue[i] = bmp->green[i] = i;
+}
+
+/*
+ ** Copy a pixmap (width x height of bmp, rows not padded) with 1 (grey),
+ ** 2 (grey + alpha) or 4 (RGBA) components into bmp.  Native bitmap rows
+ ** are not padded either, so the whole pixmap converts in one run.
+ */
 void pixmap_to_bmp(WILLUSBITMAP *bmp, unsigned char *pix_data, int ncomp) {
-    int i,j;
-    unsigned char *b, *p;
+    int n;
 
-    if (ncomp == 2) {
+    bmp->type = WILLUSBITMAP_TYPE_NATIVE;
+    n = bmp->width * bmp->height;
+    if (ncomp == 1) {
+        bmp->bpp = 8;
+        bmp_alloc(bmp);
+        set_grey_palette(bmp);
+        memcpy(bmp->data, pix_data, n);
+    } else if (ncomp == 2) {
         bmp->bpp = 8;
         bmp_alloc(bmp);
-        // set palette
-        for (i = 0; i < 256; i++)
-            bmp->red[i] = bmp->blue[i] = bmp->green[i] = i;
-        for (i = 0; i < bmp->height; i++) {
-            b = bmp_rowptr_from_top(bmp, i);
-            p = pix_data + 2*i*bmp->width;
-            for (j = 0; j < bmp->width; j++) {
-                b[j] = p[2*j];
-            }
-        }
+        set_grey_palette(bmp);
+        bmpsimd_ga_to_grey(bmp->data, pix_data, n);
     } else if (ncomp == 4) {
         bmp->bpp = 24;
         bmp_alloc(bmp);
-        for (i = 0; i < bmp->height; i++) {
-            b = bmp_rowptr_from_top(bmp, i);
-            p = pix_data + 4*i*bmp->width;
-            for (j = 0; j < bmp->width; j++) {
-                b[j] = p[4*j];
-                b[j+1] = p[4*j+1];
-                b[j+2] = p[4*j+2];
-            }
-        }
+        bmpsimd_rgba_to_rgb(bmp->data, pix_data, n);
+    }
+}
+
+/*
+ ** Like pixmap_to_bmp(), but a grey pixmap (ncomp == 1) is not copied:
+ ** bmp becomes a view of pix_data (see bmp_borrow()), which must then
+ ** stay valid until bmp is freed, and may be modified by the reflow.
+ */
+void pixmap_to_bmp_view(WILLUSBITMAP *bmp, unsigned char *pix_data, int ncomp) {
+    if (ncomp != 1) {
+        pixmap_to_bmp(bmp, pix_data, ncomp);
+        return;
+    }
+    bmp->type = WILLUSBITMAP_TYPE_NATIVE;
+    bmp->bpp = 8;
+    set_grey_palette(bmp);
+    bmp_borrow(bmp, pix_data, bmp->width * bmp->height);
+}
+
+/*
+ ** With a tile height > 0 the reflowed page is not put into kctx->dst but
+ ** cut into tiles of tile_height rows (the last one may be shorter), which
+ ** are only rendered when asked for, so that a long page in scroll mode
+ ** costs one screen of memory on top of its text rows.  The tile height
+ ** is kept with the other library state of kctx (see koptstate.h); set it
+ ** before the reflow.
+ */
+void k2pdfopt_reflow_set_tile_height(KOPTContext *kctx, int tile_height) {
+    KOPTContextState *state;
+
+    state = k2pdfopt_context_state(kctx, tile_height > 0);
+    if (state != NULL)
+        state->tile_height = tile_height > 0 ? tile_height : 0;
+}
+
+int k2pdfopt_reflow_get_tile_height(KOPTContext *kctx) {
+    KOPTContextState *state;
+
+    state = k2pdfopt_context_state(kctx, 0);
+    return state != NULL ? state->tile_height : 0;
+}
+
+/*
+ ** Renders tile tileno of the page reflowed last into tile, reusing its
+ ** storage.  Returns 0, or -1 if there is no such tile.
+ */
+int k2pdfopt_reflow_get_tile(KOPTContext *kctx, int tileno, WILLUSBITMAP *tile) {
+    KOPTContextState *state;
+    WILLUSBITMAP *master;
+    int y0, row, bw, i, th;
+
+    state = k2pdfopt_context_state(kctx, 0);
+    if (state == NULL)
+        return -1;
+    master = &state->master;
+    th = state->tile_height;
+    y0 = tileno * th;
+    if (th <= 0 || master->data == NULL || tileno < 0 || y0 >= kctx->page_height)
+        return -1;
+    tile->width = master->width;
+    tile->height = y0 + th < kctx->page_height ? th : kctx->page_height - y0;
+    tile->bpp = master->bpp;
+    tile->type = WILLUSBITMAP_TYPE_NATIVE;
+    bmp_alloc(tile);
+    memcpy(tile->red, master->red, sizeof(int) * 256);
+    memcpy(tile->green, master->green, sizeof(int) * 256);
+    memcpy(tile->blue, master->blue, sizeof(int) * 256);
+    bw = bmp_bytewidth(master);
+    for (i = 0; i < tile->height; i++) {
+        row = y0 + i - state->master_top;
+        if (row >= 0 && row < master->height)
+            memcpy(bmp_rowptr_from_top(tile, i), bmp_rowptr_from_top(master, row), bw);
+        else
+            memset(bmp_rowptr_from_top(tile, i), 255, bw);
     }
+    return 0;
 }
 
 void k2pdfopt_reflow_bmp(KOPTContext *kctx) {
-    K2PDFOPT_SETTINGS _k2settings, *k2settings;
-    MASTERINFO _masterinfo, *masterinfo;
-    WILLUSBITMAP _srcgrey, *srcgrey;
+    KOPTSession *session;
+
+    session = k2pdfopt_session_create();
+    k2pdfopt_session_reflow_bmp(session, kctx);
+    k2pdfopt_session_destroy(session);
+}
+
+void k2pdfopt_session_reflow_bmp(KOPTSession *session, KOPTContext *kctx) {
+    K2PDFOPT_SETTINGS *k2settings;
+    MASTERINFO *masterinfo;
+    KOPTContextState *state;
+    KOPTRectIndex *index;
+    WILLUSBITMAP *srcgrey;
     WILLUSBITMAP *src, *dst;
-    BMPREGION region;
-    int i, bw, martop, marbot, marleft;
-    char initstr[256];
+    BMPREGION *region;
+    int martop, marbot, marleft, height;
 
     src = &kctx->src;
-    srcgrey = &_srcgrey;
-    bmp_init(srcgrey);
-
-    k2settings = &_k2settings;
-    masterinfo = &_masterinfo;
-    /* Initialize settings */
-    k2pdfopt_settings_init_from_koptcontext(k2settings, kctx);
-    k2pdfopt_settings_quick_sanity_check(k2settings);
-    /* Init for new source doc */
-    k2pdfopt_settings_new_source_document_init(k2settings, initstr);
-    /* Init master output structure */
-    masterinfo_init(masterinfo, k2settings);
-    wrapbmp_init(&masterinfo->wrapbmp, k2settings->dst_color);
+    /* Init settings, master output structure and region for new page */
+    k2pdfopt_session_begin_page(session, kctx, KOPT_SESSION_REFLOW);
+    k2settings = &session->k2settings;
+    masterinfo = &session->masterinfo;
+    srcgrey = &session->srcgrey;
+    region = &session->region;
     /* Init new source bitmap */
-    bmpregion_init(&region);
-    masterinfo_new_source_page_init(masterinfo, k2settings, src, srcgrey, NULL,
-            &region, k2settings->src_rot, NULL, NULL, 1, -1, NULL );
+    k2pdfopt_session_new_source_page(session, kctx);
     /* Set output size */
-    k2pdfopt_settings_set_margins_and_devsize(k2settings,&region,masterinfo,-1.,0);
+    k2pdfopt_settings_set_margins_and_devsize(k2settings,region,masterinfo,-1.,0);
     /* Process single source page */
-    bmpregion_source_page_add(&region, k2settings, masterinfo, 1, 0);
+    bmpregion_source_page_add(region, k2settings, masterinfo, 1, 0);
     wrapbmp_flush(masterinfo, k2settings, 0);
 
     if (fabs(k2settings->dst_gamma - 1.0) > .001)
         bmp_gamma_correct(&masterinfo->bmp, &masterinfo->bmp,
                 k2settings->dst_gamma);
 
-    /* copy master bitmap to context dst bitmap */
+    /* hand master bitmap over to context dst bitmap */
     dst = &kctx->dst;
     martop = (int) (k2settings->dst_dpi * k2settings->dstmargins.box[1] * 2 + .5);
     marbot = (int) (k2settings->dst_dpi * k2settings->dstmargins.box[1] * 2 + .5);
     marleft = (int) (k2settings->dst_dpi * k2settings->dstmargins.box[0] + .5);
-    dst->bpp = masterinfo->bmp.bpp;
-    dst->width = masterinfo->bmp.width;
     // avoid too small page height that will cause perfermance issue in scroll mode
-    dst->height = masterinfo->rows + martop + marbot > kctx->page_height
-        ? masterinfo->rows + martop + marbot : kctx->page_height;
-    bmp_alloc(dst);
-    bmp_fill(dst, 255, 255, 255);
-    bw = bmp_bytewidth(&masterinfo->bmp);
-    for (i = 0; i < masterinfo->rows; i++)
-        memcpy(bmp_rowptr_from_top(dst, i + martop),
-                bmp_rowptr_from_top(&masterinfo->bmp, i), bw);
-
-    kctx->page_width = kctx->dst.width;
-    kctx->page_height = kctx->dst.height;
+    height = masterinfo->rows + martop + marbot > kctx->page_height
+            ? masterinfo->rows + martop + marbot : kctx->page_height;
+    state = k2pdfopt_context_state(kctx, 0);
+    if (state != NULL && state->tile_height > 0) {
+        /* keep only the rows; tiles with the margins are made on request */
+        k2pdfopt_session_hand_over_master(session, &state->master, 0, masterinfo->rows);
+        state->master_top = martop;
+        bmp_free(dst);
+        kctx->page_width = state->master.width;
+        kctx->page_height = height;
+    } else {
+        if (state != NULL)
+            bmp_free(&state->master);
+        k2pdfopt_session_hand_over_master(session, dst, martop, height);
+        kctx->page_width = kctx->dst.width;
+        kctx->page_height = kctx->dst.height;
+    }
     kctx->precache = 0;
 
-    int j;
-    BOXA *rboxa = boxaCreate(masterinfo->rectmaps.n);
-    BOXA *nboxa = boxaCreate(masterinfo->rectmaps.n);
-    for (j = 0; j < masterinfo->rectmaps.n; j++) {
+    int j, n, first;
+    n = masterinfo->rectmaps.n;
+    first = kctx->rectmaps.n;
+    BOXA *rboxa = boxaCreate(n);
+    BOXA *nboxa = boxaCreate(n);
+    BBox *rrects, *nrects;
+    willus_mem_alloc_warn((void **)&rrects, (n + 1) * sizeof(BBox), "k2pdfopt_session_reflow_bmp", 10);
+    willus_mem_alloc_warn((void **)&nrects, (n + 1) * sizeof(BBox), "k2pdfopt_session_reflow_bmp", 10);
+    for (j = 0; j < n; j++) {
         WRECTMAP * rectmap = &masterinfo->rectmaps.wrectmap[j];
         rectmap->coords[1].x += marleft;
         rectmap->coords[1].y += martop;
@@ -136,6 +223,14 @@ void k2pdfopt_reflow_bmp(KOPTContext *kctx) {
                               rectmap->coords[0].y*k2settings->src_dpi/rectmap->srcdpih/kctx->zoom + kctx->bbox.y0,
                               rectmap->coords[2].x*k2settings->src_dpi/rectmap->srcdpiw/kctx->zoom,
                               rectmap->coords[2].y*k2settings->src_dpi/rectmap->srcdpih/kctx->zoom);
+        rrects[j].x0 = rectmap->coords[1].x;
+        rrects[j].y0 = rectmap->coords[1].y;
+        rrects[j].x1 = rectmap->coords[1].x + rectmap->coords[2].x;
+        rrects[j].y1 = rectmap->coords[1].y + rectmap->coords[2].y;
+        nrects[j].x0 = rectmap->coords[0].x*k2settings->src_dpi/rectmap->srcdpiw/kctx->zoom + kctx->bbox.x0;
+        nrects[j].y0 = rectmap->coords[0].y*k2settings->src_dpi/rectmap->srcdpih/kctx->zoom + kctx->bbox.y0;
+        nrects[j].x1 = nrects[j].x0 + rectmap->coords[2].x*k2settings->src_dpi/rectmap->srcdpiw/kctx->zoom;
+        nrects[j].y1 = nrects[j].y0 + rectmap->coords[2].y*k2settings->src_dpi/rectmap->srcdpih/kctx->zoom;
         boxaAddBox(rboxa, rlbox, L_INSERT);
         boxaAddBox(nboxa, nlbox, L_INSERT);
         wrectmaps_add_wrectmap(&kctx->rectmaps, rectmap);
@@ -146,21 +241,39 @@ void k2pdfopt_reflow_bmp(KOPTContext *kctx) {
                 rectmap->coords[2].x, rectmap->coords[2].y,
                 rectmap->srcdpiw,     rectmap->srcdpih);*/
     }
-    /* 2D sort the bounding boxes of these words. */
-    BOXAA *rbaa = boxaSort2d(rboxa, NULL, 3, -5, 5);
-    BOXAA *nbaa = boxaSort2d(nboxa, NULL, 3, -5, 5);
+    /*
+     * Index the rects for hit-testing.  The index also puts them in reading
+     * order and finds the lines, which is what the word boxes need.
+     */
+    index = k2pdfopt_rectindex_create(rrects, nrects, n, first);
+    willus_mem_free((double **)&rrects, "k2pdfopt_session_reflow_bmp");
+    willus_mem_free((double **)&nrects, "k2pdfopt_session_reflow_bmp");
 
-    /* Flatten the boxaa, saving the boxa index for each box */
-    kctx->rboxa = boxaaFlattenToBoxa(rbaa, &kctx->rnai, L_CLONE);
-    kctx->nboxa = boxaaFlattenToBoxa(nbaa, &kctx->nnai, L_CLONE);
+    /* Word boxes in reading order, with the line index of each box */
+    kctx->rboxa = boxaCreate(n);
+    kctx->nboxa = boxaCreate(n);
+    kctx->rnai = numaCreate(n);
+    kctx->nnai = numaCreate(n);
+    for (j = 0; j < n; j++) {
+        int item = index->order[j] - first;
+        boxaAddBox(kctx->rboxa, boxaGetBox(rboxa, item, L_CLONE), L_INSERT);
+        boxaAddBox(kctx->nboxa, boxaGetBox(nboxa, item, L_CLONE), L_INSERT);
+        numaAddNumber(kctx->rnai, index->line[KOPT_SPACE_REFLOWED][j]);
+        numaAddNumber(kctx->nnai, index->line[KOPT_SPACE_NATIVE][j]);
+    }
+    state = k2pdfopt_context_state(kctx, 0);
+    if (state != NULL) {
+        k2pdfopt_rectindex_destroy(state->rectindex);
+        state->rectindex = NULL;
+    }
+    if (state != NULL && state->keep_rectindex)
+        state->rectindex = index;
+    else
+        k2pdfopt_rectindex_destroy(index);
 
     boxaDestroy(&rboxa);
-    boxaaDestroy(&rbaa);
     boxaDestroy(&nboxa);
-    boxaaDestroy(&nbaa);
 
     bmp_free(src);
-    bmp_free(srcgrey);
-    bmpregion_free(&region);
-    masterinfo_free(masterinfo, k2settings);
+    k2pdfopt_session_end_page(session);
 }
@@ -23,9 +23,16 @@
 
 #include "k2pdfopt.h"
 #include "context.h"
+#include "koptsession.h"
+#include "koptstate.h"
 
 void k2pdfopt_reflow_bmp(KOPTContext *kctx);
+void k2pdfopt_session_reflow_bmp(KOPTSession *session, KOPTContext *kctx);
 void pixmap_to_bmp(WILLUSBITMAP *bmp, unsigned char *pix_data, int ncomp);
+void k2pdfopt_reflow_set_tile_height(KOPTContext *kctx, int tile_height);
+int k2pdfopt_reflow_get_tile_height(KOPTContext *kctx);
+int k2pdfopt_reflow_get_tile(KOPTContext *kctx, int tileno, WILLUSBITMAP *tile);
+void pixmap_to_bmp_view(WILLUSBITMAP *bmp, unsigned char *pix_data, int ncomp);
 
 #endif
 
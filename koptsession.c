@@ -0,0 +1,583 @@
+/*
+ ** koptsession.c  persistent page processing session for koreader.
+ **
+ **
+ ** Copyright (C) 2012  http://willus.com
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU Affero General Public License as
+ ** published by the Free Software Foundation, either version 3 of the
+ ** License, or (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU Affero General Public License for more details.
+ **
+ ** You should have received a copy of the GNU Affero General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ */
+
+#include <pthread.h>
+#include "koptsession.h"
+#include "koptstate.h"
+
+/*
+ ** Cache of preprocessed source pages (greyscale conversion, contrast,
+ ** straightening ... done by masterinfo_new_source_page_init()), so that
+ ** e.g. re-flowing the same page with new output settings, or cropping
+ ** and then reflowing it, skips straight to the layout stage.  The
+ ** trimmed margins of the crop api are kept as well.
+ **
+ ** The reader keeps one cache per open document and tells which page a
+ ** context holds with k2pdfopt_pagecache_set_page(); contexts without a
+ ** page are not cached.  A hit does not copy the page: kctx->src and the
+ ** session's srcgrey become views of the cached bitmaps (see
+ ** bmp_borrow()), and the session holds a reference to the entry until
+ ** the end of the page.  On a miss the preprocessed bitmaps are moved
+ ** into a new entry the same way.  This relies on the layout stage not
+ ** writing into the source bitmaps, which is true unless crop boxes or
+ ** source marking are used; such pages are not cached.
+ */
+typedef struct KOPTPageCacheEntry {
+    int refs;                       // the cache while listed, plus one per borrowing session
+    unsigned long stamp;            // last use, for LRU replacement
+    KOPTPageKey key;
+    WILLUSBITMAP src;               // source bitmap after preprocessing
+    WILLUSBITMAP srcgrey;
+    int white;
+    int rotdeg;
+    double srcpage_rot_deg;
+    double srcpage_fine_rot_deg;
+    int autocrop_margins[4];
+    int trimmed;                    // 1 if the fields below are set
+    int trim_mode;                  // session mode and settings they were trimmed with
+    KOPTSettingsKey trim_key;
+    int c1, c2, r1, r2;
+    TEXTROW bbox;
+    struct KOPTPageCacheEntry *next;
+} KOPTPageCacheEntry;
+
+struct KOPTPageCache {
+    pthread_mutex_t mutex;
+    int refs;                       // the reader, plus contexts and sessions using it
+    int maxpages;
+    int npages;
+    unsigned long stamp;
+    KOPTPageCacheEntry *entries;
+};
+
+static void session_derive_settings(K2PDFOPT_SETTINGS *k2settings, KOPTContext *kctx, int mode) {
+    int i;
+    char initstr[256];
+
+    /* Initialize settings */
+    k2pdfopt_settings_init_from_koptcontext(k2settings, kctx);
+    if (mode != KOPT_SESSION_OPTIMIZE)
+        k2pdfopt_settings_quick_sanity_check(k2settings);
+    /* Init for new source doc */
+    k2pdfopt_settings_new_source_document_init(k2settings, initstr);
+    if (mode == KOPT_SESSION_OPTIMIZE) {
+        /* Additional settings for optimization */
+        k2settings->text_wrap=0;
+        k2settings->max_columns=1;
+        k2settings->vertical_break_threshold=-2;
+        k2settings->src_dpi=kctx->dev_dpi;
+        k2settings->dst_userwidth=1.0;
+        k2settings->dst_userwidth_units=UNITS_SOURCE;
+        k2settings->dst_userheight=1.0;
+        k2settings->dst_userheight_units=UNITS_SOURCE;
+        k2settings->dst_fit_to_page=-2;
+        k2settings->src_trim=0;
+        for (i=0;i<4;i++)
+            k2settings->dstmargins.box[i]=.0;
+        k2settings->pad_left=k2settings->pad_top=k2settings->pad_bottom=k2settings->pad_right=0;
+        k2settings->mark_corners=0;
+        k2pdfopt_settings_quick_sanity_check(k2settings);
+    }
+}
+
+/* hand the storage kept in pool over to bmp (which must be freshly inited) */
+static void session_lend_bitmap(WILLUSBITMAP *pool, WILLUSBITMAP *bmp) {
+    bmp->data = pool->data;
+    bmp->size_allocated = pool->size_allocated;
+    pool->data = NULL;
+    pool->size_allocated = 0;
+}
+
+/* take the storage of bmp back into pool, keeping the larger buffer */
+static void session_reclaim_bitmap(WILLUSBITMAP *pool, WILLUSBITMAP *bmp) {
+    if (bmp->data == NULL)
+        return;
+    if (bmp->size_allocated < pool->size_allocated) {
+        bmp_free(bmp);
+        return;
+    }
+    bmp_free(pool);
+    pool->data = bmp->data;
+    pool->size_allocated = bmp->size_allocated;
+    bmp->data = NULL;
+    bmp->size_allocated = 0;
+}
+
+static void pagecache_free_entry(KOPTPageCacheEntry *entry) {
+    bmp_free(&entry->src);
+    bmp_free(&entry->srcgrey);
+    willus_mem_free((double **)&entry, "pagecache_free_entry");
+}
+
+/* give a page lent by pagecache_lookup() back to its cache */
+static void pagecache_return(KOPTPageCache *cache, KOPTPageCacheEntry *entry) {
+    int refs;
+
+    if (entry == NULL)
+        return;
+    pthread_mutex_lock(&cache->mutex);
+    refs = --entry->refs;
+    pthread_mutex_unlock(&cache->mutex);
+    if (refs == 0)
+        pagecache_free_entry(entry);
+}
+
+KOPTSession* k2pdfopt_session_create() {
+    static char *funcname="k2pdfopt_session_create";
+    KOPTSession *session;
+
+    willus_mem_alloc_warn((void **)&session, sizeof(KOPTSession), funcname, 10);
+    session->mode = -1;
+    memset(&session->key, 0, sizeof(KOPTSettingsKey));
+    bmp_init(&session->srcgrey);
+    bmp_init(&session->masterbmp);
+    bmp_init(&session->wrapbmp);
+    session->pagecache = NULL;
+    session->pageentry = NULL;
+    return session;
+}
+
+void k2pdfopt_session_destroy(KOPTSession *session) {
+    if (session == NULL)
+        return;
+    bmp_free(&session->srcgrey);
+    bmp_free(&session->masterbmp);
+    bmp_free(&session->wrapbmp);
+    willus_mem_free((double **)&session, "k2pdfopt_session_destroy");
+}
+
+/*
+ ** Prepare session->k2settings, masterinfo, region and srcgrey for a new
+ ** source page, re-deriving the settings only if the context changed.
+ */
+void k2pdfopt_session_begin_page(KOPTSession *session, KOPTContext *kctx, int mode) {
+    KOPTSettingsKey key;
+    K2PDFOPT_SETTINGS *k2settings;
+    MASTERINFO *masterinfo;
+
+    k2pdfopt_settings_key_from_koptcontext(&key, kctx);
+    if (mode != session->mode || memcmp(&key, &session->key, sizeof(KOPTSettingsKey))) {
+        session_derive_settings(&session->k2settings0, kctx, mode);
+        session->key = key;
+        session->mode = mode;
+    }
+    /* Every page starts from the settings of a new source document */
+    k2settings = &session->k2settings;
+    /* (this also resets the per-document layout state in k2settings->docstate) */
+    *k2settings = session->k2settings0;
+    /* Init master output structure on the kept buffers */
+    masterinfo = &session->masterinfo;
+    masterinfo_init(masterinfo, k2settings);
+    wrapbmp_init(&masterinfo->wrapbmp, k2settings->dst_color);
+    session_lend_bitmap(&session->masterbmp, &masterinfo->bmp);
+    session_lend_bitmap(&session->wrapbmp, &masterinfo->wrapbmp.bmp);
+    bmpregion_init(&session->region);
+}
+
+/*
+ ** Give the storage of the master bitmap to dst (freeing what dst had)
+ ** instead of copying it.  The master rows are moved down by top rows
+ ** in place and the bitmap is padded with white to at least height rows,
+ ** so only the margins get filled.
+ */
+void k2pdfopt_session_hand_over_master(KOPTSession *session, WILLUSBITMAP *dst, int top, int height) {
+    WILLUSBITMAP *bmp;
+    int bw, rows;
+
+    bmp = &session->masterinfo.bmp;
+    rows = session->masterinfo.rows;
+    if (height < top + rows)
+        height = top + rows;
+    bw = bmp_bytewidth(bmp);
+    bmp->height = height;
+    /* keeps the rows already there */
+    bmp_alloc(bmp);
+    if (top > 0) {
+        memmove(bmp_rowptr_from_top(bmp, top), bmp_rowptr_from_top(bmp, 0), (size_t)bw*rows);
+        memset(bmp_rowptr_from_top(bmp, 0), 255, (size_t)bw*top);
+    }
+    memset(bmp_rowptr_from_top(bmp, top + rows), 255, (size_t)bw*(height - top - rows));
+    bmp_free(dst);
+    dst->data = bmp->data;
+    dst->size_allocated = bmp->size_allocated;
+    dst->width = bmp->width;
+    dst->height = bmp->height;
+    dst->bpp = bmp->bpp;
+    dst->type = bmp->type;
+    bmp->data = NULL;
+    bmp->size_allocated = 0;
+}
+
+void k2pdfopt_session_end_page(KOPTSession *session) {
+    MASTERINFO *masterinfo;
+
+    masterinfo = &session->masterinfo;
+    session_reclaim_bitmap(&session->masterbmp, &masterinfo->bmp);
+    session_reclaim_bitmap(&session->wrapbmp, &masterinfo->wrapbmp.bmp);
+    bmpregion_free(&session->region);
+    masterinfo_free(masterinfo, &session->k2settings);
+    /* drop the view of a cached page before giving the page back */
+    if (bmp_is_borrowed(&session->srcgrey))
+        bmp_free(&session->srcgrey);
+    pagecache_return(session->pagecache, session->pageentry);
+    session->pageentry = NULL;
+    k2pdfopt_pagecache_release(session->pagecache);
+    session->pagecache = NULL;
+}
+
+
+/*
+ ** Cache for the pages of one document, holding at most maxpages of them
+ ** (KOPT_PAGECACHE_SIZE if maxpages < 1).
+ */
+KOPTPageCache* k2pdfopt_pagecache_create(int maxpages) {
+    static char *funcname="k2pdfopt_pagecache_create";
+    KOPTPageCache *cache;
+
+    willus_mem_alloc_warn((void **)&cache, sizeof(KOPTPageCache), funcname, 10);
+    pthread_mutex_init(&cache->mutex, NULL);
+    cache->refs = 1;
+    cache->maxpages = maxpages < 1 ? KOPT_PAGECACHE_SIZE : maxpages;
+    cache->npages = 0;
+    cache->stamp = 0;
+    cache->entries = NULL;
+    return cache;
+}
+
+/* must hold cache->mutex; returns 1 if the caller has to free entry */
+static int pagecache_unlink(KOPTPageCache *cache, KOPTPageCacheEntry *entry) {
+    KOPTPageCacheEntry **p;
+
+    for (p = &cache->entries; (*p) != NULL; p = &(*p)->next)
+        if ((*p) == entry) {
+            (*p) = entry->next;
+            cache->npages--;
+            return --entry->refs == 0;
+        }
+    return 0;
+}
+
+/*
+ ** Drop every cached page, e.g. when the reader runs low on memory.
+ ** Pages still in use by a reflow are freed when it is done with them.
+ */
+void k2pdfopt_pagecache_flush(KOPTPageCache *cache) {
+    KOPTPageCacheEntry *entry, *freelist;
+
+    if (cache == NULL)
+        return;
+    freelist = NULL;
+    pthread_mutex_lock(&cache->mutex);
+    while ((entry = cache->entries) != NULL)
+        if (pagecache_unlink(cache, entry)) {
+            entry->next = freelist;
+            freelist = entry;
+        }
+    pthread_mutex_unlock(&cache->mutex);
+    while ((entry = freelist) != NULL) {
+        freelist = entry->next;
+        pagecache_free_entry(entry);
+    }
+}
+
+/* drop one reference to cache, freeing it with the last one */
+void k2pdfopt_pagecache_release(KOPTPageCache *cache) {
+    int refs;
+
+    if (cache == NULL)
+        return;
+    pthread_mutex_lock(&cache->mutex);
+    refs = --cache->refs;
+    pthread_mutex_unlock(&cache->mutex);
+    if (refs > 0)
+        return;
+    k2pdfopt_pagecache_flush(cache);
+    pthread_mutex_destroy(&cache->mutex);
+    willus_mem_free((double **)&cache, "k2pdfopt_pagecache_release");
+}
+
+/*
+ ** Call when the document is closed.  The cached pages are freed right
+ ** away; the cache itself goes with the last context still set to one
+ ** of its pages (see k2pdfopt_context_release()).
+ */
+void k2pdfopt_pagecache_destroy(KOPTPageCache *cache) {
+    k2pdfopt_pagecache_flush(cache);
+    k2pdfopt_pagecache_release(cache);
+}
+
+/*
+ ** Tell that kctx->src is (will be) page pageno of the document of cache,
+ ** so that crop, reflow and optimize look it up there.  Pass cache NULL
+ ** for a bitmap that should not be cached.
+ */
+void k2pdfopt_pagecache_set_page(KOPTContext *kctx, KOPTPageCache *cache, int pageno) {
+    KOPTContextState *state;
+
+    state = k2pdfopt_context_state(kctx, cache != NULL);
+    if (state == NULL)
+        return;
+    if (cache != NULL) {
+        pthread_mutex_lock(&cache->mutex);
+        cache->refs++;
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    k2pdfopt_pagecache_release(state->pagecache);
+    state->pagecache = cache;
+    state->pageno = pageno;
+}
+
+/*
+ ** FNV-1a hash of a handful of evenly spaced rows of src:  cheap next to
+ ** the page preprocessing and enough to tell two pages apart when the
+ ** reader did not call k2pdfopt_pagecache_set_page() for the new one.
+ */
+#define PAGECACHE_FINGERPRINT_ROWS  8
+
+static unsigned long long pagecache_fingerprint(WILLUSBITMAP *src) {
+    unsigned long long h;
+    unsigned char *p;
+    long i, n;
+    int k, row;
+
+    h = 1469598103934665603ULL;
+    if (src->data == NULL || src->width <= 0 || src->height <= 0)
+        return h;
+    n = bmp_bytewidth(src);
+    for (k = 0; k < PAGECACHE_FINGERPRINT_ROWS; k++) {
+        row = (int)((2 * k + 1) * (long)src->height / (2 * PAGECACHE_FINGERPRINT_ROWS));
+        p = bmp_rowptr_from_top(src, row);
+        for (i = 0; i < n; i++) {
+            h ^= p[i];
+            h *= 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+static void pagecache_key(KOPTPageKey *key, KOPTContext *kctx, int pageno, K2PDFOPT_SETTINGS *k2settings) {
+    WILLUSBITMAP *src;
+    int i;
+
+    /* zero the padding too so that keys can be compared with memcmp() */
+    memset(key, 0, sizeof(KOPTPageKey));
+    src = &kctx->src;
+    key->pageno = pageno;
+    key->zoom = kctx->zoom;
+    key->bbox = kctx->bbox;
+    key->width = src->width;
+    key->height = src->height;
+    key->bpp = src->bpp;
+    key->fingerprint = pagecache_fingerprint(src);
+    key->src_rot = k2settings->src_rot;
+    key->src_left_to_right = k2settings->src_left_to_right;
+    key->src_whitethresh = k2settings->src_whitethresh;
+    key->src_paintwhite = k2settings->src_paintwhite;
+    key->src_erosion = k2settings->src_erosion;
+    key->src_dpi = k2settings->src_dpi;
+    key->src_autostraighten = k2settings->src_autostraighten;
+    key->src_trim = k2settings->src_trim;
+    key->dst_color = k2settings->dst_color;
+    key->show_marked_source = k2settings->show_marked_source;
+    key->autocrop = k2settings->autocrop;
+#ifdef HAVE_LEPTONICA_LIB
+    key->dewarp = k2settings->dewarp;
+#endif
+    key->use_crop_boxes = k2settings->use_crop_boxes;
+    key->erase_vertical_lines = k2settings->erase_vertical_lines;
+    key->erase_horizontal_lines = k2settings->erase_horizontal_lines;
+    key->debug = k2settings->debug;
+    key->verbose = k2settings->verbose;
+    for (i = 0; i < 4; i++) {
+        key->cropunits[i] = k2settings->srccropmargins.units[i];
+        key->cropbox[i] = k2settings->srccropmargins.box[i];
+    }
+    key->min_column_height_inches = k2settings->min_column_height_inches;
+    key->contrast_max = k2settings->contrast_max;
+    key->defect_size_pts = k2settings->defect_size_pts;
+}
+
+/* must hold cache->mutex */
+static KOPTPageCacheEntry *pagecache_find(KOPTPageCache *cache, KOPTPageKey *key) {
+    KOPTPageCacheEntry *entry;
+
+    for (entry = cache->entries; entry != NULL; entry = entry->next)
+        if (!memcmp(&entry->key, key, sizeof(KOPTPageKey)))
+            return entry;
+    return NULL;
+}
+
+/*
+ ** The cached page as a view: bitmap header and palette, not the pixels.
+ ** On a miss the view already shows the pixels just moved into the entry.
+ */
+static void pagecache_view(WILLUSBITMAP *view, WILLUSBITMAP *bmp) {
+    if (view->data != bmp->data)
+        bmp_free(view);
+    (*view) = (*bmp);
+    view->size_allocated = -abs(bmp->size_allocated);
+}
+
+/*
+ ** Same as masterinfo_new_source_page_init() on kctx->src for the current
+ ** page of the session, but served from the page cache when possible.
+ */
+void k2pdfopt_session_new_source_page(KOPTSession *session, KOPTContext *kctx) {
+    static char *funcname="k2pdfopt_session_new_source_page";
+    K2PDFOPT_SETTINGS *k2settings;
+    MASTERINFO *masterinfo;
+    BMPREGION *region;
+    KOPTContextState *state;
+    KOPTPageCache *cache;
+    KOPTPageCacheEntry *entry, *old;
+    int i;
+
+    k2settings = &session->k2settings;
+    masterinfo = &session->masterinfo;
+    region = &session->region;
+    /* the layout stage writes into the source bitmaps for these */
+    state = k2pdfopt_context_state(kctx, 0);
+    cache = state != NULL && !k2settings->show_marked_source
+            && k2cropboxes_count(&k2settings->cropboxes, K2CROPBOX_FLAGS_NOTUSED, 0) == 0
+            ? state->pagecache : NULL;
+    if (cache == NULL) {
+        masterinfo_new_source_page_init(masterinfo, k2settings, &kctx->src, &session->srcgrey,
+                NULL, region, k2settings->src_rot, NULL, NULL, 1, -1, NULL);
+        return;
+    }
+    pagecache_key(&session->pagekey, kctx, state->pageno, k2settings);
+    pthread_mutex_lock(&cache->mutex);
+    /* held until the end of the page */
+    cache->refs++;
+    session->pagecache = cache;
+    entry = pagecache_find(cache, &session->pagekey);
+    if (entry != NULL) {
+        entry->refs++;
+        entry->stamp = ++cache->stamp;
+        pthread_mutex_unlock(&cache->mutex);
+        session->pageentry = entry;
+        pagecache_view(&kctx->src, &entry->src);
+        pagecache_view(&session->srcgrey, &entry->srcgrey);
+        masterinfo_source_page_info_init(masterinfo, k2settings, region, 1, -1);
+        region->rotdeg = entry->rotdeg;
+        masterinfo->pageinfo.srcpage_rot_deg = entry->srcpage_rot_deg;
+        masterinfo->pageinfo.srcpage_fine_rot_deg = entry->srcpage_fine_rot_deg;
+        for (i = 0; i < 4; i++)
+            masterinfo->autocrop_margins[i] = entry->autocrop_margins[i];
+        masterinfo_source_page_region_init(masterinfo, k2settings, &kctx->src,
+                &session->srcgrey, NULL, region, entry->white, 1);
+        return;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    masterinfo_new_source_page_init(masterinfo, k2settings, &kctx->src, &session->srcgrey,
+            NULL, region, k2settings->src_rot, NULL, NULL, 1, -1, NULL);
+
+    /*
+     ** Move the results into a new entry and leave views of them behind,
+     ** unless the page got cached by someone else in the meantime.
+     */
+    if (!willus_mem_alloc((double **)&entry, sizeof(KOPTPageCacheEntry), funcname))
+        return;
+    /* kctx->src may still be a view of the reader's pixmap */
+    bmp_own(&kctx->src, 0);
+    entry->src = kctx->src;
+    entry->srcgrey = session->srcgrey;
+    entry->key = session->pagekey;
+    entry->white = region->bgcolor;
+    entry->rotdeg = region->rotdeg;
+    entry->srcpage_rot_deg = masterinfo->pageinfo.srcpage_rot_deg;
+    entry->srcpage_fine_rot_deg = masterinfo->pageinfo.srcpage_fine_rot_deg;
+    for (i = 0; i < 4; i++)
+        entry->autocrop_margins[i] = masterinfo->autocrop_margins[i];
+    entry->trimmed = 0;
+    old = NULL;
+    pthread_mutex_lock(&cache->mutex);
+    if (pagecache_find(cache, &session->pagekey) != NULL) {
+        pthread_mutex_unlock(&cache->mutex);
+        willus_mem_free((double **)&entry, funcname);
+        return;
+    }
+    if (cache->npages >= cache->maxpages) {
+        KOPTPageCacheEntry *e;
+
+        for (e = cache->entries; e != NULL; e = e->next)
+            if (old == NULL || e->stamp < old->stamp)
+                old = e;
+        if (!pagecache_unlink(cache, old))
+            old = NULL;
+    }
+    entry->refs = 2;
+    entry->stamp = ++cache->stamp;
+    entry->next = cache->entries;
+    cache->entries = entry;
+    cache->npages++;
+    pthread_mutex_unlock(&cache->mutex);
+    session->pageentry = entry;
+    pagecache_view(&kctx->src, &entry->src);
+    pagecache_view(&session->srcgrey, &entry->srcgrey);
+    if (old != NULL)
+        pagecache_free_entry(old);
+}
+
+/*
+ ** Trim the margins of the session region (whole source page), or take
+ ** them from the page cache if this page was trimmed with the same
+ ** settings before.
+ */
+void k2pdfopt_session_trim_margins(KOPTSession *session) {
+    BMPREGION *region;
+    KOPTPageCacheEntry *entry;
+    KOPTPageCache *cache;
+
+    region = &session->region;
+    entry = session->pageentry;
+    if (entry == NULL) {
+        bmpregion_trim_margins(region, &session->k2settings, 0xf);
+        return;
+    }
+    cache = session->pagecache;
+    pthread_mutex_lock(&cache->mutex);
+    if (entry->trimmed && entry->trim_mode == session->mode
+            && !memcmp(&entry->trim_key, &session->key, sizeof(KOPTSettingsKey))) {
+        region->c1 = entry->c1;
+        region->c2 = entry->c2;
+        region->r1 = entry->r1;
+        region->r2 = entry->r2;
+        region->bbox = entry->bbox;
+        pthread_mutex_unlock(&cache->mutex);
+        return;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    bmpregion_trim_margins(region, &session->k2settings, 0xf);
+
+    pthread_mutex_lock(&cache->mutex);
+    entry->trimmed = 1;
+    entry->trim_mode = session->mode;
+    entry->trim_key = session->key;
+    entry->c1 = region->c1;
+    entry->c2 = region->c2;
+    entry->r1 = region->r1;
+    entry->r2 = region->r2;
+    entry->bbox = region->bbox;
+    pthread_mutex_unlock(&cache->mutex);
+}
@@ -0,0 +1,114 @@
+/*
+ ** koptsession.h  persistent page processing session for koreader.
+ **
+ ** Copyright (C) 2012  http://willus.com
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU Affero General Public License as
+ ** published by the Free Software Foundation, either version 3 of the
+ ** License, or (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU Affero General Public License for more details.
+ **
+ ** You should have received a copy of the GNU Affero General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ */
+
+#ifndef _KOPTSESSION_H
+#define _KOPTSESSION_H
+
+#include "k2pdfopt.h"
+#include "context.h"
+#include "setting.h"
+
+#define KOPT_SESSION_REFLOW     0
+#define KOPT_SESSION_CROP       1
+#define KOPT_SESSION_OPTIMIZE   2
+
+#define KOPT_PAGECACHE_SIZE     4       // default number of pages per document
+
+/*
+ ** Identifies a source page within the page cache of its document: the
+ ** page number and rendering (zoom, bbox, size) the reader gave, a hash
+ ** of a few rows of kctx->src so that a context left on another page
+ ** cannot match, plus the derived settings that
+ ** masterinfo_new_source_page_init() reads.  Crop and reflow derive the
+ ** same values here, and so do reflows that only differ in output
+ ** settings (margins, spacing, justification, contrast ...).
+ */
+typedef struct {
+    int pageno;
+    double zoom;
+    BBox bbox;
+    int width;
+    int height;
+    int bpp;
+    unsigned long long fingerprint;
+    int src_rot;
+    int src_left_to_right;
+    int src_whitethresh;
+    int src_paintwhite;
+    int src_erosion;
+    int src_dpi;
+    int src_autostraighten;
+    int src_trim;
+    int dst_color;
+    int show_marked_source;
+    int autocrop;
+    int dewarp;
+    int use_crop_boxes;
+    int erase_vertical_lines;
+    int erase_horizontal_lines;
+    int debug;
+    int verbose;
+    int cropunits[4];
+    double cropbox[4];
+    double min_column_height_inches;
+    double contrast_max;
+    double defect_size_pts;
+} KOPTPageKey;
+
+/*
+ ** Preprocessed source pages of one document, see koptsession.c.  The
+ ** reader creates one per open document and destroys it on close.
+ */
+typedef struct KOPTPageCache KOPTPageCache;
+
+/*
+ ** A session keeps the derived settings and the large work buffers of
+ ** the page apis alive between pages.  Settings are only re-derived when
+ ** a KOPTContext field they depend on (or the kind of processing) changes.
+ */
+typedef struct KOPTSession {
+    int mode;                       // processing mode of k2settings0, -1 = none yet
+    KOPTSettingsKey key;            // context fields k2settings0 was derived from
+    K2PDFOPT_SETTINGS k2settings0;  // settings right after new source document init
+    K2PDFOPT_SETTINGS k2settings;   // per page working copy of k2settings0
+    MASTERINFO masterinfo;
+    BMPREGION region;
+    WILLUSBITMAP srcgrey;
+    WILLUSBITMAP masterbmp;         // master bitmap storage kept between pages
+    WILLUSBITMAP wrapbmp;           // wrap bitmap storage kept between pages
+    KOPTPageKey pagekey;            // source page of the current page
+    KOPTPageCache *pagecache;       // cache the current page was looked up in
+    struct KOPTPageCacheEntry *pageentry;   // cached page lent to the current page
+} KOPTSession;
+
+KOPTSession* k2pdfopt_session_create();
+void k2pdfopt_session_destroy(KOPTSession *session);
+void k2pdfopt_session_begin_page(KOPTSession *session, KOPTContext *kctx, int mode);
+void k2pdfopt_session_end_page(KOPTSession *session);
+void k2pdfopt_session_new_source_page(KOPTSession *session, KOPTContext *kctx);
+void k2pdfopt_session_trim_margins(KOPTSession *session);
+void k2pdfopt_session_hand_over_master(KOPTSession *session, WILLUSBITMAP *dst, int top, int height);
+KOPTPageCache* k2pdfopt_pagecache_create(int maxpages);
+void k2pdfopt_pagecache_flush(KOPTPageCache *cache);
+void k2pdfopt_pagecache_destroy(KOPTPageCache *cache);
+void k2pdfopt_pagecache_set_page(KOPTContext *kctx, KOPTPageCache *cache, int pageno);
+void k2pdfopt_pagecache_release(KOPTPageCache *cache);
+
+#endif
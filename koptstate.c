@@ -0,0 +1,108 @@
+/*
+ ** koptstate.c  library-owned state of a KOPTContext.
+ **
+ ** Copyright (C) 2012  http://willus.com
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU Affero General Public License as
+ ** published by the Free Software Foundation, either version 3 of the
+ ** License, or (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU Affero General Public License for more details.
+ **
+ ** You should have received a copy of the GNU Affero General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ */
+
+/*
+ ** A reader has a few contexts alive at a time (the current page and a
+ ** few precached ones), so a list is all the table needs.  The mutex only
+ ** guards the list; like the context itself, the state of one context is
+ ** used by one thread at a time.
+ */
+
+#include <pthread.h>
+#include "koptstate.h"
+#include "koptindex.h"
+#include "koptsession.h"
+
+static KOPTContextState *context_states = NULL;
+static pthread_mutex_t context_states_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* call with context_states_mutex held */
+static KOPTContextState **context_state_find(KOPTContext *kctx) {
+    KOPTContextState **p;
+
+    for (p = &context_states; (*p) != NULL; p = &(*p)->next)
+        if ((*p)->kctx == kctx)
+            break;
+    return p;
+}
+
+static void context_state_free(KOPTContextState *state) {
+    k2pdfopt_rectindex_destroy(state->rectindex);
+    bmp_free(&state->master);
+    k2pdfopt_pagecache_release(state->pagecache);
+    willus_mem_free((double **)&state, "context_state_free");
+}
+
+/*
+ ** State of kctx, or NULL if it has none yet and create is not set (or
+ ** it cannot be allocated).
+ */
+KOPTContextState* k2pdfopt_context_state(KOPTContext *kctx, int create) {
+    KOPTContextState *state;
+
+    pthread_mutex_lock(&context_states_mutex);
+    state = (*context_state_find(kctx));
+    if (state == NULL && create
+            && willus_mem_alloc((double **)&state, sizeof(KOPTContextState), "k2pdfopt_context_state")) {
+        memset(state, 0, sizeof(KOPTContextState));
+        bmp_init(&state->master);
+        state->kctx = kctx;
+        state->next = context_states;
+        context_states = state;
+    }
+    pthread_mutex_unlock(&context_states_mutex);
+    return state;
+}
+
+/* Hand the state of src over to dst; the previous state of dst is freed. */
+void k2pdfopt_context_state_move(KOPTContext *dst, KOPTContext *src) {
+    KOPTContextState **p, *state;
+
+    if (dst == src)
+        return;
+    pthread_mutex_lock(&context_states_mutex);
+    p = context_state_find(dst);
+    state = (*p);
+    if (state != NULL)
+        (*p) = state->next;
+    p = context_state_find(src);
+    if ((*p) != NULL)
+        (*p)->kctx = dst;
+    pthread_mutex_unlock(&context_states_mutex);
+    if (state != NULL)
+        context_state_free(state);
+}
+
+/*
+ ** Free what the library keeps for kctx.  The KOPTContext fields (dst,
+ ** rboxa, rectmaps, ...) stay as they are: they belong to the caller.
+ */
+void k2pdfopt_context_release(KOPTContext *kctx) {
+    KOPTContextState **p, *state;
+
+    pthread_mutex_lock(&context_states_mutex);
+    p = context_state_find(kctx);
+    state = (*p);
+    if (state != NULL)
+        (*p) = state->next;
+    pthread_mutex_unlock(&context_states_mutex);
+    if (state != NULL)
+        context_state_free(state);
+}
@@ -0,0 +1,52 @@
+/*
+ ** koptstate.h  library-owned state of a KOPTContext.
+ **
+ ** Copyright (C) 2012  http://willus.com
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU Affero General Public License as
+ ** published by the Free Software Foundation, either version 3 of the
+ ** License, or (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU Affero General Public License for more details.
+ **
+ ** You should have received a copy of the GNU Affero General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ */
+
+#ifndef _KOPTSTATE_H
+#define _KOPTSTATE_H
+
+#include "context.h"
+
+/*
+ ** KOPTContext is built by the reader from its own declaration, so its
+ ** layout must not change.  What the library keeps per context on top of
+ ** it lives here instead, in a table keyed by the context.  A context only
+ ** gets an entry once the reader asks for something that needs one (a
+ ** tile height, a kept rect index or a page cache); plain reflows never
+ ** create one.  A reader that does ask must call k2pdfopt_context_release()
+ ** before it frees or reuses the context, or the next context at the same
+ ** address would inherit the entry.
+ */
+typedef struct KOPTContextState {
+    KOPTContext *kctx;
+    int keep_rectindex;     // set: reflow keeps rectindex, see k2pdfopt_rectindex_keep()
+    struct KOPTRectIndex *rectindex;    // grid index over rectmaps, see koptindex.h
+    int tile_height;        // > 0: reflow leaves dst empty, see k2pdfopt_reflow_get_tile()
+    int master_top;         // top margin above the master rows of the page
+    WILLUSBITMAP master;    // reflowed rows, without margins, when tiled
+    struct KOPTPageCache *pagecache;    // page cache of the document of src, see koptsession.c
+    int pageno;             // page of the document that src was rendered from
+    struct KOPTContextState *next;
+} KOPTContextState;
+
+KOPTContextState* k2pdfopt_context_state(KOPTContext *kctx, int create);
+void k2pdfopt_context_state_move(KOPTContext *dst, KOPTContext *src);
+void k2pdfopt_context_release(KOPTContext *kctx);
+
+#endif
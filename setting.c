@@ -46,6 +46,8 @@ void k2pdfopt_settings_init_from_koptcontext(K2PDFOPT_SETTINGS *k2settings, KOPT
     k2settings->dst_color = 0;
     k2settings->use_crop_boxes = 0;
     k2settings->defect_size_pts = 1.0;
+    /* the reader renders pages in parallel itself (see koptprecache.c) */
+    k2settings->nthreads = 1;
 
     /* Apply context */
     k2settings->dst_dpi = kctx->dev_dpi;
@@ -116,3 +118,28 @@ void k2pdfopt_settings_init_from_koptcontext(K2PDFOPT_SETTINGS *k2settings, KOPT
     else
         k2settings->hyphen_detect = 1;
 }
+
+void k2pdfopt_settings_key_from_koptcontext(KOPTSettingsKey *key, KOPTContext *kctx)
+
+{
+    /* zero the padding too so that keys can be compared with memcmp() */
+    memset(key, 0, sizeof(KOPTSettingsKey));
+    key->trim = kctx->trim;
+    key->wrap = kctx->wrap;
+    key->white = kctx->white;
+    key->indent = kctx->indent;
+    key->columns = kctx->columns;
+    key->dev_dpi = kctx->dev_dpi;
+    key->dev_width = kctx->dev_width;
+    key->dev_height = kctx->dev_height;
+    key->straighten = kctx->straighten;
+    key->justification = kctx->justification;
+    key->writing_direction = kctx->writing_direction;
+    key->cjkchar = kctx->cjkchar;
+    key->margin = kctx->margin;
+    key->quality = kctx->quality;
+    key->contrast = kctx->contrast;
+    key->defect_size = kctx->defect_size;
+    key->line_spacing = kctx->line_spacing;
+    key->word_spacing = kctx->word_spacing;
+}
@@ -26,7 +26,34 @@
 #include "k2pdfopt.h"
 #include "context.h"
 
+/*
+ ** The subset of KOPTContext fields that k2pdfopt_settings_init_from_koptcontext()
+ ** reads.  Two contexts with equal keys derive identical K2PDFOPT_SETTINGS.
+ */
+typedef struct {
+    int trim;
+    int wrap;
+    int white;
+    int indent;
+    int columns;
+    int dev_dpi;
+    int dev_width;
+    int dev_height;
+    int straighten;
+    int justification;
+    int writing_direction;
+    int cjkchar;
+
+    double margin;
+    double quality;
+    double contrast;
+    double defect_size;
+    double line_spacing;
+    double word_spacing;
+} KOPTSettingsKey;
+
 void k2pdfopt_settings_init_from_koptcontext(K2PDFOPT_SETTINGS *k2settings, KOPTContext *kctx);
+void k2pdfopt_settings_key_from_koptcontext(KOPTSettingsKey *key, KOPTContext *kctx);
 
 #endif
 
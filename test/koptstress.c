@@ -0,0 +1,254 @@
+/*
+ ** koptstress.c  concurrency stress test of the reflow entry points.
+ **
+ ** Copyright (C) 2012  http://willus.com
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU Affero General Public License as
+ ** published by the Free Software Foundation, either version 3 of the
+ ** License, or (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU Affero General Public License for more details.
+ **
+ ** You should have received a copy of the GNU Affero General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ */
+
+/*
+ ** Reflows and optimizes one page image with a few different settings,
+ ** first one after the other to get the reference results, then from
+ ** several threads at once, and checks that every concurrent run gives
+ ** the same bitmaps and rect maps as the serial one.  The threads go
+ ** through k2pdfopt_reflow_bmp(), a KOPTSession of their own, and a
+ ** KOPTSession with a KOPTPageCache shared by all of them.  Build with
+ ** "make koptstress" and run as
+ **
+ **     ./koptstress page.bmp [threads [rounds]]
+ **
+ ** e.g. with k2pdfopt/kindlepdfviewer/out.bmp.  Exits with 1 if a
+ ** concurrent run differs from the serial one.  Also worth running
+ ** once built with -fsanitize=thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "koptsession.h"
+#include "koptreflow.h"
+#include "koptimize.h"
+#include "koptstate.h"
+
+#define NVARIANTS   4
+#define NMODES      3
+
+static char *mode_name[NMODES] = {"reflow", "session", "pagecache"};
+
+typedef struct {
+    unsigned long long dst;     // reflowed page
+    unsigned long long rects;   // rect maps
+    unsigned long long opt;     // optimized page
+    int nrects;
+} STRESSRESULT;
+
+typedef struct {
+    WILLUSBITMAP *src;
+    KOPTPageCache *pagecache;
+    STRESSRESULT ref[NVARIANTS];
+    int rounds;
+    pthread_mutex_t mutex;
+    int runs[NMODES];
+    int bad[NMODES];
+} STRESSDATA;
+
+typedef struct {
+    STRESSDATA *data;
+    int id;
+} STRESSTHREAD;
+
+static unsigned long long hash_bytes(unsigned long long h, unsigned char *p, long n) {
+    long i;
+
+    for (i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static unsigned long long hash_bmp(WILLUSBITMAP *bmp) {
+    unsigned long long h;
+    int row;
+
+    h = 1469598103934665603ULL;
+    h = hash_bytes(h, (unsigned char *)&bmp->width, sizeof(int));
+    h = hash_bytes(h, (unsigned char *)&bmp->height, sizeof(int));
+    h = hash_bytes(h, (unsigned char *)&bmp->bpp, sizeof(int));
+    for (row = 0; row < bmp->height; row++)
+        h = hash_bytes(h, bmp_rowptr_from_top(bmp, row), bmp->width * (bmp->bpp >> 3));
+    return h;
+}
+
+/* the settings a reader would pass, varied a little by variant */
+static void stress_init_context(KOPTContext *kctx, int variant) {
+    memset(kctx, 0, sizeof(KOPTContext));
+    kctx->trim = 1;
+    kctx->wrap = 1;
+    kctx->white = -1;
+    kctx->indent = 1;
+    kctx->columns = variant == 1 ? 1 : 2;
+    kctx->dev_dpi = 167;
+    kctx->dev_width = variant == 2 ? 758 : 600;
+    kctx->dev_height = 800;
+    kctx->page_width = kctx->dev_width;
+    kctx->page_height = kctx->dev_height;
+    kctx->straighten = variant == 3;
+    kctx->justification = -1;
+    kctx->zoom = 1.0;
+    kctx->margin = 0.06;
+    kctx->quality = 1.0;
+    kctx->contrast = variant == 1 ? 1.5 : 1.0;
+    kctx->defect_size = 1.0;
+    kctx->line_spacing = variant == 2 ? 1.0 : 1.2;
+    kctx->word_spacing = -1;
+    wrectmaps_init(&kctx->rectmaps);
+    bmp_init(&kctx->src);
+    bmp_init(&kctx->dst);
+}
+
+static void stress_free_context(KOPTContext *kctx) {
+    bmp_free(&kctx->src);
+    bmp_free(&kctx->dst);
+    wrectmaps_free(&kctx->rectmaps);
+    boxaDestroy(&kctx->rboxa);
+    numaDestroy(&kctx->rnai);
+    boxaDestroy(&kctx->nboxa);
+    numaDestroy(&kctx->nnai);
+    k2pdfopt_context_release(kctx);
+}
+
+static void stress_run(STRESSDATA *data, int variant, int mode, STRESSRESULT *result) {
+    KOPTContext kctx;
+    KOPTSession *session;
+    int i;
+
+    memset(result, 0, sizeof(STRESSRESULT));
+    session = mode > 0 ? k2pdfopt_session_create() : NULL;
+    stress_init_context(&kctx, variant);
+    if (mode == 2)
+        k2pdfopt_pagecache_set_page(&kctx, data->pagecache, variant + 1);
+    bmp_copy(&kctx.src, data->src);
+    if (session != NULL)
+        k2pdfopt_session_reflow_bmp(session, &kctx);
+    else
+        k2pdfopt_reflow_bmp(&kctx);
+    result->dst = hash_bmp(&kctx.dst);
+    result->nrects = kctx.rectmaps.n;
+    result->rects = 1469598103934665603ULL;
+    for (i = 0; i < kctx.rectmaps.n; i++)
+        result->rects = hash_bytes(result->rects,
+                (unsigned char *)kctx.rectmaps.wrectmap[i].coords,
+                sizeof(kctx.rectmaps.wrectmap[i].coords));
+    bmp_free(&kctx.dst);
+    bmp_copy(&kctx.src, data->src);
+    if (session != NULL)
+        k2pdfopt_session_optimize_bmp(session, &kctx);
+    else
+        k2pdfopt_optimize_bmp(&kctx);
+    result->opt = hash_bmp(&kctx.dst);
+    stress_free_context(&kctx);
+    if (session != NULL)
+        k2pdfopt_session_destroy(session);
+}
+
+static void *stress_thread(void *arg) {
+    STRESSTHREAD *thread = (STRESSTHREAD *)arg;
+    STRESSDATA *data = thread->data;
+    STRESSRESULT result;
+    int r, variant, mode, same;
+
+    for (r = 0; r < data->rounds; r++) {
+        variant = (thread->id + r) % NVARIANTS;
+        mode = (thread->id + r / NVARIANTS) % NMODES;
+        stress_run(data, variant, mode, &result);
+        same = !memcmp(&result, &data->ref[variant], sizeof(STRESSRESULT));
+        pthread_mutex_lock(&data->mutex);
+        data->runs[mode]++;
+        if (!same) {
+            data->bad[mode]++;
+            printf("thread %d round %d: variant %d via %s differs from the serial run\n",
+                    thread->id, r, variant, mode_name[mode]);
+        }
+        pthread_mutex_unlock(&data->mutex);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    STRESSDATA data;
+    STRESSTHREAD *thread;
+    pthread_t *tid;
+    WILLUSBITMAP src;
+    double t0;
+    int i, nthreads, started, bad;
+
+    nthreads = argc > 2 ? atoi(argv[2]) : 8;
+    data.rounds = argc > 3 ? atoi(argv[3]) : 3 * NVARIANTS;
+    if (argc < 2 || nthreads < 1 || data.rounds < 1) {
+        printf("usage: koptstress page.bmp [threads [rounds]]\n");
+        return 2;
+    }
+    bmp_init(&src);
+    if (bmp_read(&src, argv[1], stdout) < 0) {
+        printf("cannot read %s\n", argv[1]);
+        return 2;
+    }
+    data.src = &src;
+    data.pagecache = k2pdfopt_pagecache_create(NVARIANTS);
+    pthread_mutex_init(&data.mutex, NULL);
+    memset(data.runs, 0, sizeof(data.runs));
+    memset(data.bad, 0, sizeof(data.bad));
+
+    t0 = wsys_clock_secs();
+    for (i = 0; i < NVARIANTS; i++)
+        stress_run(&data, i, 0, &data.ref[i]);
+    printf("%d x %d page, %d variants: serial %.3f s\n",
+            src.width, src.height, NVARIANTS, wsys_clock_secs() - t0);
+
+    thread = malloc(nthreads * sizeof(STRESSTHREAD));
+    tid = malloc(nthreads * sizeof(pthread_t));
+    if (thread == NULL || tid == NULL) {
+        printf("out of memory\n");
+        return 2;
+    }
+    t0 = wsys_clock_secs();
+    for (started = 0; started < nthreads; started++) {
+        thread[started].data = &data;
+        thread[started].id = started;
+        if (pthread_create(&tid[started], NULL, stress_thread, &thread[started]) != 0)
+            break;
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(tid[i], NULL);
+    printf("%d threads x %d rounds: %.3f s\n", started, data.rounds, wsys_clock_secs() - t0);
+
+    bad = started < nthreads;
+    if (bad)
+        printf("could only start %d of %d threads\n", started, nthreads);
+    for (i = 0; i < NMODES; i++) {
+        printf("%-10s %5d runs %5d differ\n", mode_name[i], data.runs[i], data.bad[i]);
+        bad |= data.bad[i] > 0;
+    }
+    printf("%s\n", bad ? "FAILED" : "ok");
+
+    free(tid);
+    free(thread);
+    pthread_mutex_destroy(&data.mutex);
+    k2pdfopt_pagecache_destroy(data.pagecache);
+    bmp_free(&src);
+    return bad;
+}
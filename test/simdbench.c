@@ -0,0 +1,258 @@
+/*
+ ** simdbench.c  microbenchmark of the bmpsimd.c pixel kernels.
+ **
+ ** Copyright (C) 2012  http://willus.com
+ **
+ ** This program is free software: you can redistribute it and/or modify
+ ** it under the terms of the GNU Affero General Public License as
+ ** published by the Free Software Foundation, either version 3 of the
+ ** License, or (at your option) any later version.
+ **
+ ** This program is distributed in the hope that it will be useful,
+ ** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ ** GNU Affero General Public License for more details.
+ **
+ ** You should have received a copy of the GNU Affero General Public License
+ ** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **
+ */
+
+/*
+ ** Runs each bmpsimd_*() kernel on a page sized bitmap next to a plain C
+ ** version of the same job, checks that both give the same result and
+ ** prints the time per pixel of each.  Build with "make simdbench" and
+ ** run as
+ **
+ **     ./simdbench [width height [repeats]]
+ **
+ ** Exits with 1 if a kernel gives a different result.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "willus.h"
+
+typedef struct {
+    int width, height, bw;
+    unsigned char *grey;        // width x height, rows bw bytes apart
+    unsigned char *ga;          // grey + alpha
+    unsigned char *rgba;
+    unsigned char *out1, *out2;
+    int *rows1, *cols1, *rows2, *cols2;
+    short *wsum1, *wsum2;
+    unsigned short *tally1, *tally2;
+} BENCHDATA;
+
+static void ref_ga_to_grey(unsigned char *dst, unsigned char *src, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+        dst[i] = src[2 * i];
+}
+
+static void ref_rgba_to_rgb(unsigned char *dst, unsigned char *src, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        dst[3 * i] = src[4 * i];
+        dst[3 * i + 1] = src[4 * i + 1];
+        dst[3 * i + 2] = src[4 * i + 2];
+    }
+}
+
+static void ref_dark_counts(int *rowcount, int *colcount, unsigned char *p, int bw,
+        int nr, int nc, int thresh) {
+    int i, j;
+
+    for (j = 0; j < nr; j++)
+        for (i = 0; i < nc; i++)
+            if (p[(size_t)j * bw + i] < thresh) {
+                rowcount[j]++;
+                colcount[i]++;
+            }
+}
+
+static void ref_weighted_rows(short *dst, unsigned char **src, int *weight, int nrows, int n) {
+    int i, k, sum;
+
+    for (i = 0; i < n; i++) {
+        for (sum = 64, k = 0; k < nrows; k++)
+            sum += weight[k] * src[k][i];
+        dst[i] = sum >> 7;
+    }
+}
+
+static void ref_add_bytes(unsigned short *sum, unsigned char *p, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+        sum[i] += p[i];
+}
+
+static void bench_report(char *name, double t1, double t2, int npixels, int repeats, int same) {
+    double ns;
+
+    ns = 1e9 / ((double)npixels * repeats);
+    printf("%-16s  simd %7.3f ns/pixel  c %7.3f ns/pixel  x%5.2f  %s\n",
+            name, t1 * ns, t2 * ns, t1 > 0. ? t2 / t1 : 0., same ? "ok" : "DIFFERENT");
+}
+
+int main(int argc, char *argv[]) {
+    static int weight[4] = {2048, 6144, 6144, 2048};
+    BENCHDATA d;
+    unsigned char *src[4];
+    double t0, t1, t2;
+    int i, j, r, n, repeats, same, bad;
+
+    d.width = argc > 2 ? atoi(argv[1]) : 2480;
+    d.height = argc > 2 ? atoi(argv[2]) : 3508;
+    repeats = argc > 3 ? atoi(argv[3]) : 10;
+    if (d.width < 1 || d.height < 4 || repeats < 1) {
+        printf("usage: simdbench [width height [repeats]]\n");
+        return 2;
+    }
+    d.bw = (d.width + 3) & ~3;
+    n = d.width * d.height;
+    d.grey = malloc((size_t)d.bw * d.height);
+    d.ga = malloc((size_t)2 * n);
+    d.rgba = malloc((size_t)4 * n);
+    d.out1 = malloc((size_t)3 * n);
+    d.out2 = malloc((size_t)3 * n);
+    d.rows1 = calloc(d.height, sizeof(int));
+    d.rows2 = calloc(d.height, sizeof(int));
+    d.cols1 = calloc(d.width, sizeof(int));
+    d.cols2 = calloc(d.width, sizeof(int));
+    d.wsum1 = malloc(d.width * sizeof(short));
+    d.wsum2 = malloc(d.width * sizeof(short));
+    d.tally1 = calloc(d.width, sizeof(unsigned short));
+    d.tally2 = calloc(d.width, sizeof(unsigned short));
+    if (d.grey == NULL || d.ga == NULL || d.rgba == NULL || d.out1 == NULL || d.out2 == NULL
+            || d.rows1 == NULL || d.rows2 == NULL || d.cols1 == NULL || d.cols2 == NULL
+            || d.wsum1 == NULL || d.wsum2 == NULL || d.tally1 == NULL || d.tally2 == NULL) {
+        printf("out of memory\n");
+        return 2;
+    }
+    /* mostly white page with some dark text-like pixels */
+    srand(1);
+    for (i = 0; i < d.bw * d.height; i++)
+        d.grey[i] = rand() % 8 == 0 ? rand() % 128 : 200 + rand() % 56;
+    for (i = 0; i < 2 * n; i++)
+        d.ga[i] = rand() & 0xff;
+    for (i = 0; i < 4 * n; i++)
+        d.rgba[i] = rand() & 0xff;
+    printf("%d x %d pixels, %d repeats, cpu features 0x%x\n",
+            d.width, d.height, repeats, wsys_cpu_features());
+    bad = 0;
+
+    t0 = wsys_clock_secs();
+    for (r = 0; r < repeats; r++)
+        bmpsimd_ga_to_grey(d.out1, d.ga, n);
+    t1 = wsys_clock_secs() - t0;
+    t0 = wsys_clock_secs();
+    for (r = 0; r < repeats; r++)
+        ref_ga_to_grey(d.out2, d.ga, n);
+    t2 = wsys_clock_secs() - t0;
+    same = !memcmp(d.out1, d.out2, n);
+    bad |= !same;
+    bench_report("ga_to_grey", t1, t2, n, repeats, same);
+
+    t0 = wsys_clock_secs();
+    for (r = 0; r < repeats; r++)
+        bmpsimd_rgba_to_rgb(d.out1, d.rgba, n);
+    t1 = wsys_clock_secs() - t0;
+    t0 = wsys_clock_secs();
+    for (r = 0; r < repeats; r++)
+        ref_rgba_to_rgb(d.out2, d.rgba, n);
+    t2 = wsys_clock_secs() - t0;
+    same = !memcmp(d.out1, d.out2, (size_t)3 * n);
+    bad |= !same;
+    bench_report("rgba_to_rgb", t1, t2, n, repeats, same);
+
+    /* whole page at once, then row by row as bmpregion_row_black_count() does */
+    t0 = wsys_clock_secs();
+    for (r = 0; r < repeats; r++)
+        bmpsimd_dark_counts(d.rows1, d.cols1, d.grey, d.bw, d.height, d.width, 128);
+    t1 = wsys_clock_secs() - t0;
+    t0 = wsys_clock_secs();
+    for (r = 0; r < repeats; r++)
+        ref_dark_counts(d.rows2, d.cols2, d.grey, d.bw, d.height, d.width, 128);
+    t2 = wsys_clock_secs() - t0;
+    same = !memcmp(d.rows1, d.rows2, d.height * sizeof(int))
+            && !memcmp(d.cols1, d.cols2, d.width * sizeof(int));
+    bad |= !same;
+    bench_report("dark_counts", t1, t2, n, repeats, same);
+    memset(d.rows1, 0, d.height * sizeof(int));
+    memset(d.rows2, 0, d.height * sizeof(int));
+    t0 = wsys_clock_secs();
+    for (r = 0; r < repeats; r++)
+        for (j = 0; j < d.height; j++)
+            bmpsimd_dark_counts(&d.rows1[j], NULL, &d.grey[(size_t)j * d.bw], d.bw, 1, d.width, 128);
+    t1 = wsys_clock_secs() - t0;
+    memset(d.cols2, 0, d.width * sizeof(int));
+    t0 = wsys_clock_secs();
+    for (r = 0; r < repeats; r++)
+        ref_dark_counts(d.rows2, d.cols2, d.grey, d.bw, d.height, d.width, 128);
+    t2 = wsys_clock_secs() - t0;
+    same = !memcmp(d.rows1, d.rows2, d.height * sizeof(int));
+    bad |= !same;
+    bench_report("dark_counts/row", t1, t2, n, repeats, same);
+
+    t1 = t2 = 0.;
+    same = 1;
+    for (r = 0; r < repeats; r++)
+        for (j = 0; j + 4 <= d.height; j += 4) {
+            for (i = 0; i < 4; i++)
+                src[i] = &d.grey[(size_t)(j + i) * d.bw];
+            t0 = wsys_clock_secs();
+            bmpsimd_weighted_rows(d.wsum1, src, weight, 4, d.width);
+            t1 += wsys_clock_secs() - t0;
+            t0 = wsys_clock_secs();
+            ref_weighted_rows(d.wsum2, src, weight, 4, d.width);
+            t2 += wsys_clock_secs() - t0;
+            if (memcmp(d.wsum1, d.wsum2, d.width * sizeof(short)))
+                same = 0;
+        }
+    bad |= !same;
+    bench_report("weighted_rows", t1, t2, n, repeats, same);
+
+    /* at most 257 rows per tally, as bmp_autostraighten() does */
+    t1 = t2 = 0.;
+    same = 1;
+    for (r = 0; r < repeats; r++)
+        for (j = 0; j < d.height; j += 256) {
+            int m;
+
+            m = d.height - j < 256 ? d.height - j : 256;
+            memset(d.tally1, 0, d.width * sizeof(unsigned short));
+            memset(d.tally2, 0, d.width * sizeof(unsigned short));
+            t0 = wsys_clock_secs();
+            for (i = 0; i < m; i++)
+                bmpsimd_add_bytes(d.tally1, &d.grey[(size_t)(j + i) * d.bw], d.width);
+            t1 += wsys_clock_secs() - t0;
+            t0 = wsys_clock_secs();
+            for (i = 0; i < m; i++)
+                ref_add_bytes(d.tally2, &d.grey[(size_t)(j + i) * d.bw], d.width);
+            t2 += wsys_clock_secs() - t0;
+            if (memcmp(d.tally1, d.tally2, d.width * sizeof(unsigned short)))
+                same = 0;
+        }
+    bad |= !same;
+    bench_report("add_bytes", t1, t2, n, repeats, same);
+
+    free(d.tally2);
+    free(d.tally1);
+    free(d.wsum2);
+    free(d.wsum1);
+    free(d.cols2);
+    free(d.cols1);
+    free(d.rows2);
+    free(d.rows1);
+    free(d.out2);
+    free(d.out1);
+    free(d.rgba);
+    free(d.ga);
+    free(d.grey);
+    return bad;
+}